@@ -102,19 +102,19 @@ static void clear_bans(Channel *chan, User *u)
     if (!chan->bancount)
 	return;
 
-    /* Save original ban info */
-    count = chan->bancount;
-    bans = smalloc(sizeof(char *) * count);
-    memcpy(bans, chan->bans, sizeof(char *) * count);
+    /* Find the bans to remove before changing the list */
+    bans = smalloc(sizeof(char *) * chan->bancount);
+    for (i = count = 0; i < chan->bancount; i++) {
+	if (!u || match_parsed_usermask(&chan->banmasks[i], u))
+	    bans[count++] = chan->bans[i];
+    }
 
     av[0] = chan->name;
     av[1] = "-b";
     for (i = 0; i < count; i++) {
-	if (!u || match_usermask(bans[i], u)) {
-	    av[2] = bans[i];
-	    send_cmode(MODE_SENDER(s_ChanServ), av[0], av[1], av[2]);
-	    do_cmode(s_ChanServ, 3, av);
-	}
+	av[2] = bans[i];
+	send_cmode(MODE_SENDER(s_ChanServ), av[0], av[1], av[2]);
+	do_cmode(s_ChanServ, 3, av);
     }
     free(bans);
 }
@@ -128,17 +128,17 @@ static void clear_excepts(Channel *chan, User *u)
 
     if (!chan->exceptcount)
 	return;
-    count = chan->exceptcount;
-    excepts = smalloc(sizeof(char *) * count);
-    memcpy(excepts, chan->excepts, sizeof(char *) * count);
+    excepts = smalloc(sizeof(char *) * chan->exceptcount);
+    for (i = count = 0; i < chan->exceptcount; i++) {
+	if (!u || match_parsed_usermask(&chan->exceptmasks[i], u))
+	    excepts[count++] = chan->excepts[i];
+    }
     av[0] = chan->name;
     av[1] = "-e";
     for (i = 0; i < count; i++) {
-	if (!u || match_usermask(excepts[i], u)) {
-	    av[2] = excepts[i];
-	    send_cmode(MODE_SENDER(s_ChanServ), av[0], av[1], av[2]);
-	    do_cmode(s_ChanServ, 3, av);
-	}
+	av[2] = excepts[i];
+	send_cmode(MODE_SENDER(s_ChanServ), av[0], av[1], av[2]);
+	do_cmode(s_ChanServ, 3, av);
     }
     free(excepts);
 #endif
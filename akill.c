@@ -85,6 +85,7 @@ void load_akill(void)
     akills = scalloc(sizeof(*akills), akill_size);
 
     switch (ver) {
+      case 12:
       case 11:
       case 10:
       case 9:
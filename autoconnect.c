@@ -88,6 +88,7 @@ void load_aconnect(void)
     aconnects = scalloc(sizeof(*aconnects), naconnect);
 
     switch (ver) {
+      case 12:
       case 11:
 	for (i = 0; i < naconnect; i++) {
 	    SAFE(read_string(&aconnects[i].servername, f));
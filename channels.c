@@ -91,10 +91,10 @@ void get_channel_stats(long *nrec, long *memuse)
 	    mem += strlen(chan->topic)+1;
 	if (chan->key)
 	    mem += strlen(chan->key)+1;
-	mem += sizeof(char *) * chan->bansize;
+	mem += (sizeof(char *) + sizeof(UserMask)) * chan->bansize;
 	for (i = 0; i < chan->bancount; i++) {
 	    if (chan->bans[i])
-		mem += strlen(chan->bans[i])+1;
+		mem += (strlen(chan->bans[i])+1) * 2;
 	}
 	for (cu = chan->users; cu; cu = cu->next)
 	    mem += sizeof(*cu);
@@ -205,7 +205,11 @@ Channel *chan_adduser(User *user, const char *chan, int32 modes)
 	c->users->prev = u;
     c->users = u;
     u->user = user;
-    u->mode = check_chan_user_modes(NULL, user, chan, modes);
+    /* A user waiting for burst validation is checked once validated */
+    if (user->burst_pending)
+	u->mode = modes;
+    else
+	u->mode = check_chan_user_modes(NULL, user, chan, modes);
     return c;
 }
 
@@ -249,18 +253,24 @@ void chan_deluser(User *user, Channel *c)
 		free(c->bans[i]);
 	    else
 		log("channel: BUG freeing %s: bans[%d] is NULL!", c->name, i);
+	    free_usermask(&c->banmasks[i]);
 	}
-	if (c->bansize)
+	if (c->bansize) {
 	    free(c->bans);
+	    free(c->banmasks);
+	}
 #ifdef HAVE_BANEXCEPT
 	for (i = 0; i < c->exceptcount; ++i) {
 	    if (c->excepts[i])
 		free(c->excepts[i]);
 	    else
 		log("channel: BUG freeing %s: excepts[%d] is NULL!", c->name, i);
+	    free_usermask(&c->exceptmasks[i]);
 	}
-	if (c->exceptsize)
+	if (c->exceptsize) {
 	    free(c->excepts);
+	    free(c->exceptmasks);
+	}
 #endif
 	if (c->next)
 	    c->next->prev = c->prev;
@@ -393,7 +403,10 @@ void do_cmode(const char *source, int ac, char **av)
 		    chan->bansize += 8;
 		    chan->bans = srealloc(chan->bans,
 					sizeof(char *) * chan->bansize);
+		    chan->banmasks = srealloc(chan->banmasks,
+					sizeof(UserMask) * chan->bansize);
 		}
+		parse_usermask(*av, &chan->banmasks[chan->bancount]);
 		chan->bans[chan->bancount++] = sstrdup(*av++);
 	    } else {
 		char **s = chan->bans;
@@ -403,9 +416,13 @@ void do_cmode(const char *source, int ac, char **av)
 		    s++;
 		}
 		if (i < chan->bancount) {
+		    UserMask *um = &chan->banmasks[i];
+		    free_usermask(um);
 		    chan->bancount--;
-		    if (i < chan->bancount)
+		    if (i < chan->bancount) {
 			memmove(s, s+1, sizeof(char *) * (chan->bancount-i));
+			memmove(um, um+1, sizeof(*um) * (chan->bancount-i));
+		    }
 		} else {
 		    log("channel: MODE %s -b %s: ban not found",
 			chan->name, *av);
@@ -426,7 +443,10 @@ void do_cmode(const char *source, int ac, char **av)
 		    chan->exceptsize += 8;
 		    chan->excepts = srealloc(chan->excepts,
 					sizeof(char *) * chan->exceptsize);
+		    chan->exceptmasks = srealloc(chan->exceptmasks,
+					sizeof(UserMask) * chan->exceptsize);
 		}
+		parse_usermask(*av, &chan->exceptmasks[chan->exceptcount]);
 		chan->excepts[chan->exceptcount++] = sstrdup(*av++);
 	    } else {
 		char **s = chan->excepts;
@@ -436,9 +456,13 @@ void do_cmode(const char *source, int ac, char **av)
 		    s++;
 		}
 		if (i < chan->exceptcount) {
+		    UserMask *um = &chan->exceptmasks[i];
+		    free_usermask(um);
 		    chan->exceptcount--;
-		    if (i < chan->exceptcount)
+		    if (i < chan->exceptcount) {
 			memmove(s, s+1, sizeof(char *)*(chan->exceptcount-i));
+			memmove(um, um+1, sizeof(*um)*(chan->exceptcount-i));
+		    }
 		} else {
 		    log("channel: MODE %s -e %s: exception not found",
 			chan->name, *av);
@@ -509,7 +533,9 @@ static void do_cumode(const char *source, Channel *chan, int32 flag, int add,
 	u->mode |= flag;
     else
 	u->mode &= ~flag;
-    u->mode = check_chan_user_modes(source, u->user, chan->name, u->mode);
+    /* A user waiting for burst validation is checked once validated */
+    if (!u->user->burst_pending)
+	u->mode = check_chan_user_modes(source, u->user, chan->name, u->mode);
 }
 
 /*************************************************************************/
@@ -28,9 +28,11 @@ struct channel_ {
 
     int32 bancount, bansize;
     char **bans;
+    UserMask *banmasks;			/* bans[] split up, for matching */
 #ifdef HAVE_BANEXCEPT
     int32 exceptcount, exceptsize;
     char **excepts;
+    UserMask *exceptmasks;		/* Same, for excepts[] */
 #endif
 
     struct c_userlist {
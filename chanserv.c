@@ -16,32 +16,18 @@
 /************************** Declaration section **************************/
 /*************************************************************************/
 
-#define HASH(chan)  (hashtable[(unsigned char)((chan)[1])]<<5 \
-		     | (chan[1] ? hashtable[(unsigned char)((chan)[2])] : 0))
-#define HASHSIZE    1024
+/* As for nicknames, channels are hashed on the whole name; see the
+ * comments in nickserv.c. */
+#define HASH(chan)  (hash_chan(chan) & (HASHSIZE-1))
+#define HASHSIZE    0x10000
 static ChannelInfo *chanlists[HASHSIZE];
 
-static const char hashtable[256] = {
-     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-
-     0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15,
-    16,17,18,19,20,21,22,23,24,25,26,27,28,29, 0, 0,
-     0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15,
-    16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,30,
-
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-};
+/* All channels sorted with irc_stricmp(), for cs_firstchan_sorted().
+ * Rebuilt when next needed after channels are added or removed. */
+static ChannelInfo **chan_order = NULL;
+static int chan_order_count = 0, chan_order_size = 0;
+static int chan_order_pos = 0;
+static int chan_order_dirty = 1;
 
 /*************************************************************************/
 
@@ -141,9 +127,53 @@ static int levelinfo_maxwidth = 0;
 
 /*************************************************************************/
 
+/* Access level caching.  cs_access_gen changes whenever something
+ * get_access() depends on changes, which invalidates the access_cache[] of
+ * every user; cs_link_gen changes whenever nickname links change, which
+ * invalidates the access list index of every channel.  Neither is ever 0.
+ */
+
+uint32 cs_access_gen = 1;
+static uint32 cs_link_gen = 1;
+
+/*************************************************************************/
+
+/* Compiled autokick lists (see find_akick()).  Nickname entries are
+ * hashed by the nick they are linked to.  Mask entries are chained by the
+ * last AKICK_SUFFIX_LEN characters of the host part when those contain no
+ * wildcards, so that a joining user is only matched against masks which
+ * could apply to their host; masks without such a suffix go on a separate
+ * chain which is always checked.  All chains are kept in list order, so
+ * the first matching entry in akick[] is the one found, as with a list
+ * search.
+ */
+
+#define AKICK_SUFFIX_LEN	6
+#define AKICK_BUCKETS		64	/* Must be a power of 2 */
+
+struct akickset_ {
+    uint32 link_gen;		/* Link generation set was built for */
+    int32 memsize;		/* Memory used, for statistics */
+    int32 nicksize;		/* Slots in nicks[] (power of 2), 0 if none */
+    struct akicknick {
+	NickInfo *ni;		/* NULL for free slots */
+	int16 index;		/* Index into akick[] */
+    } *nicks;
+    struct akickmask {
+	int16 index;		/* Index into akick[] */
+	int16 next;		/* Next mask in chain, -1 for end */
+    } *masks;
+    int16 buckets[AKICK_BUCKETS]; /* Chains of masks by host suffix */
+    int16 others;		/* Chain of masks without a host suffix */
+};
+
+/*************************************************************************/
+
 /* Local functions. */
 
-static void alpha_insert_chan(ChannelInfo *ci);
+static unsigned int hash_chan(const char *chan);
+static void insert_chan(ChannelInfo *ci);
+static void unlink_chan(ChannelInfo *ci);
 static ChannelInfo *makechan(const char *chan);
 static int delchan(ChannelInfo *ci);
 static void count_chan(ChannelInfo *ci);
@@ -152,6 +182,12 @@ static void reset_levels(ChannelInfo *ci);
 static int is_founder(User *user, ChannelInfo *ci);
 static int is_identified(User *user, ChannelInfo *ci);
 static int get_access(User *user, ChannelInfo *ci);
+static int find_access(ChannelInfo *ci, NickInfo *ni);
+static void build_access_index(ChannelInfo *ci);
+static void access_changed(ChannelInfo *ci);
+static int find_akick(ChannelInfo *ci, User *user, NickInfo *ni);
+static void build_akick_set(ChannelInfo *ci);
+static void akick_changed(ChannelInfo *ci);
 static void suspend(ChannelInfo *ci, const char *reason,
 		    const char *who, const time_t expires);
 static void unsuspend(ChannelInfo *ci, int set_time);
@@ -400,6 +436,50 @@ ChannelInfo *cs_nextchan(void)
 
 /*************************************************************************/
 
+/* Iterate over all ChannelInfo structures in alphabetical order.  Channels
+ * must not be added or removed during the iteration.
+ */
+
+static int compare_chan_order(const void *a, const void *b)
+{
+    return irc_stricmp((*(ChannelInfo **)a)->name,
+		       (*(ChannelInfo **)b)->name);
+}
+
+ChannelInfo *cs_firstchan_sorted(void)
+{
+    if (chan_order_dirty) {
+	ChannelInfo *ci;
+	if (!chan_order) {
+	    chan_order_size = 1024;
+	    chan_order = smalloc(sizeof(*chan_order) * chan_order_size);
+	}
+	chan_order_count = 0;
+	for (ci = cs_firstchan(); ci; ci = cs_nextchan()) {
+	    if (chan_order_count >= chan_order_size) {
+		chan_order_size *= 2;
+		chan_order = srealloc(chan_order,
+				sizeof(*chan_order) * chan_order_size);
+	    }
+	    chan_order[chan_order_count++] = ci;
+	}
+	qsort(chan_order, chan_order_count, sizeof(*chan_order),
+	      compare_chan_order);
+	chan_order_dirty = 0;
+    }
+    chan_order_pos = 0;
+    return cs_nextchan_sorted();
+}
+
+ChannelInfo *cs_nextchan_sorted(void)
+{
+    if (chan_order_pos < chan_order_count)
+	return chan_order[chan_order_pos++];
+    return NULL;
+}
+
+/*************************************************************************/
+
 /* Return information on memory use.  Assumes pointers are valid. */
 
 void get_chanserv_stats(long *nrec, long *memuse)
@@ -418,10 +498,14 @@ void get_chanserv_stats(long *nrec, long *memuse)
 	if (ci->email)
 	    mem += strlen(ci->email)+1;
 	mem += ci->accesscount * sizeof(ChanAccess);
+	if (ci->accessidx)
+	    mem += ci->accessidx_size * sizeof(ChanAccessIdx);
 	mem += ci->akickcount * sizeof(AutoKick);
+	if (ci->akickset)
+	    mem += ci->akickset->memsize;
 	for (i = 0; i < ci->akickcount; i++) {
 	    if (!ci->akick[i].is_nick && ci->akick[i].u.mask)
-		mem += strlen(ci->akick[i].u.mask)+1;
+		mem += (strlen(ci->akick[i].u.mask)+1) * 2;
 	    if (ci->akick[i].reason)
 		mem += strlen(ci->akick[i].reason)+1;
 	}
@@ -746,21 +830,16 @@ int check_kick(User *user, const char *chan)
     else
 	ni = NULL;
 
-    for (akick = ci->akick, i = 0; i < ci->akickcount; akick++, i++) {
-	if (!akick->in_use)
-	    continue;
-	if ((akick->is_nick && getlink(akick->u.ni) == ni)
-	 || (!akick->is_nick && match_usermask(akick->u.mask, user))
-	) {
-	    if (debug >= 2) {
-		log("debug: %s matched akick %s", user->nick,
-			akick->is_nick ? akick->u.ni->nick : akick->u.mask);
-	    }
-	    mask = akick->is_nick ? create_mask(user, 1)
-	                          : sstrdup(akick->u.mask);
-	    reason = akick->reason ? akick->reason : CSAutokickReason;
-	    goto kick;
+    if ((i = find_akick(ci, user, ni)) >= 0) {
+	akick = &ci->akick[i];
+	if (debug >= 2) {
+	    log("debug: %s matched akick %s", user->nick,
+		    akick->is_nick ? akick->u.ni->nick : akick->u.mask);
 	}
+	mask = akick->is_nick ? create_mask(user, 1)
+	                      : sstrdup(akick->u.mask);
+	reason = akick->reason ? akick->reason : CSAutokickReason;
+	goto kick;
     }
 
     if (time(NULL)-start_time >= CSRestrictDelay
@@ -910,11 +989,14 @@ void cs_remove_nick(const NickInfo *ni)
     ChanAccess *ca;
     AutoKick *akick;
 
+    /* The nick may be in any access list index, and founders may change */
+    cs_links_changed();
     for (ci = cs_firstchan(); ci; ci = next) {
 	next = cs_nextchan();
 	if (ci->founder == ni) {
 	    int was_suspended = (ci->suspendinfo != NULL);
 	    char name_save[CHANMAX];
+	    cs_journal_mark(ci);
 	    if (was_suspended)
 		strscpy(name_save, ci->name, CHANMAX);
 	    uncount_chan(ci);  /* Make sure it disappears from founderchans */
@@ -948,16 +1030,20 @@ void cs_remove_nick(const NickInfo *ni)
 		continue;
 	    }
 	}
-	if (ci->successor == ni)
+	if (ci->successor == ni) {
 	    ci->successor = NULL;
+	    cs_journal_mark(ci);
+	}
 	for (ca = ci->access, i = ci->accesscount; i > 0; ca++, i--) {
 	    if (ca->in_use && ca->ni == ni) {
 		ca->in_use = 0;
 		ca->ni = NULL;
+		cs_journal_mark(ci);
 	    }
 	}
 	for (akick = ci->akick, i = ci->akickcount; i > 0; akick++, i--) {
 	    if (akick->is_nick && akick->u.ni == ni) {
+		cs_journal_mark(ci);
 		akick->in_use = akick->is_nick = 0;
 		akick->u.ni = NULL;
 		if (akick->reason) {
@@ -997,6 +1083,19 @@ int check_access(User *user, ChannelInfo *ci, int what)
 
 /*************************************************************************/
 
+/* Note that nickname links have changed (or a nickname is going away), so
+ * that cached access levels and access list indexes are recomputed. */
+
+void cs_links_changed(void)
+{
+    if (!++cs_link_gen)
+	cs_link_gen++;
+    if (!++cs_access_gen)
+	cs_access_gen++;
+}
+
+/*************************************************************************/
+
 /* Check the nick's number of registered channels against its limit, and
  * return -1 if below the limit, 0 if at it exactly, and 1 if over it.
  */
@@ -1048,26 +1147,48 @@ char *chanopts_to_string(ChannelInfo *ci, NickInfo *ni)
 /*********************** ChanServ private routines ***********************/
 /*************************************************************************/
 
-/* Insert a channel alphabetically into the database. */
+/* Hash function for channel names; case-insensitive in the same way as
+ * irc_stricmp(). */
 
-static void alpha_insert_chan(ChannelInfo *ci)
+static unsigned int hash_chan(const char *chan)
 {
-    ChannelInfo *ptr, *prev;
-    char *chan = ci->name;
-    int hash = HASH(chan);
+    unsigned int hash = 0;
 
-    for (prev = NULL, ptr = chanlists[hash];
-	 ptr != NULL && irc_stricmp(ptr->name, chan) < 0;
-	 prev = ptr, ptr = ptr->next)
-	;
-    ci->prev = prev;
-    ci->next = ptr;
-    if (!prev)
-	chanlists[hash] = ci;
+    while (*chan)
+	hash = hash*31 + irc_tolower(*chan++);
+    return hash;
+}
+
+/*************************************************************************/
+
+/* Insert a channel into the database. */
+
+static void insert_chan(ChannelInfo *ci)
+{
+    int hash = HASH(ci->name);
+
+    ci->prev = NULL;
+    ci->next = chanlists[hash];
+    if (ci->next)
+	ci->next->prev = ci;
+    chanlists[hash] = ci;
+    chan_order_dirty = 1;
+}
+
+/*************************************************************************/
+
+/* Remove a channel from the hash table and alphabetical index.  Does not
+ * free anything. */
+
+static void unlink_chan(ChannelInfo *ci)
+{
+    if (ci->next)
+	ci->next->prev = ci->prev;
+    if (ci->prev)
+	ci->prev->next = ci->next;
     else
-	prev->next = ci;
-    if (ptr)
-	ptr->prev = ci;
+	chanlists[HASH(ci->name)] = ci->next;
+    chan_order_dirty = 1;
 }
 
 /*************************************************************************/
@@ -1084,7 +1205,8 @@ static ChannelInfo *makechan(const char *chan)
     strscpy(ci->name, chan, CHANMAX);
     ci->time_registered = time(NULL);
     reset_levels(ci);
-    alpha_insert_chan(ci);
+    insert_chan(ci);
+    cs_journal_mark(ci);
     return ci;
 }
 
@@ -1098,6 +1220,8 @@ static int delchan(ChannelInfo *ci)
     int i;
     User *u;
 
+    cs_journal_mark(ci);
+
     /* Remove channel from founder's owned-channel count */
     uncount_chan(ci);
 
@@ -1121,12 +1245,7 @@ static int delchan(ChannelInfo *ci)
     /* Now actually free channel data */
     if (ci->c)
 	ci->c->ci = NULL;
-    if (ci->next)
-	ci->next->prev = ci->prev;
-    if (ci->prev)
-	ci->prev->next = ci->next;
-    else
-	chanlists[HASH(ci->name)] = ci->next;
+    unlink_chan(ci);
     if (ci->desc)
 	free(ci->desc);
     if (ci->mlock_key)
@@ -1137,14 +1256,18 @@ static int delchan(ChannelInfo *ci)
 	unsuspend(ci, 0);
     if (ci->access)
 	free(ci->access);
+    access_changed(ci);
     for (i = 0; i < ci->akickcount; i++) {
-	if (!ci->akick[i].is_nick && ci->akick[i].u.mask)
+	if (!ci->akick[i].is_nick && ci->akick[i].u.mask) {
 	    free(ci->akick[i].u.mask);
+	    free_usermask(&ci->akick[i].parsed);
+	}
 	if (ci->akick[i].reason)
 	    free(ci->akick[i].reason);
     }
     if (ci->akick)
 	free(ci->akick);
+    akick_changed(ci);
     if (ci->levels)
 	free(ci->levels);
     if (ci->memos.memos) {
@@ -1271,24 +1394,295 @@ static int is_identified(User *user, ChannelInfo *ci)
 static int get_access(User *user, ChannelInfo *ci)
 {
     NickInfo *ni = user->ni;
-    ChanAccess *access;
-    int i;
+    struct u_accesscache *ac;
+    int16 status;
+    int i, level;
 
     if (!ci || !ni || (ci->flags & CI_VERBOTEN) || ci->suspendinfo)
 	return 0;
+
+    /* A cached level is good as long as nothing changed since, and the
+     * user is still using the same nick with the same IDENTIFY status. */
+    status = user->real_ni
+	? user->real_ni->status & (NS_IDENTIFIED | NS_RECOGNIZED) : 0;
+    for (ac = user->access_cache, i = 0; i < USER_ACCESS_CACHE; ac++, i++) {
+	if (ac->gen == cs_access_gen && ac->ci == ci && ac->ni == ni
+	 && ac->status == status)
+	    return ac->level;
+    }
+
     if (is_founder(user, ci))
-	return ACCLEV_FOUNDER;
-    if (nick_identified(user)
-	|| (nick_recognized(user) && !(ci->flags & CI_SECURE))
-    ) {
+	level = ACCLEV_FOUNDER;
+    else if (nick_identified(user)
+	     || (nick_recognized(user) && !(ci->flags & CI_SECURE)))
+	level = find_access(ci, ni);
+    else
+	level = 0;
+
+    ac = &user->access_cache[user->access_cache_next];
+    user->access_cache_next = (user->access_cache_next+1) % USER_ACCESS_CACHE;
+    ac->ci = ci;
+    ac->ni = ni;
+    ac->status = status;
+    ac->level = level;
+    ac->gen = cs_access_gen;
+    return level;
+}
+
+/*************************************************************************/
+
+/* Return the level of the given (not linked) nick on the channel's access
+ * list, 0 if it isn't on it.  Long lists are looked up through an index
+ * which is built here when needed. */
+
+#define ACCESSIDX_HASH(ni,size) \
+    ((((uint32)((unsigned long)(ni) >> 4)) * 0x9E3779B1 >> 16) & ((size)-1))
+
+static int find_access(ChannelInfo *ci, NickInfo *ni)
+{
+    ChanAccess *access;
+    ChanAccessIdx *idx;
+    int i;
+
+    if (ci->accesscount < ACCESS_INDEX_MIN) {
 	for (access = ci->access, i = 0; i < ci->accesscount; access++, i++) {
 	    if (access->in_use && getlink(access->ni) == ni)
 		return access->level;
 	}
+	return 0;
+    }
+    if (!ci->accessidx || ci->accessidx_gen != cs_link_gen)
+	build_access_index(ci);
+    i = ACCESSIDX_HASH(ni, ci->accessidx_size);
+    while ((idx = &ci->accessidx[i])->ni) {
+	if (idx->ni == ni)
+	    return idx->level;
+	i = (i+1) & (ci->accessidx_size-1);
     }
     return 0;
 }
 
+
+/* (Re)build the access list index for a channel.  When several entries
+ * are linked to the same nick, the first one wins, like a list search. */
+
+static void build_access_index(ChannelInfo *ci)
+{
+    ChanAccess *access;
+    ChanAccessIdx *idx;
+    NickInfo *ni;
+    int i, j;
+
+    if (ci->accessidx)
+	free(ci->accessidx);
+    ci->accessidx_size = 32;
+    while (ci->accessidx_size < ci->accesscount*2)
+	ci->accessidx_size *= 2;
+    ci->accessidx = scalloc(ci->accessidx_size, sizeof(ChanAccessIdx));
+    ci->accessidx_gen = cs_link_gen;
+    for (access = ci->access, i = 0; i < ci->accesscount; access++, i++) {
+	if (!access->in_use)
+	    continue;
+	ni = getlink(access->ni);
+	j = ACCESSIDX_HASH(ni, ci->accessidx_size);
+	while ((idx = &ci->accessidx[j])->ni && idx->ni != ni)
+	    j = (j+1) & (ci->accessidx_size-1);
+	if (!idx->ni) {
+	    idx->ni = ni;
+	    idx->level = access->level;
+	}
+    }
+}
+
+#undef ACCESSIDX_HASH
+
+
+/* Note that the channel's access list (or its founder) has changed. */
+
+static void access_changed(ChannelInfo *ci)
+{
+    cs_journal_mark(ci);
+    if (ci->accessidx) {
+	free(ci->accessidx);
+	ci->accessidx = NULL;
+	ci->accessidx_size = 0;
+    }
+    if (!++cs_access_gen)
+	cs_access_gen++;
+}
+
+/*************************************************************************/
+
+#define AKICKNICK_HASH(ni,size) \
+    ((((uint32)((unsigned long)(ni) >> 4)) * 0x9E3779B1 >> 16) & ((size)-1))
+
+/* Hash the AKICK_SUFFIX_LEN characters at s, ignoring case. */
+
+static int akick_suffix_hash(const char *s)
+{
+    uint32 hash = 0;
+    int i;
+
+    for (i = 0; i < AKICK_SUFFIX_LEN; i++)
+	hash = hash*31 + tolower(s[i]);
+    return hash & (AKICK_BUCKETS-1);
+}
+
+
+/* Return the index of the first mask on the given chain matching the
+ * user, if it is lower than `best'; else return `best'. */
+
+static int akick_match_chain(ChannelInfo *ci, int chain, User *user, int best)
+{
+    struct akickmask *am;
+
+    for (; chain >= 0 && (am = &ci->akickset->masks[chain])->index < best;
+	 chain = am->next
+    ) {
+	if (match_parsed_usermask(&ci->akick[am->index].parsed, user))
+	    return am->index;
+    }
+    return best;
+}
+
+
+/* Return the index of the first autokick list entry matching the given
+ * user (recognized as the given nick, if not NULL), or -1 if none do.
+ * The compiled form of the list is built here when needed. */
+
+static int find_akick(ChannelInfo *ci, User *user, NickInfo *ni)
+{
+    AkickSet *as;
+    struct akicknick *an;
+    int best, i, len;
+
+    if (!ci->akickcount)
+	return -1;
+    if (!ci->akickset || ci->akickset->link_gen != cs_link_gen)
+	build_akick_set(ci);
+    as = ci->akickset;
+    best = ci->akickcount;
+    if (ni && as->nicksize) {
+	i = AKICKNICK_HASH(ni, as->nicksize);
+	while ((an = &as->nicks[i])->ni) {
+	    if (an->ni == ni) {
+		best = an->index;
+		break;
+	    }
+	    i = (i+1) & (as->nicksize-1);
+	}
+    }
+    best = akick_match_chain(ci, as->others, user, best);
+    if ((len = strlen(user->host)) >= AKICK_SUFFIX_LEN) {
+	i = akick_suffix_hash(user->host + len - AKICK_SUFFIX_LEN);
+	best = akick_match_chain(ci, as->buckets[i], user, best);
+    }
+#ifdef IRC_UNREAL
+    if (user->fakehost
+     && (len = strlen(user->fakehost)) >= AKICK_SUFFIX_LEN) {
+	i = akick_suffix_hash(user->fakehost + len - AKICK_SUFFIX_LEN);
+	best = akick_match_chain(ci, as->buckets[i], user, best);
+    }
+#endif
+    return best < ci->akickcount ? best : -1;
+}
+
+
+/* (Re)build the compiled autokick list for a channel.  Entries are added
+ * from last to first, so that earlier entries end up at the head of each
+ * chain and take over nick slots from later ones. */
+
+static void build_akick_set(ChannelInfo *ci)
+{
+    AkickSet *as;
+    AutoKick *akick;
+    struct akicknick *an;
+    struct akickmask *am;
+    NickInfo *ni;
+    const char *host;
+    int nnicks = 0, nmasks = 0;
+    int i, j, len;
+
+    akick_changed(ci);
+    for (akick = ci->akick, i = 0; i < ci->akickcount; akick++, i++) {
+	if (!akick->in_use)
+	    continue;
+	if (akick->is_nick) {
+	    nnicks++;
+	} else {
+	    nmasks++;
+	}
+    }
+    as = scalloc(1, sizeof(*as));
+    as->link_gen = cs_link_gen;
+    as->memsize = sizeof(*as);
+    if (nnicks) {
+	as->nicksize = 8;
+	while (as->nicksize < nnicks*2)
+	    as->nicksize *= 2;
+	as->nicks = scalloc(as->nicksize, sizeof(*as->nicks));
+	as->memsize += as->nicksize * sizeof(*as->nicks);
+    }
+    if (nmasks) {
+	as->masks = smalloc(nmasks * sizeof(*as->masks));
+	as->memsize += nmasks * sizeof(*as->masks);
+    }
+    for (i = 0; i < AKICK_BUCKETS; i++)
+	as->buckets[i] = -1;
+    as->others = -1;
+
+    nmasks = 0;
+    for (i = ci->akickcount-1; i >= 0; i--) {
+	akick = &ci->akick[i];
+	if (!akick->in_use)
+	    continue;
+	if (akick->is_nick) {
+	    ni = getlink(akick->u.ni);
+	    j = AKICKNICK_HASH(ni, as->nicksize);
+	    while ((an = &as->nicks[j])->ni && an->ni != ni)
+		j = (j+1) & (as->nicksize-1);
+	    an->ni = ni;
+	    an->index = i;
+	    continue;
+	}
+	if (!(host = akick->parsed.host))
+	    continue;	/* Invalid mask, can never match */
+	am = &as->masks[nmasks];
+	am->index = i;
+	len = strlen(host);
+	for (j = len; j > 0 && host[j-1] != '*' && host[j-1] != '?'; j--)
+	    ;
+	if (len-j >= AKICK_SUFFIX_LEN) {
+	    j = akick_suffix_hash(host + len - AKICK_SUFFIX_LEN);
+	    am->next = as->buckets[j];
+	    as->buckets[j] = nmasks;
+	} else {
+	    am->next = as->others;
+	    as->others = nmasks;
+	}
+	nmasks++;
+    }
+    ci->akickset = as;
+}
+
+#undef AKICKNICK_HASH
+
+
+/* Note that the channel's autokick list has changed. */
+
+static void akick_changed(ChannelInfo *ci)
+{
+    cs_journal_mark(ci);
+    if (ci->akickset) {
+	if (ci->akickset->nicks)
+	    free(ci->akickset->nicks);
+	if (ci->akickset->masks)
+	    free(ci->akickset->masks);
+	free(ci->akickset);
+	ci->akickset = NULL;
+    }
+}
+
 /*************************************************************************/
 
 /* Create a new SuspendInfo structure and associate it with the given
@@ -1305,6 +1699,7 @@ static void suspend(ChannelInfo *ci, const char *reason,
     si->suspended = time(NULL);
     si->expires = expires;
     ci->suspendinfo = si;
+    cs_journal_mark(ci);
 }
 
 /*************************************************************************/
@@ -1328,6 +1723,7 @@ static void unsuspend(ChannelInfo *ci, int set_time)
 	free(ci->suspendinfo->reason);
     free(ci->suspendinfo);
     ci->suspendinfo = NULL;
+    cs_journal_mark(ci);
     if (set_time && CSExpire && CSSuspendGrace
      && (now - ci->last_used >= CSExpire - CSSuspendGrace)
     ) {
@@ -1555,12 +1951,70 @@ static void do_register(User *u)
 
 /*************************************************************************/
 
+/* Finish an IDENTIFY once the password has been checked.  If the channel
+ * was dropped, suspended or given a new password while we were waiting,
+ * the result no longer applies, so just report failure. */
+
+static void identify_result(int res, const char *buf, void *data)
+{
+    PassRequest *req = data;
+    User *u = req->user;
+    ChannelInfo *ci;
+    struct u_chaninfolist *uc;
+    int changed;
+
+    if (!u) {
+	free_pass_request(req);
+	return;
+    }
+    ci = cs_findchan(req->name);
+    changed = (!ci || (ci->flags & CI_VERBOTEN) || ci->suspendinfo
+	       || memcmp(ci->founderpass, req->pass, PASSMAX) != 0);
+    free_pass_request(req);
+
+    if (changed) {
+	notice_lang(s_ChanServ, u, CHAN_IDENTIFY_FAILED);
+    } else if (res == 1) {
+	if (buf) {
+	    /* Password was in an old format; store the upgraded one. */
+	    memcpy(ci->founderpass, buf, PASSMAX);
+	    cs_journal_mark(ci);
+	    if (debug)
+		log("debug: %s: Upgraded password for %s",
+		    s_ChanServ, ci->name);
+	}
+	ci->bad_passwords = 0;
+	ci->last_used = time(NULL);
+	if (!is_identified(u, ci)) {
+	    uc = smalloc(sizeof(*uc));
+	    uc->next = u->founder_chans;
+	    uc->prev = NULL;
+	    if (u->founder_chans)
+		u->founder_chans->prev = uc;
+	    u->founder_chans = uc;
+	    uc->chan = ci;
+	    access_changed(ci);
+	    log("%s: %s!%s@%s identified for %s", s_ChanServ,
+		    u->nick, u->username, u->host, ci->name);
+	}
+	notice_lang(s_ChanServ, u, CHAN_IDENTIFY_SUCCEEDED, ci->name);
+    } else if (res < 0) {
+	log("%s: check_password failed for %s", s_ChanServ, ci->name);
+	notice_lang(s_ChanServ, u, CHAN_IDENTIFY_FAILED);
+    } else {
+	log("%s: Failed IDENTIFY for %s by %s!%s@%s",
+		s_ChanServ, ci->name, u->nick, u->username, u->host);
+	chan_bad_password(u, ci);
+    }
+}
+
+
 static void do_identify(User *u)
 {
     char *chan = strtok(NULL, " ");
     char *pass = strtok(NULL, " ");
     ChannelInfo *ci;
-    struct u_chaninfolist *uc;
+    PassRequest *req;
 
     if (!pass) {
 	syntax_error(s_ChanServ, u, "IDENTIFY", CHAN_IDENTIFY_SYNTAX);
@@ -1570,32 +2024,11 @@ static void do_identify(User *u)
 	notice_lang(s_ChanServ, u, CHAN_X_FORBIDDEN, chan);
     } else if (ci->suspendinfo) {
 	notice_lang(s_ChanServ, u, CHAN_X_SUSPENDED, chan);
+    } else if (u->pass_request) {
+	notice_lang(s_ChanServ, u, PASSWORD_IN_PROGRESS);
     } else {
-	int res = check_password(pass, ci->founderpass);
-	if (res == 1) {
-	    ci->bad_passwords = 0;
-	    ci->last_used = time(NULL);
-	    if (!is_identified(u, ci)) {
-		uc = smalloc(sizeof(*uc));
-		uc->next = u->founder_chans;
-		uc->prev = NULL;
-		if (u->founder_chans)
-		    u->founder_chans->prev = uc;
-		u->founder_chans = uc;
-		uc->chan = ci;
-		log("%s: %s!%s@%s identified for %s", s_ChanServ,
-			u->nick, u->username, u->host, ci->name);
-	    }
-	    notice_lang(s_ChanServ, u, CHAN_IDENTIFY_SUCCEEDED, chan);
-	} else if (res < 0) {
-	    log("%s: check_password failed for %s", s_ChanServ, ci->name);
-	    notice_lang(s_ChanServ, u, CHAN_IDENTIFY_FAILED);
-	} else {
-	    log("%s: Failed IDENTIFY for %s by %s!%s@%s",
-			s_ChanServ, ci->name, u->nick, u->username, u->host);
-	    chan_bad_password(u, ci);
-	}
-
+	req = new_pass_request(u, ci->name, ci->founderpass);
+	check_password_async(pass, ci->founderpass, identify_result, req);
     }
 }
 
@@ -1655,7 +2088,7 @@ static void do_set(User *u)
     char *chan = strtok(NULL, " ");
     char *cmd  = strtok(NULL, " ");
     char *param;
-    ChannelInfo *ci;
+    ChannelInfo *ci = NULL;
     int is_servadmin = is_services_admin(u);
 
     if (readonly) {
@@ -1728,6 +2161,7 @@ static void do_set(User *u)
 	    notice_lang(s_ChanServ, u, MORE_INFO, s_ChanServ, "SET");
 	}
     }
+    cs_journal_mark(ci);
 }
 
 /*************************************************************************/
@@ -1736,7 +2170,7 @@ static void do_unset(User *u)
 {
     char *chan = strtok(NULL, " ");
     char *cmd  = strtok(NULL, " ");
-    ChannelInfo *ci;
+    ChannelInfo *ci = NULL;
     int is_servadmin = is_services_admin(u);
 
     if (readonly) {
@@ -1767,6 +2201,7 @@ static void do_unset(User *u)
     } else {
 	syntax_error(s_ChanServ, u, "UNSET", CHAN_UNSET_SYNTAX);
     }
+    cs_journal_mark(ci);
 }
 
 /*************************************************************************/
@@ -1794,6 +2229,7 @@ static void do_set_founder(User *u, ChannelInfo *ci, char *param)
     uncount_chan(ci);
     ci->founder = ni;
     count_chan(ci);
+    access_changed(ci);
     if (ci->successor == ci->founder)
 	ci->successor = NULL;
     log("%s: Changing founder of %s to %s by %s!%s@%s", s_ChanServ,
@@ -2085,6 +2521,8 @@ static void do_set_mlock(User *u, ChannelInfo *ci, char *param)
 
 static void do_set_boolean(User *u, ChannelInfo *ci, ChanOpt *co, char *param)
 {
+    if (co->flag == CI_SECURE)
+	access_changed(ci);
     if (stricmp(param, "ON") == 0) {
 	ci->flags |= co->flag;
 	if (co->flag == CI_RESTRICTED && ci->levels[CA_NOJOIN] < 0)
@@ -2118,6 +2556,7 @@ static int akick_del(User *u, AutoKick *akick)
     } else {
 	free(akick->u.mask);
 	akick->u.mask = NULL;
+	free_usermask(&akick->parsed);
     }
     if (akick->reason) {
 	free(akick->reason);
@@ -2134,7 +2573,10 @@ static int akick_del_callback(User *u, int num, va_list args)
     if (num < 1 || num > ci->akickcount)
 	return 0;
     *last = num;
-    return akick_del(u, &ci->akick[num-1]);
+    if (!akick_del(u, &ci->akick[num-1]))
+	return 0;
+    akick_changed(ci);
+    return 1;
 }
 
 
@@ -2261,12 +2703,14 @@ static void do_akick(User *u)
 	} else {
 	    akick->is_nick = 0;
 	    akick->u.mask = mask;
+	    parse_usermask(mask, &akick->parsed);
 	}
 	if (reason)
 	    akick->reason = sstrdup(reason);
 	else
 	    akick->reason = NULL;
 	strscpy(akick->who, u->nick, NICKMAX);
+	akick_changed(ci);
 	notice_lang(s_ChanServ, u, CHAN_AKICK_ADDED, mask, chan);
 
     } else if (stricmp(cmd, "DEL") == 0) {
@@ -2310,6 +2754,7 @@ static void do_akick(User *u)
 	    }
 	    notice_lang(s_ChanServ, u, CHAN_AKICK_DELETED, mask, chan);
 	    akick_del(u, akick);
+	    akick_changed(ci);
 	}
 
     } else if (stricmp(cmd, "LIST") == 0 || stricmp(cmd, "VIEW") == 0) {
@@ -2419,6 +2864,7 @@ static void do_levels(User *u)
 	for (i = 0; levelinfo[i].what >= 0; i++) {
 	    if (stricmp(levelinfo[i].name, what) == 0) {
 		ci->levels[levelinfo[i].what] = level;
+		cs_journal_mark(ci);
 		notice_lang(s_ChanServ, u, CHAN_LEVELS_CHANGED,
 			levelinfo[i].name, chan, level);
 		return;
@@ -2430,6 +2876,7 @@ static void do_levels(User *u)
 	for (i = 0; levelinfo[i].what >= 0; i++) {
 	    if (stricmp(levelinfo[i].name, what) == 0) {
 		ci->levels[levelinfo[i].what] = ACCLEV_INVALID;
+		cs_journal_mark(ci);
 		notice_lang(s_ChanServ, u, CHAN_LEVELS_DISABLED,
 			levelinfo[i].name, chan);
 		return;
@@ -2459,6 +2906,7 @@ static void do_levels(User *u)
 
     } else if (stricmp(cmd, "RESET") == 0) {
 	reset_levels(ci);
+	cs_journal_mark(ci);
 	notice_lang(s_ChanServ, u, CHAN_LEVELS_RESET, chan);
 
     } else {
@@ -2640,7 +3088,7 @@ static void do_list(User *u)
 	}
 
 	notice_lang(s_ChanServ, u, CHAN_LIST_HEADER, pattern);
-	for (ci = cs_firstchan(); ci; ci = cs_nextchan()) {
+	for (ci = cs_firstchan_sorted(); ci; ci = cs_nextchan_sorted()) {
 	    if (!is_servadmin && (ci->flags & (CI_PRIVATE | CI_VERBOTEN)))
 		continue;
 	    if (matchflags || match_susp) {
@@ -41,6 +41,17 @@ typedef struct {
 #endif
 
 
+/* Entry in the access list index (see get_access()).  Keyed by the nick
+ * the access list entry's nick is linked to; ni is NULL for free slots. */
+typedef struct {
+    NickInfo *ni;
+    int16 level;
+} ChanAccessIdx;
+
+/* Access lists shorter than this are searched directly. */
+#define ACCESS_INDEX_MIN	16
+
+
 /* AutoKick data. */
 typedef struct {
     int16 in_use;
@@ -52,8 +63,13 @@ typedef struct {
     } u;
     char *reason;
     char who[NICKMAX];
+    UserMask parsed;	/* u.mask split up (mask entries only) */
 } AutoKick;
 
+/* Compiled form of a channel's autokick list (see check_kick()); the
+ * structure is private to chanserv.c. */
+typedef struct akickset_ AkickSet;
+
 
 struct chaninfo_ {
     ChannelInfo *next, *prev;
@@ -94,6 +110,15 @@ struct chaninfo_ {
 				 *    channel is currently in use) */
 
     int bad_passwords;		/* # of bad passwords since last good one */
+
+    ChanAccessIdx *accessidx;	/* Index of access[] by nick (open
+				 *    addressing); NULL if not built */
+    int32 accessidx_size;	/* Number of slots (power of 2) */
+    uint32 accessidx_gen;	/* Link generation index was built for */
+
+    AkickSet *akickset;		/* Compiled akick[]; NULL if not built */
+
+    int journal_dirty;		/* Changed since last journal flush? */
 };
 
 /* Retain topic even after last person leaves channel */
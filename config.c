@@ -62,6 +62,7 @@ char *AConnectDBName;
 char *NakillDBName;
 char *FloodServDBName;
 char *GrNameDBName;
+char *MemoTextDBName;
 
 int   NoBackupOkay;
 int   NoBouncyModes;
@@ -72,12 +73,19 @@ int   BadPassTimeout;
 int   BadPassWarning;
 int   BadPassSuspend;
 int   UpdateTimeout;
+int   BackgroundSave;
+int   JournalFlush;
+int   JournalCompact;
+char *CompressDatabases;
 int   ExpireTimeout;
 int   ReadTimeout;
 int   WarningTimeout;
 int   TimeoutCheck;
 int   PingFrequency;
 int   MergeChannelModes;
+int   PasswordThreads;
+int   PasswordCost;
+int   PasswordTime;
 
 int   NSForceNickChange;
 char *NSGuestNickPrefix;
@@ -90,6 +98,8 @@ int   NSAccessMax;
 char *NSEnforcerUser;
 char *NSEnforcerHost;
 int   NSReleaseTimeout;
+int   NSBurstDelay;
+int   NSBurstBatch;
 int   NSAllowKillImmed;
 int   NSMaxLinkDepth;
 int   NSListOpersOnly;
@@ -164,6 +174,9 @@ int   FloodServTFNLWarned;
 int   FloodServTFSecWarned;
 int   FloodServWarnFirst;
 char *FloodServWarnMsg;
+int   FloodServSimilarity;
+int   FloodServNetLines;
+int   FloodServNetSec;
 
 char *GrNameAkillReason;
 
@@ -222,6 +235,7 @@ Directive directives[] = {
 	{ "AConnectDB",       { { PARAM_STRING, 0, &AConnectDBName } } },
     { "AutokillDB",       { { PARAM_STRING, 0, &AutokillDBName } } },
     { "AutokillExpiry",   { { PARAM_TIME, 0, &AutokillExpiry } } },
+    { "BackgroundSave",   { { PARAM_SET, 0, &BackgroundSave } } },
     { "BadPassLimit",     { { PARAM_POSINT, 0, &BadPassLimit } } },
     { "BadPassSuspend",   { { PARAM_POSINT, 0, &BadPassSuspend } } },
     { "BadPassTimeout",   { { PARAM_TIME, 0, &BadPassTimeout } } },
@@ -234,6 +248,7 @@ Directive directives[] = {
                             { PARAM_POSINT, 0, &CloneMinUsers },
                             { PARAM_TIME, 0, &CloneMaxDelay },
                             { PARAM_TIME, 0, &CloneWarningDelay } } },
+    { "CompressDatabases",{ { PARAM_STRING, 0, &CompressDatabases } } },
     { "CSAccessMax",      { { PARAM_POSINT, 0, &CSAccessMax } } },
     { "CSAutokickMax",    { { PARAM_POSINT, 0, &CSAutokickMax } } },
     { "CSAutokickReason", { { PARAM_STRING, 0, &CSAutokickReason } } },
@@ -245,6 +260,8 @@ Directive directives[] = {
     { "CSRestrictDelay",  { { PARAM_TIME, 0, &CSRestrictDelay } } },
     { "CSSuspendExpire",  { { PARAM_TIME, 0 , &CSSuspendExpire },
                             { PARAM_TIME, 0 , &CSSuspendGrace } } },
+    { "DatabaseJournal",  { { PARAM_TIME, 0, &JournalFlush },
+                            { PARAM_TIME, 0, &JournalCompact } } },
     { "DefSessionLimit",  { { PARAM_INT, 0, &DefSessionLimit } } },
     { "DevNullName",      { { PARAM_STRING, 0, &s_DevNull },
                             { PARAM_STRING, 0, &desc_DevNull } } },
@@ -256,6 +273,9 @@ Directive directives[] = {
 	{ "FloodServDB",      { { PARAM_STRING, 0, &FloodServDBName } } },
 	{ "FloodServName",    { { PARAM_STRING, 0, &s_FloodServ },
 	                            { PARAM_STRING, 0, &desc_FloodServ } } },	
+	{ "FloodServNetFlood", { { PARAM_POSINT, 0, &FloodServNetLines },
+	                            { PARAM_TIME, 0, &FloodServNetSec } } },
+	{ "FloodServSimilarity", { { PARAM_INT, 0, &FloodServSimilarity } } },
 	{ "FloodServTFNumLines", { { PARAM_INT, 0, &FloodServTFNumLines } } },
 	{ "FloodServTFSec",   { { PARAM_INT, 0, &FloodServTFSec } } },
 	{ "FloodServTFNLWarned", { { PARAM_INT, 0, &FloodServTFNLWarned } } },
@@ -282,6 +302,7 @@ Directive directives[] = {
     { "MaxSessionLimit",  { { PARAM_POSINT, 0, &MaxSessionLimit } } },
     { "MemoServName",     { { PARAM_STRING, 0, &s_MemoServ },
                             { PARAM_STRING, 0, &desc_MemoServ } } },
+    { "MemoTextDB",       { { PARAM_STRING, 0, &MemoTextDBName } } },
     { "MergeChannelModes",{ { PARAM_TIMEMSEC, 0, &MergeChannelModes } } },
     { "MOTDFile",         { { PARAM_STRING, 0, &MOTDFilename } } },
     { "MSMaxMemos",       { { PARAM_POSINT, 0, &MSMaxMemos } } },
@@ -298,6 +319,8 @@ Directive directives[] = {
     { "NoSplitRecovery",  { { PARAM_SET, 0, &NoSplitRecovery } } },
     { "NSAccessMax",      { { PARAM_POSINT, 0, &NSAccessMax } } },
     { "NSAllowKillImmed", { { PARAM_SET, 0, &NSAllowKillImmed } } },
+    { "NSBurstDelay",     { { PARAM_TIMEMSEC, 0, &NSBurstDelay },
+                            { PARAM_POSINT, PARAM_OPTIONAL, &NSBurstBatch } } },
     { "NSDefHideEmail",   { { PARAM_SET, 0, &NSDefHideEmail } } },
     { "NSDefHideQuit",    { { PARAM_SET, 0, &NSDefHideQuit } } },
     { "NSDefHideUsermask",{ { PARAM_SET, 0, &NSDefHideUsermask } } },
@@ -326,6 +349,9 @@ Directive directives[] = {
     { "OperServDB",       { { PARAM_STRING, 0, &OperDBName } } },
     { "OperServName",     { { PARAM_STRING, 0, &s_OperServ },
                             { PARAM_STRING, 0, &desc_OperServ } } },
+    { "PasswordCost",     { { PARAM_POSINT, 0, &PasswordCost } } },
+    { "PasswordThreads",  { { PARAM_POSINT, 0, &PasswordThreads } } },
+    { "PasswordTime",     { { PARAM_TIMEMSEC, 0, &PasswordTime } } },
     { "PIDFile",          { { PARAM_STRING, 0, &PIDFilename } } },
     { "PingFrequency",    { { PARAM_TIME, 0, &PingFrequency } } },
     { "ReadTimeout",      { { PARAM_TIME, 0, &ReadTimeout } } },
@@ -654,6 +680,11 @@ int read_config()
     CHEK2(NewsDBName, NewsDB);
     CHEK2(ExceptionDBName, ExceptionDB);
     CHECK(UpdateTimeout);
+    if (JournalFlush && JournalCompact < JournalFlush) {
+	error(0, "DatabaseJournal compaction time must not be less than"
+		 " the flush time");
+	retval = 0;
+    }
     CHECK(ExpireTimeout);
     CHECK(ReadTimeout);
     CHECK(WarningTimeout);
@@ -691,6 +722,14 @@ int read_config()
 	CHECK(FloodServWarnFirst);
 	CHECK(FloodServWarnMsg);
 	CHECK(GrNameAkillReason);
+	if (FloodServSimilarity < 0 || FloodServSimilarity > 100) {
+	    error(0, "FloodServSimilarity must be in the range 0..100");
+	    retval = 0;
+	}
+	if (FloodServNetLines && FloodServNetSec <= 0) {
+	    error(0, "FloodServNetFlood time must be at least 1 second");
+	    retval = 0;
+	}
 
 #ifdef IRC_UNREAL
     if (ServerNumeric < 0 || ServerNumeric > 254) {
@@ -790,6 +829,9 @@ function correctly when running together. Session limiting is preferred.
     if (!MaxSessionLimit)
 	MaxSessionLimit = 32767;
 
+    if (NSBurstDelay && !NSBurstBatch)
+	NSBurstBatch = 200;
+
     return retval;
 }
 
@@ -62,6 +62,7 @@ static int access_add(ChannelInfo *ci, const char *nick, int level, int uacc)
 	    if (access->level == level)
 		return RET_UNCHANGED;
 	    access->level = level;
+	    access_changed(ci);
 	    return RET_CHANGED;
 	}
     }
@@ -82,6 +83,7 @@ static int access_add(ChannelInfo *ci, const char *nick, int level, int uacc)
     access->ni = ni;
     access->in_use = 1;
     access->level = level;
+    access_changed(ci);
     return RET_ADDED;
 }
 
@@ -95,6 +97,7 @@ static int access_del(ChannelInfo *ci, int num, int uacc)
 	return RET_PERMISSION;
     access->ni = NULL;
     access->in_use = 0;
+    access_changed(ci);
     return RET_DELETED;
 }
 
@@ -343,6 +346,7 @@ static int xop_del_callback(User *u, int num, va_list args)
     i--;
     ci->access[i].ni = NULL;
     ci->access[i].in_use = 0;
+    access_changed(ci);
     (*offset)++;
     return 1;
 }
@@ -499,6 +503,7 @@ static void handle_xop(User *u, int level)
 			    ci->access[i].ni->nick, ci->name, listname);
 	    ci->access[i].ni = NULL;
 	    ci->access[i].in_use = 0;
+	    access_changed(ci);
 	}
 
     } else if (stricmp(cmd, "LIST") == 0) {
@@ -10,6 +10,26 @@
 /*************************************************************************/
 /*************************************************************************/
 
+/* Change journal; this works the same way as the nickname journal (see
+ * ns-loadsave.c), with <ChanDBName>.journal holding channel records. */
+
+#define JOURNAL_RECORD	1
+#define JOURNAL_DELETE	2
+
+static char (*journal_queue)[CHANMAX];	/* Channels to write on next flush */
+static int journal_count = 0, journal_size = 0;
+static int replaying = 0;	/* Are we reading a journal? */
+static int journal_damaged = 0;	/* Was a journal only partly replayed? */
+
+/* Channels read by read_cs_dbase() and waiting for load_cs_dbase() to link
+ * them in (see load_channel()), or a pre-v5 database left open for it. */
+static ChannelInfo *loaded_chans = NULL;
+static dbFILE *old_dbfile = NULL;
+static int old_dbver;
+static int chans_read = 0;	/* Has read_cs_dbase() been called? */
+
+/*************************************************************************/
+
 /* Load v1-v4 files. */
 
 #define SAFE(x) do {					\
@@ -24,7 +44,7 @@
 static void load_old_cs_dbase(dbFILE *f, int ver)
 {
     int i, j, c;
-    ChannelInfo *ci, **last, *prev;
+    ChannelInfo *ci;
     int failed = 0;
 
     struct {
@@ -71,9 +91,6 @@ static void load_old_cs_dbase(dbFILE *f, int ver)
 
 
     for (i = 33; i < 256 && !failed; i++) {
-
-	last = &chanlists[i];
-	prev = NULL;
 	while ((c = getc_db(f)) != 0) {
 	    if (c != 1)
 		fatal("Invalid format in %s", ChanDBName);
@@ -96,17 +113,7 @@ static void load_old_cs_dbase(dbFILE *f, int ver)
 	    strscpy(ci->last_topic_setter,
 			old_channelinfo.last_topic_setter, NICKMAX);
 	    ci->last_topic_time = old_channelinfo.last_topic_time;
-#ifdef USE_ENCRYPTION
-	    if (!(ci->flags & (CI_ENCRYPTEDPW | CI_VERBOTEN))) {
-		if (debug)
-		    log("debug: %s: encrypting password for %s on load",
-				s_ChanServ, ci->name);
-		if (encrypt_in_place(ci->founderpass, PASSMAX) < 0)
-		    fatal("%s: load database: Can't encrypt %s password!",
-				s_ChanServ, ci->name);
-		ci->flags |= CI_ENCRYPTEDPW;
-	    }
-#else
+#ifndef USE_ENCRYPTION
 	    if (ci->flags & CI_ENCRYPTEDPW) {
 		/* Bail: it makes no sense to continue with encrypted
 		 * passwords, since we won't be able to verify them */
@@ -165,7 +172,7 @@ static void load_old_cs_dbase(dbFILE *f, int ver)
 		AutoKick *akick;
 		char *s;
 
-		akick = smalloc(sizeof(AutoKick) * ci->akickcount);
+		akick = scalloc(sizeof(AutoKick), ci->akickcount);
 		ci->akick = akick;
 		for (j = 0; j < ci->akickcount; j++, akick++) {
 		    SAFE(read_variable(old_autokick, f));
@@ -188,6 +195,8 @@ static void load_old_cs_dbase(dbFILE *f, int ver)
 		    } else {
 			if (!(akick->u.mask = s))
 			    akick->in_use = 0;
+			else
+			    parse_usermask(s, &akick->parsed);
 		    }
 		    if (akick->reason)
 			SAFE(read_string(&akick->reason, f));
@@ -197,6 +206,7 @@ static void load_old_cs_dbase(dbFILE *f, int ver)
 			} else {
 			    free(akick->u.mask);
 			    akick->u.mask = NULL;
+			    free_usermask(&akick->parsed);
 			}
 			if (akick->reason) {
 			    free(akick->reason);
@@ -231,15 +241,10 @@ static void load_old_cs_dbase(dbFILE *f, int ver)
 
 	    ci->memos.memomax = MSMaxMemos;
 
-	    *last = ci;
-	    last = &ci->next;
-	    ci->prev = prev;
-	    prev = ci;
+	    insert_chan(ci);
 
 	} /* while (getc_db(f) != 0) */
 
-	*last = NULL;
-
     } /* for (i) */
 }
 
@@ -247,14 +252,83 @@ static void load_old_cs_dbase(dbFILE *f, int ver)
 
 /*************************************************************************/
 
+/* Free a channel read in by load_channel() whose nick references are
+ * still names (see below). */
+
+static void free_loaded_channel(ChannelInfo *ci)
+{
+    int i;
+
+    if (ci->founder)
+	free(ci->founder);
+    if (ci->successor)
+	free(ci->successor);
+    if (ci->desc)
+	free(ci->desc);
+    if (ci->url)
+	free(ci->url);
+    if (ci->email)
+	free(ci->email);
+    if (ci->last_topic)
+	free(ci->last_topic);
+    if (ci->suspendinfo) {
+	if (ci->suspendinfo->reason)
+	    free(ci->suspendinfo->reason);
+	free(ci->suspendinfo);
+    }
+    if (ci->access) {
+	for (i = 0; i < ci->accesscount; i++) {
+	    if (ci->access[i].ni)
+		free(ci->access[i].ni);
+	}
+	free(ci->access);
+    }
+    if (ci->akick) {
+	for (i = 0; i < ci->akickcount; i++) {
+	    if (ci->akick[i].is_nick) {
+		if (ci->akick[i].u.ni)
+		    free(ci->akick[i].u.ni);
+	    } else if (ci->akick[i].u.mask) {
+		free(ci->akick[i].u.mask);
+		free_usermask(&ci->akick[i].parsed);
+	    }
+	    if (ci->akick[i].reason)
+		free(ci->akick[i].reason);
+	}
+	free(ci->akick);
+    }
+    if (ci->levels)
+	free(ci->levels);
+    if (ci->mlock_key)
+	free(ci->mlock_key);
+    if (ci->memos.memos) {
+	for (i = 0; i < ci->memos.memocount; i++) {
+	    if (ci->memos.memos[i].text)
+		free(ci->memos.memos[i].text);
+	}
+	free(ci->memos.memos);
+    }
+    if (ci->entry_message)
+	free(ci->entry_message);
+    free(ci);
+}
+
+/*************************************************************************/
+
 #define SAFE(x) do {					\
     if ((x) < 0) {					\
-	if (!forceload)					\
+	if (!forceload && !replaying)			\
 	    fatal("Read error on %s", ChanDBName);	\
-	return NULL;					\
+	goto fail;					\
     }							\
 } while (0)
 
+/* Read a channel record.  The channel is not linked into the channel list,
+ * and its founder, successor and nick access and autokick entries are left
+ * as nick names (cast to NickInfo *), since the nick database may still be
+ * loading when this is called; resolve_channel() takes care of both.
+ */
+
 static ChannelInfo *load_channel(dbFILE *f, int ver)
 {
     ChannelInfo *ci;
@@ -266,29 +340,9 @@ static ChannelInfo *load_channel(dbFILE *f, int ver)
 
     ci = scalloc(sizeof(ChannelInfo), 1);
     SAFE(read_buffer(ci->name, f));
-    alpha_insert_chan(ci);
-    SAFE(read_string(&s, f));
-    if (s) {
-	ci->founder = findnick(s);
-	free(s);
-    } else {
-	ci->founder = NULL;
-    }
-    if (ver >= 7) {
-	SAFE(read_string(&s, f));
-	if (s) {
-	    ci->successor = findnick(s);
-	    free(s);
-	} else {
-	    ci->successor = NULL;
-	}
-	/* Founder could be successor, which is bad, in vers 7,8 */
-	if (ci->founder == ci->successor)
-	    ci->successor = NULL;
-    } else {
-	ci->successor = NULL;
-    }
-    count_chan(ci);
+    SAFE(read_string((char **)&ci->founder, f));
+    if (ver >= 7)
+	SAFE(read_string((char **)&ci->successor, f));
     SAFE(read_buffer(ci->founderpass, f));
     SAFE(read_string(&ci->desc, f));
     if (!ci->desc)
@@ -307,26 +361,18 @@ static ChannelInfo *load_channel(dbFILE *f, int ver)
     if (ver >= 9)
 	SAFE(read_ptr((void **)&ci->suspendinfo, f));
     if (ci->suspendinfo) {
-	SuspendInfo *si = smalloc(sizeof(*si));
+	/* Replace the marker before reading, so that a record cut short
+	 * here still leaves something free_loaded_channel() can free */
+	SuspendInfo *si = scalloc(sizeof(*si), 1);
+	ci->suspendinfo = si;
 	SAFE(read_buffer(si->who, f));
 	SAFE(read_string(&si->reason, f));
 	SAFE(read_int32(&tmp32, f));
 	si->suspended = tmp32;
 	SAFE(read_int32(&tmp32, f));
 	si->expires = tmp32;
-	ci->suspendinfo = si;
-    }
-#ifdef USE_ENCRYPTION
-    if (!(ci->flags & (CI_ENCRYPTEDPW | CI_VERBOTEN))) {
-	if (debug)
-	    log("debug: %s: encrypting password for %s on load",
-		s_ChanServ, ci->name);
-	if (encrypt_in_place(ci->founderpass, PASSMAX) < 0)
-	    fatal("%s: load database: Can't encrypt %s password!",
-		  s_ChanServ, ci->name);
-	ci->flags |= CI_ENCRYPTEDPW;
     }
-#else
+#ifndef USE_ENCRYPTION
     if (ci->flags & CI_ENCRYPTEDPW) {
 	/* Bail: it makes no sense to continue with encrypted
 	 * passwords, since we won't be able to verify them */
@@ -352,13 +398,7 @@ static ChannelInfo *load_channel(dbFILE *f, int ver)
 	    SAFE(read_int16(&ci->access[i].in_use, f));
 	    if (ci->access[i].in_use) {
 		SAFE(read_int16(&ci->access[i].level, f));
-		SAFE(read_string(&s, f));
-		if (s) {
-		    ci->access[i].ni = findnick(s);
-		    free(s);
-		}
-		if (ci->access[i].ni == NULL)
-		    ci->access[i].in_use = 0;
+		SAFE(read_string((char **)&ci->access[i].ni, f));
 	    }
 	}
     } else {
@@ -374,18 +414,13 @@ static ChannelInfo *load_channel(dbFILE *f, int ver)
 		SAFE(read_int16(&ci->akick[i].is_nick, f));
 		SAFE(read_string(&s, f));
 		if (ci->akick[i].is_nick) {
-		    ci->akick[i].u.ni = findnick(s);
-		    if (!ci->akick[i].u.ni)
-			ci->akick[i].in_use = 0;
-		    free(s);
+		    ci->akick[i].u.ni = (NickInfo *)s;
 		} else {
 		    ci->akick[i].u.mask = s;
+		    if (s)
+			parse_usermask(s, &ci->akick[i].parsed);
 		}
-		SAFE(read_string(&s, f));
-		if (ci->akick[i].in_use)
-		    ci->akick[i].reason = s;
-		else if (s)
-		    free(s);
+		SAFE(read_string(&ci->akick[i].reason, f));
 		if (ver >= 8)
 		    SAFE(read_buffer(ci->akick[i].who, f));
 		else
@@ -413,7 +448,8 @@ static ChannelInfo *load_channel(dbFILE *f, int ver)
     SAFE(read_int16(&ci->memos.memomax, f));
     if (ci->memos.memocount) {
 	Memo *memos;
-	memos = smalloc(sizeof(Memo) * ci->memos.memocount);
+	/* Zeroed, so that only the texts actually read are freed */
+	memos = scalloc(sizeof(Memo), ci->memos.memocount);
 	ci->memos.memos = memos;
 	for (i = 0; i < ci->memos.memocount; i++, memos++) {
 	    SAFE(read_int32(&memos->number, f));
@@ -421,6 +457,10 @@ static ChannelInfo *load_channel(dbFILE *f, int ver)
 	    SAFE(read_int32(&tmp32, f));
 	    memos->time = tmp32;
 	    SAFE(read_buffer(memos->sender, f));
+	    if (ver >= 12)
+		SAFE(read_int32(&memos->textpos, f));
+	    else
+		memos->textpos = 0;
 	    SAFE(read_string(&memos->text, f));
 	}
     }
@@ -430,23 +470,228 @@ static ChannelInfo *load_channel(dbFILE *f, int ver)
     ci->c = NULL;
 
     return ci;
+
+  fail:
+    free_loaded_channel(ci);
+    return NULL;
 }
 
 #undef SAFE
 
 /*************************************************************************/
 
-void load_cs_dbase(void)
+/* Link a channel read by load_channel() into the channel list and look up
+ * the nicks it refers to, dropping access and autokick entries for nicks
+ * which no longer exist.  Non-forbidden channels with no founder are
+ * deleted; these can crop up if the nick and channel databases get out of
+ * sync and the founder's nick has disappeared.  (Note that we ignore the
+ * successor here, but since this shouldn't happen normally, no big deal.)
+ * Must be called from the main thread, after the nick database is loaded.
+ */
+
+static void resolve_channel(ChannelInfo *ci)
+{
+    AutoKick *akick;
+    char *s;
+    int i;
+
+    insert_chan(ci);
+    if ((s = (char *)ci->founder) != NULL) {
+	ci->founder = findnick(s);
+	free(s);
+    }
+    if ((s = (char *)ci->successor) != NULL) {
+	ci->successor = findnick(s);
+	free(s);
+    }
+    /* Founder could be successor, which is bad, in vers 7,8 */
+    if (ci->founder == ci->successor)
+	ci->successor = NULL;
+    count_chan(ci);
+    for (i = 0; i < ci->accesscount; i++) {
+	if ((s = (char *)ci->access[i].ni) != NULL) {
+	    ci->access[i].ni = findnick(s);
+	    free(s);
+	}
+	if (ci->access[i].ni == NULL)
+	    ci->access[i].in_use = 0;
+    }
+    for (i = 0, akick = ci->akick; i < ci->akickcount; i++, akick++) {
+	if (!akick->in_use || !akick->is_nick)
+	    continue;
+	if ((s = (char *)akick->u.ni) != NULL) {
+	    akick->u.ni = findnick(s);
+	    free(s);
+	}
+	if (!akick->u.ni) {
+	    akick->in_use = 0;
+	    if (akick->reason) {
+		free(akick->reason);
+		akick->reason = NULL;
+	    }
+	}
+    }
+    if (ci->memos.memocount)
+	memos_loaded(&ci->memos, ci->name);
+
+    if (!(ci->flags & CI_VERBOTEN) && !ci->founder) {
+	log("%s: database load: Deleting founderless channel %s",
+	    s_ChanServ, ci->name);
+	delchan(ci);
+    }
+}
+
+/*************************************************************************/
+
+/* Replay the given journal file over the channels loaded so far; see
+ * replay_journal() in ns-loadsave.c.  Returns the number of records
+ * applied.
+ */
+
+static int replay_journal(const char *filename)
+{
+    dbFILE *f;
+    int ver, c, count = 0;
+    ChannelInfo *ci, *old;
+    char chan[CHANMAX];
+
+    if (!(f = open_db(s_ChanServ, filename, "r")))
+	return 0;
+    ver = get_file_version(f);
+    if (ver < 5 || ver > FILE_VERSION) {
+	log("%s: Unsupported version number (%d) on %s, not replaying",
+	    s_ChanServ, ver, filename);
+	close_db(f);
+	return 0;
+    }
+    replaying = 1;
+    while ((c = getc_db(f)) != EOF) {
+	if (c == JOURNAL_RECORD) {
+	    if (!(ci = load_channel(f, ver)))
+		break;
+	    if ((old = cs_findchan(ci->name)) != NULL)
+		delchan(old);
+	    resolve_channel(ci);
+	} else if (c == JOURNAL_DELETE && read_buffer(chan, f)) {
+	    chan[CHANMAX-1] = 0;
+	    if ((old = cs_findchan(chan)) != NULL)
+		delchan(old);
+	} else {
+	    break;
+	}
+	count++;
+    }
+    replaying = 0;
+    if (c != EOF) {
+	log("%s: %s damaged after %d records, ignoring the rest",
+	    s_ChanServ, filename, count);
+    }
+    if (c != EOF || f->badblocks)
+	journal_damaged = 1;
+    close_db(f);
+    if (debug)
+	log("debug: %s: replayed %d records from %s",
+	    s_ChanServ, count, filename);
+    return count;
+}
+
+static void replay_journals(void)
+{
+    char buf[PATH_MAX];
+
+    snprintf(buf, sizeof(buf), "%s.journal.old", ChanDBName);
+    replay_journal(buf);
+    snprintf(buf, sizeof(buf), "%s.journal", ChanDBName);
+    replay_journal(buf);
+}
+
+/* Save the whole database if a journal was damaged; see
+ * replace_damaged_journals() in ns-loadsave.c. */
+
+static void replace_damaged_journals(void)
+{
+    char buf[PATH_MAX];
+    int errors = db_write_errors;
+
+    if (!journal_damaged || readonly)
+	return;
+    journal_damaged = 0;
+    log("%s: saving %s to replace its damaged journal", s_ChanServ,
+	ChanDBName);
+    save_cs_dbase();
+    if (db_write_errors != errors)
+	return;
+    snprintf(buf, sizeof(buf), "%s.journal", ChanDBName);
+    unlink(buf);
+}
+
+/*************************************************************************/
+
+/* Encrypt the founder passwords of any channels loaded without encryption
+ * (from a database saved before encryption was enabled), several at a
+ * time; see encrypt_loaded_nicks().
+ */
+
+#ifdef USE_ENCRYPTION
+static void encrypt_channel_list(ChannelInfo **list, int count)
+{
+    char *bufs[16];
+    int i;
+
+    for (i = 0; i < count; i++)
+	bufs[i] = list[i]->founderpass;
+    if (encrypt_in_place_batch(bufs, count, PASSMAX) < 0)
+	fatal("%s: load database: Can't encrypt %s password!",
+	      s_ChanServ, list[0]->name);
+    for (i = 0; i < count; i++)
+	list[i]->flags |= CI_ENCRYPTEDPW;
+}
+#endif
+
+static void encrypt_loaded_channels(void)
+{
+#ifdef USE_ENCRYPTION
+    ChannelInfo *ci, *list[16];
+    int count = 0;
+
+    for (ci = cs_firstchan(); ci; ci = cs_nextchan()) {
+	if (ci->flags & (CI_ENCRYPTEDPW | CI_VERBOTEN))
+	    continue;
+	if (debug)
+	    log("debug: %s: encrypting password for %s on load",
+		s_ChanServ, ci->name);
+	list[count++] = ci;
+	if (count == lenof(list)) {
+	    encrypt_channel_list(list, count);
+	    count = 0;
+	}
+    }
+    if (count > 0)
+	encrypt_channel_list(list, count);
+#endif
+}
+
+/*************************************************************************/
+
+/* Read the channel database into memory without linking the channels in
+ * or looking up any nicks, so that this can be done (from a second thread)
+ * while the nick database is being loaded.  load_cs_dbase() finishes the
+ * job, and calls this itself if it hasn't already been called.
+ */
+
+void read_cs_dbase(void)
 {
     dbFILE *f;
     int ver, i, c;
-    ChannelInfo *ci;
+    ChannelInfo *ci, **tail = &loaded_chans;
     int failed = 0;
 
+    chans_read = 1;
     if (!(f = open_db(s_ChanServ, ChanDBName, "r")))
 	return;
 
     switch (ver = get_file_version(f)) {
+      case 12:
       case 11:
       case 10:
       case 9:
@@ -456,25 +701,22 @@ void load_cs_dbase(void)
       case 5:
 	for (i = 0; i < 256 && !failed; i++) {
 	    while ((c = getc_db(f)) != 0) {
-		if (c != 1)
+		if (c != 1) {
+		    /* Damaged blocks have already been reported */
+		    if (c == EOF && f->badblocks) {
+			failed = 1;
+			break;
+		    }
 		    fatal("Invalid format in %s", ChanDBName);
+		}
 		ci = load_channel(f, ver);
 		if (!ci) {
 		    failed = 1;
 		    break;
 		}
-		/* Delete non-forbidden channels with no founder.  These
-		 * can crop up if the nick and channel databases get out
-		 * of sync and the founder's nick has disappeared.  Note
-		 * that we ignore the successor here, but since this
-		 * shouldn't happen normally, no big deal.
-		 */
-		if (!(ci->flags & CI_VERBOTEN) && !ci->founder) {
-		    log("%s: database load: Deleting founderless channel %s",
-			s_ChanServ, ci->name);
-		    delchan(ci);
-		    continue;
-		}
+		ci->next = NULL;
+		*tail = ci;
+		tail = &ci->next;
 	    }
 	}
 	break;
@@ -483,19 +725,11 @@ void load_cs_dbase(void)
       case 3:
       case 2:
       case 1:
-	load_old_cs_dbase(f, ver);
-	for (i = 0; i < 256; i++) {
-	    ChannelInfo *next;
-	    for (ci = chanlists[i]; ci; ci = next) {
-		next = ci->next;
-		if (!(ci->flags & CI_VERBOTEN) && !ci->founder) {
-		    log("%s: database load: Deleting founderless channel %s",
-			s_ChanServ, ci->name);
-		    delchan(ci);
-		}
-	    }
-	}
-	break;
+	/* These look up nicks as they go, so leave them to
+	 * load_cs_dbase() */
+	old_dbfile = f;
+	old_dbver = ver;
+	return;
 
       case -1:
 	fatal("Unable to read version number from %s", ChanDBName);
@@ -506,7 +740,42 @@ void load_cs_dbase(void)
     } /* switch (version) */
 
     close_db(f);
+}
+
+/*************************************************************************/
+
+void load_cs_dbase(void)
+{
+    ChannelInfo *ci, *next;
+
+    if (!chans_read)
+	read_cs_dbase();
+    chans_read = 0;
+
+    if (old_dbfile) {
+	load_old_cs_dbase(old_dbfile, old_dbver);
+	close_db(old_dbfile);
+	old_dbfile = NULL;
+	for (ci = cs_firstchan(); ci; ci = next) {
+	    next = cs_nextchan();
+	    if (!(ci->flags & CI_VERBOTEN) && !ci->founder) {
+		log("%s: database load: Deleting founderless channel %s",
+		    s_ChanServ, ci->name);
+		delchan(ci);
+	    }
+	}
+    } else {
+	for (ci = loaded_chans; ci; ci = next) {
+	    next = ci->next;
+	    resolve_channel(ci);
+	}
+	loaded_chans = NULL;
+	/* Bring the data up to date */
+	replay_journals();
+    }
 
+    encrypt_loaded_channels();
+    replace_damaged_journals();
 }
 
 #undef SAFE
@@ -514,96 +783,114 @@ void load_cs_dbase(void)
 /*************************************************************************/
 /*************************************************************************/
 
-#define SAFE(x) do { if ((x) < 0) goto fail; } while (0)
+#define SAFE(x) do { if ((x) < 0) return -1; } while (0)
 
-void save_cs_dbase(void)
+/* Write a single channel's record.  Returns 0 on success, -1 on error. */
+
+static int save_channel(dbFILE *f, ChannelInfo *ci)
 {
-    dbFILE *f;
     int i;
     int16 tmp16;
-    ChannelInfo *ci;
     Memo *memos;
-    static time_t lastwarn = 0;
-
-    if (!(f = open_db(s_ChanServ, ChanDBName, "w")))
-	return;
 
-    for (ci = cs_firstchan(); ci; ci = cs_nextchan()) {
-	SAFE(write_int8(1, f));
-	SAFE(write_buffer(ci->name, f));
-	if (ci->founder)
-	    SAFE(write_string(ci->founder->nick, f));
-	else
-	    SAFE(write_string(NULL, f));
-	if (ci->successor)
-	    SAFE(write_string(ci->successor->nick, f));
-	else
-	    SAFE(write_string(NULL, f));
-	SAFE(write_buffer(ci->founderpass, f));
-	SAFE(write_string(ci->desc, f));
-	SAFE(write_string(ci->url, f));
-	SAFE(write_string(ci->email, f));
-	SAFE(write_int32(ci->time_registered, f));
-	SAFE(write_int32(ci->last_used, f));
-	SAFE(write_string(ci->last_topic, f));
-	SAFE(write_buffer(ci->last_topic_setter, f));
-	SAFE(write_int32(ci->last_topic_time, f));
-	SAFE(write_int32(ci->flags, f));
-	SAFE(write_ptr(ci->suspendinfo, f));
-	if (ci->suspendinfo) {
-	    SAFE(write_buffer(ci->suspendinfo->who, f));
-	    SAFE(write_string(ci->suspendinfo->reason, f));
-	    SAFE(write_int32(ci->suspendinfo->suspended, f));
-	    SAFE(write_int32(ci->suspendinfo->expires, f));
-	}
+    SAFE(write_buffer(ci->name, f));
+    if (ci->founder)
+	SAFE(write_string(ci->founder->nick, f));
+    else
+	SAFE(write_string(NULL, f));
+    if (ci->successor)
+	SAFE(write_string(ci->successor->nick, f));
+    else
+	SAFE(write_string(NULL, f));
+    SAFE(write_buffer(ci->founderpass, f));
+    SAFE(write_string(ci->desc, f));
+    SAFE(write_string(ci->url, f));
+    SAFE(write_string(ci->email, f));
+    SAFE(write_int32(ci->time_registered, f));
+    SAFE(write_int32(ci->last_used, f));
+    SAFE(write_string(ci->last_topic, f));
+    SAFE(write_buffer(ci->last_topic_setter, f));
+    SAFE(write_int32(ci->last_topic_time, f));
+    SAFE(write_int32(ci->flags, f));
+    SAFE(write_ptr(ci->suspendinfo, f));
+    if (ci->suspendinfo) {
+	SAFE(write_buffer(ci->suspendinfo->who, f));
+	SAFE(write_string(ci->suspendinfo->reason, f));
+	SAFE(write_int32(ci->suspendinfo->suspended, f));
+	SAFE(write_int32(ci->suspendinfo->expires, f));
+    }
 
-	tmp16 = CA_SIZE;
-	SAFE(write_int16(tmp16, f));
-	for (i = 0; i < CA_SIZE; i++)
-	    SAFE(write_int16(ci->levels[i], f));
+    tmp16 = CA_SIZE;
+    SAFE(write_int16(tmp16, f));
+    for (i = 0; i < CA_SIZE; i++)
+	SAFE(write_int16(ci->levels[i], f));
 
-	SAFE(write_int16(ci->accesscount, f));
-	for (i = 0; i < ci->accesscount; i++) {
-	    SAFE(write_int16(ci->access[i].in_use, f));
-	    if (ci->access[i].in_use) {
-		SAFE(write_int16(ci->access[i].level, f));
-		SAFE(write_string(ci->access[i].ni->nick, f));
-	    }
+    SAFE(write_int16(ci->accesscount, f));
+    for (i = 0; i < ci->accesscount; i++) {
+	SAFE(write_int16(ci->access[i].in_use, f));
+	if (ci->access[i].in_use) {
+	    SAFE(write_int16(ci->access[i].level, f));
+	    SAFE(write_string(ci->access[i].ni->nick, f));
 	}
+    }
 
-	SAFE(write_int16(ci->akickcount, f));
-	for (i = 0; i < ci->akickcount; i++) {
-	    SAFE(write_int16(ci->akick[i].in_use, f));
-	    if (ci->akick[i].in_use) {
-		SAFE(write_int16(ci->akick[i].is_nick, f));
-		if (ci->akick[i].is_nick)
-		    SAFE(write_string(ci->akick[i].u.ni->nick, f));
-		else
-		    SAFE(write_string(ci->akick[i].u.mask, f));
-		SAFE(write_string(ci->akick[i].reason, f));
-		SAFE(write_buffer(ci->akick[i].who, f));
-	    }
+    SAFE(write_int16(ci->akickcount, f));
+    for (i = 0; i < ci->akickcount; i++) {
+	SAFE(write_int16(ci->akick[i].in_use, f));
+	if (ci->akick[i].in_use) {
+	    SAFE(write_int16(ci->akick[i].is_nick, f));
+	    if (ci->akick[i].is_nick)
+		SAFE(write_string(ci->akick[i].u.ni->nick, f));
+	    else
+		SAFE(write_string(ci->akick[i].u.mask, f));
+	    SAFE(write_string(ci->akick[i].reason, f));
+	    SAFE(write_buffer(ci->akick[i].who, f));
 	}
+    }
 
-	SAFE(write_int32(ci->mlock_on, f));
-	SAFE(write_int32(ci->mlock_off, f));
-	SAFE(write_int32(ci->mlock_limit, f));
-	SAFE(write_string(ci->mlock_key, f));
+    SAFE(write_int32(ci->mlock_on, f));
+    SAFE(write_int32(ci->mlock_off, f));
+    SAFE(write_int32(ci->mlock_limit, f));
+    SAFE(write_string(ci->mlock_key, f));
 
-	SAFE(write_int16(ci->memos.memocount, f));
-	SAFE(write_int16(ci->memos.memomax, f));
-	memos = ci->memos.memos;
-	for (i = 0; i < ci->memos.memocount; i++, memos++) {
-	    SAFE(write_int32(memos->number, f));
-	    SAFE(write_int16(memos->flags, f));
-	    SAFE(write_int32(memos->time, f));
-	    SAFE(write_buffer(memos->sender, f));
-	    SAFE(write_string(memos->text, f));
-	}
+    SAFE(write_int16(ci->memos.memocount, f));
+    SAFE(write_int16(ci->memos.memomax, f));
+    memos = ci->memos.memos;
+    for (i = 0; i < ci->memos.memocount; i++, memos++) {
+	SAFE(write_int32(memos->number, f));
+	SAFE(write_int16(memos->flags, f));
+	SAFE(write_int32(memos->time, f));
+	SAFE(write_buffer(memos->sender, f));
+	SAFE(write_int32(memos->textpos, f));
+	SAFE(write_string(memos->text, f));
+    }
 
-	SAFE(write_string(ci->entry_message, f));
+    SAFE(write_string(ci->entry_message, f));
+    return 0;
+}
 
-    } /* for (ci) */
+#undef SAFE
+
+/*************************************************************************/
+
+#define SAFE(x) do { if ((x) < 0) goto fail; } while (0)
+
+void save_cs_dbase(void)
+{
+    dbFILE *f;
+    ChannelInfo *ci;
+    char oldname[PATH_MAX];
+    static time_t lastwarn = 0;
+
+    memo_store_sync();
+    if (!(f = open_db(s_ChanServ, ChanDBName, "w")))
+	return;
+
+    for (ci = cs_firstchan(); ci; ci = cs_nextchan()) {
+	SAFE(write_int8(1, f));
+	SAFE(save_channel(f, ci));
+	end_record_db(f);
+    }
 
     {
 	/* This is an UGLY HACK but it simplifies loading.  It will go away
@@ -612,11 +899,17 @@ void save_cs_dbase(void)
 	SAFE(write_buffer(buf, f));
     }
 
-    close_db(f);
+    if (close_db(f) < 0) {
+	f = NULL;	/* close_db() has already restored it */
+	goto fail;
+    }
+    snprintf(oldname, sizeof(oldname), "%s.journal.old", ChanDBName);
+    unlink(oldname);
     return;
 
   fail:
-    restore_db(f);
+    if (f)
+	restore_db(f);
     log_perror("Write error on %s", ChanDBName);
     if (time(NULL) - lastwarn > WarningTimeout) {
 	wallops(NULL, "Write error on %s: %s", ChanDBName,
@@ -628,3 +921,104 @@ void save_cs_dbase(void)
 #undef SAFE
 
 /*************************************************************************/
+/*************************************************************************/
+
+/* Note that the given channel has changed (or is about to be dropped), so
+ * that it is written to the journal on the next flush. */
+
+void cs_journal_mark(ChannelInfo *ci)
+{
+    if (!JournalFlush || readonly || !ci || ci->journal_dirty)
+	return;
+    if (journal_count >= journal_size) {
+	journal_size += 64;
+	journal_queue = srealloc(journal_queue,
+				 sizeof(*journal_queue) * journal_size);
+    }
+    strscpy(journal_queue[journal_count++], ci->name, CHANMAX);
+    ci->journal_dirty = 1;
+}
+
+/*************************************************************************/
+
+#define SAFE(x) do { if ((x) < 0) goto fail; } while (0)
+
+/* Append the records of all changed channels to the journal; see
+ * ns_journal_flush(). */
+
+void cs_journal_flush(void)
+{
+    dbFILE *f;
+    ChannelInfo *ci;
+    char buf[PATH_MAX];
+    int i;
+    static time_t lastwarn = 0;
+
+    if (!journal_count)
+	return;
+    memo_store_sync();
+    snprintf(buf, sizeof(buf), "%s.journal", ChanDBName);
+    if (!(f = open_db(s_ChanServ, buf, "a")))
+	return;
+    for (i = 0; i < journal_count; i++) {
+	ci = cs_findchan(journal_queue[i]);
+	if (!ci) {
+	    SAFE(write_int8(JOURNAL_DELETE, f));
+	    if (!write_buffer(journal_queue[i], f))
+		goto fail;
+	} else if (ci->journal_dirty == 1) {
+	    SAFE(write_int8(JOURNAL_RECORD, f));
+	    SAFE(save_channel(f, ci));
+	    ci->journal_dirty = 2;	/* Don't write it twice */
+	}
+	end_record_db(f);
+    }
+    if (close_db(f) < 0) {
+	f = NULL;	/* close_db() has already restored it */
+	goto fail;
+    }
+    for (i = 0; i < journal_count; i++) {
+	if ((ci = cs_findchan(journal_queue[i])) != NULL)
+	    ci->journal_dirty = 0;
+    }
+    if (debug >= 2)
+	log("debug: %s: journaled %d changes", s_ChanServ, journal_count);
+    journal_count = 0;
+    return;
+
+  fail:
+    if (f)
+	restore_db(f);
+    for (i = 0; i < journal_count; i++) {
+	if ((ci = cs_findchan(journal_queue[i])) != NULL)
+	    ci->journal_dirty = 1;
+    }
+    log_perror("Write error on %s", buf);
+    if (time(NULL) - lastwarn > WarningTimeout) {
+	wallops(NULL, "Write error on %s: %s", buf, strerror(errno));
+	lastwarn = time(NULL);
+    }
+}
+
+#undef SAFE
+
+/*************************************************************************/
+
+/* Flush the journal and set it aside before a full save of the channel
+ * database; see ns_journal_rotate(). */
+
+void cs_journal_rotate(void)
+{
+    char buf[PATH_MAX], oldbuf[PATH_MAX];
+
+    if (!JournalFlush)
+	return;
+    cs_journal_flush();
+    snprintf(buf, sizeof(buf), "%s.journal", ChanDBName);
+    snprintf(oldbuf, sizeof(oldbuf), "%s.journal.old", ChanDBName);
+    if (access(oldbuf, F_OK) < 0 && rename(buf, oldbuf) < 0
+     && errno != ENOENT)
+	log_perror("Can't rename %s to %s", buf, oldbuf);
+}
+
+/*************************************************************************/
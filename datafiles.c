@@ -10,6 +10,18 @@
 #include "services.h"
 #include "datafiles.h"
 #include <fcntl.h>
+#if HAVE_PTHREAD && !defined(NOT_MAIN)
+# include <pthread.h>
+#endif
+#if HAVE_MMAP
+# include <sys/mman.h>
+#endif
+
+/*************************************************************************/
+
+/* Number of times a database could not be opened for writing or had to be
+ * restored after a write error.  Used to report on background saves. */
+int db_write_errors = 0;
 
 /*************************************************************************/
 /*************************************************************************/
@@ -21,22 +33,22 @@
 
 int get_file_version(dbFILE *f)
 {
-    FILE *fp = f->fp;
-    int version = fgetc(fp)<<24 | fgetc(fp)<<16 | fgetc(fp)<<8 | fgetc(fp);
-    if (ferror(fp)) {
-#ifndef NOT_MAIN
-	log_perror("Error reading version number on %s", f->filename);
-#endif
-	return -1;
-    } else if (feof(fp)) {
+    uint32 version;
+
+    if (read_int32(&version, f) < 0) {
 #ifndef NOT_MAIN
-	log("Error reading version number on %s: End of file detected",
+	if (f->error > 0) {
+	    errno = f->error;
+	    log_perror("Error reading version number on %s", f->filename);
+	} else {
+	    log("Error reading version number on %s: End of file detected",
 		f->filename);
+	}
 #endif
 	return -1;
     } else if (version > FILE_VERSION || version < 1) {
 #ifndef NOT_MAIN
-	log("Invalid version number (%d) on %s", version, f->filename);
+	log("Invalid version number (%d) on %s", (int)version, f->filename);
 #endif
 	return -1;
     }
@@ -51,13 +63,7 @@ int get_file_version(dbFILE *f)
 
 int write_file_version(dbFILE *f)
 {
-    FILE *fp = f->fp;
-    if (
-	fputc(FILE_VERSION>>24 & 0xFF, fp) < 0 ||
-	fputc(FILE_VERSION>>16 & 0xFF, fp) < 0 ||
-	fputc(FILE_VERSION>> 8 & 0xFF, fp) < 0 ||
-	fputc(FILE_VERSION     & 0xFF, fp) < 0
-    ) {
+    if (write_int32(FILE_VERSION, f) < 0) {
 #ifndef NOT_MAIN
 	log_perror("Error writing version number on %s", f->filename);
 #endif
@@ -69,22 +75,300 @@ int write_file_version(dbFILE *f)
 /*************************************************************************/
 /*************************************************************************/
 
-static dbFILE *open_db_read(const char *service, const char *filename)
+/* CRC32C (Castagnoli polynomial, reflected) of a block of data, computed
+ * eight bytes at a time with the usual "slicing" tables. */
+
+static uint32 crc_table[8][256];
+
+/* Databases may be read by two threads at once during startup (see
+ * init.c), so the table must be set up exactly once. */
+#if HAVE_PTHREAD && !defined(NOT_MAIN)
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+# define INIT_CRC_TABLE()	pthread_once(&crc_table_once, init_crc_table)
+#else
+static int crc_table_ready = 0;
+# define INIT_CRC_TABLE()	\
+    (crc_table_ready ? 0 : (init_crc_table(), crc_table_ready = 1))
+#endif
+
+static void init_crc_table(void)
+{
+    uint32 crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+	crc = i;
+	for (j = 0; j < 8; j++)
+	    crc = (crc>>1) ^ (crc & 1 ? 0x82F63B78 : 0);
+	crc_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+	crc = crc_table[0][i];
+	for (j = 1; j < 8; j++) {
+	    crc = crc_table[0][crc & 0xFF] ^ (crc>>8);
+	    crc_table[j][i] = crc;
+	}
+    }
+}
+
+static uint32 crc32c(const unsigned char *data, long len)
+{
+    uint32 crc = 0xFFFFFFFF;
+
+    INIT_CRC_TABLE();
+    while (len >= 8) {
+	uint32 lo = crc ^ (data[0] | data[1]<<8 | data[2]<<16
+			   | (uint32)data[3]<<24);
+	crc = crc_table[7][lo & 0xFF] ^ crc_table[6][lo>>8 & 0xFF]
+	    ^ crc_table[5][lo>>16 & 0xFF] ^ crc_table[4][lo>>24]
+	    ^ crc_table[3][data[4]] ^ crc_table[2][data[5]]
+	    ^ crc_table[1][data[6]] ^ crc_table[0][data[7]];
+	data += 8;
+	len -= 8;
+    }
+    while (len-- > 0)
+	crc = crc_table[0][(crc ^ *data++) & 0xFF] ^ (crc>>8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+/*************************************************************************/
+
+/* Store or retrieve a 32-bit value in big-endian order. */
+
+static void put32(unsigned char *s, uint32 val)
+{
+    s[0] = val>>24;
+    s[1] = val>>16;
+    s[2] = val>>8;
+    s[3] = val;
+}
+
+static uint32 get32(const unsigned char *s)
+{
+    return (uint32)s[0]<<24 | s[1]<<16 | s[2]<<8 | s[3];
+}
+
+/*************************************************************************/
+
+/* Write or read exactly `len' bytes, retrying after short transfers and
+ * signals.  Return the number of bytes transferred (less than `len' only
+ * on error or end of file), or -1 if nothing could be transferred because
+ * of an error. */
+
+static long write_all(int fd, const unsigned char *s, long len)
+{
+    long done = 0;
+
+    while (done < len) {
+	long n = write(fd, s+done, len-done);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return done ? done : -1;
+	}
+	done += n;
+    }
+    return done;
+}
+
+static long read_all(int fd, unsigned char *s, long len)
+{
+    long done = 0;
+
+    while (done < len) {
+	long n = read(fd, s+done, len-done);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return done ? done : -1;
+	}
+	if (n == 0)
+	    break;
+	done += n;
+    }
+    return done;
+}
+
+/*************************************************************************/
+
+/* A simple LZ77 block compressor in the style of LZ4, used for databases
+ * listed in CompressDatabases.  The compressed data is a series of
+ * sequences, each consisting of a token byte (number of literals in the
+ * high 4 bits, match length minus LZ_MINMATCH in the low 4 bits), further
+ * length bytes for the literal count if it was 15 (each byte is added to
+ * the count, stopping after the first byte that is not 255), the literal
+ * bytes, a 2-byte big-endian match offset, and further length bytes for
+ * the match length if it was 15.  The last sequence consists of literals
+ * only and ends at the end of the data.  Compression is fast rather than
+ * tight, so that saving a database takes little more time than before.
+ */
+
+#define LZ_HASHBITS	14
+#define LZ_MINMATCH	4
+#define LZ_MAXOFFSET	65535
+
+/* Maximum compressed size of `len' bytes of data. */
+#define LZ_BOUND(len)	((len) + (len)/255 + 16)
+
+static uint32 lz_table[1<<LZ_HASHBITS];
+
+static unsigned char *lz_putlen(unsigned char *op, long n)
+{
+    while (n >= 255) {
+	*op++ = 255;
+	n -= 255;
+    }
+    *op++ = n;
+    return op;
+}
+
+static unsigned char *lz_sequence(unsigned char *op,
+				  const unsigned char *lit, long litlen,
+				  long offset, long matchlen)
+{
+    unsigned char *token = op++;
+
+    *token = (litlen < 15 ? litlen : 15) << 4;
+    if (litlen >= 15)
+	op = lz_putlen(op, litlen-15);
+    memcpy(op, lit, litlen);
+    op += litlen;
+    if (matchlen) {
+	matchlen -= LZ_MINMATCH;
+	*token |= matchlen < 15 ? matchlen : 15;
+	*op++ = offset>>8;
+	*op++ = offset;
+	if (matchlen >= 15)
+	    op = lz_putlen(op, matchlen-15);
+    }
+    return op;
+}
+
+/* Compress `len' bytes from `in' into `out', which must have room for
+ * LZ_BOUND(len) bytes, and return the compressed length. */
+
+static long lz_compress(const unsigned char *in, long len, unsigned char *out)
+{
+    const unsigned char *ip = in, *anchor = in, *end = in+len;
+    unsigned char *op = out;
+
+    memset(lz_table, 0, sizeof(lz_table));
+    while (end - ip >= LZ_MINMATCH) {
+	uint32 seq = ip[0] | ip[1]<<8 | ip[2]<<16 | (uint32)ip[3]<<24;
+	uint32 hash = (seq * 2654435761U) >> (32-LZ_HASHBITS);
+	uint32 pos = lz_table[hash];  /* Offset of last match + 1, or 0 */
+	lz_table[hash] = (ip-in) + 1;
+	if (pos && ip-(in+pos-1) <= LZ_MAXOFFSET
+	 && memcmp(in+pos-1, ip, LZ_MINMATCH) == 0
+	) {
+	    const unsigned char *ref = in+pos-1;
+	    long matchlen = LZ_MINMATCH;
+	    while (ip+matchlen < end && ref[matchlen] == ip[matchlen])
+		matchlen++;
+	    op = lz_sequence(op, anchor, ip-anchor, ip-ref, matchlen);
+	    ip += matchlen;
+	    anchor = ip;
+	} else {
+	    ip++;
+	}
+    }
+    op = lz_sequence(op, anchor, end-anchor, 0, 0);
+    return op - out;
+}
+
+/* Decompress `inlen' bytes from `in' into `out', which has room for
+ * `outlen' bytes.  Return the decompressed length, or -1 if the data is
+ * invalid. */
+
+static long lz_decompress(const unsigned char *in, long inlen,
+			  unsigned char *out, long outlen)
+{
+    const unsigned char *ip = in, *iend = in+inlen;
+    unsigned char *op = out, *oend = out+outlen;
+
+    while (ip < iend) {
+	int token = *ip++, c;
+	long n, offset;
+	const unsigned char *ref;
+
+	n = token >> 4;
+	if (n == 15) {
+	    do {
+		if (ip >= iend)
+		    return -1;
+		n += (c = *ip++);
+	    } while (c == 255);
+	}
+	if (n > iend-ip || n > oend-op)
+	    return -1;
+	memcpy(op, ip, n);
+	op += n;
+	ip += n;
+	if (ip == iend)
+	    break;
+	if (iend-ip < 2)
+	    return -1;
+	offset = ip[0]<<8 | ip[1];
+	ip += 2;
+	if (offset == 0 || offset > op-out)
+	    return -1;
+	n = token & 15;
+	if (n == 15) {
+	    do {
+		if (ip >= iend)
+		    return -1;
+		n += (c = *ip++);
+	    } while (c == 255);
+	}
+	n += LZ_MINMATCH;
+	if (n > oend-op)
+	    return -1;
+	/* The match may overlap the output, so copy a byte at a time */
+	for (ref = op-offset; n > 0; n--)
+	    *op++ = *ref++;
+    }
+    return op - out;
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Allocate and initialize a dbFILE structure with room for the default
+ * buffer.  Logs and returns NULL on failure. */
+
+static dbFILE *new_db(const char *service, const char *filename, int mode)
 {
     dbFILE *f;
-    FILE *fp;
 
-    f = malloc(sizeof(*f));
+    f = malloc(sizeof(*f) + DB_BUFSIZE);
     if (!f) {
 #ifndef NOT_MAIN
-	log_perror("Can't read %s database %s", service, filename);
+	log_perror("Can't %s %s database %s",
+		   mode=='r' ? "read" : mode=='w' ? "write" : "append to",
+		   service, filename);
 #endif
 	return NULL;
     }
+    memset(f, 0, sizeof(*f));
     strscpy(f->filename, filename, sizeof(f->filename));
-    f->mode = 'r';
-    fp = fopen(f->filename, "rb");
-    if (!fp) {
+    f->mode = mode;
+    f->fd = -1;
+    f->recstart = -1;
+    f->iobuf = f->buf = (unsigned char *)(f+1);
+    f->bufsize = DB_BUFSIZE;
+    return f;
+}
+
+/*************************************************************************/
+
+static dbFILE *open_db_read(const char *service, const char *filename)
+{
+    dbFILE *f;
+
+    if (!(f = new_db(service, filename, 'r')))
+	return NULL;
+    f->fd = open(f->filename, O_RDONLY);
+    if (f->fd < 0) {
 	int errno_save = errno;
 #ifndef NOT_MAIN
 	if (errno != ENOENT)
@@ -94,32 +378,88 @@ static dbFILE *open_db_read(const char *service, const char *filename)
 	errno = errno_save;
 	return NULL;
     }
-    f->fp = fp;
-    f->backupfp = NULL;
+#if HAVE_MMAP
+    {
+	struct stat st;
+	void *map;
+	if (fstat(f->fd, &st) == 0 && st.st_size > 0
+	 && (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0))
+		!= MAP_FAILED
+	) {
+# ifdef MADV_SEQUENTIAL
+	    madvise(map, st.st_size, MADV_SEQUENTIAL);
+# endif
+	    f->map = map;
+	    f->maplen = st.st_size;
+	}
+    }
+#endif
+
+    /* Files written by older versions start directly with the version
+     * number and are read as a plain stream. */
+    if (f->map) {
+	f->buf = f->map;
+	f->buflen = f->maplen;
+	if (f->maplen >= 4 && get32(f->map) == DB_MAGIC) {
+	    f->blocks = 1;
+	    f->blockpos = 4;
+	    f->buflen = 0;
+	}
+    } else {
+	f->buflen = read_all(f->fd, f->buf, 4);
+	if (f->buflen < 0) {
+	    f->error = errno;
+	    f->buflen = 0;
+	} else if (f->buflen == 4 && get32(f->buf) == DB_MAGIC) {
+	    f->blocks = 1;
+	    f->blockpos = 4;
+	    f->buflen = 0;
+	}
+    }
     return f;
 }
 
 /*************************************************************************/
 
+/* Open a database file for writing.  The data is written to a temporary
+ * file, which close_db() syncs to disk and renames over the real file, so
+ * the real file is never seen in a partially written state.
+ */
+
+/* Return whether the given database is listed in CompressDatabases. */
+
+static int want_compress(const char *filename)
+{
+    const char *s = CompressDatabases;
+    size_t len = strlen(filename), n;
+
+    if (!s)
+	return 0;
+    while (*(s += strspn(s, " \t"))) {
+	n = strcspn(s, " \t");
+	if (n == len && strncmp(s, filename, n) == 0)
+	    return 1;
+	s += n;
+    }
+    return 0;
+}
+
+
 static dbFILE *open_db_write(const char *service, const char *filename)
 {
     dbFILE *f;
-    int fd;
+    unsigned char magic[4];
 
-    f = malloc(sizeof(*f));
-    if (!f) {
-#ifndef NOT_MAIN
-	log_perror("Can't read %s database %s", service, filename);
-#endif
+    if (!(f = new_db(service, filename, 'w')))
 	return NULL;
-    }
-    strscpy(f->filename, filename, sizeof(f->filename));
     filename = f->filename;
-    f->mode = 'w';
+    f->blocks = 1;
+    f->strings = 1;
+    f->compress = want_compress(filename);
 
-    *f->backupname = 0;
-    snprintf(f->backupname, sizeof(f->backupname), "%s.save", filename);
-    if (!*f->backupname || strcmp(f->backupname, filename) == 0) {
+    *f->tempname = 0;
+    snprintf(f->tempname, sizeof(f->tempname), "%s.new", filename);
+    if (!*f->tempname || strcmp(f->tempname, filename) == 0) {
 	int errno_save = errno;
 #ifndef NOT_MAIN
 	log("Opening %s database %s for write: Filename too long",
@@ -129,70 +469,100 @@ static dbFILE *open_db_write(const char *service, const char *filename)
 	errno = errno_save;
 	return NULL;
     }
-    unlink(f->backupname);
-    f->backupfp = fopen(filename, "rb");
-    if (rename(filename, f->backupname) < 0 && errno != ENOENT) {
+    unlink(f->tempname);
+    /* Use open() to avoid people sneaking a new file in under us */
+    f->fd = open(f->tempname, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    put32(magic, DB_MAGIC);
+    if (f->fd < 0 || write_all(f->fd, magic, 4) != 4
+     || write_file_version(f) < 0 || flush_db(f) < 0
+    ) {
 	int errno_save = errno;
 #ifndef NOT_MAIN
 	static int walloped = 0;
 	if (!walloped) {
 	    walloped++;
-	    wallops(NULL, "Can't back up %s database %s", service, filename);
+	    wallops(NULL, "Can't write to %s database %s", service, filename);
 	}
 	errno = errno_save;
-	log_perror("Can't back up %s database %s", service, filename);
-	if (!NoBackupOkay) {
+	log_perror("Can't write to %s database %s", service, filename);
 #endif
-	    if (f->backupfp)
-		fclose(f->backupfp);
-	    free(f);
-	    errno = errno_save;
-	    return NULL;
-#ifndef NOT_MAIN
+	if (f->fd >= 0) {
+	    close(f->fd);
+	    unlink(f->tempname);
 	}
-#endif
-	*f->backupname = 0;
+	free(f);
+	errno = errno_save;
+	return NULL;
     }
-    unlink(filename);
-    /* Use open() to avoid people sneaking a new file in under us */
-    fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0666);
-    f->fp = fdopen(fd, "wb");	/* will fail and return NULL if fd < 0 */
-    if (!f->fp || write_file_version(f) < 0) {
-	int errno_save = errno;
-#ifndef NOT_MAIN
-	static int walloped = 0;
-	if (!walloped) {
-	    walloped++;
-	    wallops(NULL, "Can't write to %s database %s", service, filename);
+    return f;
+}
+
+/*************************************************************************/
+
+/* Open a file for appending records to the end, creating it (with a
+ * version number) if it does not exist yet.  No backup is made; instead,
+ * restore_db() cuts the file back to the size it had here.  A file in the
+ * old stream format is appended to in that format.
+ */
+
+static dbFILE *open_db_append(const char *service, const char *filename)
+{
+    dbFILE *f;
+    unsigned char magic[4];
+
+    if (!(f = new_db(service, filename, 'a')))
+	return NULL;
+    f->fd = open(f->filename, O_RDWR | O_CREAT | O_APPEND, 0666);
+    if (f->fd < 0 || (f->appendpos = lseek(f->fd, 0, SEEK_END)) < 0)
+	goto fail;
+    if (f->appendpos == 0) {
+	f->blocks = 1;
+	f->strings = 1;
+	put32(magic, DB_MAGIC);
+	if (write_all(f->fd, magic, 4) != 4 || write_file_version(f) < 0
+	 || flush_db(f) < 0) {
+	    int errno_save = errno;
+	    ftruncate(f->fd, 0);
+	    errno = errno_save;
+	    goto fail;
 	}
-	errno = errno_save;
-	log_perror("Can't write to %s database %s", service, filename);
+	/* close_db() syncs the records, but not the new name */
+	if (sync_dir(f->filename) < 0) {
+#ifndef NOT_MAIN
+	    log_perror("Can't sync directory of %s", f->filename);
 #endif
-	if (f->fp) {
-	    fclose(f->fp);
-	    unlink(filename);
 	}
-	if (*f->backupname && rename(f->backupname, filename) < 0)
+    } else {
+	if (lseek(f->fd, 0, SEEK_SET) < 0 || read_all(f->fd, magic, 4) != 4)
+	    goto fail;
+	f->blocks = (get32(magic) == DB_MAGIC);
+	/* Each block says whether it has a string table, so new ones can
+	 * even if the blocks already in the file don't */
+	f->strings = f->blocks;
+    }
+    return f;
+
+  fail:
+    {
+	int errno_save = errno;
 #ifndef NOT_MAIN
-	    fatal_perror("Cannot restore backup copy of %s", filename);
-#else
-	    ;
+	log_perror("Can't append to %s database %s", service, filename);
 #endif
+	if (f->fd >= 0)
+	    close(f->fd);
+	free(f);
 	errno = errno_save;
 	return NULL;
     }
-    return f;
 }
 
 /*************************************************************************/
 
 /* Open a database file for reading (*mode == 'r') or writing (*mode == 'w').
+ * A mode of 'a' opens a file for appending; see open_db_append().
  * Return the stream pointer, or NULL on error.  When opening for write, it
- * is an error for rename() to return an error (when backing up the original
- * file) other than ENOENT, if NO_BACKUP_OKAY is not defined; it is an error
- * if the version number cannot be written to the file; and it is a fatal
- * error if opening the file for write fails and the backup was successfully
- * made but cannot be restored.
+ * is an error if the temporary file cannot be created or the version
+ * number cannot be written to it.
  */
 
 dbFILE *open_db(const char *service, const char *filename, const char *mode)
@@ -200,7 +570,15 @@ dbFILE *open_db(const char *service, const char *filename, const char *mode)
     if (*mode == 'r') {
 	return open_db_read(service, filename);
     } else if (*mode == 'w') {
-	return open_db_write(service, filename);
+	dbFILE *f = open_db_write(service, filename);
+	if (!f)
+	    db_write_errors++;
+	return f;
+    } else if (*mode == 'a') {
+	dbFILE *f = open_db_append(service, filename);
+	if (!f)
+	    db_write_errors++;
+	return f;
     } else {
 	errno = EINVAL;
 	return NULL;
@@ -209,11 +587,101 @@ dbFILE *open_db(const char *service, const char *filename, const char *mode)
 
 /*************************************************************************/
 
+/* Ask the system to start reading the given database file into memory in
+ * the background, so that it is already cached when it comes to be
+ * loaded.  Errors (including a missing file) are ignored.
+ */
+
+void prefetch_db(const char *filename)
+{
+#ifdef POSIX_FADV_WILLNEED
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+    }
+#endif
+}
+
+/*************************************************************************/
+
+/* Sync the directory containing the given file to disk, so that a file
+ * just created or renamed there is still there after a crash.  Returns 0
+ * on success, -1 on error (with errno set).
+ */
+
+int sync_dir(const char *filename)
+{
+    char dirname[PATH_MAX];
+    const char *s = strrchr(filename, '/');
+    int fd, retval, errno_save;
+
+    if (!s) {
+	strscpy(dirname, ".", sizeof(dirname));
+    } else if (s == filename) {
+	strscpy(dirname, "/", sizeof(dirname));
+    } else if (s - filename >= sizeof(dirname)) {
+	errno = ENAMETOOLONG;
+	return -1;
+    } else {
+	memcpy(dirname, filename, s - filename);
+	dirname[s - filename] = 0;
+    }
+    fd = open(dirname, O_RDONLY);
+    if (fd < 0)
+	return -1;
+    retval = fsync(fd);
+    errno_save = errno;
+    close(fd);
+    errno = errno_save;
+    return retval;
+}
+
+/*************************************************************************/
+
+/* Let go of the string table of the block being read, if any.  Strings
+ * already handed out from it stay valid. */
+
+static void release_block_strings(dbFILE *f)
+{
+#ifndef NOT_MAIN
+    if (f->strtab) {
+	release_strtab(f->strtab, f->struses);
+	f->strtab = NULL;
+	f->struses = 0;
+    }
+#endif
+}
+
+
+/* Close the file descriptor and free the dbFILE structure. */
+
+static void free_db(dbFILE *f)
+{
+#if HAVE_MMAP
+    if (f->map)
+	munmap(f->map, f->maplen);
+#endif
+    if (f->mode == 'r')
+	release_block_strings(f);
+    else
+	free(f->strbuf);
+    if (f->bufalloc)
+	free(f->iobuf);
+    free(f->zbuf);
+    if (f->fd >= 0)
+	close(f->fd);
+    free(f);
+}
+
+/*************************************************************************/
+
 /* Restore the database file to its condition before open_db().  This is
- * identical to close_db() for files open for reading; however, for files
- * open for writing, we first attempt to restore any backup file before
- * closing files.  Return 0 on success, errno value on failure.  Does not
- * modify errno itself.
+ * identical to close_db() for files open for reading; for files open for
+ * writing, the temporary file is removed, leaving the original untouched,
+ * and for files open for appending, the file is truncated to its original
+ * length.  Return 0 on success, errno value on failure.  Does not modify
+ * errno itself.
  */
 
 int restore_db(dbFILE *f)
@@ -223,61 +691,472 @@ int restore_db(dbFILE *f)
     int retval = 0;
 
     if (f->mode == 'w') {
-	int ok = 0;	/* Did we manage to restore the old file? */
-	errno = 0;
-	if (*f->backupname && strcmp(f->backupname, f->filename) != 0) {
-	    if (rename(f->backupname, f->filename) == 0)
-		ok = 1;
-	}
-	if (!ok && f->backupfp) {
-	    char buf[1024];
-	    int i;
-	    ok = 1;
-	    if (fseek(f->fp, 0, SEEK_SET) < 0)
-		ok = 0;
-	    while (ok && (i = fread(buf, 1, sizeof(buf), f->backupfp)) > 0) {
-		if (fwrite(buf, 1, i, f->fp) != i)
-		    ok = 0;
-	    }
-	    if (ok) {
-		fflush(f->fp);
-		ftruncate(fileno(f->fp), ftell(f->fp));
-	    }
-	}
-	if (!ok && errno > 0) {
+	db_write_errors++;
+	unlink(f->tempname);
+    } else if (f->mode == 'a') {
+	db_write_errors++;
+	if (ftruncate(f->fd, f->appendpos) < 0) {
 	    errno_save = errno;
 	    retval = -1;
 #ifndef NOT_MAIN
-	    log_perror("Unable to restore backup of %s", f->filename);
+	    log_perror("Unable to restore %s", f->filename);
 #endif
 	}
-	if (f->backupfp)
-	    fclose(f->backupfp);
-	if (*f->backupname)
-	    unlink(f->backupname);
     }
-    fclose(f->fp);
-    free(f);
+    free_db(f);
     errno = errno_orig;
     return retval<0 ? errno_save : 0;
 }
 
 /*************************************************************************/
 
-/* Close a database file.  If the file was opened for write, remove the
- * backup we (may have) created earlier.
+/* Make sure the (de)compression buffer can hold `size' bytes.  Return 0 on
+ * success, -1 if memory could not be allocated. */
+
+static int grow_zbuf(dbFILE *f, long size)
+{
+    unsigned char *newbuf;
+
+    if (f->zsize >= size)
+	return 0;
+    newbuf = malloc(size);
+    if (!newbuf)
+	return -1;
+    free(f->zbuf);
+    f->zbuf = newbuf;
+    f->zsize = size;
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Write out the first `len' bytes of the buffer, as a checksummed block
+ * (compressed if requested) if the file uses them, and move any remaining
+ * data to the beginning of the buffer.  The strings of the records written
+ * go into the block's string table.  Return 0 on success, -1 on failure
+ * (with errno set).  Once a write has failed, all further writes to the
+ * file fail as well.
  */
 
-void close_db(dbFILE *f)
+static int write_block(dbFILE *f, long len)
 {
-    if (f->mode == 'w' && *f->backupname
-			&& strcmp(f->backupname, f->filename) != 0) {
-	if (f->backupfp)
-	    fclose(f->backupfp);
-	unlink(f->backupname);
+    const unsigned char *data = f->buf;
+    long datalen = len;
+    long nstr = 0;	/* Bytes of string table written with the block */
+
+    if (f->error) {
+	errno = f->error;
+	return -1;
     }
-    fclose(f->fp);
-    free(f);
+    if (len <= 0)
+	return 0;
+    if (f->blocks) {
+	unsigned char header[8];
+	uint32 flags = 0, stored;
+	long zpos = 0;	/* Where compressed data goes in zbuf[] */
+	if (f->strings) {
+	    /* Put the block together in zbuf[], leaving room after it for
+	     * compressing it */
+	    nstr = (len == f->bufpos) ? f->strused : f->strrec;
+	    datalen = 8 + len + nstr;
+	    if (grow_zbuf(f, f->compress ? datalen + LZ_BOUND(datalen)+4
+					 : datalen) < 0) {
+		f->error = errno = ENOMEM;
+		return -1;
+	    }
+	    put32(f->zbuf, len);
+	    put32(f->zbuf+4, f->strbase);
+	    memcpy(f->zbuf+8, f->buf, len);
+	    memcpy(f->zbuf+8+len, f->strbuf, nstr);
+	    data = f->zbuf;
+	    zpos = datalen;
+	    flags = DB_STRINGS;
+	}
+	stored = datalen;
+	/* Store the block compressed only if that actually saves space */
+	if (f->compress && grow_zbuf(f, zpos + LZ_BOUND(datalen)+4) == 0) {
+	    long zlen = lz_compress(data, datalen, f->zbuf+zpos+4) + 4;
+	    if (zlen < datalen) {
+		put32(f->zbuf+zpos, datalen);
+		data = f->zbuf+zpos;
+		datalen = zlen;
+		stored = zlen | DB_COMPRESSED;
+	    }
+	}
+	put32(header, stored | flags);
+	put32(header+4, crc32c(data, datalen));
+	if (write_all(f->fd, header, 8) != 8) {
+	    f->error = errno ? errno : EIO;
+	    return -1;
+	}
+    }
+    if (write_all(f->fd, data, datalen) != datalen) {
+	f->error = errno ? errno : EIO;
+	return -1;
+    }
+    memmove(f->buf, f->buf+len, f->bufpos-len);
+    f->bufpos -= len;
+    if (f->recstart > 0)
+	f->recstart = f->recstart > len ? f->recstart - len : 0;
+    if (nstr > 0) {
+	memmove(f->strbuf, f->strbuf+nstr, f->strused-nstr);
+	f->strused -= nstr;
+	f->strbase += nstr;
+	f->strrec = f->strrec > nstr ? f->strrec - nstr : 0;
+    }
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Make room for at least `len' more bytes in the write buffer.  When
+ * records are being marked with end_record_db(), a block only ever holds
+ * whole records, and the buffer is enlarged if a single record does not
+ * fit.  Return 0 on success, -1 on failure.
+ */
+
+static int make_room(dbFILE *f, long len)
+{
+    if (f->mode == 'r')
+	return -1;
+    if (f->recstart < 0) {
+	if (write_block(f, f->bufpos) < 0)
+	    return -1;
+    } else if (f->recstart > 0) {
+	if (write_block(f, f->recstart) < 0)
+	    return -1;
+    }
+    if (f->bufpos + len > f->bufsize) {
+	long newsize = f->bufsize*2;
+	unsigned char *newbuf;
+	if (newsize < f->bufpos + len)
+	    newsize = f->bufpos + len;
+	newbuf = malloc(newsize);
+	if (!newbuf) {
+	    f->error = ENOMEM;
+	    errno = ENOMEM;
+	    return -1;
+	}
+	memcpy(newbuf, f->iobuf, f->bufpos);
+	if (f->bufalloc)
+	    free(f->iobuf);
+	f->iobuf = f->buf = newbuf;
+	f->bufsize = newsize;
+	f->bufalloc = 1;
+    }
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Mark the end of a record: the data written since the last mark will not
+ * be split across two blocks, so a damaged block never takes part of a
+ * neighboring record with it.
+ */
+
+void end_record_db(dbFILE *f)
+{
+    f->recstart = f->bufpos;
+    f->strrec = f->strused;
+}
+
+/*************************************************************************/
+
+/* Write out any data still in the buffer of a file open for writing or
+ * appending.  Return 0 on success, -1 on failure (with errno set).
+ */
+
+int flush_db(dbFILE *f)
+{
+    if (f->mode == 'r')
+	return 0;
+    return write_block(f, f->bufpos);
+}
+
+/*************************************************************************/
+
+/* Close a database file.  A file opened for writing or appending is synced
+ * to disk, and a newly written file then replaces the original.  If any of
+ * that fails, the file is restored as by restore_db() instead and -1 is
+ * returned; otherwise 0 is returned.  If damaged blocks were skipped while
+ * reading, a link to the file is left under the name "<file>.damaged".
+ */
+
+int close_db(dbFILE *f)
+{
+    if (f->mode == 'r' && f->badblocks) {
+	/* Keep a copy of the damaged file; it will be overwritten by the
+	 * next save */
+	char buf[PATH_MAX+16];
+	snprintf(buf, sizeof(buf), "%s.damaged", f->filename);
+	unlink(buf);
+	if (link(f->filename, buf) == 0) {
+#ifndef NOT_MAIN
+	    log("%s: %d damaged block(s) skipped; original file saved as %s",
+		f->filename, f->badblocks, buf);
+#endif
+	}
+    } else if (f->mode != 'r') {
+	if (flush_db(f) < 0 || DB_SYNC(f->fd) < 0) {
+#ifndef NOT_MAIN
+	    log_perror("Error writing to %s", f->filename);
+#endif
+	    restore_db(f);
+	    return -1;
+	}
+	if (f->mode == 'w') {
+	    close(f->fd);
+	    f->fd = -1;
+	    if (rename(f->tempname, f->filename) < 0) {
+#ifndef NOT_MAIN
+		log_perror("Can't rename %s to %s", f->tempname, f->filename);
+#endif
+		restore_db(f);
+		return -1;
+	    }
+	    /* The new file is complete either way, so just report this */
+	    if (sync_dir(f->filename) < 0) {
+#ifndef NOT_MAIN
+		log_perror("Can't sync directory of %s", f->filename);
+#endif
+	    }
+	}
+    }
+    free_db(f);
+    return 0;
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Make the given (uncompressed) block data the current buffer, setting up
+ * its string table if it has one.  Return 0 on success, -1 if the string
+ * table is invalid.
+ */
+
+static int start_block(dbFILE *f, unsigned char *data, long len, int strings)
+{
+    long reclen = 0;
+
+    if (strings) {
+	if (len < 8 || (reclen = get32(data)) > len-8
+	 || (len > 8+reclen && data[len-1] != 0))
+	    return -1;
+    }
+    release_block_strings(f);
+    f->strings = strings;
+    if (strings) {
+	f->strbase = get32(data+4);
+	f->strbuf = data + 8 + reclen;
+	f->strused = len - 8 - reclen;
+	data += 8;
+	len = reclen;
+    }
+    f->buf = data;
+    f->buflen = len;
+    f->bufpos = 0;
+    return 0;
+}
+
+
+/* Read the next block of a checksummed file into the buffer (or point the
+ * buffer at it, if the file is mapped), decompressing it if necessary.
+ * Blocks whose checksums do not match or which cannot be decoded are
+ * logged and skipped.  Return 0 on success, -1 at end of file or if the
+ * rest of the file cannot be read.
+ */
+
+static int next_block(dbFILE *f)
+{
+    unsigned char header[8];
+    uint32 len, crc;
+    int compressed, strings;
+    unsigned char *data;
+
+    for (;;) {
+	if (f->map) {
+	    if (f->blockpos == f->maplen)
+		return -1;
+	    if (f->maplen - f->blockpos < 8)
+		goto damaged;
+	    memcpy(header, f->map + f->blockpos, 8);
+	} else {
+	    long n = read_all(f->fd, header, 8);
+	    if (n == 0)
+		return -1;
+	    if (n < 0) {
+		f->error = errno;
+		return -1;
+	    }
+	    if (n < 8)
+		goto damaged;
+	}
+	len = get32(header);
+	crc = get32(header+4);
+	compressed = (len & DB_COMPRESSED) != 0;
+	strings = (len & DB_STRINGS) != 0;
+	len &= ~(DB_COMPRESSED | DB_STRINGS);
+	if (len == 0 || len > DB_MAXBLOCK)
+	    goto damaged;
+	if (f->map) {
+	    if (len > f->maplen - f->blockpos - 8)
+		goto damaged;
+	    data = f->map + f->blockpos + 8;
+	} else {
+	    long n;
+	    if (len > f->bufsize) {
+		unsigned char *newbuf = malloc(len);
+		if (!newbuf) {
+		    f->error = ENOMEM;
+		    return -1;
+		}
+		if (f->bufalloc)
+		    free(f->iobuf);
+		f->iobuf = newbuf;
+		f->bufsize = len;
+		f->bufalloc = 1;
+	    }
+	    data = f->iobuf;
+	    n = read_all(f->fd, data, len);
+	    if (n < 0) {
+		f->error = errno;
+		return -1;
+	    }
+	    if (n < len)
+		goto damaged;
+	}
+	if (crc32c(data, len) != crc) {
+#ifndef NOT_MAIN
+	    log("%s: checksum error in block at offset %ld, skipping %lu"
+		" bytes", f->filename, f->blockpos, (unsigned long)len);
+#endif
+	} else if (!compressed) {
+	    if (start_block(f, data, len, strings) == 0) {
+		f->blockpos += 8 + len;
+		return 0;
+	    }
+#ifndef NOT_MAIN
+	    log("%s: invalid string table in block at offset %ld, skipping"
+		" %lu bytes", f->filename, f->blockpos, (unsigned long)len);
+#endif
+	} else {
+	    uint32 rawlen = len >= 4 ? get32(data) : 0;
+	    if (rawlen > 0 && rawlen <= DB_MAXBLOCK) {
+		if (grow_zbuf(f, rawlen) < 0) {
+		    f->error = ENOMEM;
+		    return -1;
+		}
+		if (lz_decompress(data+4, len-4, f->zbuf, rawlen) == rawlen
+		 && start_block(f, f->zbuf, rawlen, strings) == 0) {
+		    f->blockpos += 8 + len;
+		    return 0;
+		}
+	    }
+#ifndef NOT_MAIN
+	    log("%s: invalid compressed data in block at offset %ld, skipping"
+		" %lu bytes", f->filename, f->blockpos, (unsigned long)len);
+#endif
+	}
+	f->badblocks++;
+	f->blockpos += 8 + len;
+    }
+
+  damaged:
+#ifndef NOT_MAIN
+    log("%s: damaged block header at offset %ld, ignoring the rest of the"
+	" file", f->filename, f->blockpos);
+#endif
+    f->badblocks++;
+    return -1;
+}
+
+/*************************************************************************/
+
+/* Low-level buffered reads and writes.  fill_db() refills the buffer of a
+ * file open for reading and returns the next byte (as for getc_db()), or
+ * EOF at end of file or on error.  read_db() and write_db() copy `len'
+ * bytes to or from `buf' and return the number of bytes copied, which is
+ * less than `len' only at end of file or on error.
+ */
+
+int fill_db(dbFILE *f)
+{
+    long n;
+
+    if (f->mode != 'r' || f->error)
+	return EOF;
+    if (f->blocks) {
+	if (next_block(f) < 0) {
+	    if (!f->error)
+		f->error = -1;
+	    f->bufpos = f->buflen = 0;
+	    return EOF;
+	}
+	return f->buf[f->bufpos++];
+    }
+    if (f->map) {
+	f->error = -1;
+	return EOF;
+    }
+    f->buf = f->iobuf;
+    n = read_all(f->fd, f->buf, f->bufsize);
+    if (n <= 0) {
+	f->error = n<0 ? errno : -1;
+	f->bufpos = f->buflen = 0;
+	return EOF;
+    }
+    f->buflen = n;
+    f->bufpos = 1;
+    return f->buf[0];
+}
+
+
+size_t read_db(dbFILE *f, void *buf, size_t len)
+{
+    unsigned char *s = buf;
+    size_t left = len;
+
+    while (left > 0) {
+	size_t n = f->buflen - f->bufpos;
+	if (n == 0) {
+	    int c = fill_db(f);
+	    if (c == EOF)
+		break;
+	    *s++ = c;
+	    left--;
+	    continue;
+	}
+	if (n > left)
+	    n = left;
+	memcpy(s, f->buf + f->bufpos, n);
+	f->bufpos += n;
+	s += n;
+	left -= n;
+    }
+    return len - left;
+}
+
+
+size_t write_db(dbFILE *f, const void *buf, size_t len)
+{
+    const unsigned char *s = buf;
+    size_t left = len;
+
+    while (left > 0) {
+	size_t n = f->bufsize - f->bufpos;
+	if (n == 0) {
+	    if (make_room(f, left < DB_BUFSIZE ? left : DB_BUFSIZE) < 0)
+		break;
+	    continue;
+	}
+	if (n > left)
+	    n = left;
+	memcpy(f->buf + f->bufpos, s, n);
+	f->bufpos += n;
+	s += n;
+	left -= n;
+    }
+    return len - left;
 }
 
 /*************************************************************************/
@@ -287,19 +1166,30 @@ void close_db(dbFILE *f)
  * multibyte values are stored in big-endian order (most significant byte
  * first).  A pointer is stored as a byte, either 0 if NULL or 1 if not,
  * and read pointers are returned as either (void *)0 or (void *)1.  A
- * string is stored with a 2-byte unsigned length (including the trailing
- * \0) first; a length of 0 indicates that the string pointer is NULL.
- * Written strings are truncated silently at 65534 bytes, and are always
- * null-terminated.
+ * string is stored in the block's string table, with its 4-byte offset
+ * there plus one in the record (see datafiles.h); an offset of 0
+ * indicates that the string pointer is NULL.  In blocks without a string
+ * table, a string is stored with a 2-byte unsigned length (including the
+ * trailing \0) first, with a length of 0 for NULL.  Written strings are
+ * truncated silently at 65534 bytes, and are always null-terminated.
+ * Strings read from a string table point into a copy of the table shared
+ * with the other strings read from the block (see new_strtab() in
+ * memory.c), and are freed with free() as usual.
  *
  * All routines return -1 on error, 0 otherwise.
  */
 
 /*************************************************************************/
 
+/* Make sure there is room for `len' more bytes in the write buffer. */
+#define WRITE_ROOM(f,len)  \
+    ((f)->bufpos + (len) <= (f)->bufsize || make_room((f),(len)) == 0)
+
+/*************************************************************************/
+
 int read_int8(unsigned char *ret, dbFILE *f)
 {
-    int c = fgetc(f->fp);
+    int c = getc_db(f);
     if (c == EOF)
 	return -1;
     *ret = c;
@@ -308,32 +1198,41 @@ int read_int8(unsigned char *ret, dbFILE *f)
 
 int write_int8(unsigned char val, dbFILE *f)
 {
-    if (fputc(val, f->fp) == EOF)
+    if (!WRITE_ROOM(f, 1))
 	return -1;
+    f->buf[f->bufpos++] = val;
     return 0;
 }
 
 /*************************************************************************/
 
-/* These two are inline to help out {read,write}_string. */
-
-inline int read_int16(uint16 *ret, dbFILE *f)
+int read_int16(uint16 *ret, dbFILE *f)
 {
-    int c1, c2;
-
-    c1 = fgetc(f->fp);
-    c2 = fgetc(f->fp);
-    if (c2 == EOF)
-	return -1;
-    *ret = c1<<8 | c2;
+    if (f->buflen - f->bufpos >= 2) {
+	unsigned char *s = f->buf + f->bufpos;
+	*ret = s[0]<<8 | s[1];
+	f->bufpos += 2;
+    } else {
+	int c1, c2;
+	c1 = getc_db(f);
+	c2 = getc_db(f);
+	if (c2 == EOF)
+	    return -1;
+	*ret = c1<<8 | c2;
+    }
     return 0;
 }
 
-inline int write_int16(uint16 val, dbFILE *f)
+int write_int16(uint16 val, dbFILE *f)
 {
-    fputc((val>>8), f->fp);
-    if (fputc(val, f->fp) == EOF)
+    unsigned char *s;
+
+    if (!WRITE_ROOM(f, 2))
 	return -1;
+    s = f->buf + f->bufpos;
+    s[0] = val>>8;
+    s[1] = val;
+    f->bufpos += 2;
     return 0;
 }
 
@@ -341,25 +1240,35 @@ inline int write_int16(uint16 val, dbFILE *f)
 
 int read_int32(uint32 *ret, dbFILE *f)
 {
-    int c1, c2, c3, c4;
-
-    c1 = fgetc(f->fp);
-    c2 = fgetc(f->fp);
-    c3 = fgetc(f->fp);
-    c4 = fgetc(f->fp);
-    if (c4 == EOF)
-	return -1;
-    *ret = c1<<24 | c2<<16 | c3<<8 | c4;
+    if (f->buflen - f->bufpos >= 4) {
+	unsigned char *s = f->buf + f->bufpos;
+	*ret = (uint32)s[0]<<24 | s[1]<<16 | s[2]<<8 | s[3];
+	f->bufpos += 4;
+    } else {
+	int c1, c2, c3, c4;
+	c1 = getc_db(f);
+	c2 = getc_db(f);
+	c3 = getc_db(f);
+	c4 = getc_db(f);
+	if (c4 == EOF)
+	    return -1;
+	*ret = (uint32)c1<<24 | c2<<16 | c3<<8 | c4;
+    }
     return 0;
 }
 
 int write_int32(uint32 val, dbFILE *f)
 {
-    fputc((val>>24), f->fp);
-    fputc((val>>16), f->fp);
-    fputc((val>> 8), f->fp);
-    if (fputc((val & 0xFF), f->fp) == EOF)
+    unsigned char *s;
+
+    if (!WRITE_ROOM(f, 4))
 	return -1;
+    s = f->buf + f->bufpos;
+    s[0] = val>>24;
+    s[1] = val>>16;
+    s[2] = val>>8;
+    s[3] = val;
+    f->bufpos += 4;
     return 0;
 }
 
@@ -369,7 +1278,7 @@ int read_ptr(void **ret, dbFILE *f)
 {
     int c;
 
-    c = fgetc(f->fp);
+    c = getc_db(f);
     if (c == EOF)
 	return -1;
     *ret = (c ? (void *)1 : (void *)0);
@@ -378,9 +1287,7 @@ int read_ptr(void **ret, dbFILE *f)
 
 int write_ptr(const void *ptr, dbFILE *f)
 {
-    if (fputc(ptr ? 1 : 0, f->fp) == EOF)
-	return -1;
-    return 0;
+    return write_int8(ptr ? 1 : 0, f);
 }
 
 /*************************************************************************/
@@ -390,6 +1297,30 @@ int read_string(char **ret, dbFILE *f)
     char *s;
     uint16 len;
 
+    if (f->strings) {
+	uint32 pos;
+	if (read_int32(&pos, f) < 0)
+	    return -1;
+	if (pos == 0) {
+	    *ret = NULL;
+	    return 0;
+	}
+	pos -= f->strbase + 1;
+	/* The table ends with a \0, so any position in it is a string */
+	if (!f->strings || pos >= f->strused)
+	    return -1;
+#ifndef NOT_MAIN
+	if (!f->strtab)
+	    f->strtab = new_strtab(f->strbuf, f->strused);
+	f->struses++;
+	*ret = f->strtab + pos;
+#else
+	s = smalloc(strlen((char *)f->strbuf + pos) + 1);
+	strcpy(s, (char *)f->strbuf + pos);
+	*ret = s;
+#endif
+	return 0;
+    }
     if (read_int16(&len, f) < 0)
 	return -1;
     if (len == 0) {
@@ -397,7 +1328,10 @@ int read_string(char **ret, dbFILE *f)
 	return 0;
     }
     s = smalloc(len);
-    if (len != fread(s, 1, len, f->fp)) {
+    if (f->buflen - f->bufpos >= len) {
+	memcpy(s, f->buf + f->bufpos, len);
+	f->bufpos += len;
+    } else if (read_db(f, s, len) != len) {
 	free(s);
 	return -1;
     }
@@ -408,16 +1342,58 @@ int read_string(char **ret, dbFILE *f)
 int write_string(const char *s, dbFILE *f)
 {
     uint32 len;
+    unsigned char *d;
 
+    if (f->strings) {
+	uint32 pos = 0;
+	/* Make room first, so the string goes in the same block as its
+	 * offset even when not writing records */
+	if (!WRITE_ROOM(f, 4))
+	    return -1;
+	if (s) {
+	    len = strlen(s);
+	    if (len > 65534)
+		len = 65534;
+	    if (f->strused + len+1 > f->strsize) {
+		long newsize = f->strsize ? f->strsize*2 : DB_BUFSIZE/2;
+		unsigned char *newbuf;
+		if (newsize < f->strused + len+1)
+		    newsize = f->strused + len+1;
+		newbuf = malloc(newsize);
+		if (!newbuf) {
+		    f->error = ENOMEM;
+		    errno = ENOMEM;
+		    return -1;
+		}
+		memcpy(newbuf, f->strbuf, f->strused);
+		free(f->strbuf);
+		f->strbuf = newbuf;
+		f->strsize = newsize;
+	    }
+	    memcpy(f->strbuf + f->strused, s, len);
+	    f->strbuf[f->strused + len] = 0;
+	    pos = f->strbase + f->strused + 1;
+	    f->strused += len+1;
+	}
+	d = f->buf + f->bufpos;
+	put32(d, pos);
+	f->bufpos += 4;
+	return 0;
+    }
     if (!s)
 	return write_int16(0, f);
     len = strlen(s);
     if (len > 65534)
 	len = 65534;
-    write_int16((uint16)(len+1), f);
-    fwrite(s, 1, len, f->fp);
-    if (fputc(0, f->fp) == EOF)
+    /* The whole string always fits in an empty buffer. */
+    if (!WRITE_ROOM(f, len+3))
 	return -1;
+    d = f->buf + f->bufpos;
+    d[0] = (len+1)>>8;
+    d[1] = (len+1);
+    memcpy(d+2, s, len);
+    d[len+2] = 0;
+    f->bufpos += len+3;
     return 0;
 }
 
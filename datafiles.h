@@ -12,29 +12,105 @@
 
 /*************************************************************************/
 
+/* Size of the I/O buffer in each dbFILE.  Data is only passed to the
+ * system (with read() or write()) in chunks of this size, so it should be
+ * large compared to the average record.  Where mmap() is available, files
+ * opened for reading are mapped whole and decoded in place instead. */
+#define DB_BUFSIZE	0x200000
+
+/* Database files are written as DB_MAGIC followed by a series of blocks,
+ * each consisting of the length of its data and the CRC32C of the data
+ * (both 32 bits, big-endian) followed by the data itself.  The file version
+ * number is in the first block.  Files without DB_MAGIC are read as a plain
+ * stream, as written by older versions.  DB_MAXBLOCK is a sanity limit on
+ * the block length when reading.  If the DB_COMPRESSED bit is set in the
+ * length, the data is the uncompressed length (32 bits) followed by the
+ * compressed data (see lz_compress() in datafiles.c); the checksum covers
+ * the data as stored.  If the DB_STRINGS bit is set, the (uncompressed)
+ * data is the length of the records in the block and the offset of the
+ * block's first string (32 bits each), then the records, then the string
+ * table: the strings of those records, each with its trailing \0.  The
+ * records then refer to each string by its offset plus one (see
+ * write_string() in datafiles.c); offsets count from the first string in
+ * the file.  Versions which do not know DB_STRINGS see such blocks as
+ * damaged, and all blocks written now have it set. */
+#define DB_MAGIC	0x53764442	/* "SvDB" */
+#define DB_MAXBLOCK	0x10000000
+#define DB_COMPRESSED	0x80000000
+#define DB_STRINGS	0x40000000
+
 typedef struct dbFILE_ dbFILE;
 struct dbFILE_ {
-    int mode;			/* 'r' for reading, 'w' for writing */
-    FILE *fp;			/* The normal file descriptor */
-    FILE *backupfp;		/* Open file pointer to a backup copy of
-				 *    the database file (if non-NULL) */
+    int mode;			/* 'r' for reading, 'w' for writing, 'a'
+				 *    for appending */
+    int fd;			/* The file descriptor */
     char filename[PATH_MAX];	/* Name of the database file */
-    char backupname[PATH_MAX];	/* Name of the backup file */
+    char tempname[PATH_MAX];	/* Name of the file actually written to
+				 *    (mode 'w'), renamed on close */
+    long appendpos;		/* File size when opened for appending */
+    int error;			/* errno of first failed read()/write(), or
+				 *    -1 at end of file when reading */
+    int blocks;			/* Nonzero if the file has checksummed
+				 *    blocks (see above) */
+    int badblocks;		/* Number of damaged blocks skipped */
+    int compress;		/* Nonzero to compress blocks (writing) */
+    long blockpos;		/* File offset of the next block (reading) */
+    long recstart;		/* Start of the current record in buf[]
+				 *    (writing), -1 if not using records */
+    unsigned char *map;		/* mmap() of the whole file, or NULL */
+    long maplen;		/* Length of the mapping */
+    long bufpos;		/* Next byte to read/write in buf[] */
+    long buflen;		/* Number of valid bytes in buf[] (reading) */
+    unsigned char *buf;		/* Data being read or written: iobuf, zbuf,
+				 *    or part of map */
+    unsigned char *iobuf;	/* I/O buffer */
+    long bufsize;		/* Size of iobuf[] */
+    int bufalloc;		/* Nonzero if iobuf[] was malloc()ed */
+    unsigned char *zbuf;	/* Buffer for (de)compressed data, or NULL */
+    long zsize;			/* Size of zbuf[] */
+    int strings;		/* Nonzero if strings are kept in string
+				 *    tables (writing), or if the current
+				 *    block has one (reading) */
+    unsigned char *strbuf;	/* String table being built (writing), or
+				 *    that of the current block (reading) */
+    long strused;		/* Length of the table in strbuf[] */
+    long strsize;		/* Size of strbuf[] (writing) */
+    long strrec;		/* strused at the last end_record_db() */
+    uint32 strbase;		/* File-wide offset of strbuf[0] */
+    char *strtab;		/* Copy of strbuf[] strings are handed out
+				 *    from (reading), or NULL; see
+				 *    new_strtab() in memory.c */
+    long struses;		/* Number of strings handed out from it */
 };
 
 /*************************************************************************/
 
 /* Prototypes and macros: */
 
+/* Sync a file's data to disk (before it replaces the old copy, or before
+ * anything refers to it). */
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+# define DB_SYNC(fd)	fdatasync(fd)
+#else
+# define DB_SYNC(fd)	fsync(fd)
+#endif
+
 E void check_file_version(dbFILE *f);
 E int get_file_version(dbFILE *f);
 E int write_file_version(dbFILE *f);
 E dbFILE *open_db(const char *service, const char *filename, const char *mode);
 E int restore_db(dbFILE *f);	/* Restore to state before open_db() */
-E void close_db(dbFILE *f);
-#define read_db(f,buf,len)	(fread((buf),1,(len),(f)->fp))
-#define write_db(f,buf,len)	(fwrite((buf),1,(len),(f)->fp))
-#define getc_db(f)		(fgetc((f)->fp))
+E void prefetch_db(const char *filename);
+E int sync_dir(const char *filename);
+E int flush_db(dbFILE *f);
+E void end_record_db(dbFILE *f);
+E int close_db(dbFILE *f);
+E int db_write_errors;		/* Count of failed database writes */
+E int fill_db(dbFILE *f);
+E size_t read_db(dbFILE *f, void *buf, size_t len);
+E size_t write_db(dbFILE *f, const void *buf, size_t len);
+#define getc_db(f)		((f)->bufpos < (f)->buflen \
+				 ? (f)->buf[(f)->bufpos++] : fill_db(f))
 
 E int read_int8(unsigned char *ret, dbFILE *f);
 E int write_int8(unsigned char val, dbFILE *f);
@@ -9,6 +9,10 @@
 
 #include "services.h"
 #include "encrypt.h"
+#include <fcntl.h>
+#if HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 #ifdef USE_ENCRYPTION
 
@@ -335,56 +339,755 @@ unsigned int len;
 
 /*************************************************************************/
 
+/******** SHA-256 and PBKDF2, for the current password format. ********/
+
+/* Passwords are stored as PBKDF2-HMAC-SHA256 (RFC 2898) hashes with a
+ * random salt and a tunable iteration count, in a PASSMAX-byte buffer laid
+ * out as follows:
+ *     bytes  0-1   PASS_MAGIC ("$p")
+ *     byte   2     format version (PASS_PBKDF2_SHA256)
+ *     byte   3     cost: the iteration count is 1<<cost
+ *     bytes  4-11  salt
+ *     bytes 12-31  derived key (first PASS_KEYLEN bytes)
+ * Passwords encrypted by earlier versions are raw MD5 digests, which are
+ * still accepted (see check_password()) and replaced with the current
+ * format the next time the user identifies.  An MD5 digest could by
+ * chance begin with the same three bytes as the current format; this is
+ * harmless, since a failed PBKDF2 check falls back to MD5.
+ */
+
+#define PASS_MAGIC		"$p"
+#define PASS_PBKDF2_SHA256	1
+#define PASS_SALTLEN		8
+#define PASS_KEYLEN		20
+#define PASS_HASHLEN		(4+PASS_SALTLEN+PASS_KEYLEN)
+
+#define PASS_MINCOST		10	/* Lowest cost we will select */
+#define PASS_MAXCOST		24	/* Highest cost we will select */
+#define PASS_LIMITCOST		30	/* Highest cost we will verify */
+#define PASS_DEFAULT_TIME	25	/* Default PasswordTime, in ms */
+
+/* Cost used for newly encrypted passwords; set by password_hash_init(). */
+static int password_cost = PASS_MINCOST;
+
+#if PASS_HASHLEN > PASSMAX
+# error PASSMAX too small for password hashes
+#endif
+
+
+typedef struct {
+    uint32 state[8];
+    uint32 count;			/* Bytes processed (mod 2^32) */
+    unsigned char buf[64];
+} SHA256_CTX;
+
+static const uint32 sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x,n)	(((x) >> (n)) | ((x) << (32-(n))))
+
+/* SHA-256 compression function, on a block already split into 16
+ * big-endian words. */
+
+static void sha256_block(uint32 *state, const uint32 *block)
+{
+    uint32 w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++)
+	w[i] = block[i];
+    for (; i < 64; i++) {
+	uint32 s0 = ROTR(w[i-15],7) ^ ROTR(w[i-15],18) ^ (w[i-15]>>3);
+	uint32 s1 = ROTR(w[i-2],17) ^ ROTR(w[i-2],19) ^ (w[i-2]>>10);
+	w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+	t1 = h + (ROTR(e,6) ^ ROTR(e,11) ^ ROTR(e,25)) + ((e & f) ^ (~e & g))
+	   + sha256_k[i] + w[i];
+	t2 = (ROTR(a,2) ^ ROTR(a,13) ^ ROTR(a,22))
+	   + ((a & b) ^ (a & c) ^ (b & c));
+	h = g; g = f; f = e; e = d + t1;
+	d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void sha256_transform(uint32 *state, const unsigned char *data)
+{
+    uint32 block[16];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+	block[i] = (uint32)data[i*4]<<24 | (uint32)data[i*4+1]<<16
+		 | (uint32)data[i*4+2]<<8 | (uint32)data[i*4+3];
+    }
+    sha256_block(state, block);
+}
+
+static void sha256_init(SHA256_CTX *ctx)
+{
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->count = 0;
+}
+
+static void sha256_update(SHA256_CTX *ctx, const unsigned char *data, int len)
+{
+    int used = ctx->count % 64;
+
+    ctx->count += len;
+    if (used) {
+	int n = 64 - used;
+	if (n > len)
+	    n = len;
+	memcpy(ctx->buf+used, data, n);
+	data += n;
+	len -= n;
+	if (used+n < 64)
+	    return;
+	sha256_transform(ctx->state, ctx->buf);
+    }
+    while (len >= 64) {
+	sha256_transform(ctx->state, data);
+	data += 64;
+	len -= 64;
+    }
+    memcpy(ctx->buf, data, len);
+}
+
+static void sha256_final(unsigned char *digest, SHA256_CTX *ctx)
+{
+    uint32 bits = ctx->count << 3;
+    int used = ctx->count % 64;
+    int i;
+
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+	memset(ctx->buf+used, 0, 64-used);
+	sha256_transform(ctx->state, ctx->buf);
+	used = 0;
+    }
+    memset(ctx->buf+used, 0, 56-used);
+    ctx->buf[56] = ctx->count >> 29;	/* Bits 32-34 of the bit count */
+    ctx->buf[57] = ctx->buf[58] = ctx->buf[59] = 0;
+    ctx->buf[60] = bits>>24;
+    ctx->buf[61] = bits>>16;
+    ctx->buf[62] = bits>>8;
+    ctx->buf[63] = bits;
+    sha256_transform(ctx->state, ctx->buf);
+    for (i = 0; i < 8; i++) {
+	digest[i*4  ] = ctx->state[i]>>24;
+	digest[i*4+1] = ctx->state[i]>>16;
+	digest[i*4+2] = ctx->state[i]>>8;
+	digest[i*4+3] = ctx->state[i];
+    }
+}
+
+/*************************************************************************/
+
+/* Set up PBKDF2-HMAC-SHA256 for one password: store the HMAC inner and
+ * outer states (after hashing the padded key blocks) in `istate' and
+ * `ostate', and the first block U1 = HMAC(pass, salt || INT32_BE(1)) as
+ * eight words in `u'. */
+
+static void pbkdf2_start(const char *pass, int passlen,
+			 const unsigned char *salt, int saltlen,
+			 uint32 *istate, uint32 *ostate, uint32 *u)
+{
+    SHA256_CTX ictx, octx, ctx;
+    unsigned char pad[64], digest[32];
+    int i;
+
+    memset(pad, 0, sizeof(pad));
+    if (passlen > 64) {
+	sha256_init(&ctx);
+	sha256_update(&ctx, (const unsigned char *)pass, passlen);
+	sha256_final(pad, &ctx);
+    } else {
+	memcpy(pad, pass, passlen);
+    }
+    for (i = 0; i < 64; i++)
+	pad[i] ^= 0x36;
+    sha256_init(&ictx);
+    sha256_update(&ictx, pad, 64);
+    for (i = 0; i < 64; i++)
+	pad[i] ^= 0x36 ^ 0x5C;
+    sha256_init(&octx);
+    sha256_update(&octx, pad, 64);
+    memcpy(istate, ictx.state, 32);
+    memcpy(ostate, octx.state, 32);
+
+    ctx = ictx;
+    sha256_update(&ctx, salt, saltlen);
+    sha256_update(&ctx, (const unsigned char *)"\0\0\0\1", 4);
+    sha256_final(digest, &ctx);
+    ctx = octx;
+    sha256_update(&ctx, digest, 32);
+    sha256_final(digest, &ctx);
+    for (i = 0; i < 8; i++) {
+	u[i] = (uint32)digest[i*4]<<24 | (uint32)digest[i*4+1]<<16
+	     | (uint32)digest[i*4+2]<<8 | (uint32)digest[i*4+3];
+    }
+
+    memset(pad, 0, sizeof(pad));
+    memset(digest, 0, sizeof(digest));
+    memset(&ictx, 0, sizeof(ictx));
+    memset(&octx, 0, sizeof(octx));
+    memset(&ctx, 0, sizeof(ctx));
+}
+
+/* Write the first `keylen' (at most 32) bytes of the PBKDF2 result `t'
+ * to `key'. */
+
+static void pbkdf2_finish(const uint32 *t, unsigned char *key, int keylen)
+{
+    unsigned char buf[32];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+	buf[i*4  ] = t[i]>>24;
+	buf[i*4+1] = t[i]>>16;
+	buf[i*4+2] = t[i]>>8;
+	buf[i*4+3] = t[i];
+    }
+    memcpy(key, buf, keylen);
+    memset(buf, 0, sizeof(buf));
+}
+
+/* Derive `keylen' (at most 32) bytes from the given password and salt with
+ * PBKDF2-HMAC-SHA256, using 1<<cost iterations.  The HMAC inner and outer
+ * key blocks are hashed only once, and every later message is a single
+ * 32-byte digest, so each iteration costs exactly two SHA-256 block
+ * transforms on fixed-padded word blocks. */
+
+static void pbkdf2_sha256(const char *pass, int passlen,
+			  const unsigned char *salt, int saltlen,
+			  int cost, unsigned char *key, int keylen)
+{
+    uint32 istate[8], ostate[8], u[8], t[8], state[8], block[16];
+    uint32 iter, count = (uint32)1 << cost;
+    int i;
+
+    pbkdf2_start(pass, passlen, salt, saltlen, istate, ostate, u);
+    memcpy(t, u, sizeof(t));
+
+    /* U2..Un = HMAC(pass, U(n-1)); T = U1 ^ U2 ^ ... ^ Un */
+    block[8] = 0x80000000;
+    for (i = 9; i < 15; i++)
+	block[i] = 0;
+    block[15] = (64+32)*8;
+    for (iter = 1; iter < count; iter++) {
+	memcpy(block, u, 32);
+	memcpy(state, istate, 32);
+	sha256_block(state, block);
+	memcpy(block, state, 32);
+	memcpy(state, ostate, 32);
+	sha256_block(state, block);
+	for (i = 0; i < 8; i++) {
+	    u[i] = state[i];
+	    t[i] ^= state[i];
+	}
+    }
+    pbkdf2_finish(t, key, keylen);
+    memset(istate, 0, sizeof(istate));
+    memset(ostate, 0, sizeof(ostate));
+    memset(t, 0, sizeof(t));
+}
+
+/*************************************************************************/
+
+/* Multi-buffer PBKDF2: PASS_LANES passwords with the same cost are hashed
+ * together, with word i of every lane's state packed into one vector so
+ * each SHA-256 operation works on all lanes at once.  SSE2 intrinsics are
+ * used where the compiler provides them; otherwise the lanes are plain
+ * arrays, which is no slower than hashing the passwords one at a time. */
+
+#define PASS_LANES	4
+
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+typedef __m128i lanevec;
+
+#define LV_ADD(a,b)	_mm_add_epi32((a),(b))
+#define LV_XOR(a,b)	_mm_xor_si128((a),(b))
+#define LV_AND(a,b)	_mm_and_si128((a),(b))
+#define LV_ANDNOT(a,b)	_mm_andnot_si128((a),(b))	/* ~a & b */
+#define LV_ROTR(x,n)	_mm_or_si128(_mm_srli_epi32((x),(n)), \
+				     _mm_slli_epi32((x),32-(n)))
+#define LV_SHR(x,n)	_mm_srli_epi32((x),(n))
+#define LV_SET1(x)	_mm_set1_epi32((int)(x))
+#define LV_LOAD(p)	_mm_loadu_si128((const __m128i *)(p))
+#define LV_STORE(p,v)	_mm_storeu_si128((__m128i *)(p),(v))
+
+#else  /* !__SSE2__ */
+
+typedef struct { uint32 l[PASS_LANES]; } lanevec;
+
+static lanevec lv_add(lanevec a, lanevec b)
+{
+    int i;
+    for (i = 0; i < PASS_LANES; i++)
+	a.l[i] += b.l[i];
+    return a;
+}
+
+static lanevec lv_xor(lanevec a, lanevec b)
+{
+    int i;
+    for (i = 0; i < PASS_LANES; i++)
+	a.l[i] ^= b.l[i];
+    return a;
+}
+
+static lanevec lv_and(lanevec a, lanevec b)
+{
+    int i;
+    for (i = 0; i < PASS_LANES; i++)
+	a.l[i] &= b.l[i];
+    return a;
+}
+
+static lanevec lv_andnot(lanevec a, lanevec b)
+{
+    int i;
+    for (i = 0; i < PASS_LANES; i++)
+	a.l[i] = ~a.l[i] & b.l[i];
+    return a;
+}
+
+static lanevec lv_rotr(lanevec a, int n)
+{
+    int i;
+    for (i = 0; i < PASS_LANES; i++)
+	a.l[i] = ROTR(a.l[i], n);
+    return a;
+}
+
+static lanevec lv_shr(lanevec a, int n)
+{
+    int i;
+    for (i = 0; i < PASS_LANES; i++)
+	a.l[i] >>= n;
+    return a;
+}
+
+static lanevec lv_load(const uint32 *p)
+{
+    lanevec a;
+    memcpy(a.l, p, sizeof(a.l));
+    return a;
+}
+
+static lanevec lv_set1(uint32 x)
+{
+    lanevec a;
+    int i;
+    for (i = 0; i < PASS_LANES; i++)
+	a.l[i] = x;
+    return a;
+}
+
+#define LV_ADD(a,b)	lv_add((a),(b))
+#define LV_XOR(a,b)	lv_xor((a),(b))
+#define LV_AND(a,b)	lv_and((a),(b))
+#define LV_ANDNOT(a,b)	lv_andnot((a),(b))
+#define LV_ROTR(x,n)	lv_rotr((x),(n))
+#define LV_SHR(x,n)	lv_shr((x),(n))
+#define LV_SET1(x)	lv_set1(x)
+#define LV_LOAD(p)	lv_load(p)
+#define LV_STORE(p,v)	memcpy((p), (v).l, sizeof((v).l))
+
+#endif	/* __SSE2__ */
+
+/* sha256_block() on PASS_LANES independent states and blocks. */
+
+static void sha256_block_lanes(lanevec *state, const lanevec *block)
+{
+    lanevec w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++)
+	w[i] = block[i];
+    for (; i < 64; i++) {
+	lanevec s0 = LV_XOR(LV_XOR(LV_ROTR(w[i-15],7), LV_ROTR(w[i-15],18)),
+			    LV_SHR(w[i-15],3));
+	lanevec s1 = LV_XOR(LV_XOR(LV_ROTR(w[i-2],17), LV_ROTR(w[i-2],19)),
+			    LV_SHR(w[i-2],10));
+	w[i] = LV_ADD(LV_ADD(w[i-16], s0), LV_ADD(w[i-7], s1));
+    }
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+	t1 = LV_ADD(LV_ADD(h, LV_XOR(LV_XOR(LV_ROTR(e,6), LV_ROTR(e,11)),
+				     LV_ROTR(e,25))),
+		    LV_ADD(LV_XOR(LV_AND(e,f), LV_ANDNOT(e,g)),
+			   LV_ADD(LV_SET1(sha256_k[i]), w[i])));
+	t2 = LV_ADD(LV_XOR(LV_XOR(LV_ROTR(a,2), LV_ROTR(a,13)), LV_ROTR(a,22)),
+		    LV_XOR(LV_XOR(LV_AND(a,b), LV_AND(a,c)), LV_AND(b,c)));
+	h = g; g = f; f = e; e = LV_ADD(d, t1);
+	d = c; c = b; b = a; a = LV_ADD(t1, t2);
+    }
+    state[0] = LV_ADD(state[0], a); state[1] = LV_ADD(state[1], b);
+    state[2] = LV_ADD(state[2], c); state[3] = LV_ADD(state[3], d);
+    state[4] = LV_ADD(state[4], e); state[5] = LV_ADD(state[5], f);
+    state[6] = LV_ADD(state[6], g); state[7] = LV_ADD(state[7], h);
+}
+
+/* pbkdf2_sha256() on PASS_LANES passwords at once, all with the same
+ * cost.  Every input is consumed before any key is written, so key[i] may
+ * overlap pass[i] or salt[i]. */
+
+static void pbkdf2_sha256_lanes(const char **pass, const int *passlen,
+				const unsigned char **salt, int saltlen,
+				int cost, unsigned char **key, int keylen)
+{
+    uint32 istate[PASS_LANES][8], ostate[PASS_LANES][8], u[PASS_LANES][8];
+    uint32 lanes[PASS_LANES];
+    lanevec vi[8], vo[8], vu[8], vt[8], state[8], block[16];
+    uint32 iter, count = (uint32)1 << cost;
+    int i, lane;
+
+    for (lane = 0; lane < PASS_LANES; lane++) {
+	pbkdf2_start(pass[lane], passlen[lane], salt[lane], saltlen,
+		     istate[lane], ostate[lane], u[lane]);
+    }
+    for (i = 0; i < 8; i++) {
+	for (lane = 0; lane < PASS_LANES; lane++)
+	    lanes[lane] = istate[lane][i];
+	vi[i] = LV_LOAD(lanes);
+	for (lane = 0; lane < PASS_LANES; lane++)
+	    lanes[lane] = ostate[lane][i];
+	vo[i] = LV_LOAD(lanes);
+	for (lane = 0; lane < PASS_LANES; lane++)
+	    lanes[lane] = u[lane][i];
+	vu[i] = vt[i] = LV_LOAD(lanes);
+    }
+
+    block[8] = LV_SET1(0x80000000);
+    for (i = 9; i < 15; i++)
+	block[i] = LV_SET1(0);
+    block[15] = LV_SET1((64+32)*8);
+    for (iter = 1; iter < count; iter++) {
+	for (i = 0; i < 8; i++) {
+	    block[i] = vu[i];
+	    state[i] = vi[i];
+	}
+	sha256_block_lanes(state, block);
+	for (i = 0; i < 8; i++) {
+	    block[i] = state[i];
+	    state[i] = vo[i];
+	}
+	sha256_block_lanes(state, block);
+	for (i = 0; i < 8; i++) {
+	    vu[i] = state[i];
+	    vt[i] = LV_XOR(vt[i], state[i]);
+	}
+    }
+
+    for (i = 0; i < 8; i++) {
+	LV_STORE(lanes, vt[i]);
+	for (lane = 0; lane < PASS_LANES; lane++)
+	    u[lane][i] = lanes[lane];
+    }
+    for (lane = 0; lane < PASS_LANES; lane++)
+	pbkdf2_finish(u[lane], key[lane], keylen);
+    memset(istate, 0, sizeof(istate));
+    memset(ostate, 0, sizeof(ostate));
+    memset(u, 0, sizeof(u));
+    memset(vi, 0, sizeof(vi));
+    memset(vo, 0, sizeof(vo));
+    memset(vt, 0, sizeof(vt));
+}
+
+/*************************************************************************/
+
+/* Fill `buf' with `len' unpredictable bytes for a salt. */
+
+#if HAVE_PTHREAD
+static pthread_mutex_t salt_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void make_salt(unsigned char *buf, int len)
+{
+    static uint32 counter = 0;
+    uint32 count;
+    SHA256_CTX ctx;
+    unsigned char digest[32];
+    struct timeval tv;
+    int fd, n = 0;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+	n = read(fd, buf, len);
+	close(fd);
+	if (n == len)
+	    return;
+    }
+    /* No /dev/urandom; the salt only needs to be unique, so make do with
+     * the time, process and a counter. */
+    gettimeofday(&tv, NULL);
+    /* Salts are also made by the password threads */
+#if HAVE_PTHREAD
+    pthread_mutex_lock(&salt_lock);
+#endif
+    count = ++counter;
+#if HAVE_PTHREAD
+    pthread_mutex_unlock(&salt_lock);
+#endif
+    sha256_init(&ctx);
+    sha256_update(&ctx, (const unsigned char *)&tv, sizeof(tv));
+    sha256_update(&ctx, (const unsigned char *)&count, sizeof(count));
+    n = getpid();
+    sha256_update(&ctx, (const unsigned char *)&n, sizeof(n));
+    sha256_update(&ctx, (const unsigned char *)&buf, sizeof(buf));
+    sha256_final(digest, &ctx);
+    memcpy(buf, digest, len);
+}
+
+/*************************************************************************/
+
+/* Return nonzero if `password' (PASSMAX bytes) looks like a password in
+ * the current format. */
+
+static int is_pbkdf2_password(const char *password)
+{
+    return memcmp(password, PASS_MAGIC, 2) == 0
+	&& password[2] == PASS_PBKDF2_SHA256
+	&& password[3] >= 1 && password[3] <= PASS_LIMITCOST;
+}
+
+
+/* Choose the cost for newly encrypted passwords: PasswordCost if set,
+ * otherwise the highest cost whose verification takes no longer than
+ * PasswordTime on one processor, as measured here.  Returns the cost
+ * selected. */
+
+int password_hash_init(void)
+{
+    unsigned char salt[PASS_SALTLEN], key[PASS_KEYLEN];
+    int budget = PasswordTime ? PasswordTime : PASS_DEFAULT_TIME;
+    uint32 start, elapsed = 0;
+    int cost;
+
+    if (PasswordCost) {
+	password_cost = PasswordCost;
+	if (password_cost > PASS_LIMITCOST)
+	    password_cost = PASS_LIMITCOST;
+	log("Password hashing: using %lu iterations (PasswordCost %d)",
+	    (unsigned long)1 << password_cost, password_cost);
+	return password_cost;
+    }
+
+    /* Each step up doubles the time taken, so stop as soon as the next
+     * step would exceed the budget. */
+    memset(salt, 0, sizeof(salt));
+    for (cost = PASS_MINCOST; cost < PASS_MAXCOST; cost++) {
+	start = time_msec();
+	pbkdf2_sha256("benchmark", 9, salt, sizeof(salt), cost,
+		      key, sizeof(key));
+	elapsed = time_msec() - start;
+	if (elapsed*2 > budget)
+	    break;
+    }
+    password_cost = cost;
+    log("Password hashing: using %lu iterations (about %lu ms per check)",
+	(unsigned long)1 << password_cost, (unsigned long)elapsed);
+    return password_cost;
+}
+
+
+/* Return nonzero if `password' (as stored, PASSMAX bytes) is not in the
+ * current format or was encrypted at a lower cost than we now use, and
+ * should therefore be re-encrypted when the plaintext is next available.
+ */
+
+int password_needs_rehash(const char *password)
+{
+    return !is_pbkdf2_password(password) || password[3] < password_cost;
+}
+
+/*************************************************************************/
+
 /******** Our own high-level routines. ********/
 
 
 #define XTOI(c) ((c)>9 ? (c)-'A'+10 : (c)-'0')
 
+/* Store a hash in the current format, with the given salt, cost and key,
+ * in `dest' (`size' bytes, at least PASS_HASHLEN). */
+
+static void store_hash(char *dest, int size, const unsigned char *salt,
+		       int cost, const unsigned char *key)
+{
+    memset(dest, 0, size);
+    memcpy(dest, PASS_MAGIC, 2);
+    dest[2] = PASS_PBKDF2_SHA256;
+    dest[3] = cost;
+    memcpy(dest+4, salt, PASS_SALTLEN);
+    memcpy(dest+4+PASS_SALTLEN, key, PASS_KEYLEN);
+}
+
+
+/* encrypt() at the given cost. */
+
+static int encrypt_cost(const char *src, int len, char *dest, int size,
+			int cost)
+{
+    unsigned char salt[PASS_SALTLEN], key[PASS_KEYLEN];
+
+    if (size < PASS_HASHLEN)
+	return -1;
+
+    /* `src' and `dest' may be the same buffer (encrypt_in_place()), so
+     * don't touch `dest' until we're done with `src'. */
+    make_salt(salt, sizeof(salt));
+    pbkdf2_sha256(src, len, salt, sizeof(salt), cost, key, sizeof(key));
+    store_hash(dest, size, salt, cost, key);
+    memset(key, 0, sizeof(key));
+    return 0;
+}
+
+
 /* Encrypt `src' of length `len' and store the result in `dest'.  If the
  * resulting string would be longer than `size', return -1 and leave `dest'
  * unchanged; else return 0.
  */
 int encrypt(const char *src, int len, char *dest, int size)
 {
+    return encrypt_cost(src, len, dest, size, password_cost);
+}
 
-#ifdef ENCRYPT_MD5
-    MD5_CTX context;
 
-    if (size < 16)
-	return -1;
+/* Shortcut for encrypting a null-terminated string in place. */
+int encrypt_in_place(char *buf, int size)
+{
+    return encrypt(buf, strlen(buf), buf, size);
+}
+
+
+/* encrypt_batch() at the given cost. */
 
-    MD5Init(&context);
-    MD5Update(&context, src, len);
-    MD5Final(dest, &context);
+static int encrypt_batch_cost(const char **src, const int *len, char **dest,
+			      int size, int count, int cost)
+{
+    const char *pass[PASS_LANES];
+    int passlen[PASS_LANES];
+    unsigned char salts[PASS_LANES][PASS_SALTLEN];
+    unsigned char keys[PASS_LANES][PASS_KEYLEN];
+    const unsigned char *salt[PASS_LANES];
+    unsigned char *key[PASS_LANES];
+    int i, lane, n;
+
+    if (size < PASS_HASHLEN)
+	return -1;
 
+    for (lane = 0; lane < PASS_LANES; lane++) {
+	salt[lane] = salts[lane];
+	key[lane] = keys[lane];
+    }
+    for (i = 0; i < count; i += n) {
+	n = count-i < PASS_LANES ? count-i : PASS_LANES;
+	if (n == 1) {
+	    encrypt_cost(src[i], len[i], dest[i], size, cost);
+	    break;
+	}
+	/* Unused lanes just repeat the first password; their results are
+	 * thrown away. */
+	for (lane = 0; lane < PASS_LANES; lane++) {
+	    int j = i + (lane < n ? lane : 0);
+	    pass[lane] = src[j];
+	    passlen[lane] = len[j];
+	    make_salt(salts[lane], PASS_SALTLEN);
+	}
+	pbkdf2_sha256_lanes(pass, passlen, salt, PASS_SALTLEN, cost,
+			    key, PASS_KEYLEN);
+	for (lane = 0; lane < n; lane++)
+	    store_hash(dest[i+lane], size, salts[lane], cost, keys[lane]);
+    }
+    memset(keys, 0, sizeof(keys));
     return 0;
-#endif
+}
 
-    return -1;	/* unknown encryption algorithm */
+
+/* Encrypt `count' passwords as encrypt() would, src[i] (of length len[i])
+ * into dest[i], hashing PASS_LANES of them at a time.  dest[i] may be the
+ * same buffer as src[i].  Return -1 (leaving every `dest' unchanged) if
+ * `size' is too small, else 0.
+ */
+int encrypt_batch(const char **src, const int *len, char **dest, int size,
+		  int count)
+{
+    return encrypt_batch_cost(src, len, dest, size, count, password_cost);
 }
 
 
-/* Shortcut for encrypting a null-terminated string in place. */
-int encrypt_in_place(char *buf, int size)
+/* encrypt_batch() for `count' null-terminated strings, each encrypted in
+ * place in a buffer of `size' bytes.  This is used to convert plaintext
+ * passwords when loading the databases, where there may be a great many
+ * of them, so it hashes at no more than PASS_MINCOST; the hashes are
+ * brought up to the current cost by password_needs_rehash() when their
+ * owners next identify. */
+
+int encrypt_in_place_batch(char **bufs, int count, int size)
 {
-    return encrypt(buf, strlen(buf), buf, size);
+    int len[PASS_LANES];
+    int i, j, n, cost;
+
+    if (size < PASS_HASHLEN)
+	return -1;
+    cost = password_cost < PASS_MINCOST ? password_cost : PASS_MINCOST;
+    for (i = 0; i < count; i += n) {
+	n = count-i < PASS_LANES ? count-i : PASS_LANES;
+	for (j = 0; j < n; j++)
+	    len[j] = strlen(bufs[i+j]);
+	encrypt_batch_cost((const char **)bufs+i, len, bufs+i, size, n, cost);
+    }
+    return 0;
 }
 
 
-/* Compare a plaintext string against an encrypted password.  Return 1 if
- * they match, 0 if not, and -1 if something went wrong. */
+/* Compare a plaintext string against a password encrypted by an earlier
+ * version of Services. */
 
-int check_password(const char *plaintext, const char *password)
+static int check_old_password(const char *plaintext, const char *password)
 {
     char buf[BUFSIZE];
 
-    if (encrypt(plaintext, strlen(plaintext), buf, sizeof(buf)) < 0)
-	return -1;
 #ifdef ENCRYPT_MD5
+    {
+	MD5_CTX context;
+	MD5Init(&context);
+	MD5Update(&context, (unsigned char *)plaintext, strlen(plaintext));
+	MD5Final((unsigned char *)buf, &context);
+    }
     if (memcmp(buf, password, 16) == 0)
-#else
-    if (0)
-#endif
 	return 1;
 #ifdef BROKEN_MD5_COMPAT
     {
@@ -396,13 +1099,101 @@ int check_password(const char *plaintext, const char *password)
     if (memcmp(buf, password, 16) == 0)
 	return 1;
 #endif
+#endif /* ENCRYPT_MD5 */
     return 0;
 }
 
+
+/* Compare a plaintext string against an encrypted password.  Return 1 if
+ * they match, 0 if not, and -1 if something went wrong. */
+
+int check_password(const char *plaintext, const char *password)
+{
+    if (is_pbkdf2_password(password)) {
+	unsigned char key[PASS_KEYLEN];
+	pbkdf2_sha256(plaintext, strlen(plaintext),
+		      (const unsigned char *)password+4, PASS_SALTLEN,
+		      password[3], key, sizeof(key));
+	if (memcmp(key, password+4+PASS_SALTLEN, PASS_KEYLEN) == 0)
+	    return 1;
+	/* Might be an old-style password that happens to look like the
+	 * current format, so fall through. */
+    }
+    return check_old_password(plaintext, password);
+}
+
+
+/* check_password() for `count' pairs at once, storing each result in
+ * results[i].  Passwords in the current format with equal costs are
+ * checked PASS_LANES at a time; anything else is checked singly.
+ */
+void check_password_batch(const char **plaintext, const char **password,
+			  int *results, int count)
+{
+    const char *pass[PASS_LANES];
+    int passlen[PASS_LANES], index[PASS_LANES];
+    const unsigned char *salt[PASS_LANES];
+    unsigned char keys[PASS_LANES][PASS_KEYLEN];
+    unsigned char *key[PASS_LANES];
+    int i, j, lane, n, cost;
+
+    for (lane = 0; lane < PASS_LANES; lane++)
+	key[lane] = keys[lane];
+    for (i = 0; i < count; i++)
+	results[i] = -2;	/* Not yet checked */
+    for (i = 0; i < count; i++) {
+	if (results[i] != -2)
+	    continue;
+	if (!is_pbkdf2_password(password[i])) {
+	    results[i] = check_old_password(plaintext[i], password[i]);
+	    continue;
+	}
+	cost = password[i][3];
+	index[0] = i;
+	n = 1;
+	for (j = i+1; j < count && n < PASS_LANES; j++) {
+	    if (results[j] == -2 && is_pbkdf2_password(password[j])
+	     && password[j][3] == cost)
+		index[n++] = j;
+	}
+	if (n == 1) {
+	    results[i] = check_password(plaintext[i], password[i]);
+	    continue;
+	}
+	for (lane = 0; lane < PASS_LANES; lane++) {
+	    j = index[lane < n ? lane : 0];
+	    pass[lane] = plaintext[j];
+	    passlen[lane] = strlen(plaintext[j]);
+	    salt[lane] = (const unsigned char *)password[j]+4;
+	}
+	pbkdf2_sha256_lanes(pass, passlen, salt, PASS_SALTLEN, cost,
+			    key, PASS_KEYLEN);
+	for (lane = 0; lane < n; lane++) {
+	    j = index[lane];
+	    if (memcmp(keys[lane], password[j]+4+PASS_SALTLEN,
+		       PASS_KEYLEN) == 0)
+		results[j] = 1;
+	    else
+		results[j] = check_old_password(plaintext[j], password[j]);
+	}
+    }
+    memset(keys, 0, sizeof(keys));
+}
+
 /*************************************************************************/
 
 #else /* !USE_ENCRYPTION */
 
+int password_hash_init(void)
+{
+    return 0;
+}
+
+int password_needs_rehash(const char *password)
+{
+    return 0;
+}
+
 int encrypt(const char *src, int len, char *dest, int size)
 {
     if (size < len)
@@ -417,6 +1208,25 @@ int encrypt_in_place(char *buf, int size)
     return 0;
 }
 
+int encrypt_batch(const char **src, const int *len, char **dest, int size,
+		  int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+	if (size < len[i])
+	    return -1;
+    }
+    for (i = 0; i < count; i++)
+	encrypt(src[i], len[i], dest[i], size);
+    return 0;
+}
+
+int encrypt_in_place_batch(char **bufs, int count, int size)
+{
+    return 0;
+}
+
 int check_password(const char *plaintext, const char *password)
 {
     if (strcmp(plaintext, password) == 0)
@@ -425,6 +1235,350 @@ int check_password(const char *plaintext, const char *password)
 	return 0;
 }
 
+void check_password_batch(const char **plaintext, const char **password,
+			  int *results, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+	results[i] = check_password(plaintext[i], password[i]);
+}
+
 #endif /* USE_ENCRYPTION */
 
 /*************************************************************************/
+
+/******** Asynchronous encryption and password checking. ********/
+
+/* Encrypting or checking a password may take long enough (particularly
+ * when many users identify at once, as after a netsplit) that doing it in
+ * the main loop would hold up everything else.  With PasswordThreads set,
+ * such operations are handed to a pool of worker threads instead: each is
+ * recorded in a PassJob, which a worker takes off the job queue, performs,
+ * and moves to the done list, writing a byte to a pipe so that the main
+ * loop wakes up and calls run_password_callbacks().  The workers touch
+ * nothing but the PassJob itself, and callbacks are always called from the
+ * main loop.
+ *
+ * Without worker threads (or without encryption, where there is nothing
+ * to gain), the operation is performed and the callback called before
+ * encrypt_async() or check_password_async() returns.
+ */
+
+#define MAX_PASSWORD_THREADS	64
+
+typedef struct passjob_ PassJob;
+struct passjob_ {
+    PassJob *next;
+    int check;			/* Nonzero for check_password(), zero for
+				 *    encrypt() */
+    char src[BUFSIZE];		/* Plaintext password */
+    int len;
+    char buf[PASSMAX];		/* Encrypted password (checked against, or
+				 *    result of encryption) */
+    int size;
+    int result;
+    int rehashed;		/* check_password() only: nonzero if buf
+				 *    has been re-encrypted in the current
+				 *    format */
+    PasswordCallback callback;
+    void *data;
+};
+
+/*************************************************************************/
+
+static void run_job(PassJob *job)
+{
+    if (job->check) {
+	job->result = check_password(job->src, job->buf);
+	/* Upgrade old passwords while we have the plaintext. */
+	if (job->result == 1 && password_needs_rehash(job->buf)
+	 && encrypt(job->src, strlen(job->src), job->buf,
+		    sizeof(job->buf)) == 0
+	) {
+	    job->rehashed = 1;
+	}
+    } else {
+	job->result = encrypt(job->src, job->len, job->buf, job->size);
+    }
+    memset(job->src, 0, sizeof(job->src));
+}
+
+static void finish_job(PassJob *job)
+{
+    const char *buf = NULL;
+
+    if (!job->check || job->rehashed)
+	buf = job->buf;
+    job->callback(job->result, buf, job->data);
+    memset(job, 0, sizeof(*job));
+    free(job);
+}
+
+/*************************************************************************/
+
+#if defined(USE_ENCRYPTION) && HAVE_PTHREAD
+
+static int password_threads = 0;
+static int wakeup_pipe[2] = { -1, -1 };
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static PassJob *job_queue = NULL, **job_queue_tail = &job_queue;
+static PassJob *job_done = NULL, **job_done_tail = &job_done;
+
+
+/* Run `count' jobs taken off the queue together.  Checks are passed to
+ * check_password_batch(), and any old passwords among them re-encrypted
+ * with encrypt_batch(); encryptions are run singly. */
+
+static void run_jobs(PassJob **jobs, int count)
+{
+    const char *plaintext[PASS_LANES], *password[PASS_LANES];
+    char *rehash[PASS_LANES];
+    int results[PASS_LANES], len[PASS_LANES], index[PASS_LANES];
+    int i, n = 0;
+
+    if (count == 1 || !jobs[0]->check) {
+	for (i = 0; i < count; i++)
+	    run_job(jobs[i]);
+	return;
+    }
+    for (i = 0; i < count; i++) {
+	plaintext[i] = jobs[i]->src;
+	password[i] = jobs[i]->buf;
+    }
+    check_password_batch(plaintext, password, results, count);
+    for (i = 0; i < count; i++) {
+	jobs[i]->result = results[i];
+	if (results[i] == 1 && password_needs_rehash(jobs[i]->buf)) {
+	    /* Upgrade old passwords while we have the plaintext. */
+	    index[n] = i;
+	    plaintext[n] = jobs[i]->src;
+	    len[n] = strlen(jobs[i]->src);
+	    rehash[n++] = jobs[i]->buf;
+	}
+    }
+    if (n > 0 && encrypt_batch(plaintext, len, rehash, PASSMAX, n) == 0) {
+	for (i = 0; i < n; i++)
+	    jobs[index[i]]->rehashed = 1;
+    }
+    for (i = 0; i < count; i++)
+	memset(jobs[i]->src, 0, sizeof(jobs[i]->src));
+}
+
+
+static void *password_thread(void *arg)
+{
+    PassJob *jobs[PASS_LANES], **ptr;
+    int i, count;
+
+    pthread_mutex_lock(&job_lock);
+    for (;;) {
+	while (!job_queue)
+	    pthread_cond_wait(&job_cond, &job_lock);
+	jobs[0] = job_queue;
+	job_queue = job_queue->next;
+	count = 1;
+	ptr = &job_queue;
+	/* When checks are queued up (as after a netsplit), take as many as
+	 * can be hashed together. */
+	if (jobs[0]->check) {
+	    while (*ptr && count < PASS_LANES) {
+		if ((*ptr)->check) {
+		    jobs[count++] = *ptr;
+		    *ptr = (*ptr)->next;
+		} else {
+		    ptr = &(*ptr)->next;
+		}
+	    }
+	}
+	if (!*ptr)
+	    job_queue_tail = ptr;
+	pthread_mutex_unlock(&job_lock);
+	run_jobs(jobs, count);
+	pthread_mutex_lock(&job_lock);
+	/* Only the first finished job needs to wake the main loop. */
+	if (!job_done && write(wakeup_pipe[1], "", 1) < 0)
+	    ;	/* Pipe full, so the main loop will wake up anyway */
+	for (i = 0; i < count; i++) {
+	    jobs[i]->next = NULL;
+	    *job_done_tail = jobs[i];
+	    job_done_tail = &jobs[i]->next;
+	}
+    }
+    return NULL;
+}
+
+
+/* Start `count' password worker threads.  Must be called after forking
+ * into the background.  Returns the number of threads started. */
+
+int password_threads_init(int count)
+{
+    sigset_t allsigs, oldsigs;
+    pthread_t thread;
+    int i;
+
+    if (count <= 0 || password_threads)
+	return password_threads;
+    if (count > MAX_PASSWORD_THREADS)
+	count = MAX_PASSWORD_THREADS;
+    if (pipe(wakeup_pipe) < 0) {
+	log_perror("Unable to create pipe for password threads");
+	wakeup_pipe[0] = wakeup_pipe[1] = -1;
+	return 0;
+    }
+    for (i = 0; i < 2; i++) {
+	fcntl(wakeup_pipe[i], F_SETFL, O_NONBLOCK);
+	fcntl(wakeup_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    /* Signals are for the main loop; keep them away from the workers. */
+    sigfillset(&allsigs);
+    pthread_sigmask(SIG_BLOCK, &allsigs, &oldsigs);
+    for (i = 0; i < count; i++) {
+	if ((errno = pthread_create(&thread, NULL, password_thread, NULL))) {
+	    log_perror("Unable to start password thread");
+	    break;
+	}
+	pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+    password_threads = i;
+    if (!password_threads) {
+	close(wakeup_pipe[0]);
+	close(wakeup_pipe[1]);
+	wakeup_pipe[0] = wakeup_pipe[1] = -1;
+    }
+    return password_threads;
+}
+
+
+/* Return a descriptor which becomes readable when run_password_callbacks()
+ * has work to do, or -1 if there are no worker threads. */
+
+int password_wakeup_fd(void)
+{
+    return wakeup_pipe[0];
+}
+
+
+/* Call the callbacks for all completed operations. */
+
+void run_password_callbacks(void)
+{
+    PassJob *job, *next;
+    char buf[64];
+
+    if (!password_threads)
+	return;
+    while (read(wakeup_pipe[0], buf, sizeof(buf)) > 0)
+	;
+    pthread_mutex_lock(&job_lock);
+    job = job_done;
+    job_done = NULL;
+    job_done_tail = &job_done;
+    pthread_mutex_unlock(&job_lock);
+    for (; job; job = next) {
+	next = job->next;
+	finish_job(job);
+    }
+}
+
+
+static void submit_job(PassJob *job)
+{
+    if (!password_threads) {
+	run_job(job);
+	finish_job(job);
+	return;
+    }
+    job->next = NULL;
+    pthread_mutex_lock(&job_lock);
+    *job_queue_tail = job;
+    job_queue_tail = &job->next;
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+}
+
+/*************************************************************************/
+
+#else /* !(USE_ENCRYPTION && HAVE_PTHREAD) */
+
+int password_threads_init(int count)
+{
+    if (count > 0) {
+#ifdef USE_ENCRYPTION
+	log("PasswordThreads: threads not supported on this system, ignoring");
+#else
+	log("PasswordThreads: encryption not enabled, ignoring");
+#endif
+    }
+    return 0;
+}
+
+int password_wakeup_fd(void)
+{
+    return -1;
+}
+
+void run_password_callbacks(void)
+{
+}
+
+static void submit_job(PassJob *job)
+{
+    run_job(job);
+    finish_job(job);
+}
+
+#endif /* USE_ENCRYPTION && HAVE_PTHREAD */
+
+/*************************************************************************/
+
+/* Encrypt `src' of length `len' as encrypt() would, with a result buffer
+ * of `size' bytes (at most PASSMAX), and pass the result to `callback'.
+ */
+
+void encrypt_async(const char *src, int len, int size,
+		   PasswordCallback callback, void *data)
+{
+    PassJob *job = scalloc(sizeof(*job), 1);
+
+    if (len > sizeof(job->src))
+	len = sizeof(job->src);
+    if (size > sizeof(job->buf))
+	size = sizeof(job->buf);
+    memcpy(job->src, src, len);
+    job->len = len;
+    job->size = size;
+    job->check = 0;
+    job->callback = callback;
+    job->data = data;
+    submit_job(job);
+}
+
+
+/* Check `plaintext' against the encrypted password `password' (PASSMAX
+ * bytes) as check_password() would, and pass the result to `callback'.
+ * If the password matched but was stored in an old format (see
+ * password_needs_rehash()), the callback also receives the password
+ * re-encrypted in the current format, which the caller should store in
+ * place of the old one.
+ */
+
+void check_password_async(const char *plaintext, const char *password,
+			  PasswordCallback callback, void *data)
+{
+    PassJob *job = scalloc(sizeof(*job), 1);
+
+    strscpy(job->src, plaintext, sizeof(job->src));
+    memcpy(job->buf, password, sizeof(job->buf));
+    job->check = 1;
+    job->callback = callback;
+    job->data = data;
+    submit_job(job);
+}
+
+/*************************************************************************/
@@ -10,3 +10,26 @@
 extern int encrypt(const char *src, int len, char *dest, int size);
 extern int encrypt_in_place(char *buf, int size);
 extern int check_password(const char *plaintext, const char *password);
+extern int encrypt_batch(const char **src, const int *len, char **dest,
+			 int size, int count);
+extern int encrypt_in_place_batch(char **bufs, int count, int size);
+extern void check_password_batch(const char **plaintext,
+				 const char **password, int *results,
+				 int count);
+extern int password_hash_init(void);
+extern int password_needs_rehash(const char *password);
+
+/* Function called when an encrypt_async() or check_password_async()
+ * operation completes.  `result' is what encrypt() or check_password()
+ * returned; `buf' is the encrypted data for encrypt_async(), and for
+ * check_password_async() is either NULL or the password re-encrypted in
+ * the current format. */
+typedef void (*PasswordCallback)(int result, const char *buf, void *data);
+
+extern void encrypt_async(const char *src, int len, int size,
+			  PasswordCallback callback, void *data);
+extern void check_password_async(const char *plaintext, const char *password,
+				 PasswordCallback callback, void *data);
+extern int password_threads_init(int count);
+extern int password_wakeup_fd(void);
+extern void run_password_callbacks(void);
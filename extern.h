@@ -115,6 +115,8 @@ E void chanserv(const char *source, char *buf);
 E ChannelInfo *cs_findchan(const char *chan);
 E ChannelInfo *cs_firstchan(void);
 E ChannelInfo *cs_nextchan(void);
+E ChannelInfo *cs_firstchan_sorted(void);
+E ChannelInfo *cs_nextchan_sorted(void);
 E void get_chanserv_stats(long *nrec, long *memuse);
 
 E void check_modes(const char *chan);
@@ -127,6 +129,8 @@ E int check_topiclock(const char *chan);
 E void expire_chans(void);
 E void cs_remove_nick(const NickInfo *ni);
 E int check_access(User *user, ChannelInfo *ci, int what);
+E uint32 cs_access_gen;
+E void cs_links_changed(void);
 E int check_channel_limit(NickInfo *ni);
 E char *chanopts_to_string(ChannelInfo *ci, NickInfo *ni);
 
@@ -221,6 +225,7 @@ E char *NakillDBName;
 E char *FloodServDBName;
 E char *GrNameDBName;
 E char *NewsDBName;
+E char *MemoTextDBName;
 
 E int   NoBackupOkay;
 E int   NoBouncyModes;
@@ -231,12 +236,19 @@ E int   BadPassTimeout;
 E int   BadPassWarning;
 E int   BadPassSuspend;
 E int   UpdateTimeout;
+E int   BackgroundSave;
+E int   JournalFlush;
+E int   JournalCompact;
+E char *CompressDatabases;
 E int   ExpireTimeout;
 E int   ReadTimeout;
 E int   WarningTimeout;
 E int   TimeoutCheck;
 E int   PingFrequency;
 E int   MergeChannelModes;
+E int   PasswordThreads;
+E int   PasswordCost;
+E int   PasswordTime;
 
 E int   NSForceNickChange;
 E char *NSGuestNickPrefix;
@@ -249,6 +261,8 @@ E int   NSAccessMax;
 E char *NSEnforcerUser;
 E char *NSEnforcerHost;
 E int   NSReleaseTimeout;
+E int   NSBurstDelay;
+E int   NSBurstBatch;
 E int   NSAllowKillImmed;
 E int   NSMaxLinkDepth;
 E int   NSListOpersOnly;
@@ -323,6 +337,9 @@ E int   FloodServTFNLWarned;
 E int   FloodServTFSecWarned;
 E int   FloodServWarnFirst;
 E char *FloodServWarnMsg;
+E int   FloodServSimilarity;
+E int   FloodServNetLines;
+E int   FloodServNetSec;
 
 E char *GrNameAkillReason;
 
@@ -331,8 +348,12 @@ E int read_config(void);
 
 /**** cs-loadsave.c ****/
 
+E void read_cs_dbase(void);
 E void load_cs_dbase(void);
 E void save_cs_dbase(void);
+E void cs_journal_mark(ChannelInfo *ci);
+E void cs_journal_flush(void);
+E void cs_journal_rotate(void);
 
 
 /**** helpserv.c ****/
@@ -349,12 +370,27 @@ E int init(int ac, char **av);
 /**** language.c ****/
 
 E char **langtexts[NUM_LANGS];
+E const unsigned char **langrender[NUM_LANGS];
 E char *langnames[NUM_LANGS];
 E int langlist[NUM_LANGS];
 
 E void lang_init(void);
+E void lang_use(int language);
+E void get_language_stats(long *nrec, long *memuse, long *shared,
+			  long *init_ms, long *load_ms);
 #define getstring(ni,index) \
 	(langtexts[((ni)?((NickInfo*)ni)->language:DEF_LANGUAGE)][(index)])
+#define getrender(ni,index) \
+	(langrender[((ni)?((NickInfo*)ni)->language:DEF_LANGUAGE)][(index)])
+
+/* Compiled language file format; these must match lang/langcomp.c. */
+#define LANG_MAGIC	0x53764C6E	/* "SvLn" */
+#define LANG_RF_FORMAT	0x0001	/* String has printf() conversions */
+#define LANG_RF_SOURCE	0x0002	/* String contains %S */
+#define LANG_PIECE_SOURCE 0x8000 /* Piece is followed by %S */
+#define LANG_PIECE_EOL	0x4000	/* Piece ends a line */
+#define LANG_PIECE_LEN	0x3FFF	/* Mask for piece length */
+#define LANG_GET16(s)	((s)[0]<<8 | (s)[1])
 E int strftime_lang(char *buf, int size, User *u, int format, struct tm *tm);
 E void expires_in_lang(char *buf, int size, NickInfo *ni, time_t seconds);
 E void syntax_error(const char *service, User *u, const char *command,
@@ -413,9 +449,21 @@ E void ms_init(void);
 E void memoserv(const char *source, char *buf);
 E void get_memoserv_stats(long *nrec, long *memuse);
 E void load_old_ms_dbase(void);
+E int find_memo(const MemoInfo *mi, uint32 num);
+E void memos_loaded(MemoInfo *mi, const char *owner);
 E void check_memos(User *u);
 
 
+/**** memostore.c ****/
+
+E void open_memo_store(void);
+E const char *memo_text(const Memo *m);
+E void store_memo_text(const char *owner, Memo *m);
+E void memo_store_check(const char *owner, MemoInfo *mi);
+E void memo_store_loaded(void);
+E void memo_store_sync(void);
+
+
 /**** misc.c ****/
 
 E unsigned char irc_toupper(char c);
@@ -471,11 +519,17 @@ E NickInfo *findnick(const char *nick);
 E NickInfo *getlink(NickInfo *ni);
 E NickInfo *firstnick(void);
 E NickInfo *nextnick(void);
+E NickInfo *firstnick_sorted(void);
+E NickInfo *nextnick_sorted(void);
 E void get_nickserv_stats(long *nrec, long *memuse);
 
 E void load_ns_dbase(void);
 E void save_ns_dbase(void);
+E void ns_journal_mark(NickInfo *ni);
+E void ns_journal_flush(void);
+E void ns_journal_rotate(void);
 E int check_on_access(User *u);
+E int split_recovered(User *u);
 E int validate_user(User *u);
 E void cancel_user(User *u);
 E int nick_identified(User *u);
@@ -572,11 +626,15 @@ E int32 total_read, total_written;
 E int32 read_buffer_len(void);
 E int32 write_buffer_len(void);
 
+E void set_read_wakeup(int fd);
+E void set_read_limit(int ms);
+E void set_write_hold(int hold);
 E int sgetc(int s);
 E char *sgets(char *buf, int len, int s);
 E char *sgets2(char *buf, int len, int s);
 E int sread(int s, char *buf, int len);
 E int sputs(char *str, int s);
+E int swrite(int s, const char *buf, int len);
 E int sockprintf(int s, char *fmt,...);
 E int conn(const char *host, int port, const char *lhost, int lport);
 E void disconn(int s);
@@ -611,6 +669,10 @@ E void get_user_stats(long *nusers, long *memuse);
 E User *finduser(const char *nick);
 E User *firstuser(void);
 E User *nextuser(void);
+E PassRequest *new_pass_request(User *user, const char *name,
+				const char *pass);
+E void free_pass_request(PassRequest *req);
+E int burst_users_waiting(void);
 
 E int do_nick(const char *source, int ac, char **av);
 E void do_join(const char *source, int ac, char **av);
@@ -630,6 +692,9 @@ E int is_chanop(const char *nick, const char *chan);
 E int is_voiced(const char *nick, const char *chan);
 
 E int match_usermask(const char *mask, User *user);
+E void parse_usermask(const char *mask, UserMask *um);
+E void free_usermask(UserMask *um);
+E int match_parsed_usermask(const UserMask *um, User *user);
 E void split_usermask(const char *mask, char **nick, char **user, char **host);
 E char *create_mask(User *u, int use_fakehost);
 
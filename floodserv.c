@@ -19,10 +19,15 @@
 /* Local Functions declarations                                   */
 /******************************************************************/
 void fs_add_akill(time_t expires, TxtFloods *pnt);
-void add_floodtxt(User *u, char *buf, int id);
+static void fs_akill_host(const char *host, time_t expires);
+static int fs_net_flood(User *u, const char *text, const uint32 *fp, int len);
+static void fs_net_decay(time_t now);
+void add_floodtxt(User *u, char *buf, const uint32 *fp, int len, int id);
 void add_floodtxt_user(User *u, TxtFloods *pnt);
 void expire_floodtxt();
 char *strstrip(char *d, const char *s);
+int fs_fingerprint(const char *s, uint32 *fp);
+static TxtFloods *fs_find_similar(TxtFloods *txt, const uint32 *fp, int len);
 void do_chan(User *u);
 static void do_help(User *u);
 void do_grname(User *u);
@@ -48,6 +53,20 @@ static int32	ngrname = 0;
 static int32	grname_size	= 0;
 static struct	grname *grnames = NULL;
 
+/* Network-wide sketch and sighting log (see floodserv.h) */
+static uint16	netsketch[FS_CMS_DEPTH][1<<FS_CMS_BITS];
+static time_t	netsketch_decay = 0;
+static struct	netsighting_ netlog[FS_NETLOG];
+static int32	netlog_pos = 0;
+
+/* Seeds of the FS_MINHASH hash functions used by fs_fingerprint() */
+static const uint32 fs_seeds[FS_MINHASH] = {
+	0x2545F491, 0x9E3779B9, 0x7F4A7C15, 0xF39CC060,
+	0x5851F42D, 0x4C957F2D, 0xD1B54A32, 0xA0761D64,
+	0xE7037ED1, 0x8EBC6AF0, 0x589965CC, 0x1D8E4E27,
+	0xC2B2AE3D, 0x27D4EB2F, 0x165667B1, 0x85EBCA6B
+};
+
 /******************************************************************/
 /* Cmd Struct Declaration                                         */
 /******************************************************************/
@@ -71,10 +90,11 @@ void privmsg_flood(const char *source, int ac, char **av)
 	char *text;
 	//char buf[BUFSIZE];
 	char text_d[BUFSIZE];
+	uint32 fp[FS_MINHASH];
 	TxtFloods *txt, *next;
 	time_t now = time(NULL);
 	time_t expires = FloodServAkillExpiry;
-	int i = 0;
+	int i = 0, len;
 
 	User *u = finduser(source);
 	if (!u) return;
@@ -84,46 +104,56 @@ void privmsg_flood(const char *source, int ac, char **av)
 
 	text = av[1];
 	strstrip(text_d, text);
+	len = fs_fingerprint(text_d, fp);
 
 	//if (!Expire_Timeout)
 	//	Expire_Timeout = add_timeout((FloodServTFSecWarned + 2), expire_floodtxt_timeout, 0);
 	expire_floodtxt();
 
+	/* same line all over the network ? */
+	if (FloodServNetLines > 0 && fs_net_flood(u, text, fp, len))
+		return;
+
 	/* first check - does we monitor that channel ? - because oper can raw command a bot to join a channel. */
 	for (i = 0; i < nchan; i++) {
 		if(irc_stricmp(av[0],chanprotected[i].channame)==0) {
 			txt = chanprotected[i].TxtFlood;
 			while (txt) {
 				next = txt->next;
-				if(stricmp(text_d, txt->txtbuffer)==0) {
-					add_floodtxt_user(u, txt);
-					txt->repeat +=	1;
-					if (txt->repeat >= FloodServTFNumLines) {
-						 /* he repeated more than the limit, but we need to check the delay,
-						    thrusting expire_floodtxt is not safe - jabea */
-						expires += now;
-						//snprintf(buf, sizeof(buf), "*@%s", u->host);
-						if (now <= (txt->time + FloodServTFSec)) {
-							if ((FloodServWarnFirst) && (!txt->warned)) {
-								txt->warned = 1;
-								wallops(s_FloodServ, "(FloodServ) Flood Detected: (Text: [%45s]) (In: [\2%s\2]) (Last Said by: [\2%s\2] (%s@%s)) has been said %d times in less than %d seconds", 
-									text, av[0], u->nick, u->username, u->host, txt->repeat, FloodServTFSec);
-								kill_user(s_FloodServ, source, FloodServWarnMsg);
-							} 
-							else {
-								fs_add_akill(expires, txt);
-							}
-						} else if ((now <= (txt->time + FloodServTFSecWarned)) && (txt->warned) && (txt->repeat >= FloodServTFNLWarned)) {
+				if(stricmp(text_d, txt->txtbuffer)==0)
+					break;
+				txt = next;
+			}
+			/* not said before, but maybe close enough to a recent line */
+			if (!txt && FloodServSimilarity > 0)
+				txt = fs_find_similar(chanprotected[i].TxtFlood, fp, len);
+			if (txt) {
+				add_floodtxt_user(u, txt);
+				txt->repeat +=	1;
+				if (txt->repeat >= FloodServTFNumLines) {
+					 /* he repeated more than the limit, but we need to check the delay,
+					    thrusting expire_floodtxt is not safe - jabea */
+					expires += now;
+					//snprintf(buf, sizeof(buf), "*@%s", u->host);
+					if (now <= (txt->time + FloodServTFSec)) {
+						if ((FloodServWarnFirst) && (!txt->warned)) {
+							txt->warned = 1;
+							wallops(s_FloodServ, "(FloodServ) Flood Detected: (Text: [%45s]) (In: [\2%s\2]) (Last Said by: [\2%s\2] (%s@%s)) has been said %d times in less than %d seconds", 
+								text, av[0], u->nick, u->username, u->host, txt->repeat, FloodServTFSec);
+							kill_user(s_FloodServ, source, FloodServWarnMsg);
+						} 
+						else {
 							fs_add_akill(expires, txt);
 						}
-						
+					} else if ((now <= (txt->time + FloodServTFSecWarned)) && (txt->warned) && (txt->repeat >= FloodServTFNLWarned)) {
+						fs_add_akill(expires, txt);
 					}
-					/* .... */
-					return;
+					
 				}
-				txt = next;
+				/* .... */
+				return;
 			}
-			add_floodtxt(u, text_d, i);
+			add_floodtxt(u, text_d, fp, len, i);
 			return;
 		}
 	}
@@ -141,50 +171,158 @@ void privmsg_flood(const char *source, int ac, char **av)
 /*******************************************************************/
 void fs_add_akill(time_t expires, TxtFloods *pnt) 
 {
-	User *u, *unext;
-	char buf[BUFSIZE];
-	char timebuf[128];
 	Flooders  *fpnt, *next;
 	
 	for (fpnt = pnt->flooder; fpnt; fpnt = next) {
 			next = fpnt->next;
 			if (!fpnt->akilled) {
-				if (!is_akilled(fpnt->host)) {
-					snprintf(buf, sizeof(buf), "*@%s", fpnt->host);
-					add_akill(buf, FloodServAkillReason, s_FloodServ, expires);
-					/* if ImmediatelySendAkill is off, that give us heachache there...
-					   lets kill that poor guy & his bots with a homemade autokill, 
-					   and hope he sign again to make the autokill *finally* active
-					   argthh -jabea */
-					if (!ImmediatelySendAkill) {
-						/* here, we will try to find user matching that mask....  */
-						/* if there is a better way to do that, let me know -jabea */
-						u = firstuser();
-						while (u)
-						{
-							unext = nextuser();
-							if (stricmp(u->host, fpnt->host)==0) {
-								kill_user(s_FloodServ, u->nick, FloodServAkillReason);
-							}
-							u = unext;
-						}
-						/* end of search */
-					}
-					if (WallOSAkill) {
-						expires_in_lang(timebuf, sizeof(timebuf), NULL, expires);
-						wallops(s_OperServ, "FloodServ added an AKILL for \2%s\2 (%s)", buf, timebuf);
-					}
-				}
+				fs_akill_host(fpnt->host, expires);
 				fpnt->akilled = 1;
 			}
 		}
 }
 
 
+/*******************************************************************/
+/* fs_akill_host : akill one flooding host                         */
+/*******************************************************************/
+static void fs_akill_host(const char *host, time_t expires)
+{
+	User *u, *unext;
+	char buf[BUFSIZE];
+	char timebuf[128];
+
+	if (is_akilled(host))
+		return;
+	snprintf(buf, sizeof(buf), "*@%s", host);
+	add_akill(buf, FloodServAkillReason, s_FloodServ, expires);
+	/* if ImmediatelySendAkill is off, that give us heachache there...
+	   lets kill that poor guy & his bots with a homemade autokill, 
+	   and hope he sign again to make the autokill *finally* active
+	   argthh -jabea */
+	if (!ImmediatelySendAkill) {
+		/* here, we will try to find user matching that mask....  */
+		/* if there is a better way to do that, let me know -jabea */
+		u = firstuser();
+		while (u)
+		{
+			unext = nextuser();
+			if (stricmp(u->host, host)==0) {
+				kill_user(s_FloodServ, u->nick, FloodServAkillReason);
+			}
+			u = unext;
+		}
+		/* end of search */
+	}
+	if (WallOSAkill) {
+		expires_in_lang(timebuf, sizeof(timebuf), NULL, expires);
+		wallops(s_OperServ, "FloodServ added an AKILL for \2%s\2 (%s)", buf, timebuf);
+	}
+}
+
+
+/*******************************************************************/
+/* fs_net_flood : count a line network-wide, akill the hosts that  */
+/*                said it if it crossed FloodServNetLines          */
+/*******************************************************************/
+static int fs_net_flood(User *u, const char *text, const uint32 *fp, int len)
+{
+	NetSighting *ns;
+	uint32 band[FS_BANDS], h;
+	time_t now = time(NULL);
+	int b, k, r, est, count, nhosts, hit = -1;
+
+	if (len < FS_SIMMINLEN)
+		return 0;
+	fs_net_decay(now);
+
+	count = 0;
+	for (b = 0; b < FS_BANDS; b++) {
+		/* fold this band of the fingerprint in one key */
+		h = 0;
+		for (k = b * (FS_MINHASH/FS_BANDS); k < (b+1) * (FS_MINHASH/FS_BANDS); k++)
+			h = (h ^ fp[k]) * 0x01000193;
+		band[b] = h;
+		est = 65535;
+		for (r = 0; r < FS_CMS_DEPTH; r++) {
+			uint16 *c = &netsketch[r][((h ^ fs_seeds[r]) * 0x9E3779B1) >> (32 - FS_CMS_BITS)];
+			if (*c < 65535)
+				(*c)++;
+			if (*c < est)
+				est = *c;
+		}
+		if (est > count) {
+			count = est;
+			hit = b;
+		}
+	}
+
+	ns = &netlog[netlog_pos];
+	netlog_pos = (netlog_pos + 1) % FS_NETLOG;
+	memcpy(ns->band, band, sizeof(ns->band));
+	strscpy(ns->nick, u->nick, NICKMAX);
+	strscpy(ns->host, u->host, FS_HOSTMAX);
+	ns->time = now;
+	ns->akilled = 0;
+
+	if (count < FloodServNetLines)
+		return 0;
+
+	/* roll the recent sightings of that line up by host */
+	nhosts = 0;
+	for (k = 0; k < FS_NETLOG; k++) {
+		ns = &netlog[k];
+		if (ns->akilled || !ns->time || ns->time + FloodServNetSec < now
+		 || ns->band[hit] != band[hit])
+			continue;
+		fs_akill_host(ns->host, now + FloodServAkillExpiry);
+		nhosts++;
+		for (r = k; r < FS_NETLOG; r++) {
+			if (stricmp(netlog[r].host, ns->host) == 0)
+				netlog[r].akilled = 1;
+		}
+	}
+	/* nothing new to akill: let the channel checks handle the line */
+	if (!nhosts)
+		return 0;
+	wallops(s_FloodServ, "(FloodServ) Network Flood Detected: (Text: [%45s]) (Last Said by: [\2%s\2] (%s@%s)) has been said about %d times in less than %d seconds from %d new host(s)",
+		text, u->nick, u->username, u->host, count, FloodServNetSec, nhosts);
+	return 1;
+}
+
+
+/*******************************************************************/
+/* fs_net_decay : halve the network-wide counters every            */
+/*                FloodServNetSec/2 seconds                        */
+/*******************************************************************/
+static void fs_net_decay(time_t now)
+{
+	int32 period = FloodServNetSec / 2;
+	int shift, r, i;
+
+	if (period < 1)
+		period = 1;
+	if (!netsketch_decay)
+		netsketch_decay = now;
+	if (now < netsketch_decay + period)
+		return;
+	shift = (now - netsketch_decay) / period;
+	netsketch_decay += (time_t)shift * period;
+	if (shift >= 16) {
+		memset(netsketch, 0, sizeof(netsketch));
+		return;
+	}
+	for (r = 0; r < FS_CMS_DEPTH; r++) {
+		for (i = 0; i < (1<<FS_CMS_BITS); i++)
+			netsketch[r][i] >>= shift;
+	}
+}
+
+
 /*******************************************************************/
 /* add_floodtxt : link a msg from a channel to a channel struct    */
 /*******************************************************************/
-void add_floodtxt(User *u, char *buf, int id)
+void add_floodtxt(User *u, char *buf, const uint32 *fp, int len, int id)
 {
 	TxtFloods *txt  = NULL;
 	TxtFloods *pnt  = NULL;
@@ -195,6 +333,8 @@ void add_floodtxt(User *u, char *buf, int id)
 	txt->repeat = 1;
 	txt->warned = 0;
 	txt->txtbuffer = sstrdup(buf);
+	memcpy(txt->fingerprint, fp, sizeof(txt->fingerprint));
+	txt->len = len;
 	txt->time = time(NULL);
 	txt->flooder = NULL;
 
@@ -346,6 +486,63 @@ char *strstrip(char *d, const char *s)
 }
 
 
+/*******************************************************************/
+/* fs_fingerprint : MinHash of the shingles of a stripped line,    */
+/*                  one pass, returns the length of the line       */
+/*******************************************************************/
+int fs_fingerprint(const char *s, uint32 *fp)
+{
+	uint32 shingle = 0, h;
+	int len = 0, k;
+
+	for (k = 0; k < FS_MINHASH; k++)
+		fp[k] = 0xFFFFFFFF;
+	while (*s) {
+		/* the last FS_SHINGLE characters, case folded */
+		shingle = (shingle << 8) | (unsigned char)tolower(*s);
+		s++;
+		len++;
+		if (len < FS_SHINGLE && *s)
+			continue;
+		for (k = 0; k < FS_MINHASH; k++) {
+			h = (shingle ^ fs_seeds[k]) * 0x9E3779B1;
+			h ^= h >> 16;
+			h *= 0x85EBCA6B;
+			h ^= h >> 13;
+			if (h < fp[k])
+				fp[k] = h;
+		}
+	}
+	return len;
+}
+
+
+/*******************************************************************/
+/* fs_find_similar : look for a near-duplicate of a line in the    */
+/*                   FS_SIMWINDOW most recent lines of a channel   */
+/*******************************************************************/
+static TxtFloods *fs_find_similar(TxtFloods *txt, const uint32 *fp, int len)
+{
+	int n, k, same, need;
+
+	if (len < FS_SIMMINLEN)
+		return NULL;
+	need = (FS_MINHASH * FloodServSimilarity + 99) / 100;
+	for (n = 0; txt && n < FS_SIMWINDOW; txt = txt->next, n++) {
+		if (txt->len < FS_SIMMINLEN)
+			continue;
+		same = 0;
+		for (k = 0; k < FS_MINHASH; k++) {
+			if (fp[k] == txt->fingerprint[k])
+				same++;
+		}
+		if (same >= need)
+			return txt;
+	}
+	return NULL;
+}
+
+
 /*******************************************************************/
 /* Main routine                                                    */
 /*******************************************************************/
@@ -603,6 +800,42 @@ void do_set(User *u) {
 		}
 		FloodServTFSecWarned = value;
 		send_cmd(s_FloodServ, "NOTICE %s :TXTFLOODWARN \2%s\2 succesfully set!", u->nick, s_value);
+	} else if (stricmp(cmd, "SIMILARITY") == 0) {
+		if (!s_value) {
+			send_cmd(s_FloodServ, "NOTICE %s :SET \2SIMILARITY\2 [0-100]", u->nick);
+			return;
+		}
+		value = atoi(s_value);
+		if (value<0 || value>100) {
+			send_cmd(s_FloodServ, "NOTICE %s :SET \2SIMILARITY\2 [0-100]", u->nick);
+			return;
+		}
+		FloodServSimilarity = value;
+		send_cmd(s_FloodServ, "NOTICE %s :SIMILARITY \2%s\2 succesfully set!", u->nick, s_value);
+	} else if (stricmp(cmd, "NETLINES") == 0) {
+		if (!s_value) {
+			send_cmd(s_FloodServ, "NOTICE %s :SET \2NETLINES\2 [number >=0]", u->nick);
+			return;
+		}
+		value = atoi(s_value);
+		if (value<0) {
+			send_cmd(s_FloodServ, "NOTICE %s :SET \2NETLINES\2 [number >=0]", u->nick);
+			return;
+		}
+		FloodServNetLines = value;
+		send_cmd(s_FloodServ, "NOTICE %s :NETLINES \2%s\2 succesfully set!", u->nick, s_value);
+	} else if (stricmp(cmd, "NETSEC") == 0) {
+		if (!s_value) {
+			send_cmd(s_FloodServ, "NOTICE %s :SET \2NETSEC\2 [number >0]", u->nick);
+			return;
+		}
+		value = atoi(s_value);
+		if (value<=0) {
+			send_cmd(s_FloodServ, "NOTICE %s :SET \2NETSEC\2 [number >0]", u->nick);
+			return;
+		}
+		FloodServNetSec = value;
+		send_cmd(s_FloodServ, "NOTICE %s :NETSEC \2%s\2 succesfully set!", u->nick, s_value);
 	} else if (stricmp(cmd, "VIEW") == 0) {
 		send_cmd(s_FloodServ, "NOTICE %s :Current setting for \2%s\2", u->nick, s_FloodServ);
 		if (FloodServWarnFirst == 0)
@@ -616,6 +849,15 @@ void do_set(User *u) {
 		send_cmd(s_FloodServ, "NOTICE %s :TXTFLOODWARN - Number of seconds(warned): \2%d\2", u->nick, FloodServTFSecWarned);
 		send_cmd(s_FloodServ, "NOTICE %s :[%d:%d lines/seconds, the real value is currently %d:%d]", u->nick, 
 			FloodServTFNLWarned, FloodServTFSecWarned, FloodServTFNLWarned - FloodServTFNumLines, FloodServTFSecWarned - FloodServTFSec);
+		if (FloodServSimilarity == 0)
+			send_cmd(s_FloodServ, "NOTICE %s :SIMILARITY   - Near-duplicate detection \2OFF\2", u->nick);
+		else
+			send_cmd(s_FloodServ, "NOTICE %s :SIMILARITY   - Near-duplicate threshold: \2%d%%\2", u->nick, FloodServSimilarity);
+		if (FloodServNetLines == 0)
+			send_cmd(s_FloodServ, "NOTICE %s :NETLINES     - Network-wide detection \2OFF\2", u->nick);
+		else
+			send_cmd(s_FloodServ, "NOTICE %s :NETLINES     - Number of lines(network): \2%d\2", u->nick, FloodServNetLines);
+		send_cmd(s_FloodServ, "NOTICE %s :NETSEC       - Number of seconds(network): \2%d\2", u->nick, FloodServNetSec);
 		send_cmd(s_FloodServ, "NOTICE %s :End of setting list (use SET to change them).", u->nick);
 	} else {
 		send_cmd(s_FloodServ, "NOTICE %s :SET {OPTION | VIEW } [value].", u->nick);
@@ -947,6 +1189,7 @@ void load_fs_dbase(void)
     chanprotected = scalloc(sizeof(*chanprotected), chan_size);
 
     switch (ver) {
+      case 12:
       case 11:
 	for (i = 0; i < nchan; i++) {
 	    SAFE(read_string(&chanprotected[i].channame, f));
@@ -987,6 +1230,7 @@ void load_grname_dbase(void)
     grnames = scalloc(sizeof(*grnames), grname_size);
 
     switch (ver) {
+      case 12:
       case 11:
 	for (i = 0; i < ngrname; i++) {
 	    SAFE(read_string(&grnames[i].mask, f));
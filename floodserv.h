@@ -19,6 +19,41 @@
 #define TXTFLOOD_WARN  20		Numeric value representating the second(s)
 */
 
+/* Near-duplicate detection.  Each line gets a MinHash fingerprint of its
+ * FS_SHINGLE-character shingles, computed once when the line is seen; two
+ * lines are considered the same flood text when at least
+ * FloodServSimilarity percent of the FS_MINHASH slots agree.  Only the
+ * FS_SIMWINDOW most recent lines of a channel are compared that way, and
+ * lines shorter than FS_SIMMINLEN are only matched exactly.
+ */
+#define FS_MINHASH	16
+#define FS_SHINGLE	4
+#define FS_SIMWINDOW	32
+#define FS_SIMMINLEN	16
+
+/* Network-wide correlation.  Every line of FS_SIMMINLEN characters or more
+ * is counted in a count-min sketch (FS_CMS_DEPTH rows of 1<<FS_CMS_BITS
+ * counters) under FS_BANDS keys, one per band of its fingerprint, so that
+ * near-duplicates share at least one key.  The sketch is halved every
+ * FloodServNetSec/2 seconds.  The last FS_NETLOG sightings remember who
+ * said what, so the hosts behind a line crossing FloodServNetLines can be
+ * akilled.  Memory use is fixed whatever the flood looks like.
+ */
+#define FS_BANDS	4
+#define FS_CMS_DEPTH	4
+#define FS_CMS_BITS	12
+#define FS_NETLOG	512
+#define FS_HOSTMAX	64
+
+typedef struct netsighting_ NetSighting;
+struct netsighting_ {
+		uint32 band[FS_BANDS];		/* LSH keys of the line */
+		char nick[NICKMAX];			/* Who said it */
+		char host[FS_HOSTMAX];		/* From what host */
+		time_t time;				/* When */
+		int akilled;				/* AKILLED? */
+};
+
 typedef struct chanprotected_ ChanProtected;
 typedef struct txtflood_ TxtFloods;
 typedef struct flooder_ Flooders;
@@ -34,6 +69,8 @@ struct txtflood_ {
 		TxtFloods *next, *prev;
 		Flooders *flooder;			/* Who triggered it [key of the struct] */
 		char *txtbuffer;			/* TEXT / CTCP */
+		uint32 fingerprint[FS_MINHASH];	/* MinHash of txtbuffer */
+		int len;					/* strlen(txtbuffer) */
 		time_t time;				/* When the txt was last said */
 		int repeat;					/* How many time */
 		int warned;					/* WARNED? */
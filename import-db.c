@@ -7,6 +7,8 @@
  * details.
  */
 
+/* This program has its own smalloc() (below) instead of memory.c */
+#define NO_MEMREDEF
 #include "services.h"
 #include "datafiles.h"
 
@@ -52,6 +54,9 @@ time_t maxusertime;
 char supass[PASSMAX];
 int no_supass = 1;
 
+/* Amount of data read and written, for progress reports */
+long bytes_read = 0, bytes_written = 0;
+
 int32 char_modes[256] = {
     ['i'] = CMODE_i,
     ['m'] = CMODE_m,
@@ -110,6 +115,11 @@ dbFILE *open_db_ver(const char *dir, const char *name, int32 min_version,
 	perror("reading");
 	exit(1);
     }
+    {
+	struct stat st;
+	if (stat(filename, &st) == 0)
+	    bytes_read += st.st_size;
+    }
     if (read_int32(&ver, f) < 0) {
 	fprintf(stderr, "Error reading version number on %s\n", filename);
 	exit(1);
@@ -173,14 +183,84 @@ void make_backup(const char *name)
 
 /*************************************************************************/
 
+/* Index of nicknames by full name, since the loaders look up the nick
+ * for every channel founder, access list entry and memo.  The index is
+ * built from the nick lists on the first call to findnick() and then kept
+ * up to date by addnick(), so nicks added after that point must be added
+ * with addnick().  Nicks removed from the lists directly stay in the index
+ * but are ignored by findnick(). */
+
+static NickInfo **nick_index = NULL;
+static uint32 nick_index_size = 0;	/* Always a power of 2 */
+static uint32 nick_index_count = 0;
+
+static uint32 hash_nickname(const char *nick)
+{
+    uint32 hash = 0;
+
+    while (*nick)
+	hash = hash*31 + tolower((unsigned char)*nick++);
+    return hash;
+}
+
+static void index_nick(NickInfo *ni)
+{
+    uint32 i = hash_nickname(ni->nick) & (nick_index_size-1);
+
+    while (nick_index[i])
+	i = (i+1) & (nick_index_size-1);
+    nick_index[i] = ni;
+    nick_index_count++;
+}
+
+/* (Re)build the nick index from the nick lists. */
+
+static void build_nick_index(void)
+{
+    NickInfo *ni;
+    uint32 count = 0;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next)
+	    count++;
+    }
+    free(nick_index);
+    nick_index_size = 1024;
+    while (nick_index_size < count*2)
+	nick_index_size *= 2;
+    nick_index = smalloc(nick_index_size * sizeof(*nick_index));
+    nick_index_count = 0;
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next)
+	    index_nick(ni);
+    }
+}
+
+/* Is the nick still in its list? */
+
+static int nick_in_list(NickInfo *ni)
+{
+    if (ni->prev)
+	return ni->prev->next == ni;
+    else
+	return nicklists[irc_tolower(*ni->nick)] == ni;
+}
+
+/*************************************************************************/
+
 /* Find a nickname or channel. */
 
 NickInfo *findnick(const char *nick)
 {
     NickInfo *ni;
+    uint32 i;
 
-    for (ni = nicklists[irc_tolower(*nick)]; ni; ni = ni->next) {
-	if (stricmp(ni->nick, nick) == 0)
+    if (!nick_index)
+	build_nick_index();
+    i = hash_nickname(nick) & (nick_index_size-1);
+    for (; (ni = nick_index[i]) != NULL; i = (i+1) & (nick_index_size-1)) {
+	if (stricmp(ni->nick, nick) == 0 && nick_in_list(ni))
 	    return ni;
     }
     return NULL;
@@ -206,10 +286,17 @@ void addnick(NickInfo *ni)
 {
     int hash = irc_tolower(*ni->nick);
 
+    ni->prev = NULL;
     ni->next = nicklists[hash];
     if (ni->next)
 	ni->next->prev = ni;
     nicklists[hash] = ni;
+    if (nick_index) {
+	if (nick_index_count >= nick_index_size/2)
+	    build_nick_index();  /* Includes the new nick */
+	else
+	    index_nick(ni);
+    }
 }
 
 
@@ -415,15 +502,13 @@ static void m14_load_nick(const char *sourcedir, int32 version)
 	}
     }
     close_db(f);
-    /* Resolve links */
+    /* Resolve links; the nicks above went straight into the lists, so
+     * index them first */
+    build_nick_index();
     for (i = 33; i < 256; i++) {
 	for (ni = nicklists[i]; ni; ni = ni->next) {
 	    if (ni->link) {
-		int c = (unsigned char) irc_tolower(ni->last_usermask[0]);
-		for (ni2 = nicklists[c]; ni2; ni2 = ni2->next) {
-		    if (stricmp(ni2->nick, ni->last_usermask) == 0)
-			break;
-		}
+		ni2 = findnick(ni->last_usermask);
 		if (ni2) {
 		    ni->link = ni2;
 		    strscpy(ni->pass, ni2->pass, PASSMAX);
@@ -1006,15 +1091,13 @@ static void sirv_load_nick(const char *sourcedir)
 	}
     }
     close_db(f);
-    /* Resolve links */
+    /* Resolve links; the nicks above went straight into the lists, so
+     * index them first */
+    build_nick_index();
     for (i = 33; i < 256; i++) {
 	for (ni = nicklists[i]; ni; ni = ni->next) {
 	    if (ni->link) {
-		int c = (unsigned char) irc_tolower(ni->last_usermask[0]);
-		for (ni2 = nicklists[c]; ni2; ni2 = ni2->next) {
-		    if (stricmp(ni2->nick, ni->last_usermask) == 0)
-			break;
-		}
+		ni2 = findnick(ni->last_usermask);
 		if (ni2) {
 		    ni->link = ni2;
 		    strscpy(ni->pass, ni2->pass, PASSMAX);
@@ -1613,15 +1696,13 @@ static void aus_load_nick(const char *sourcedir)
 	}
     }
     close_db(f);
-    /* Resolve links */
+    /* Resolve links; the nicks above went straight into the lists, so
+     * index them first */
+    build_nick_index();
     for (i = 33; i < 256; i++) {
 	for (ni = nicklists[i]; ni; ni = ni->next) {
 	    if (ni->link) {
-		int c = (unsigned char) irc_tolower(ni->last_usermask[0]);
-		for (ni2 = nicklists[c]; ni2; ni2 = ni2->next) {
-		    if (stricmp(ni2->nick, ni->last_usermask) == 0)
-			break;
-		}
+		ni2 = findnick(ni->last_usermask);
 		if (ni2) {
 		    ni->link = ni2;
 		    strscpy(ni->pass, ni2->pass, PASSMAX);
@@ -4012,6 +4093,7 @@ void save_ns_dbase(void)
 		SAFE(write_int16(memos->flags, f));
 		SAFE(write_int32(memos->time, f));
 		SAFE(write_buffer(memos->sender, f));
+		SAFE(write_int32(0, f));	/* Text is not in a memo store */
 		SAFE(write_string(memos->text, f));
 	    }
 	    SAFE(write_int16(ni->channelcount, f));
@@ -4125,6 +4207,7 @@ void save_cs_dbase(void)
 	    SAFE(write_int16(memos->flags, f));
 	    SAFE(write_int32(memos->time, f));
 	    SAFE(write_buffer(memos->sender, f));
+	    SAFE(write_int32(0, f));	/* Text is not in a memo store */
 	    SAFE(write_string(memos->text, f));
 	}
 
@@ -4401,12 +4484,69 @@ static loadfunc_t check_type(const char *sourcedir)
 
 /*************************************************************************/
 
+/* Return the number of seconds elapsed since the given time. */
+
+static double elapsed(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec)
+	 + (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* Return a string describing a data transfer rate. */
+
+static const char *rate(long bytes, double secs)
+{
+    static char buf[32];
+
+    if (secs < 0.001)
+	secs = 0.001;
+    snprintf(buf, sizeof(buf), "%.1f MB/s", bytes / secs / 1048576.0);
+    return buf;
+}
+
+/* Save a database with the given routine, and (if verbose) report how
+ * much data was written and how long it took. */
+
+static void save_dbase(void (*save)(void), const char *what,
+		       const char *filename, int verbose)
+{
+    struct timeval start;
+    char buf[PATH_MAX+1];
+    struct stat st;
+    double secs;
+
+    if (verbose) {
+	printf("Saving new %s database... ", what);
+	fflush(stdout);
+    }
+    gettimeofday(&start, NULL);
+    save();
+    secs = elapsed(&start);
+    snprintf(buf, sizeof(buf), "%s/%s", SERVICES_DIR, filename);
+    if (stat(buf, &st) < 0)
+	st.st_size = 0;
+    bytes_written += st.st_size;
+    if (verbose) {
+	printf("%ld bytes in %.2f seconds (%s)\n",
+	       (long)st.st_size, secs, rate(st.st_size, secs));
+    }
+}
+
+/*************************************************************************/
+
 int main(int ac, char **av)
 {
     char *sourcedir = NULL;	/* Source data file directory */
     int verbose = 0;		/* Verbose output? */
     loadfunc_t load = NULL;
-    int i;
+    int i, nnicks, nchans;
+    NickInfo *ni;
+    ChannelInfo *ci;
+    struct timeval start;
+    double secs;
     char oldpath[PATH_MAX+1], newpath[PATH_MAX+1];
 
     for (i = 1; i < ac; i++) {
@@ -4477,25 +4617,33 @@ int main(int ac, char **av)
 	}
     }
 
+    gettimeofday(&start, NULL);
     load(sourcedir, verbose);
-    if (verbose)
-	printf("Saving new NickServ database\n");
-    save_ns_dbase();
-    if (verbose)
-	printf("Saving new ChanServ database\n");
-    save_cs_dbase();
-    if (verbose)
-	printf("Saving new OperServ database\n");
-    save_os_dbase();
-    if (verbose)
-	printf("Saving new AKILL database\n");
-    save_akill();
-    if (verbose)
-	printf("Saving new exception database\n");
-    save_exceptions();
-    if (verbose)
-	printf("Saving new news database\n");
-    save_news();
+    secs = elapsed(&start);
+    nnicks = nchans = 0;
+    for (i = 0; i < 256; i++) {
+	for (ni = nicklists[i]; ni; ni = ni->next)
+	    nnicks++;
+	for (ci = chanlists[i]; ci; ci = ci->next)
+	    nchans++;
+    }
+    if (verbose) {
+	printf("Read %ld bytes in %.2f seconds (%s): %d nicknames, %d"
+	       " channels\n", bytes_read, secs, rate(bytes_read, secs),
+	       nnicks, nchans);
+    }
+
+    save_dbase(save_ns_dbase, "NickServ", NickDBName, verbose);
+    save_dbase(save_cs_dbase, "ChanServ", ChanDBName, verbose);
+    save_dbase(save_os_dbase, "OperServ", OperDBName, verbose);
+    save_dbase(save_akill, "AKILL", AutokillDBName, verbose);
+    save_dbase(save_exceptions, "exception", ExceptionDBName, verbose);
+    save_dbase(save_news, "news", NewsDBName, verbose);
+
+    secs = elapsed(&start);
+    printf("Imported %d nicknames and %d channels (%ld bytes read, %ld bytes"
+	   " written) in %.2f seconds.\n", nnicks, nchans, bytes_read,
+	   bytes_written, secs);
     return 0;
 }
 
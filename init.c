@@ -8,6 +8,14 @@
  */
 
 #include "services.h"
+#include "datafiles.h"
+#include "encrypt.h"
+
+/* MEMCHECKS builds keep unlocked allocation counts, so load serially */
+#if HAVE_PTHREAD && !defined(MEMCHECKS)
+# define THREADED_LOAD
+# include <pthread.h>
+#endif
 
 /*************************************************************************/
 
@@ -306,6 +314,100 @@ static void write_pidfile(void)
 
 /*************************************************************************/
 
+/* Load the databases which don't refer to nicks or channels, and so can
+ * be loaded independently of (and at the same time as) the nick, channel
+ * and OperServ databases.  Each loader only touches its own module's data.
+ */
+
+static void load_other_dbases(void)
+{
+    load_akill();
+    if (debug)
+	log("debug: Loaded AKILL database (4/13)");
+    load_news();
+    if (debug)
+	log("debug: Loaded news database (5/13)");
+#ifndef STREAMLINED
+    load_exceptions();
+    if (debug)
+	log("debug: Loaded exception database (6/13)");
+#else
+    if (debug)
+	log("debug: Not loading exception database (6/13)");
+#endif
+#ifdef STATISTICS
+    load_ss_dbase();
+    if (debug)
+	log("debug: Loaded statistics database (7/13)");
+#else
+    if (debug)
+	log("debug: Not loading statistics database (7/13)");
+#endif
+    load_nooper();
+    if (debug)
+	log("debug: Loaded NOOPER database (8/13)");
+    load_snooper();
+    if (debug)
+	log("debug: Loaded SNOOPER database (9/13)");
+    load_aconnect();
+    if (debug)
+	log("debug: Loaded ACONNECT database (10/13)");
+    load_nakill();
+    if (debug)
+	log("debug: Loaded NAKILL database (11/13)");
+    load_fs_dbase();
+    if (debug)
+	log("debug: Loaded FLOODSERV database (12/13)");
+    load_grname_dbase();
+    if (debug)
+	log("debug: Loaded GRNAME database (13/13)");
+}
+
+#ifdef THREADED_LOAD
+
+static pthread_t loader, chan_loader;
+
+static void *loader_thread(void *arg)
+{
+    load_other_dbases();
+    return NULL;
+}
+
+static void *chan_loader_thread(void *arg)
+{
+    read_cs_dbase();
+    return NULL;
+}
+
+/* Start a thread running the given loader.  Returns nonzero if the thread
+ * was started, zero if the caller must load the databases itself.
+ */
+
+static int start_loader(pthread_t *thread, void *(*func)(void *))
+{
+    sigset_t sigs, oldsigs;
+
+    /* Leave signals from outside to the main thread, which is the one
+     * that knows what state the databases are in. */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+    errno = pthread_create(thread, NULL, func, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+    if (errno) {
+	log_perror("Unable to start database loading thread");
+	return 0;
+    }
+    return 1;
+}
+
+#endif /* THREADED_LOAD */
+
+/*************************************************************************/
+
 /* Overall initialization routine.  Returns 0 on success, -1 on failure. */
 
 int init(int ac, char **av)
@@ -313,6 +415,9 @@ int init(int ac, char **av)
     int i;
     int openlog_failed = 0, openlog_errno = 0;
     int started_from_term = isatty(0) && isatty(1) && isatty(2);
+#ifdef THREADED_LOAD
+    int loader_started, chan_loader_started;
+#endif
 
 
     /* Initialize pseudo-random number generator. */
@@ -430,6 +535,20 @@ int init(int ac, char **av)
     /* This is our "out-of-memory" panic switch */
     signal(SIGUSR1, weirdsig_handler);
 
+    /* Choose how much work to put into encrypting passwords; this runs a
+     * short benchmark unless PasswordCost is set.  Must come before the
+     * databases are loaded, since unencrypted passwords are encrypted then.
+     */
+    password_hash_init();
+
+    /* Start password threads.  This has to come after forking, since only
+     * the forking thread survives fork(). */
+    if ((i = password_threads_init(PasswordThreads)) > 0) {
+	set_read_wakeup(password_wakeup_fd());
+	if (debug)
+	    log("debug: Started %d password threads", i);
+    }
+
     /* Initialize multi-language support */
     lang_init();
     if (debug)
@@ -441,72 +560,67 @@ int init(int ac, char **av)
     ms_init();
     os_init();
 
-    /* Load up databases */
+    /* Start the disk reading every database now, so later files are
+     * (mostly) in memory by the time the ones before them are parsed */
     if (!skeleton) {
+	prefetch_db(NickDBName);
+	prefetch_db(ChanDBName);
+    }
+    prefetch_db(OperDBName);
+    prefetch_db(AutokillDBName);
+    prefetch_db(NewsDBName);
+#ifndef STREAMLINED
+    prefetch_db(ExceptionDBName);
+#endif
+#ifdef STATISTICS
+    prefetch_db(StatDBName);
+#endif
+    prefetch_db(NooperDBName);
+    prefetch_db(SNooperDBName);
+    prefetch_db(AConnectDBName);
+    prefetch_db(NakillDBName);
+    prefetch_db(FloodServDBName);
+    prefetch_db(GrNameDBName);
+
+    /* Load up databases.  The ones which don't refer to nicks or
+     * channels are loaded by load_other_dbases(), in a second thread if
+     * possible, while the main thread loads the rest.  The channel
+     * database is read by a third thread while the nick database loads;
+     * load_cs_dbase() then links the channels to their nicks. */
+#ifdef THREADED_LOAD
+    set_strtab_locking(1);
+    loader_started = start_loader(&loader, loader_thread);
+    chan_loader_started =
+	!skeleton && start_loader(&chan_loader, chan_loader_thread);
+#endif
+    if (!skeleton) {
+	open_memo_store();
 	load_ns_dbase();
 	if (debug)
 	    log("debug: Loaded %s database (1/13)", s_NickServ);
+#ifdef THREADED_LOAD
+	if (chan_loader_started)
+	    pthread_join(chan_loader, NULL);
+#endif
 	load_cs_dbase();
 	if (debug)
 	    log("debug: Loaded %s database (2/13)", s_ChanServ);
+	memo_store_loaded();
     }
     load_os_dbase();
     if (debug)
 	log("debug: Loaded %s database (3/13)", s_OperServ);
-    load_akill();
-    if (debug)
-	log("debug: Loaded AKILL database (4/13)");
-    load_news();
-    if (debug)
-	log("debug: Loaded news database (5/13)");
-#ifndef STREAMLINED
-    load_exceptions();
-    if (debug)
-        log("debug: Loaded exception database (6/13)");
-#else
-    if (debug)
-        log("debug: Not loading exception database (6/13)");
+#ifdef THREADED_LOAD
+    if (loader_started)
+	pthread_join(loader, NULL);
+    else
 #endif
-#ifdef STATISTICS
-    load_ss_dbase();
-    if (debug)
-	log("debug: Loaded statistics database (7/13)");
-#else
-    if (debug)
-	log("debug: Not loading statistics database (7/13)");
+	load_other_dbases();
+#ifdef THREADED_LOAD
+    set_strtab_locking(0);
 #endif
     log("Databases loaded");
 
-	load_nooper();
-	if (debug)
-	log("debug: Loaded NOOPER database (8/13)");
-    log("Databases loaded");
-	
-	load_snooper();
-	if (debug)
-	log("debug: Loaded SNOOPER database (9/13)");
-    log("Databases loaded");
-	
-	load_aconnect();
-	if (debug)
-	log("debug: Loaded ACONNECT database (10/13)");
-    log("Databases loaded");
-    
-	load_nakill();
-	if (debug)
-	log("debug: Loaded NAKILL database (11/13)");
-    log("Databases loaded");
-
-	load_fs_dbase();
-	if (debug)
-	log("debug: Loaded FLOODSERV database (12/13)");
-    log("Databases loaded");
-    
-	load_grname_dbase();
-	if (debug)
-	log("debug: Loaded GRNAME database (13/13)");
-    log("Databases loaded");
- 
     /* Connect to the remote server */
     servsock = conn(RemoteServer, RemotePort, LocalHost, LocalPort);
     if (servsock < 0)
@@ -31,6 +31,28 @@
  * generates a compiled language file whose name is created by removing any
  * extension on the source file on the input filename.
  *
+ * The compiled file is laid out so that Services can read it into memory
+ * in one piece and use it in place.  All integers are stored in big-endian order:
+ *
+ *	32-bit LANG_MAGIC
+ *	32-bit number of strings
+ *	for each string: 32-bit offset of text, 32-bit length of text, and
+ *		32-bit offset of render information (all zero for a
+ *		string with no text)
+ *	the strings, each followed by a null, and each followed by its
+ *		render information
+ *
+ * The render information lets Services send a string as NOTICE lines
+ * without searching it for newlines and %S every time.  It begins with a
+ * 16-bit set of RF_* flags.  If RF_FORMAT is clear, this is followed by a
+ * 16-bit count of pieces and the pieces themselves: each is a 16-bit
+ * offset into the string and a 16-bit length, which has PIECE_SOURCE set
+ * if the piece is followed by a %S and PIECE_EOL set if it ends a line.
+ * If both RF_FORMAT and RF_SOURCE are set, the flags are instead followed
+ * by a copy of the string with each %S replaced by two \1 characters (so
+ * that printf() leaves them alone), followed by a null.  These values
+ * must match those in extern.h.
+ *
  * You may also pass a "-w" option to print warnings for missing strings.
  *
  * This program isn't very flexible, because it doesn't need to be, but
@@ -47,6 +69,14 @@ char **strings;		/* Strings we have loaded */
 
 int linenum = 0;	/* Current line number in input file */
 
+#define LANG_MAGIC	0x53764C6E	/* "SvLn" */
+
+#define RF_FORMAT	0x0001	/* String has printf() conversions */
+#define RF_SOURCE	0x0002	/* String contains %S */
+#define PIECE_SOURCE	0x8000	/* Piece is followed by %S */
+#define PIECE_EOL	0x4000	/* Piece ends a line */
+#define PIECE_MAXLEN	0x3FFF
+
 /*************************************************************************/
 
 /* Read the index file and load numstrings and stringnames.  Return -1 on
@@ -62,8 +92,11 @@ int read_index_file()
 	perror("fopen(index)");
 	return -1;
     }
-    while (fgets(buf, sizeof(buf), f))
-	numstrings++;
+    /* Blank lines (such as one at the end of the file) aren't strings */
+    while (fgets(buf, sizeof(buf), f)) {
+	if (*buf != '\n')
+	    numstrings++;
+    }
     if (!(stringnames = calloc(sizeof(char *), numstrings))) {
 	perror("calloc(stringnames)");
 	return -1;
@@ -75,6 +108,8 @@ int read_index_file()
     fseek(f, 0, SEEK_SET);
     i = 0;
     while (fgets(buf, sizeof(buf), f)) {
+	if (*buf == '\n')
+	    continue;
 	if (buf[strlen(buf)-1] == '\n')
 	    buf[strlen(buf)-1] = 0;
 	if (!(stringnames[i++] = strdup(buf))) {
@@ -139,6 +174,107 @@ int fput32(int val, FILE *f)
     }
 }
 
+/* Write a 16-bit value to a file in big-endian order. */
+
+int fput16(int val, FILE *f)
+{
+    if (fputc(val>>8, f) < 0 || fputc(val, f) < 0)
+	return -1;
+    else
+	return 0;
+}
+
+/*************************************************************************/
+
+/* Return the RF_* flags for a string. */
+
+int render_flags(const char *str)
+{
+    int flags = 0;
+
+    for (; *str; str++) {
+	if (*str != '%')
+	    continue;
+	if (str[1] == 'S')
+	    flags |= RF_SOURCE;
+	else
+	    flags |= RF_FORMAT;
+	if (str[1])
+	    str++;
+    }
+    return flags;
+}
+
+/* Write the render information for a string to the given file (or just
+ * count its length if `f' is NULL).  Return the number of bytes written,
+ * or -1 if a line of the string is too long. */
+
+int write_render(const char *str, FILE *f)
+{
+    int flags = render_flags(str);
+    int len = 2, npieces = 0, start, i, pass, last;
+
+    if (f)
+	fput16(flags, f);
+    if (flags & RF_FORMAT) {
+	if (!(flags & RF_SOURCE))
+	    return len;
+	/* "%S" and "\1\1" are the same length, so the copy is exactly as
+	 * long as the string */
+	if (f) {
+	    for (i = 0; str[i]; i++) {
+		if (str[i] == '%' && str[i+1] == 'S') {
+		    fputs("\1\1", f);
+		    i++;
+		} else if (str[i] == '%' && str[i+1]) {
+		    fputc(str[i], f);
+		    fputc(str[++i], f);
+		} else {
+		    fputc(str[i], f);
+		}
+	    }
+	    fputc(0, f);
+	}
+	return len + strlen(str) + 1;
+    }
+
+    /* Pass 0 counts the pieces, pass 1 writes them */
+    for (pass = 0; pass < 2; pass++) {
+	if (pass == 1 && f)
+	    fput16(npieces, f);
+	npieces = 0;
+	start = 0;
+	last = PIECE_EOL;
+	for (i = 0; ; i++) {
+	    int type;
+	    if (str[i] == '\n' || !str[i])
+		type = PIECE_EOL;
+	    else if (str[i] == '%' && str[i+1] == 'S')
+		type = PIECE_SOURCE;
+	    else
+		continue;
+	    /* Like notice_text(), don't send an empty line after a final
+	     * newline (or for an empty string) */
+	    if (!str[i] && i == start && last == PIECE_EOL)
+		break;
+	    if (start > 0xFFFF || i - start > PIECE_MAXLEN)
+		return -1;
+	    if (pass == 1 && f) {
+		fput16(start, f);
+		fput16((i - start) | type, f);
+	    }
+	    npieces++;
+	    last = type;
+	    if (!str[i])
+		break;
+	    start = i + (type == PIECE_SOURCE ? 2 : 1);
+	    if (type == PIECE_SOURCE)
+		i++;
+	}
+    }
+    return len + 2 + npieces*4;
+}
+
 /*************************************************************************/
 
 int main(int ac, char **av)
@@ -225,26 +361,52 @@ int main(int ac, char **av)
 	}
     }
 
-    fput32(numstrings, out);
-    pos = numstrings * 8 + 4;
-    for (i = 0; i < numstrings; i++) {
-	int len = strings[i] && *strings[i] ? strlen(strings[i])-1 : 0;
-	fput32(pos, out);
-	fput32(len, out);
-	pos += len;
-    }
     for (i = 0; i < numstrings; i++) {
 	if (strings[i]) {
 	    if (*strings[i])
 		strings[i][strlen(strings[i])-1] = 0;	/* kill last \n */
-	    if (*strings[i])
-		fputs(strings[i], out);
+	    if (!*strings[i]) {
+		free(strings[i]);
+		strings[i] = NULL;
+	    }
 	} else if (warn) {
 	    fprintf(stderr, "%s: String `%s' missing\n", filename,
 			stringnames[i]);
 	}
     }
 
+    fput32(LANG_MAGIC, out);
+    fput32(numstrings, out);
+    pos = numstrings * 12 + 8;
+    for (i = 0; i < numstrings; i++) {
+	int len, rlen;
+	if (!strings[i]) {
+	    fput32(0, out);
+	    fput32(0, out);
+	    fput32(0, out);
+	    continue;
+	}
+	len = strlen(strings[i]);
+	if ((rlen = write_render(strings[i], NULL)) < 0) {
+	    fprintf(stderr, "%s: String `%s' is too long\n",
+			filename, stringnames[i]);
+	    fclose(out);
+	    remove(outfile);
+	    return 1;
+	}
+	fput32(pos, out);
+	fput32(len, out);
+	fput32(pos+len+1, out);
+	pos += len+1 + rlen;
+    }
+    for (i = 0; i < numstrings; i++) {
+	if (strings[i]) {
+	    fputs(strings[i], out);
+	    fputc(0, out);
+	    write_render(strings[i], out);
+	}
+    }
+
     fclose(in);
     fclose(out);
     return retval;
@@ -874,5 +874,7 @@
 #define OPER_HELP_ACONNECT		     873
 #define OPER_HELP_CLOSENET		     874
 #define CHAN_HELP_SET_FLOODSERV		875
+#define PASSWORD_IN_PROGRESS		876
+#define OPER_STATS_LANGUAGE_MEM		877
 
-#define NUM_STRINGS 876
+#define NUM_STRINGS 878
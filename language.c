@@ -9,12 +9,34 @@
 
 #include "services.h"
 #include "language.h"
+#include <fcntl.h>
 
 /*************************************************************************/
 
 /* The list of lists of messages. */
 char **langtexts[NUM_LANGS];
 
+/* Render information for each message, parallel to langtexts[] (see
+ * lang/langcomp.c for the format). */
+const unsigned char **langrender[NUM_LANGS];
+
+/* Languages other than the default are only loaded once some nick uses
+ * them (see lang_use()); until then, their langtexts[] and langrender[]
+ * entries point to the default language's tables.  Strings identical to
+ * ones in a language already loaded point to that language's copy, and
+ * the rest are then moved out of the file buffer so it can be freed. */
+static struct {
+    int available;		/* Language file exists */
+    int loaded;
+    unsigned char *data;	/* File contents, or own strings and their
+				 *    render information once compacted */
+    uint32 size;
+    long shared;		/* Bytes of shared strings */
+} langfiles[NUM_LANGS];
+
+/* Microseconds spent loading languages in lang_init() and afterwards. */
+static long init_usec, load_usec;
+
 /* The list of names of languages. */
 char *langnames[NUM_LANGS];
 
@@ -53,121 +75,383 @@ static const char *filenames[] = {
 
 /*************************************************************************/
 
-/* Load a language file. */
+/* Load a language file.  Compiled language files are made to be used in
+ * place: the file is read into a single buffer and the string and render
+ * pointers point into it, so nothing is parsed or copied string by string.
+ * The file is not mapped, since it may be replaced (by "make install", for
+ * example) while Services is running.  If `strict' is nonzero, a file with
+ * the wrong number of strings is rejected rather than just warned about. */
 
-static int read_int32(int32 *ptr, FILE *f)
+static uint32 get32(const unsigned char *s)
 {
-    int a = fgetc(f);
-    int b = fgetc(f);
-    int c = fgetc(f);
-    int d = fgetc(f);
-    if (a == EOF || b == EOF || c == EOF || d == EOF)
-	return -1;
-    *ptr = a<<24 | b<<16 | c<<8 | d;
-    return 0;
+    return (uint32)s[0]<<24 | s[1]<<16 | s[2]<<8 | s[3];
 }
 
-static void load_lang(int index, const char *filename)
+/* Return whether the render information at `pos' lies within a file of
+ * `size' bytes and its pieces within a string of `len' bytes. */
+
+static int valid_render(const unsigned char *data, uint32 size, uint32 pos,
+			uint32 len)
+{
+    int flags, npieces, i;
+
+    if (pos > size || size - pos < 2)
+	return 0;
+    flags = LANG_GET16(data+pos);
+    pos += 2;
+    if (flags & LANG_RF_FORMAT) {
+	return !(flags & LANG_RF_SOURCE)
+	    || memchr(data+pos, 0, size-pos) != NULL;
+    }
+    if (size - pos < 2)
+	return 0;
+    npieces = LANG_GET16(data+pos);
+    pos += 2;
+    if (size - pos < npieces*4)
+	return 0;
+    for (i = 0; i < npieces; i++, pos += 4) {
+	if (LANG_GET16(data+pos)
+	    + (LANG_GET16(data+pos+2) & LANG_PIECE_LEN) > len)
+	    return 0;
+    }
+    return 1;
+}
+
+static int load_lang(int index, const char *filename, int strict)
 {
     char buf[256];
-    FILE *f;
-    int num, i;
+    struct stat st;
+    unsigned char *data = NULL;
+    char **texts = NULL;
+    const unsigned char **render = NULL;
+    uint32 num, i, size = 0;
+    int fd;
 
     if (debug) {
 	log("debug: Loading language %d from file `languages/%s'",
 		index, filename);
     }
     snprintf(buf, sizeof(buf), "languages/%s", filename);
-    if (!(f = fopen(buf, "r"))) {
+    if ((fd = open(buf, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
 	log_perror("Failed to load language %d (%s)", index, filename);
-	return;
-    } else if (read_int32(&num, f) < 0) {
-	log("Failed to read number of strings for language %d (%s)",
-		index, filename);
-	return;
+	if (fd >= 0)
+	    close(fd);
+	return -1;
+    }
+    size = st.st_size;
+    if (size < 8 || size != st.st_size) {
+	log("Failed to read header for language %d (%s)", index, filename);
+	close(fd);
+	return -1;
+    }
+    data = smalloc(size);
+    if (read(fd, data, size) != size) {
+	log_perror("Failed to read language %d (%s)", index, filename);
+	free(data);
+	close(fd);
+	return -1;
+    }
+    close(fd);
+
+    if (get32(data) != LANG_MAGIC) {
+	log("Language %d (%s) is not a compiled language file, or was"
+	    " compiled by an older version of Services", index, filename);
+	goto fail;
+    }
+    num = get32(data+4);
+    if (num != NUM_STRINGS && strict) {
+	log("Bad number of strings (%d, wanted %d) for language %d (%s),"
+	    " not loading", (int)num, NUM_STRINGS, index, filename);
+	goto fail;
     } else if (num != NUM_STRINGS) {
 	log("Warning: Bad number of strings (%d, wanted %d) "
-	    "for language %d (%s)", num, NUM_STRINGS, index, filename);
+	    "for language %d (%s)", (int)num, NUM_STRINGS, index, filename);
     }
-    langtexts[index] = scalloc(sizeof(char *), NUM_STRINGS);
+    if (num > (size-8) / 12) {
+	log("Language %d (%s) is truncated", index, filename);
+	goto fail;
+    }
+    texts = scalloc(sizeof(char *), NUM_STRINGS);
+    render = scalloc(sizeof(unsigned char *), NUM_STRINGS);
     if (num > NUM_STRINGS)
 	num = NUM_STRINGS;
     for (i = 0; i < num; i++) {
-	int32 pos, len;
-	fseek(f, i*8+4, SEEK_SET);
-	if (read_int32(&pos, f) < 0 || read_int32(&len, f) < 0) {
-	    log("Failed to read entry %d in language %d (%s) TOC",
-			i, index, filename);
-	    goto fail;
-	}
-	if (len == 0) {
-	    langtexts[index][i] = NULL;
-	} else if (len >= 65536) {
+	const unsigned char *entry = data + 8 + i*12;
+	uint32 pos = get32(entry), len = get32(entry+4);
+	uint32 rpos = get32(entry+8);
+	if (len == 0)
+	    continue;
+	if (len >= 65536) {
 	    log("Entry %d in language %d (%s) is too long (over 64k)--"
-		"corrupt TOC?", i, index, filename);
+		"corrupt TOC?", (int)i, index, filename);
 	    goto fail;
-	} else if (len < 0) {
-	    log("Entry %d in language %d (%s) has negative length--"
-		"corrupt TOC?", i, index, filename);
+	} else if (pos > size || size - pos <= len || data[pos+len] != 0
+		   || !valid_render(data, size, rpos, len)) {
+	    log("Entry %d in language %d (%s) is outside the file--"
+		"corrupt TOC?", (int)i, index, filename);
 	    goto fail;
-	} else {
-	    langtexts[index][i] = smalloc(len+1);
-	    fseek(f, pos, SEEK_SET);
-	    if (fread(langtexts[index][i], 1, len, f) != len) {
-		log("Failed to read string %d in language %d (%s)",
-			i, index, filename);
-		free(langtexts[index][i]);
-		goto fail;
-	    }
-	    langtexts[index][i][len] = 0;
 	}
+	texts[i] = (char *)data + pos;
+	render[i] = data + rpos;
     }
-    fclose(f);
-    return;
+    langtexts[index] = texts;
+    langrender[index] = render;
+    langfiles[index].data = data;
+    langfiles[index].size = size;
+    langfiles[index].loaded = 1;
+    return 0;
 
   fail:
-    while (--i >= 0) {
-	if (langtexts[index][i])
-	    free(langtexts[index][i]);
+    free(texts);
+    free(render);
+    free(data);
+    return -1;
+}
+
+/*************************************************************************/
+
+/* Read just the name of a language from its file, and note whether the
+ * language is available.  Return 0 on success, -1 on failure. */
+
+static int read_lang_name(int index, const char *filename)
+{
+    char buf[256];
+    unsigned char hdr[12];
+    uint32 len;
+    int fd;
+
+    snprintf(buf, sizeof(buf), "languages/%s", filename);
+    if ((fd = open(buf, O_RDONLY)) < 0)
+	return -1;
+    if (read(fd, hdr, 8) != 8 || get32(hdr) != LANG_MAGIC
+     || get32(hdr+4) <= LANG_NAME
+     || lseek(fd, 8 + LANG_NAME*12, SEEK_SET) < 0
+     || read(fd, hdr, 12) != 12
+     || (len = get32(hdr+4)) == 0 || len >= sizeof(buf)
+     || lseek(fd, get32(hdr), SEEK_SET) < 0
+     || read(fd, buf, len) != len
+    ) {
+	log("Failed to read name of language %d (%s)", index, filename);
+	close(fd);
+	return -1;
     }
-    free(langtexts[index]);
-    langtexts[index] = NULL;
-    return;
+    close(fd);
+    buf[len] = 0;
+    langnames[index] = sstrdup(buf);
+    langfiles[index].available = 1;
+    return 0;
 }
 
 /*************************************************************************/
 
-/* Initialize list of lists. */
+/* Return the length of the render information at `render'. */
 
-void lang_init()
+static uint32 render_len(const unsigned char *render)
 {
-    int i, j, n = 0;
+    int flags = LANG_GET16(render);
 
-    for (i = 0; i < lenof(langorder); i++)
-	load_lang(langorder[i], filenames[langorder[i]]);
+    if (flags & LANG_RF_FORMAT) {
+	if (flags & LANG_RF_SOURCE)
+	    return 2 + strlen((const char *)render+2) + 1;
+	return 2;
+    }
+    return 4 + LANG_GET16(render+2)*4;
+}
 
-    if (!langtexts[DEF_LANGUAGE])
-	fatal("Unable to load default language");
+/* Copy the strings a language still uses from its own file, and their
+ * render information, to a new buffer, and free the file buffer.  Nothing
+ * else may point into the file buffer. */
 
-    for (i = 0; i < lenof(langorder); i++) {
-	if (langtexts[langorder[i]] != NULL) {
-	    langnames[langorder[i]] = langtexts[langorder[i]][LANG_NAME];
-	    for (j = 0; j < NUM_STRINGS; j++) {
-		if (!langtexts[langorder[i]][j])
-		    langtexts[langorder[i]][j] = langtexts[DEF_LANGUAGE][j];
-		if (!langtexts[langorder[i]][j])
-		    langtexts[langorder[i]][j] = langtexts[LANG_EN_US][j];
+static void compact_lang(int index)
+{
+    unsigned char *old = langfiles[index].data, *new, *s;
+    uint32 size = langfiles[index].size, newsize = 0, len;
+    int j;
+
+#define OWN(p)  ((const unsigned char *)(p) >= old \
+		 && (const unsigned char *)(p) < old+size)
+    for (j = 0; j < NUM_STRINGS; j++) {
+	if (OWN(langtexts[index][j])) {
+	    newsize += strlen(langtexts[index][j]) + 1;
+	    newsize += render_len(langrender[index][j]);
+	}
+    }
+    if (newsize >= size)
+	return;
+    new = s = smalloc(newsize ? newsize : 1);
+    for (j = 0; j < NUM_STRINGS; j++) {
+	if (!OWN(langtexts[index][j]))
+	    continue;
+	len = strlen(langtexts[index][j]) + 1;
+	memcpy(s, langtexts[index][j], len);
+	langtexts[index][j] = (char *)s;
+	s += len;
+	len = render_len(langrender[index][j]);
+	memcpy(s, langrender[index][j], len);
+	langrender[index][j] = s;
+	s += len;
+    }
+#undef OWN
+    free(old);
+    langfiles[index].data = new;
+    langfiles[index].size = newsize;
+}
+
+/* Fill in strings missing from a newly loaded language from the default
+ * language, and point strings which are the same as in another loaded
+ * language at that language's copy (the default language, which is always
+ * loaded first, keeps its own).  If `compact' is nonzero, the language's
+ * remaining strings are then moved out of its file buffer with
+ * compact_lang(). */
+
+static void link_lang(int index, int compact)
+{
+    int i, j, k;
+
+    langfiles[index].shared = 0;
+    for (j = 0; j < NUM_STRINGS; j++) {
+	const char *str = langtexts[index][j];
+	if (!str) {
+	    langtexts[index][j] = langtexts[DEF_LANGUAGE][j];
+	    langrender[index][j] = langrender[DEF_LANGUAGE][j];
+	    continue;
+	}
+	for (i = 0; index != DEF_LANGUAGE && i < lenof(langorder); i++) {
+	    k = langorder[i];
+	    if (k != index && langfiles[k].loaded && langtexts[k][j]
+	     && strcmp(langtexts[k][j], str) == 0
+	    ) {
+		langtexts[index][j] = langtexts[k][j];
+		langrender[index][j] = langrender[k][j];
+		break;
 	    }
-	    langlist[n++] = langorder[i];
 	}
+	if (index != DEF_LANGUAGE && i < lenof(langorder))
+	    langfiles[index].shared += strlen(str)+1;
+    }
+    if (compact)
+	compact_lang(index);
+}
+
+/*************************************************************************/
+
+/* Return the number of microseconds since the given time. */
+
+static long usec_since(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000000
+	 + (now.tv_usec - start->tv_usec);
+}
+
+/*************************************************************************/
+
+/* Initialize list of lists.  Only the default language (and English, if
+ * the default is missing any strings) is loaded; the default stays loaded
+ * for as long as Services runs, and the others are loaded by lang_use(). */
+
+void lang_init()
+{
+    struct timeval start;
+    int i, j, n = 0;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < lenof(langorder); i++) {
+	if (read_lang_name(langorder[i], filenames[langorder[i]]) == 0)
+	    langlist[n++] = langorder[i];
     }
     while (n < NUM_LANGS)
 	langlist[n++] = -1;
 
+    if (!langfiles[DEF_LANGUAGE].available
+     || load_lang(DEF_LANGUAGE, filenames[DEF_LANGUAGE], 0) < 0)
+	fatal("Unable to load default language");
+    for (j = 0; j < NUM_STRINGS; j++) {
+	if (!langtexts[DEF_LANGUAGE][j])
+	    break;
+    }
+    if (j < NUM_STRINGS && DEF_LANGUAGE != LANG_EN_US
+     && langfiles[LANG_EN_US].available
+     && load_lang(LANG_EN_US, filenames[LANG_EN_US], 0) == 0
+    ) {
+	for (; j < NUM_STRINGS; j++) {
+	    if (!langtexts[DEF_LANGUAGE][j]) {
+		langtexts[DEF_LANGUAGE][j] = langtexts[LANG_EN_US][j];
+		langrender[DEF_LANGUAGE][j] = langrender[LANG_EN_US][j];
+	    }
+	}
+    }
+    link_lang(DEF_LANGUAGE, 0);
+    /* The default language now points into English's buffer for its
+     * missing strings, so English's buffer has to stay as it is */
+    if (langfiles[LANG_EN_US].loaded && DEF_LANGUAGE != LANG_EN_US)
+	link_lang(LANG_EN_US, 0);
+
     for (i = 0; i < NUM_LANGS; i++) {
-	if (!langtexts[i])
+	if (!langtexts[i]) {
 	    langtexts[i] = langtexts[DEF_LANGUAGE];
+	    langrender[i] = langrender[DEF_LANGUAGE];
+	}
+    }
+    init_usec = usec_since(&start);
+}
+
+/*************************************************************************/
+
+/* Note that a nick uses the given language, and load it if it hasn't been
+ * loaded yet.  If it can't be loaded, the default language's strings
+ * continue to be used for it. */
+
+void lang_use(int language)
+{
+    struct timeval start;
+
+    if (language < 0 || language >= NUM_LANGS
+     || langfiles[language].loaded || !langfiles[language].available)
+	return;
+    gettimeofday(&start, NULL);
+    if (load_lang(language, filenames[language], 1) == 0) {
+	link_lang(language, 1);
+	if (debug)
+	    log("debug: Loaded language %d (%s) on first use", language,
+		filenames[language]);
+    } else {
+	/* Don't try again */
+	langfiles[language].available = 0;
+    }
+    load_usec += usec_since(&start);
+}
+
+/*************************************************************************/
+
+/* Return language statistics: number of languages loaded, memory used by
+ * them (string tables and the buffers holding each language's own
+ * strings), bytes saved by sharing strings, and milliseconds spent loading
+ * languages at startup and later. */
+
+void get_language_stats(long *nrec, long *memuse, long *shared,
+			long *init_ms, long *load_ms)
+{
+    long count = 0, mem = 0, saved = 0;
+    int i;
+
+    for (i = 0; i < NUM_LANGS; i++) {
+	if (langnames[i])
+	    mem += strlen(langnames[i])+1;
+	if (langfiles[i].loaded) {
+	    count++;
+	    mem += NUM_STRINGS * (sizeof(char *) + sizeof(unsigned char *));
+	    mem += langfiles[i].size;
+	    saved += langfiles[i].shared;
+	}
     }
+    *nrec = count;
+    *memuse = mem;
+    *shared = saved;
+    *init_ms = (init_usec+500) / 1000;
+    *load_ms = (load_usec+500) / 1000;
 }
 
 /*************************************************************************/
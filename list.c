@@ -82,7 +82,7 @@ static void do_listnicks(int count_only, const char *nick)
 
     } else {
 
-	for (ni = firstnick(); ni; ni = nextnick()) {
+	for (ni = firstnick_sorted(); ni; ni = nextnick_sorted()) {
 	    printf("    %s %-20s  %s\n",
 		   ni->status & NS_NOEXPIRE ? "!" : " ",
 		   ni->nick, ni->status & NS_VERBOTEN ?
@@ -168,7 +168,7 @@ static void do_listchans(int count_only, const char *chan)
 
     } else {
 
-	for (ci = cs_firstchan(); ci; ci = cs_nextchan()) {
+	for (ci = cs_firstchan_sorted(); ci; ci = cs_nextchan_sorted()) {
 	    printf("  %s %-20s  %s\n", ci->flags & CI_NOEXPIRE ? "!" : " ",
 		   ci->name,
 		   ci->flags & CI_VERBOTEN ? "Disallowed (FORBID)" : ci->desc);
@@ -182,10 +182,551 @@ static void do_listchans(int count_only, const char *chan)
 /*************************************************************************/
 /*************************************************************************/
 
+/* Columnar export.  `listnicks -x file' and `listchans -x file' write the
+ * loaded database to a file laid out column by column, and `-q file'
+ * searches such a file without loading the databases at all.  The file
+ * starts with EXPORT_MAGIC, the kind of data ('N' for nicknames or 'C'
+ * for channels), and the number of rows and columns, followed by each
+ * column in turn: its name (COLNAME_LEN bytes, null-padded), its type, and
+ * its data.  A COL_INT column holds one value per row.  A COL_DICT column
+ * holds a dictionary of the distinct strings in the column (the number of
+ * strings, the offset of the end of each string, and the length and text
+ * of the null-terminated strings, padded to a multiple of 4 bytes),
+ * followed by one dictionary index per row.  All values are 32 bits,
+ * big-endian.
+ *
+ * A query filters the rows with one pass over each column named in the
+ * query, so a search of even a very large network takes very little
+ * time; a string match is only tried once for each distinct string.
+ */
+
+#define EXPORT_MAGIC	0x53764358	/* "SvCX" */
+#define COLNAME_LEN	16
+#define MAX_COLUMNS	16
+
+#define COL_INT		1
+#define COL_DICT	2
+
+typedef struct {
+    char name[COLNAME_LEN];
+    int type;
+    uint32 *values;		/* One per row; dictionary index for COL_DICT */
+    uint32 nstrings;		/* Number of strings in dictionary */
+    uint32 *ends;		/* Offset of end of each string in text[] */
+    char *text;			/* Dictionary strings, null-terminated */
+    uint32 textlen, textsize;
+    uint32 *hash;		/* (Export only) string index+1 by hash, or 0 */
+    uint32 hashsize;
+} Column;
+
+typedef struct {
+    int kind;			/* 'N' or 'C' */
+    uint32 rows;
+    uint32 rowsize;		/* (Export only) rows allocated in values[] */
+    int ncols;
+    Column cols[MAX_COLUMNS];
+} ExportTable;
+
+/*************************************************************************/
+
+/* Add a column to an export table. */
+
+static void add_column(ExportTable *t, const char *name, int type)
+{
+    Column *col = &t->cols[t->ncols++];
+
+    memset(col, 0, sizeof(*col));
+    strscpy(col->name, name, sizeof(col->name));
+    col->type = type;
+    if (type == COL_DICT) {
+	col->hashsize = 1024;
+	col->hash = scalloc(col->hashsize, sizeof(uint32));
+    }
+}
+
+/* Start a new row in an export table; all values in the row start out as
+ * 0 (for COL_DICT columns, the first string added to the column). */
+
+static void add_row(ExportTable *t)
+{
+    int i;
+
+    if (t->rows >= t->rowsize) {
+	t->rowsize = t->rowsize ? t->rowsize*2 : 1024;
+	for (i = 0; i < t->ncols; i++) {
+	    t->cols[i].values = srealloc(t->cols[i].values,
+					 t->rowsize * sizeof(uint32));
+	}
+    }
+    for (i = 0; i < t->ncols; i++)
+	t->cols[i].values[t->rows] = 0;
+    t->rows++;
+}
+
+/* Return a dictionary string by index. */
+
+static const char *dict_string(const Column *col, uint32 index)
+{
+    return col->text + (index ? col->ends[index-1] : 0);
+}
+
+/* Return the dictionary index of the given string in a COL_DICT column,
+ * adding it to the dictionary if it is not already there. */
+
+static uint32 dict_index(Column *col, const char *s)
+{
+    uint32 h = 0, i, len;
+    const char *t;
+
+    for (t = s; *t; t++)
+	h = h*31 + (unsigned char)*t;
+    for (;;) {
+	i = h & (col->hashsize-1);
+	while (col->hash[i]) {
+	    if (strcmp(dict_string(col, col->hash[i]-1), s) == 0)
+		return col->hash[i]-1;
+	    i = (i+1) & (col->hashsize-1);
+	}
+	if (col->nstrings < col->hashsize/2)
+	    break;
+	/* Table is half full; double it and rehash the strings we have */
+	free(col->hash);
+	col->hashsize *= 2;
+	col->hash = scalloc(col->hashsize, sizeof(uint32));
+	for (i = 0; i < col->nstrings; i++) {
+	    uint32 h2 = 0, j;
+	    for (t = dict_string(col, i); *t; t++)
+		h2 = h2*31 + (unsigned char)*t;
+	    j = h2 & (col->hashsize-1);
+	    while (col->hash[j])
+		j = (j+1) & (col->hashsize-1);
+	    col->hash[j] = i+1;
+	}
+    }
+
+    len = strlen(s) + 1;
+    if (col->textlen + len > col->textsize) {
+	col->textsize = (col->textsize + len) * 2;
+	col->text = srealloc(col->text, col->textsize);
+    }
+    memcpy(col->text + col->textlen, s, len);
+    col->textlen += len;
+    if (col->nstrings % 1024 == 0) {
+	col->ends = srealloc(col->ends,
+			     (col->nstrings+1024) * sizeof(uint32));
+    }
+    col->ends[col->nstrings] = col->textlen;
+    col->hash[i] = ++col->nstrings;
+    return col->nstrings-1;
+}
+
+/* Set a value in the current (last) row of an export table. */
+
+static void set_int(ExportTable *t, int colnum, uint32 value)
+{
+    t->cols[colnum].values[t->rows-1] = value;
+}
+
+static void set_string(ExportTable *t, int colnum, const char *s)
+{
+    t->cols[colnum].values[t->rows-1] =
+	dict_index(&t->cols[colnum], s ? s : "");
+}
+
+/*************************************************************************/
+
+/* Write a 32-bit big-endian value, or an array of them. */
+
+static void put_int32(uint32 val, FILE *f)
+{
+    putc(val>>24, f);
+    putc(val>>16, f);
+    putc(val>>8, f);
+    putc(val, f);
+}
+
+static void put_int32s(const uint32 *vals, uint32 count, FILE *f)
+{
+    unsigned char buf[4096];
+    uint32 i, n;
+
+    while (count > 0) {
+	n = count < sizeof(buf)/4 ? count : sizeof(buf)/4;
+	for (i = 0; i < n; i++) {
+	    buf[i*4  ] = vals[i]>>24;
+	    buf[i*4+1] = vals[i]>>16;
+	    buf[i*4+2] = vals[i]>>8;
+	    buf[i*4+3] = vals[i];
+	}
+	fwrite(buf, 4, n, f);
+	vals += n;
+	count -= n;
+    }
+}
+
+/* Write an export table to the given file, and close the file.  Return 0
+ * on success, -1 on error (with errno set). */
+
+static int write_export(ExportTable *t, FILE *f)
+{
+    static const char zero[4] = {0,0,0,0};
+    int i;
+
+    put_int32(EXPORT_MAGIC, f);
+    put_int32(t->kind, f);
+    put_int32(t->rows, f);
+    put_int32(t->ncols, f);
+    for (i = 0; i < t->ncols; i++) {
+	Column *col = &t->cols[i];
+	fwrite(col->name, COLNAME_LEN, 1, f);
+	put_int32(col->type, f);
+	if (col->type == COL_DICT) {
+	    put_int32(col->nstrings, f);
+	    put_int32s(col->ends, col->nstrings, f);
+	    put_int32(col->textlen, f);
+	    fwrite(col->text, col->textlen, 1, f);
+	    fwrite(zero, (4 - col->textlen%4) % 4, 1, f);
+	}
+	put_int32s(col->values, t->rows, f);
+    }
+    if (ferror(f)) {
+	int errno_save = errno;
+	fclose(f);
+	errno = errno_save;
+	return -1;
+    }
+    return fclose(f)==0 ? 0 : -1;
+}
+
+/*************************************************************************/
+
+/* Read an export file into memory.  Return the table, or NULL if the file
+ * cannot be read or is not a valid export file (an error message has been
+ * printed). */
+
+static ExportTable *read_export(const char *filename)
+{
+    ExportTable *t;
+    FILE *f;
+    unsigned char *data;
+    long size, pos, i;
+    int c;
+
+    if (!(f = fopen(filename, "r"))) {
+	fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+	return NULL;
+    }
+    if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0
+     || fseek(f, 0, SEEK_SET) < 0
+    ) {
+	fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+	fclose(f);
+	return NULL;
+    }
+    data = smalloc(size+4);
+    if (fread(data, size, 1, f) != 1 && size > 0) {
+	fprintf(stderr, "%s: Read error\n", filename);
+	fclose(f);
+	free(data);
+	return NULL;
+    }
+    fclose(f);
+
+    /* All 32-bit values are aligned (see above), so convert them to
+     * native byte order in place as we go */
+#define GET32(var) do {						\
+    if (pos+4 > size)						\
+	goto invalid;						\
+    (var) = (uint32)data[pos]<<24 | data[pos+1]<<16		\
+	  | data[pos+2]<<8 | data[pos+3];			\
+    pos += 4;							\
+} while (0)
+#define GET32S(var,count) do {					\
+    uint32 *p__ = (uint32 *)(data+pos), n__;			\
+    if ((count) > (size-pos)/4)					\
+	goto invalid;						\
+    for (n__ = 0; n__ < (count); n__++, pos += 4) {		\
+	p__[n__] = (uint32)data[pos]<<24 | data[pos+1]<<16	\
+		 | data[pos+2]<<8 | data[pos+3];		\
+    }								\
+    (var) = p__;						\
+} while (0)
+
+    t = scalloc(1, sizeof(*t));
+    pos = 0;
+    {
+	uint32 magic, kind, ncols;
+	GET32(magic);
+	GET32(kind);
+	GET32(t->rows);
+	GET32(ncols);
+	if (magic != EXPORT_MAGIC || (kind != 'N' && kind != 'C')
+	 || ncols < 1 || ncols > MAX_COLUMNS)
+	    goto invalid;
+	t->kind = kind;
+	t->ncols = ncols;
+    }
+    for (c = 0; c < t->ncols; c++) {
+	Column *col = &t->cols[c];
+	uint32 type;
+	if (pos+COLNAME_LEN > size)
+	    goto invalid;
+	memcpy(col->name, data+pos, COLNAME_LEN);
+	col->name[COLNAME_LEN-1] = 0;
+	pos += COLNAME_LEN;
+	GET32(type);
+	col->type = type;
+	if (type == COL_DICT) {
+	    GET32(col->nstrings);
+	    GET32S(col->ends, col->nstrings);
+	    GET32(col->textlen);
+	    if (col->textlen > size-pos
+	     || (col->textlen > 0 && data[pos+col->textlen-1] != 0))
+		goto invalid;
+	    col->text = (char *)data+pos;
+	    pos += (col->textlen+3) & ~3;
+	    for (i = 0; i < col->nstrings; i++) {
+		if (col->ends[i] > col->textlen
+		 || col->ends[i] <= (i ? col->ends[i-1] : 0))
+		    goto invalid;
+	    }
+	} else if (type != COL_INT) {
+	    goto invalid;
+	}
+	GET32S(col->values, t->rows);
+	if (type == COL_DICT) {
+	    for (i = 0; i < t->rows; i++) {
+		if (col->values[i] >= col->nstrings)
+		    goto invalid;
+	    }
+	}
+    }
+    if (t->ncols < 1 || t->cols[0].type != COL_DICT)
+	goto invalid;
+    return t;
+
+  invalid:
+    fprintf(stderr, "%s: Not a valid export file\n", filename);
+    free(t);
+    free(data);
+    return NULL;
+
+#undef GET32
+#undef GET32S
+}
+
+/*************************************************************************/
+
+/* Export the nickname or channel database to the given file. */
+
+static void do_export(int kind, FILE *f, const char *filename)
+{
+    ExportTable t;
+    /* Column numbers (in the order added below) */
+    enum { NC_NICK, NC_USER, NC_HOST, NC_REALNAME, NC_EMAIL, NC_LINK,
+	   NC_REGISTERED, NC_LASTSEEN, NC_FLAGS, NC_STATUS };
+    enum { CC_NAME, CC_FOUNDER, CC_SUCCESSOR, CC_DESC, CC_EMAIL,
+	   CC_REGISTERED, CC_LASTUSED, CC_FLAGS };
+
+    memset(&t, 0, sizeof(t));
+    t.kind = kind;
+    if (kind == 'N') {
+	NickInfo *ni;
+	add_column(&t, "nick", COL_DICT);
+	add_column(&t, "user", COL_DICT);
+	add_column(&t, "host", COL_DICT);
+	add_column(&t, "realname", COL_DICT);
+	add_column(&t, "email", COL_DICT);
+	add_column(&t, "link", COL_DICT);
+	add_column(&t, "registered", COL_INT);
+	add_column(&t, "lastseen", COL_INT);
+	add_column(&t, "flags", COL_INT);
+	add_column(&t, "status", COL_INT);
+	for (ni = firstnick_sorted(); ni; ni = nextnick_sorted()) {
+	    char *s = ni->last_usermask ? strrchr(ni->last_usermask, '@')
+					: NULL;
+	    add_row(&t);
+	    set_string(&t, NC_NICK, ni->nick);
+	    if (s) {
+		*s = 0;
+		set_string(&t, NC_USER, ni->last_usermask);
+		*s = '@';
+		set_string(&t, NC_HOST, s+1);
+	    } else {
+		set_string(&t, NC_USER, NULL);
+		set_string(&t, NC_HOST, ni->last_usermask);
+	    }
+	    set_string(&t, NC_REALNAME, ni->last_realname);
+	    set_string(&t, NC_EMAIL, ni->email);
+	    set_string(&t, NC_LINK, ni->link ? ni->link->nick : NULL);
+	    set_int(&t, NC_REGISTERED, ni->time_registered);
+	    set_int(&t, NC_LASTSEEN, ni->last_seen);
+	    set_int(&t, NC_FLAGS, ni->flags);
+	    set_int(&t, NC_STATUS, ni->status);
+	}
+    } else {
+	ChannelInfo *ci;
+	add_column(&t, "channel", COL_DICT);
+	add_column(&t, "founder", COL_DICT);
+	add_column(&t, "successor", COL_DICT);
+	add_column(&t, "desc", COL_DICT);
+	add_column(&t, "email", COL_DICT);
+	add_column(&t, "registered", COL_INT);
+	add_column(&t, "lastused", COL_INT);
+	add_column(&t, "flags", COL_INT);
+	for (ci = cs_firstchan_sorted(); ci; ci = cs_nextchan_sorted()) {
+	    add_row(&t);
+	    set_string(&t, CC_NAME, ci->name);
+	    set_string(&t, CC_FOUNDER, ci->founder ? ci->founder->nick : NULL);
+	    set_string(&t, CC_SUCCESSOR,
+		       ci->successor ? ci->successor->nick : NULL);
+	    set_string(&t, CC_DESC, ci->desc);
+	    set_string(&t, CC_EMAIL, ci->email);
+	    set_int(&t, CC_REGISTERED, ci->time_registered);
+	    set_int(&t, CC_LASTUSED, ci->last_used);
+	    set_int(&t, CC_FLAGS, ci->flags);
+	}
+    }
+    if (write_export(&t, f) < 0) {
+	fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+	exit(1);
+    }
+    printf("%u %s exported to %s.\n", t.rows,
+	   kind=='N' ? "nicknames" : "channels", filename);
+}
+
+/*************************************************************************/
+
+/* Search an export file and print the names (the first column) of all
+ * rows which match every one of the given conditions:
+ *     column=pattern   String column matches wildcard pattern (ignoring
+ *                          case)
+ *     column<time      Time column is less than `time' ago (see dotime())
+ *     column>time      Time column is more than `time' ago
+ *     column&value     Flag column has any of the bits in `value' set
+ * If count_only is nonzero, only the number of matching rows is printed.
+ */
+
+static void do_query(const char *filename, int count_only,
+		     int ncond, char **conds)
+{
+    ExportTable *t;
+    unsigned char *sel;
+    uint32 i, count;
+    time_t now = time(NULL);
+    int n;
+
+    if (!(t = read_export(filename)))
+	exit(1);
+    sel = smalloc(t->rows ? t->rows : 1);
+    memset(sel, 1, t->rows);
+
+    for (n = 0; n < ncond; n++) {
+	char *s = conds[n] + strcspn(conds[n], "=<>&");
+	char op = *s;
+	Column *col = NULL;
+	const uint32 *v;
+	int c;
+
+	if (op)
+	    *s++ = 0;
+	for (c = 0; c < t->ncols; c++) {
+	    if (stricmp(t->cols[c].name, conds[n]) == 0) {
+		col = &t->cols[c];
+		break;
+	    }
+	}
+	if (!op || !col || (op == '=') != (col->type == COL_DICT)) {
+	    if (op)
+		s[-1] = op;
+	    fprintf(stderr, "Invalid condition: %s\nColumns are:", conds[n]);
+	    for (c = 0; c < t->ncols; c++) {
+		fprintf(stderr, " %s (%s)", t->cols[c].name,
+			t->cols[c].type==COL_DICT ? "string" : "number");
+	    }
+	    fprintf(stderr, "\n");
+	    exit(1);
+	}
+	v = col->values;
+
+	if (op == '=') {
+	    /* Match each distinct string once, then look up each row's
+	     * string in the result */
+	    unsigned char *match = smalloc(col->nstrings ? col->nstrings : 1);
+	    for (i = 0; i < col->nstrings; i++)
+		match[i] = match_wild_nocase(s, dict_string(col, i)) ? 1 : 0;
+	    for (i = 0; i < t->rows; i++)
+		sel[i] &= match[v[i]];
+	    free(match);
+	} else if (op == '&') {
+	    uint32 mask = strtoul(s, &s, 0);
+	    if (*s) {
+		fprintf(stderr, "Invalid flag value in condition: %s\n", s);
+		exit(1);
+	    }
+	    for (i = 0; i < t->rows; i++)
+		sel[i] &= (v[i] & mask) != 0;
+	} else {
+	    int age = dotime(s);
+	    uint32 limit;
+	    if (age < 0) {
+		fprintf(stderr, "Invalid time in condition: %s\n", s);
+		exit(1);
+	    }
+	    limit = now - age;
+	    if (op == '<') {
+		for (i = 0; i < t->rows; i++)
+		    sel[i] &= v[i] > limit;
+	    } else {
+		for (i = 0; i < t->rows; i++)
+		    sel[i] &= v[i] < limit;
+	    }
+	}
+    }
+
+    count = 0;
+    for (i = 0; i < t->rows; i++) {
+	if (sel[i]) {
+	    if (!count_only)
+		printf("%s\n", dict_string(&t->cols[0], t->cols[0].values[i]));
+	    count++;
+	}
+    }
+    printf("%u of %u %s matched.\n", count, t->rows,
+	   t->kind=='N' ? "nicknames" : "channels");
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Remove the parameter of the option in av[i] (either the rest of av[i]
+ * or the following argument) from the argument list, and return it, or
+ * NULL if there is none.
+ */
+
+static char *get_optparam(int *ac, char **av, int i)
+{
+    char *param;
+
+    if (av[i][2])
+	return av[i]+2;
+    if (i >= *ac-1)
+	return NULL;
+    param = av[i+1];
+    (*ac)--;
+    memmove(av+i+1, av+i+2, sizeof(char *) * (*ac-i-1));
+    return param;
+}
+
+/*************************************************************************/
+
 void listnicks(int ac, char **av)
 {
     int count = 0;	/* Count only rather than display? */
     int usage = 0;	/* Display command usage?  (>0 also indicates error) */
+    char *exportfile = NULL;	/* File to export to (-x) */
+    char *queryfile = NULL;	/* File to search (-q) */
+    FILE *exportf = NULL;
     int i;
 
     i = 1;
@@ -195,50 +736,74 @@ void listnicks(int ac, char **av)
 	      case 'h':
 		usage = -1; break;
 	      case 'c':
-		if (i > 1)
-		    usage = 1;
 		count = 1; break;
 	      case 'd':
-		if (av[i][2]) {
-		    services_dir = av[i]+2;
-		} else {
-		    if (i >= ac-1) {
-			usage = 1;
-			break;
-		    }
-		    ac--;
-		    memmove(av+i, av+i+1, sizeof(char *) * ac-i);
-		    services_dir = av[i];
-		}
+		if (!(services_dir = get_optparam(&ac, av, i)))
+		    usage = 1;
+		break;
+	      case 'x':
+		if (!(exportfile = get_optparam(&ac, av, i)))
+		    usage = 1;
+		break;
+	      case 'q':
+		if (!(queryfile = get_optparam(&ac, av, i)))
+		    usage = 1;
 		break;
 	      default :
 		usage = 1; break;
 	    } /* switch */
 	    ac--;
 	    if (i < ac)
-		memmove(av+i, av+i+1, sizeof(char *) * ac-i);
+		memmove(av+i, av+i+1, sizeof(char *) * (ac-i));
 	} else {
-	    if (count)
-		usage = 1;
 	    i++;
 	}
     }
+    if (!queryfile && (count || exportfile) && ac > 1)
+	usage = 1;
+    if (exportfile && (count || queryfile))
+	usage = 1;
     if (usage) {
 	fprintf(stderr, "\
 \n\
 Usage: listnicks [-c] [-d data-dir] [nick [nick...]]\n\
-     -c: display only count of registered nicks\n\
+       listnicks [-d data-dir] -x export-file\n\
+       listnicks [-c] -q export-file [condition [condition...]]\n\
+     -c: display only count of registered (or matching) nicks\n\
             (cannot be combined with nicks)\n\
+     -x: write the nickname database to the given file in a form that\n\
+            can be searched quickly with -q\n\
+     -q: list the nicks in a file written by -x that match all of the\n\
+            given conditions\n\
    nick: nickname(s) to display information for\n\
 \n\
 If no nicks are given, the entire nickname database is printed out in\n\
 compact format followed by the number of registered nicks (with -c, the\n\
 list is suppressed and only the count is printed).  If one or more nicks\n\
 are given, detailed information about those nicks is displayed.\n\
+\n\
+A condition is one of:\n\
+    column=pattern   column matches the wildcard pattern (ignoring case)\n\
+    column<time      column is less than the given time (e.g. 30d) ago\n\
+    column>time      column is more than the given time ago\n\
+    column&value     column has any of the given flag bits set\n\
+The columns are nick, user, host, realname, email, link (the nick this\n\
+one is linked to), registered, lastseen, flags, and status.  Remember to\n\
+quote conditions containing <, >, &, or wildcards.\n\
 \n");
 	exit(usage>0 ? 1 : 0);
     }
 
+    if (queryfile) {
+	do_query(queryfile, count, ac-1, av+1);
+	exit(0);
+    }
+    /* Open the export file now, so relative pathnames work as expected */
+    if (exportfile && !(exportf = fopen(exportfile, "w"))) {
+	fprintf(stderr, "%s: %s\n", exportfile, strerror(errno));
+	exit(1);
+    }
+
     if (chdir(services_dir) < 0) {
 	fprintf(stderr, "chdir(%s): %s\n", services_dir, strerror(errno));
 	exit(1);
@@ -249,7 +814,9 @@ are given, detailed information about those nicks is displayed.\n\
 
     lang_init();
 
-    if (ac > 1) {
+    if (exportf) {
+	do_export('N', exportf, exportfile);
+    } else if (ac > 1) {
 	for (i = 1; i < ac; i++)
 	    do_listnicks(0, av[i]);
     } else {
@@ -264,6 +831,9 @@ void listchans(int ac, char **av)
 {
     int count = 0;	/* Count only rather than display? */
     int usage = 0;	/* Display command usage?  (>0 also indicates error) */
+    char *exportfile = NULL;	/* File to export to (-x) */
+    char *queryfile = NULL;	/* File to search (-q) */
+    FILE *exportf = NULL;
     int i;
 
     i = 1;
@@ -273,50 +843,74 @@ void listchans(int ac, char **av)
 	      case 'h':
 		usage = -1; break;
 	      case 'c':
-		if (i > 1)
-		    usage = 1;
 		count = 1; break;
 	      case 'd':
-		if (av[i][2]) {
-		    services_dir = av[i]+2;
-		} else {
-		    if (i >= ac-1) {
-			usage = 1;
-			break;
-		    }
-		    ac--;
-		    memmove(av+i, av+i+1, sizeof(char *) * ac-i);
-		    services_dir = av[i];
-		}
+		if (!(services_dir = get_optparam(&ac, av, i)))
+		    usage = 1;
+		break;
+	      case 'x':
+		if (!(exportfile = get_optparam(&ac, av, i)))
+		    usage = 1;
+		break;
+	      case 'q':
+		if (!(queryfile = get_optparam(&ac, av, i)))
+		    usage = 1;
 		break;
 	      default :
 		usage = 1; break;
 	    } /* switch */
 	    ac--;
 	    if (i < ac)
-		memmove(av+i, av+i+1, sizeof(char *) * ac-i);
+		memmove(av+i, av+i+1, sizeof(char *) * (ac-i));
 	} else {
-	    if (count)
-		usage = 1;
 	    i++;
 	}
     }
+    if (!queryfile && (count || exportfile) && ac > 1)
+	usage = 1;
+    if (exportfile && (count || queryfile))
+	usage = 1;
     if (usage) {
 	fprintf(stderr, "\
 \n\
 Usage: listchans [-c] [-d data-dir] [channel [channel...]]\n\
-     -c: display only count of registered channels\n\
+       listchans [-d data-dir] -x export-file\n\
+       listchans [-c] -q export-file [condition [condition...]]\n\
+     -c: display only count of registered (or matching) channels\n\
             (cannot be combined with channels)\n\
+     -x: write the channel database to the given file in a form that\n\
+            can be searched quickly with -q\n\
+     -q: list the channels in a file written by -x that match all of the\n\
+            given conditions\n\
 channel: channel(s) to display information for\n\
 \n\
 If no channels are given, the entire channel database is printed out in\n\
 compact format followed by the number of registered channels (with -c, the\n\
 list is suppressed and only the count is printed).  If one or more channels\n\
 are given, detailed information about those channels is displayed.\n\
+\n\
+A condition is one of:\n\
+    column=pattern   column matches the wildcard pattern (ignoring case)\n\
+    column<time      column is less than the given time (e.g. 30d) ago\n\
+    column>time      column is more than the given time ago\n\
+    column&value     column has any of the given flag bits set\n\
+The columns are channel, founder, successor, desc, email, registered,\n\
+lastused, and flags.  Remember to quote conditions containing <, >, &, or\n\
+wildcards.\n\
 \n");
 	exit(usage>0 ? 1 : 0);
     }
 
+    if (queryfile) {
+	do_query(queryfile, count, ac-1, av+1);
+	exit(0);
+    }
+    /* Open the export file now, so relative pathnames work as expected */
+    if (exportfile && !(exportf = fopen(exportfile, "w"))) {
+	fprintf(stderr, "%s: %s\n", exportfile, strerror(errno));
+	exit(1);
+    }
+
     if (chdir(services_dir) < 0) {
 	fprintf(stderr, "chdir(%s): %s\n", services_dir, strerror(errno));
 	exit(1);
@@ -328,7 +922,9 @@ are given, detailed information about those channels is displayed.\n\
 
     lang_init();
 
-    if (ac > 1) {
+    if (exportf) {
+	do_export('C', exportf, exportfile);
+    } else if (ac > 1) {
 	for (i = 1; i < ac; i++)
 	    do_listchans(0, av[i]);
     } else {
@@ -12,6 +12,14 @@
 
 static FILE *logfile;
 
+/* Databases may be loaded by a second thread (see init.c), which logs
+ * like any other code, so avoid localtime()'s shared buffer then. */
+#if HAVE_PTHREAD
+# define get_localtime(t,tm)	localtime_r((t), (tm))
+#else
+# define get_localtime(t,tm)	(*(tm) = *localtime(t))
+#endif
+
 /*************************************************************************/
 
 /* Open the log file.  Return -1 if the log file could not be opened, else
@@ -53,7 +61,7 @@ void log(const char *fmt, ...)
 
     va_start(args, fmt);
     time(&t);
-    tm = *localtime(&t);
+    get_localtime(&t, &tm);
 #if HAVE_GETTIMEOFDAY
     if (debug) {
 	char *s;
@@ -98,7 +106,7 @@ void log_perror(const char *fmt, ...)
 
     va_start(args, fmt);
     time(&t);
-    tm = *localtime(&t);
+    get_localtime(&t, &tm);
 #if HAVE_GETTIMEOFDAY
     if (debug) {
 	char *s;
@@ -143,7 +151,7 @@ void fatal(const char *fmt, ...)
 
     va_start(args, fmt);
     time(&t);
-    tm = *localtime(&t);
+    get_localtime(&t, &tm);
 #if HAVE_GETTIMEOFDAY
     if (debug) {
 	char *s;
@@ -183,7 +191,7 @@ void fatal_perror(const char *fmt, ...)
 
     va_start(args, fmt);
     time(&t);
-    tm = *localtime(&t);
+    get_localtime(&t, &tm);
 #if HAVE_GETTIMEOFDAY
     if (debug) {
 	char *s;
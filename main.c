@@ -18,8 +18,11 @@
  */
 
 #include "services.h"
+#include "datafiles.h"
+#include "encrypt.h"
 #include "timeout.h"
 #include "version.h"
+#include <sys/wait.h>
 
 
 /******** Global variables! ********/
@@ -68,6 +71,11 @@ static int started = 0;
 /* If we get a signal, use this to jump out of the main loop. */
 static sigjmp_buf panic_jmp;
 
+/* Process ID of the background database save in progress (0 if none), and
+ * when it was started. */
+static pid_t save_pid = 0;
+static time_t save_started;
+
 /*************************************************************************/
 
 /* Various signal handlers. */
@@ -160,6 +168,11 @@ void weirdsig_handler(int signum)
 		          break;
 		case -25: snprintf(buf, sizeof(buf), "expiring autokills");
 		          break;
+		case -36: snprintf(buf, sizeof(buf), "flushing journals");
+		          break;
+		case -37: snprintf(buf, sizeof(buf),
+				   "completing password operations");
+		          break;
 		default : snprintf(buf, sizeof(buf), "waiting=%d", waiting);
 	    }
 	    wallops(NULL, "PANIC! %s (%s)", buf, strsignal(signum));
@@ -189,12 +202,157 @@ void weirdsig_handler(int signum)
 
 /*************************************************************************/
 
+/* Save all databases.  If `full' is zero, the nickname and channel
+ * databases are left alone, since their changes are being journaled. */
+
+static void save_databases(int full)
+{
+    waiting = -2;
+    if (debug)
+	log("debug: Saving databases");
+    if (!skeleton && full) {
+	waiting = -11;
+	save_ns_dbase();
+	waiting = -12;
+	save_cs_dbase();
+    }
+    waiting = -14;
+    save_os_dbase();
+    waiting = -15;
+    save_akill();
+    waiting = -30;
+    save_nooper();
+    waiting = -31;
+    save_snooper();
+    waiting = -32;
+    save_aconnect();
+    waiting = -33;
+    save_fs_dbase();
+    waiting = -34;
+    save_grname_dbase();
+    waiting = -35;
+    save_nakill();
+    waiting = -16;
+    save_news();
+#ifndef STREAMLINED
+    waiting = -17;
+    save_exceptions();
+#endif
+#ifdef STATISTICS
+    waiting = -18;
+    save_ss_dbase();
+#endif
+}
+
+/*************************************************************************/
+
+/* Save all databases from a child process, so that we can go on talking
+ * to the server while the data is written out.  The child works from its
+ * own (copy-on-write) image of our memory and writes the files through
+ * the usual open_db()/close_db() backup-and-replace sequence; its exit
+ * code tells us whether any database failed to save.  If the fork fails,
+ * save in the foreground instead.
+ */
+
+static void start_background_save(int full)
+{
+    pid_t pid;
+
+    fflush(NULL);	/* Don't let the child write out our buffers too */
+    pid = fork();
+    if (pid < 0) {
+	log_perror("Can't fork for background save, saving databases now");
+	save_databases(full);
+	return;
+    }
+    if (pid == 0) {
+	/* Nothing the child does may reach the server, and signals must
+	 * not send it back into the main loop. */
+	started = 0;
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGUSR2, SIG_IGN);
+	signal(SIGTERM, SIG_DFL);
+	close(servsock);
+	servsock = -1;
+	db_write_errors = 0;
+	save_databases(full);
+	_exit(db_write_errors ? 1 : 0);
+    }
+    save_pid = pid;
+    save_started = time(NULL);
+    if (debug)
+	log("debug: Saving databases in background (pid %d)", (int)pid);
+}
+
+
+/* Check whether the background save has finished, waiting for it if
+ * `wait' is nonzero, and report on how it went. */
+
+static void check_background_save(int wait)
+{
+    int status;
+    pid_t pid;
+
+    do {
+	pid = waitpid(save_pid, &status, wait ? 0 : WNOHANG);
+    } while (pid < 0 && errno == EINTR);
+    if (pid == 0)
+	return;		/* Still running */
+    save_pid = 0;
+    if (pid < 0) {
+	log_perror("Lost track of background database save");
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+	if (debug) {
+	    log("debug: Background database save finished in %ld seconds",
+		(long)(time(NULL) - save_started));
+	}
+    } else if (WIFSIGNALED(status)) {
+	log("Background database save killed by signal %d",
+	    WTERMSIG(status));
+	wallops(NULL, "Background database save killed by signal %d",
+		WTERMSIG(status));
+    } else {
+	log("Background database save failed; see earlier log messages");
+	wallops(NULL, "Background database save failed; check the log file");
+    }
+}
+
+/*************************************************************************/
+
+/* Decide whether a database update should write out the full nickname
+ * and channel databases, and if so, set the current journals aside for
+ * the save to replace.  This is done here rather than in the saving
+ * process so that nothing is appended to a journal after the point the
+ * save reflects.  Returns nonzero for a full save.
+ */
+
+static int prepare_save(time_t now)
+{
+    static time_t last_compact = 0;
+
+    if (JournalFlush && !save_data && !skeleton) {
+	if (!last_compact)
+	    last_compact = now;
+	if (now - last_compact < JournalCompact)
+	    return 0;
+    }
+    if (JournalFlush && !skeleton) {
+	ns_journal_rotate();
+	cs_journal_rotate();
+    }
+    last_compact = now;
+    return 1;
+}
+
+/*************************************************************************/
+
 /* Main routine.  (What does it look like? :-) ) */
 
 int main(int ac, char **av, char **envp)
 {
     volatile time_t last_update; /* When did we last update the databases? */
     volatile time_t last_expire; /* When did we last expire nicks/channels? */
+    volatile time_t last_journal;/* When did we last flush the journals? */
     volatile uint32 last_check;  /* When did we last check timeouts? */
     int i;
     char *progname;
@@ -228,6 +386,7 @@ int main(int ac, char **av, char **envp)
     /* Set up timers. */
     last_update = time(NULL);
     last_expire = time(NULL);
+    last_journal = time(NULL);
     last_check  = time(NULL);
 
     /* The signal handler routine will drop back here with quitting != 0
@@ -238,6 +397,7 @@ int main(int ac, char **av, char **envp)
     signal(SIGHUP, sighup_handler);
     signal(SIGTERM, sigterm_handler);
     signal(SIGUSR2, sigusr2_handler);
+    signal(SIGCHLD, SIG_DFL);	/* So we can wait for background saves */
 
     started = 1;
 
@@ -269,42 +429,32 @@ int main(int ac, char **av, char **envp)
 #endif
 	    last_expire = now;
 	}
+	if (JournalFlush && !readonly && !skeleton
+	 && now-last_journal >= JournalFlush
+	) {
+	    waiting = -36;
+	    ns_journal_flush();
+	    cs_journal_flush();
+	    last_journal = now;
+	}
+	if (save_pid)
+	    check_background_save(0);
 	if (!readonly && (save_data || now-last_update >= UpdateTimeout)) {
-	    waiting = -2;
-	    if (debug)
-		log("debug: Saving databases");
-	    if (!skeleton) {
-		waiting = -11;
-		save_ns_dbase();
-		waiting = -12;
-		save_cs_dbase();
+	    if (BackgroundSave && !save_data) {
+		/* Periodic update: don't start another save if the last
+		 * one is still running. */
+		if (!save_pid)
+		    start_background_save(prepare_save(now));
+		else if (debug)
+		    log("debug: Background save still running, skipping");
+	    } else {
+		/* Explicit update, restart or shutdown: the files must be
+		 * complete when we return, and nobody else may be writing
+		 * them. */
+		if (save_pid)
+		    check_background_save(1);
+		save_databases(prepare_save(now));
 	    }
-	    waiting = -14;
-	    save_os_dbase();
-	    waiting = -15;
-	    save_akill();
-		waiting = -30;
-		save_nooper();
-		waiting = -31;
-		save_snooper();
-		waiting = -32;
-		save_aconnect();
-	    waiting = -33;
-		save_fs_dbase();
-		waiting = -34;
-		save_grname_dbase();
-		waiting = -35;
-		save_nakill();
-	    waiting = -16;
-	    save_news();
-#ifndef STREAMLINED
-            waiting = -17;
-            save_exceptions();
-#endif
-#ifdef STATISTICS
-	    waiting = -18;
-	    save_ss_dbase();
-#endif
 	    if (save_data < 0)
 		break;	/* out of main loop */
 
@@ -321,6 +471,10 @@ int main(int ac, char **av, char **envp)
 	    check_timeouts();
 	    last_check = now_msec;
 	}
+	waiting = -37;
+	run_password_callbacks();
+	/* Keep working through a burst even if the network goes quiet. */
+	set_read_limit(burst_users_waiting() ? TimeoutCheck+1 : 0);
 	waiting = 1;
 	i = (int)(long)sgets2(inbuf, sizeof(inbuf), servsock);
 	waiting = 0;
@@ -341,6 +495,10 @@ int main(int ac, char **av, char **envp)
     }
 
 
+    /* Don't leave a half-written database behind for the next run */
+    if (save_pid)
+	check_background_save(1);
+
     /* Check for restart instead of exit */
     if (save_data == -2) {
 	log("Restarting");
@@ -9,6 +9,9 @@
 
 #define NO_MEMREDEF
 #include "services.h"
+#if HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 /*************************************************************************/
 /*************************************************************************/
@@ -74,11 +77,180 @@ void init_memory(void)
 
 /*************************************************************************/
 
+/* String tables.  Strings read from a database block are not allocated
+ * one by one; the block's strings are copied in one piece into a string
+ * table with new_strtab(), and the reader hands out pointers into it (see
+ * read_string() in datafiles.c).  sfree() and srealloc() recognize such
+ * pointers, and a table is freed once its reader has released it with
+ * release_strtab() and every string handed out from it has been freed.
+ * Until then, the space of strings already freed is not reused.
+ *
+ * The databases are loaded by several threads at once (see init()); while
+ * they are, set_strtab_locking(1) makes the table functions lock.
+ */
+
+typedef struct strtab_ StrTab;
+struct strtab_ {
+    long len;		/* Length of the table data, which follows */
+    long refs;		/* Strings handed out and not yet freed; may be
+			 *    negative until the reader releases the table */
+    int held;		/* Nonzero until the reader releases the table */
+};
+
+static StrTab **strtabs;	/* All tables, sorted by address */
+static int strtabs_count, strtabs_size;
+
+#if HAVE_PTHREAD
+static pthread_mutex_t strtab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int strtab_locking;
+
+void set_strtab_locking(int on)
+{
+    strtab_locking = on;
+}
+
+# define LOCK_STRTABS() \
+    do { if (strtab_locking) pthread_mutex_lock(&strtab_mutex); } while (0)
+# define UNLOCK_STRTABS() \
+    do { if (strtab_locking) pthread_mutex_unlock(&strtab_mutex); } while (0)
+#else
+# define LOCK_STRTABS()		/* nothing */
+# define UNLOCK_STRTABS()	/* nothing */
+#endif
+
+
+/* Return the index in strtabs[] of the table containing `ptr', or -1 if
+ * there is none.  Must be called with the tables locked. */
+
+static int find_strtab(const void *ptr)
+{
+    const char *p = ptr;
+    int lo = 0, hi = strtabs_count - 1;
+
+    while (lo <= hi) {
+	int i = (lo + hi) / 2;
+	const char *data = (const char *)(strtabs[i] + 1);
+	if (p < data)
+	    hi = i - 1;
+	else if (p >= data + strtabs[i]->len)
+	    lo = i + 1;
+	else
+	    return i;
+    }
+    return -1;
+}
+
+
+/* Remove strtabs[i] from the list and return it.  Must be called with the
+ * tables locked. */
+
+static StrTab *unlink_strtab(int i)
+{
+    StrTab *tab = strtabs[i];
+
+    strtabs_count--;
+    memmove(&strtabs[i], &strtabs[i+1], (strtabs_count-i)*sizeof(*strtabs));
+    return tab;
+}
+
+
+/* Return whether `ptr' points into a string table. */
+
+static int in_strtab(const void *ptr)
+{
+    int found;
+
+    LOCK_STRTABS();
+    found = strtabs_count > 0 && find_strtab(ptr) >= 0;
+    UNLOCK_STRTABS();
+    return found;
+}
+
+
+/* If `ptr' points into a string table, account for the string being freed
+ * (freeing the table if it is no longer used) and return 1; otherwise
+ * return 0. */
+
+static int free_string(const void *ptr)
+{
+    StrTab *tab = NULL;
+    int i = -1;
+
+    LOCK_STRTABS();
+    if (strtabs_count > 0 && (i = find_strtab(ptr)) >= 0) {
+	if (--strtabs[i]->refs == 0 && !strtabs[i]->held)
+	    tab = unlink_strtab(i);
+    }
+    UNLOCK_STRTABS();
+    free(tab);
+    return i >= 0;
+}
+
+
+/* Create a string table holding a copy of `len' bytes from `data', and
+ * return a pointer to the copy. */
+
+char *new_strtab(const void *data, long len)
+{
+    StrTab *tab;
+    int i;
+
+    tab = malloc(sizeof(*tab) + len);
+    if (tab == NULL)
+	raise(SIGUSR1);
+    tab->len = len;
+    tab->refs = 0;
+    tab->held = 1;
+    memcpy(tab+1, data, len);
+
+    LOCK_STRTABS();
+    if (strtabs_count >= strtabs_size) {
+	StrTab **newlist;
+	strtabs_size = strtabs_size ? strtabs_size*2 : 64;
+	newlist = realloc(strtabs, strtabs_size * sizeof(*strtabs));
+	if (newlist == NULL)
+	    raise(SIGUSR1);
+	strtabs = newlist;
+    }
+    for (i = strtabs_count; i > 0 && strtabs[i-1] > tab; i--)
+	strtabs[i] = strtabs[i-1];
+    strtabs[i] = tab;
+    strtabs_count++;
+    UNLOCK_STRTABS();
+    return (char *)(tab+1);
+}
+
+
+/* Release a string table returned by new_strtab(), from which `uses'
+ * strings have been handed out.  The table is freed as soon as all of
+ * those strings have been freed. */
+
+void release_strtab(char *data, long uses)
+{
+    StrTab *tab = (StrTab *)data - 1;
+    int i;
+
+    LOCK_STRTABS();
+    tab->refs += uses;
+    tab->held = 0;
+    if (tab->refs == 0) {
+	i = find_strtab(data);
+	tab = unlink_strtab(i);
+    } else {
+	tab = NULL;
+    }
+    UNLOCK_STRTABS();
+    free(tab);
+}
+
+/*************************************************************************/
+
 /* smalloc, scalloc, srealloc, (sfree), sstrdup:
  *	Versions of the memory allocation functions which will cause the
  *	program to terminate with an "Out of memory" error if the memory
  *	cannot be allocated.  (Hence, the return value from these functions
- *	is never NULL.)  sfree() is used only with MEMCHECKS enabled.
+ *	is never NULL.)  free() and realloc() are redefined to sfree() and
+ *	srealloc(), which also handle strings from string tables (below).
  */
 
 /*************************************************************************/
@@ -177,13 +349,17 @@ void *srealloc(void *oldptr, long newsize)
 #endif /* MEMCHECKS */
 
     if (newsize == 0) {
-#ifdef MEMCHECKS
 	sfree(oldptr);
-#else
-	free(oldptr);
-#endif
 	return NULL;
     }
+    if (oldptr && in_strtab(oldptr)) {
+	/* Strings in a string table can't grow in place, so copy them out */
+	long len = strlen(oldptr) + 1;
+	void *newptr = smalloc(newsize);
+	memcpy(newptr, oldptr, len < newsize ? len : newsize);
+	sfree(oldptr);
+	return newptr;
+    }
 
 #ifdef MEMCHECKS
 
@@ -223,13 +399,15 @@ void *srealloc(void *oldptr, long newsize)
 
 /*************************************************************************/
 
-#ifdef MEMCHECKS
 void sfree(void *ptr)
 {
+#ifdef MEMCHECKS
     MemBlock *mb;
 
     if (ptr == NULL)
 	fatal("Attempt to sfree() a NULL pointer!");
+    if (free_string(ptr))
+	return;
     mb = (MemBlock *)((char *)(ptr) - sizeof(MemBlock));
     if (mb->sig != SIGNATURE)
 	fatal("Attempt to sfree() an invalid pointer! (%p)", ptr);
@@ -240,8 +418,11 @@ void sfree(void *ptr)
 # endif
     mb->sig = FREED_SIGNATURE;
     free(mb);
+#else
+    if (ptr && !free_string(ptr))
+	free(ptr);
+#endif
 }
-#endif /* MEMCHECKS */   
 
 /*************************************************************************/
 
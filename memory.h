@@ -14,8 +14,12 @@ extern void *smalloc(long size);
 extern void *scalloc(long elsize, long els);
 extern void *srealloc(void *oldptr, long newsize);
 extern char *sstrdup(const char *s);
-#ifdef MEMCHECKS
 extern void sfree(void *ptr);
+
+extern char *new_strtab(const void *data, long len);
+extern void release_strtab(char *tab, long uses);
+#if HAVE_PTHREAD
+extern void set_strtab_locking(int on);
 #endif
 
 /*************************************************************************/
@@ -36,6 +40,20 @@ extern void sfree(void *ptr);
 
 #endif /* MEMCHECKS && !NO_MEMREDEF */
 
+/* Strings loaded from databases may point into a string table (see
+ * new_strtab() in memory.c), so free() and realloc() go through sfree()
+ * and srealloc() even without MEMCHECKS. */
+
+#if !defined(MEMCHECKS) && !defined(NO_MEMREDEF) && !defined(NOT_MAIN)
+
+# undef realloc
+# undef free
+
+# define realloc srealloc
+# define free sfree
+
+#endif /* !MEMCHECKS && !NO_MEMREDEF && !NOT_MAIN */
+
 /*************************************************************************/
 
 #endif /* MEMORY_H */
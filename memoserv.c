@@ -27,6 +27,7 @@ static int read_memo(User *u, int index, MemoInfo *mi, const char *chan);
 static int read_memo_callback(User *u, int num, va_list args);
 static int del_memo(MemoInfo *mi, int num);
 static int del_memo_callback(User *u, int num, va_list args);
+static void purge_memos(MemoInfo *mi);
 
 static void do_help(User *u);
 static void do_send(User *u);
@@ -198,6 +199,7 @@ void load_old_ms_dbase(void)
 		    memos->number = oldmemo.number;
 		    memos->time = oldmemo.time;
 		    memos->flags = oldmemo.flags;
+		    memos->textpos = 0;
 		}
 		memos = old_memolist.memos;
 		for (j = 0; j < old_memolist.n_memos; j++) {
@@ -208,6 +210,7 @@ void load_old_ms_dbase(void)
 		if (ni) {
 		    ni->memos.memocount = old_memolist.n_memos;
 		    ni->memos.memos = old_memolist.memos;
+		    memos_loaded(&ni->memos, ni->nick);
 		}
 	    }
 	}
@@ -222,6 +225,41 @@ void load_old_ms_dbase(void)
 
 /*************************************************************************/
 
+/* Sort function for memos_loaded(). */
+
+static int memo_cmp(const void *a, const void *b)
+{
+    const Memo *m1 = a, *m2 = b;
+
+    return m1->number < m2->number ? -1 : m1->number > m2->number;
+}
+
+/* Set up the online-only parts of a MemoInfo just read from a database:
+ * count its unread memos, sort the memos by number if (as might happen
+ * with imported databases) they aren't already, and check their texts
+ * against the memo store.  `owner' is the nick or channel the memos
+ * belong to.
+ */
+
+void memos_loaded(MemoInfo *mi, const char *owner)
+{
+    int i, sorted = 1;
+
+    mi->unread = 0;
+    for (i = 0; i < mi->memocount; i++) {
+	mi->memos[i].flags &= ~MF_DELETED;
+	if (mi->memos[i].flags & MF_UNREAD)
+	    mi->unread++;
+	if (i > 0 && mi->memos[i].number <= mi->memos[i-1].number)
+	    sorted = 0;
+    }
+    if (!sorted)
+	qsort(mi->memos, mi->memocount, sizeof(Memo), memo_cmp);
+    memo_store_check(owner, mi);
+}
+
+/*************************************************************************/
+
 /* check_memos:  See if the given user has any unread memos, and send a
  *               NOTICE to that user if so (and if the appropriate flag is
  *               set).
@@ -230,25 +268,21 @@ void load_old_ms_dbase(void)
 void check_memos(User *u)
 {
     NickInfo *ni = u->ni;
-    int i, newcnt = 0;
+    int i, newcnt;
 
     if (!ni || !nick_recognized(u) || !(ni->flags & NI_MEMO_SIGNON))
 	return;
 
-    for (i = 0; i < ni->memos.memocount; i++) {
-	if (ni->memos.memos[i].flags & MF_UNREAD)
-	    newcnt++;
-    }
+    newcnt = ni->memos.unread;
     if (newcnt > 0) {
+	i = ni->memos.memocount - 1;
 	notice_lang(s_MemoServ, u,
 		newcnt==1 ? MEMO_HAVE_NEW_MEMO : MEMO_HAVE_NEW_MEMOS, newcnt);
-	if (newcnt == 1 && (ni->memos.memos[i-1].flags & MF_UNREAD)) {
+	if (newcnt == 1 && (ni->memos.memos[i].flags & MF_UNREAD)) {
 	    notice_lang(s_MemoServ, u, MEMO_TYPE_READ_LAST, s_MemoServ);
 	} else if (newcnt == 1) {
-	    for (i = 0; i < ni->memos.memocount; i++) {
-		if (ni->memos.memos[i].flags & MF_UNREAD)
-		    break;
-	    }
+	    while (i > 0 && !(ni->memos.memos[i].flags & MF_UNREAD))
+		i--;
 	    notice_lang(s_MemoServ, u, MEMO_TYPE_READ_NUM, s_MemoServ,
 			ni->memos.memos[i].number);
 	} else {
@@ -326,6 +360,30 @@ static MemoInfo *getmemoinfo(const char *name, int *ischan, int *error)
 
 /*************************************************************************/
 
+/* Return the index of the memo with the given number, or -1 if there is
+ * none. */
+
+int find_memo(const MemoInfo *mi, uint32 num)
+{
+    int lo = 0, hi = mi->memocount - 1, i;
+
+    while (lo <= hi) {
+	i = (lo + hi) / 2;
+	if (mi->memos[i].number < num) {
+	    lo = i+1;
+	} else if (mi->memos[i].number > num) {
+	    hi = i-1;
+	} else {
+	    if (mi->memos[i].flags & MF_DELETED)
+		return -1;
+	    return i;
+	}
+    }
+    return -1;
+}
+
+/*************************************************************************/
+
 /* Display a single memo entry, possibly printing the header first. */
 
 static int list_memo(User *u, int index, MemoInfo *mi, int *sent_header,
@@ -368,14 +426,9 @@ static int list_memo_callback(User *u, int num, va_list args)
     MemoInfo *mi = va_arg(args, MemoInfo *);
     int *sent_header = va_arg(args, int *);
     const char *chan = va_arg(args, const char *);
-    int i;
 
-    for (i = 0; i < mi->memocount; i++) {
-	if (mi->memos[i].number == num)
-	    break;
-    }
     /* Range checking done by list_memo() */
-    return list_memo(u, i, mi, sent_header, 0, chan);
+    return list_memo(u, find_memo(mi, num), mi, sent_header, 0, chan);
 }
 
 /*************************************************************************/
@@ -401,8 +454,11 @@ static int read_memo(User *u, int index, MemoInfo *mi, const char *chan)
     else
 	notice_lang(s_MemoServ, u, MEMO_HEADER, m->number,
 		m->sender, timebuf, s_MemoServ, m->number);
-    notice_lang(s_MemoServ, u, MEMO_TEXT, m->text);
-    m->flags &= ~MF_UNREAD;
+    notice_lang(s_MemoServ, u, MEMO_TEXT, memo_text(m));
+    if (m->flags & MF_UNREAD) {
+	m->flags &= ~MF_UNREAD;
+	mi->unread--;
+    }
     return 1;
 }
 
@@ -412,42 +468,30 @@ static int read_memo_callback(User *u, int num, va_list args)
 {
     MemoInfo *mi = va_arg(args, MemoInfo *);
     const char *chan = va_arg(args, const char *);
-    int i;
 
-    for (i = 0; i < mi->memocount; i++) {
-	if (mi->memos[i].number == num)
-	    break;
-    }
     /* Range check done in read_memo */
-    return read_memo(u, i, mi, chan);
+    return read_memo(u, find_memo(mi, num), mi, chan);
 }
 
 /*************************************************************************/
 
-/* Delete a memo by number.  Return 1 if the memo was found, else 0. */
+/* Delete a memo by number.  Return 1 if the memo was found, else 0.  The
+ * memo is only marked deleted; purge_memos() must be called afterwards to
+ * remove it from the array, so that deleting a list of memos moves the
+ * rest of the array once rather than once per memo. */
 
 static int del_memo(MemoInfo *mi, int num)
 {
-    int i;
+    int i = find_memo(mi, num);
 
-    for (i = 0; i < mi->memocount; i++) {
-	if (mi->memos[i].number == num)
-	    break;
-    }
-    if (i < mi->memocount) {
-	free(mi->memos[i].text); /* Deallocate memo text memory */
-	mi->memocount--;	 /* One less memo now */
-	if (i < mi->memocount)	 /* Move remaining memos down a slot */
-	    memmove(mi->memos + i, mi->memos + i+1,
-				sizeof(Memo) * (mi->memocount - i));
-	if (mi->memocount == 0) { /* If no more memos, free array */
-	    free(mi->memos);
-	    mi->memos = NULL;
-	}
-	return 1;
-    } else {
+    if (i < 0)
 	return 0;
-    }
+    if (mi->memos[i].flags & MF_UNREAD)
+	mi->unread--;
+    free(mi->memos[i].text);	/* Deallocate memo text memory */
+    mi->memos[i].text = NULL;
+    mi->memos[i].flags = MF_DELETED;
+    return 1;
 }
 
 /* Delete a single memo from a MemoInfo. */
@@ -465,6 +509,27 @@ static int del_memo_callback(User *u, int num, va_list args)
     }
 }
 
+/* Remove memos marked by del_memo() from the array. */
+
+static void purge_memos(MemoInfo *mi)
+{
+    Memo *src, *dest, *end;
+
+    end = mi->memos + mi->memocount;
+    for (src = dest = mi->memos; src < end; src++) {
+	if (!(src->flags & MF_DELETED)) {
+	    if (dest != src)
+		*dest = *src;
+	    dest++;
+	}
+    }
+    mi->memocount = dest - mi->memos;
+    if (mi->memocount == 0 && mi->memos) {  /* If no more memos, free array */
+	free(mi->memos);
+	mi->memos = NULL;
+    }
+}
+
 /*************************************************************************/
 /*********************** MemoServ command routines ***********************/
 /*************************************************************************/
@@ -489,6 +554,7 @@ static void do_help(User *u)
 static void do_send(User *u)
 {
     char *source = u->nick;
+    const char *owner;
     int ischan, error;
     MemoInfo *mi;
     Memo *m;
@@ -536,17 +602,33 @@ static void do_send(User *u)
 	strscpy(m->sender, source, NICKMAX);
 	if (mi->memocount > 1) {
 	    m->number = m[-1].number + 1;
-	    if (m->number < 1) {
-		int i;
-		for (i = 0; i < mi->memocount; i++)
-		    mi->memos[i].number = i+1;
-	    }
 	} else {
 	    m->number = 1;
 	}
 	m->time = time(NULL);
 	m->text = sstrdup(text);
+	m->textpos = 0;
 	m->flags = MF_UNREAD;
+	mi->unread++;
+	if (ischan) {
+	    ChannelInfo *ci = cs_findchan(name);
+	    owner = ci->name;
+	    cs_journal_mark(ci);
+	} else {
+	    NickInfo *ni = getlink(findnick(name));
+	    owner = ni->nick;
+	    ns_journal_mark(ni);
+	}
+	if (m->number < 1) {
+	    /* Numbers wrapped around; renumber (and so re-key) them all */
+	    int i;
+	    for (i = 0; i < mi->memocount; i++) {
+		mi->memos[i].number = i+1;
+		store_memo_text(owner, &mi->memos[i]);
+	    }
+	} else {
+	    store_memo_text(owner, m);
+	}
 	notice_lang(s_MemoServ, u, MEMO_SENT, name);
 	if (!ischan) {
 	    NickInfo *ni = getlink(findnick(name));  /* cannot fail */
@@ -617,11 +699,7 @@ static void do_list(User *u)
 					mi, &sent_header, chan);
 	} else {
 	    if (param) {
-		for (i = 0, m = mi->memos; i < mi->memocount; i++, m++) {
-		    if (m->flags & MF_UNREAD)
-			break;
-		}
-		if (i == mi->memocount) {
+		if (!mi->unread) {
 		    if (chan)
 			notice_lang(s_MemoServ, u, MEMO_X_HAS_NO_NEW_MEMOS,
 					chan);
@@ -646,7 +724,7 @@ static void do_list(User *u)
 static void do_read(User *u)
 {
     MemoInfo *mi;
-    ChannelInfo *ci;
+    ChannelInfo *ci = NULL;
     char *numstr = strtok(NULL, " "), *chan = NULL;
     int num, count;
 
@@ -700,9 +778,7 @@ static void do_read(User *u)
 		    notice_lang(s_MemoServ, u, MEMO_HAVE_NO_NEW_MEMOS);
 	    }
 	} else if (stricmp(numstr, "LAST") == 0) {
-	    for (i = 0; i < mi->memocount-1; i++)
-		;
-	    read_memo(u, i, mi, chan);
+	    read_memo(u, mi->memocount-1, mi, chan);
 	} else {	/* number[s] */
 	    if (!process_numlist(numstr, &count, read_memo_callback, u,
 								mi, chan)) {
@@ -712,6 +788,11 @@ static void do_read(User *u)
 		    notice_lang(s_MemoServ, u, MEMO_LIST_NOT_FOUND, numstr);
 	    }
 	}
+	/* Memos read are no longer marked unread */
+	if (chan)
+	    cs_journal_mark(ci);
+	else
+	    ns_journal_mark(u->ni);
 
     }
 }
@@ -723,7 +804,7 @@ static void do_read(User *u)
 static void do_del(User *u)
 {
     MemoInfo *mi;
-    ChannelInfo *ci;
+    ChannelInfo *ci = NULL;
     char *numstr = strtok(NULL, ""), *chan = NULL;
     int last, i;
     int delcount, count;
@@ -761,6 +842,7 @@ static void do_del(User *u)
 	    /* Delete a specific memo or memos. */
 	    delcount = process_numlist(numstr, &count, del_memo_callback,
 				       u, mi, &last);
+	    purge_memos(mi);
 	    if (delcount) {
 		/* Some memos got deleted. */
 		if (delcount > 1)
@@ -782,8 +864,13 @@ static void do_del(User *u)
 	    free(mi->memos);
 	    mi->memos = NULL;
 	    mi->memocount = 0;
+	    mi->unread = 0;
 	    notice_lang(s_MemoServ, u, MEMO_DELETED_ALL);
 	}
+	if (chan)
+	    cs_journal_mark(ci);
+	else
+	    ns_journal_mark(u->ni);
     }
 }
 
@@ -806,6 +893,7 @@ static void do_set(User *u)
 	return;
     } else if (stricmp(cmd, "NOTIFY") == 0) {
 	do_set_notify(u, mi, param);
+	ns_journal_mark(u->ni);
     } else if (stricmp(cmd, "LIMIT") == 0) {
 	do_set_limit(u, mi, param);
     } else {
@@ -939,6 +1027,10 @@ static void do_set_limit(User *u, MemoInfo *mi, char *param)
 	}
     }
     mi->memomax = limit;
+    if (chan)
+	cs_journal_mark(ci);
+    else
+	ns_journal_mark(ni);
     if (limit > 0) {
 	if (!chan && ni == u->ni)
 	    notice_lang(s_MemoServ, u, MEMO_SET_YOUR_LIMIT, limit);
@@ -1013,11 +1105,7 @@ static void do_info(User *u)
 	    else
 		notice_lang(s_MemoServ, u, MEMO_INFO_X_MEMO, name);
 	} else {
-	    int count = 0, i;
-	    for (i = 0; i < mi->memocount; i++) {
-		if (mi->memos[i].flags & MF_UNREAD)
-		    count++;
-	    }
+	    int count = mi->unread;
 	    if (count == mi->memocount)
 		notice_lang(s_MemoServ, u, MEMO_INFO_X_MEMOS_ALL_UNREAD,
 			name, count);
@@ -1063,11 +1151,7 @@ static void do_info(User *u)
 	    else
 		notice_lang(s_MemoServ, u, MEMO_INFO_MEMO);
 	} else {
-	    int count = 0, i;
-	    for (i = 0; i < mi->memocount; i++) {
-		if (mi->memos[i].flags & MF_UNREAD)
-		    count++;
-	    }
+	    int count = mi->unread;
 	    if (count == mi->memocount)
 		notice_lang(s_MemoServ, u, MEMO_INFO_MEMOS_ALL_UNREAD, count);
 	    else if (count == 0)
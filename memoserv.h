@@ -11,21 +11,30 @@
 #define MEMOSERV_H
 
 /* Memo info structures.  Since both nicknames and channels can have memos,
- * we encapsulate memo data in a MemoList to make it easier to handle. */
+ * we encapsulate memo data in a MemoList to make it easier to handle.
+ * The memos array is always kept in ascending order of memo number (see
+ * memos_loaded() in memoserv.c), so memos can be looked up by number with
+ * a binary search. */
 
 typedef struct {
     uint32 number;	/* Index number -- not necessarily array position! */
     int16 flags;
     time_t time;	/* When it was sent */
     char sender[NICKMAX];
-    char *text;
+    char *text;		/* NULL if the text is in the memo store */
+    uint32 textpos;	/* Offset of text in memo store, 0 if none */
 } Memo;
 
 #define MF_UNREAD	0x0001	/* Memo has not yet been read */
+#define MF_NOTEXT	0x2000	/* Text not found in the memo store
+				 * (only set while loading; never saved) */
+#define MF_DELETED	0x4000	/* Memo deleted, slot not yet reclaimed
+				 * (only set during a DEL; never saved) */
 
 struct memoinfo_ {
     int16 memocount, memomax;
     Memo *memos;
+    int16 unread;	/* Number of memos with MF_UNREAD set (not saved) */
 };
 
 #endif	/* MEMOSERV_H */
@@ -0,0 +1,585 @@
+/* Memo text store.
+ *
+ * IRC Services is copyright (c) 1996-2002 Andrew Church.
+ *     E-mail: <achurch@achurch.org>
+ * Parts copyright (c) 1999-2000 Andrew Kempe and others.
+ * This program is free but copyrighted software; see the file COPYING for
+ * details.
+ */
+
+#include "services.h"
+#include "datafiles.h"
+#include <fcntl.h>
+#if HAVE_MMAP
+# include <sys/mman.h>
+#endif
+
+/*************************************************************************/
+
+/* When MemoTextDB is set, memo texts are kept out of memory in a separate
+ * append-only file, and the nick and channel databases only store each
+ * memo's offset in that file (Memo.textpos).  The file begins with a
+ * 32-bit magic number, followed by one record per memo text:
+ *
+ *	32-bit text length (not including the trailing null)
+ *	32-bit memo number
+ *	8-bit owner name length, followed by the owner name (no null)
+ *	the text, followed by a null
+ *
+ * All integers are stored in big-endian order.  The owner is the nick or
+ * channel the memo belongs to; together with the number it lets us check
+ * that a stored offset still refers to the right text, and find the text
+ * again by scanning the file if it doesn't (for example, when the
+ * databases were saved before the file was last compacted).  Records are
+ * never changed once written: a memo that is renumbered or moved to
+ * another nick gets a new record, and deleted memos simply leave theirs
+ * behind.  The garbage is removed at startup by copying the live records
+ * to a new file when it makes up more than half of the store.
+ *
+ * The file is mapped into memory and a text is only touched when the memo
+ * is read, so memo texts neither take up memory nor get rewritten on each
+ * database save.
+ */
+
+#define STORE_MAGIC	0x4D534D54	/* "MSMT" */
+#define RECORD_HEADER	9		/* Length, number and owner length */
+
+/* Records are only compacted away if there is at least this much garbage
+ * in the file. */
+#define STORE_SLACK	65536
+
+static int store_fd = -1;		/* -1 if the store is not in use */
+static uint32 store_len;		/* Current length of the file */
+static int store_lost;			/* Texts not found at their offset */
+static int store_unsynced;		/* Texts written since the last sync */
+static int store_missing;		/* Nonzero if stored texts were loaded
+					 * with no store open */
+static int store_moved;			/* Texts moved from the databases */
+#if HAVE_MMAP
+static unsigned char *store_map;	/* Mapping of the file */
+static uint32 store_maplen;
+#else
+static unsigned char *store_buf;	/* Buffer for the last record read */
+static uint32 store_bufsize;
+#endif
+
+/*************************************************************************/
+
+static void put32(unsigned char *s, uint32 val)
+{
+    s[0] = val>>24;
+    s[1] = val>>16;
+    s[2] = val>>8;
+    s[3] = val;
+}
+
+static uint32 get32(const unsigned char *s)
+{
+    return (uint32)s[0]<<24 | s[1]<<16 | s[2]<<8 | s[3];
+}
+
+/*************************************************************************/
+
+/* Write exactly `len' bytes at the given offset.  Return 0 on success, -1
+ * on error. */
+
+static int write_at(int fd, const void *buf, uint32 len, uint32 pos)
+{
+    const char *s = buf;
+    ssize_t n;
+
+    if (lseek(fd, pos, SEEK_SET) < 0)
+	return -1;
+    while (len > 0) {
+	n = write(fd, s, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return -1;
+	s += n;
+	len -= n;
+    }
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Return a pointer to the record at the given offset, or NULL if there is
+ * no valid record there.  The pointer remains valid until the next call to
+ * store_record() or any function that writes to the store. */
+
+static const unsigned char *store_record(uint32 pos)
+{
+    unsigned char hdr[RECORD_HEADER];
+    const unsigned char *rec;
+    uint32 len;
+
+    if (store_fd < 0 || pos < 4 || pos > store_len
+     || store_len - pos < RECORD_HEADER)
+	return NULL;
+
+#if HAVE_MMAP
+    if (store_len > store_maplen) {
+	/* The file has grown since we mapped it */
+	void *map;
+	if (store_map)
+	    munmap(store_map, store_maplen);
+	store_map = NULL;
+	store_maplen = 0;
+	map = mmap(NULL, store_len, PROT_READ, MAP_SHARED, store_fd, 0);
+	if (map == MAP_FAILED) {
+	    log_perror("Can't map memo store %s", MemoTextDBName);
+	    return NULL;
+	}
+	store_map = map;
+	store_maplen = store_len;
+    }
+    memcpy(hdr, store_map+pos, RECORD_HEADER);
+#else
+    if (lseek(store_fd, pos, SEEK_SET) < 0
+     || read(store_fd, hdr, RECORD_HEADER) != RECORD_HEADER)
+	return NULL;
+#endif
+
+    len = get32(hdr);
+    if (len > store_len || store_len - pos - RECORD_HEADER < len+1+hdr[8])
+	return NULL;
+    len += RECORD_HEADER + hdr[8] + 1;
+#if HAVE_MMAP
+    rec = store_map + pos;
+#else
+    if (len > store_bufsize) {
+	store_bufsize = len;
+	store_buf = srealloc(store_buf, store_bufsize);
+    }
+    if (lseek(store_fd, pos, SEEK_SET) < 0
+     || read(store_fd, store_buf, len) != len)
+	return NULL;
+    rec = store_buf;
+#endif
+    if (rec[len-1] != 0)
+	return NULL;
+    return rec;
+}
+
+/* Return the total length of the given record. */
+
+#define RECORD_LEN(rec)  (RECORD_HEADER + (rec)[8] + get32(rec) + 1)
+
+/* Return whether the given record belongs to the given owner and memo. */
+
+static int record_is(const unsigned char *rec, const char *owner,
+		     uint32 number)
+{
+    return get32(rec+4) == number
+	&& strlen(owner) == rec[8]
+	&& strnicmp((const char *)rec+RECORD_HEADER, owner, rec[8]) == 0;
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Open the memo store, if one is configured.  Called before the nick and
+ * channel databases are loaded. */
+
+void open_memo_store(void)
+{
+    unsigned char buf[4];
+    struct stat st;
+
+    if (!MemoTextDBName || skeleton)
+	return;
+    store_fd = open(MemoTextDBName, readonly ? O_RDONLY : O_RDWR|O_CREAT,
+		    0666);
+    if (store_fd < 0) {
+	if (readonly && errno == ENOENT)
+	    return;
+	log_perror("Can't open memo store %s", MemoTextDBName);
+	if (!forceload)
+	    fatal("Can't open memo store %s", MemoTextDBName);
+	return;
+    }
+    if (fstat(store_fd, &st) < 0) {
+	log_perror("Can't stat memo store %s", MemoTextDBName);
+	close(store_fd);
+	store_fd = -1;
+	return;
+    }
+    if (st.st_size == 0 && !readonly) {
+	put32(buf, STORE_MAGIC);
+	if (write_at(store_fd, buf, 4, 0) < 0) {
+	    log_perror("Can't write memo store %s", MemoTextDBName);
+	    close(store_fd);
+	    store_fd = -1;
+	    return;
+	}
+	if (sync_dir(MemoTextDBName) < 0)
+	    log_perror("Can't sync directory of %s", MemoTextDBName);
+	st.st_size = 4;
+    }
+    if (st.st_size < 4 || (uint32)st.st_size != st.st_size
+     || lseek(store_fd, 0, SEEK_SET) < 0
+     || read(store_fd, buf, 4) != 4 || get32(buf) != STORE_MAGIC
+    ) {
+	close(store_fd);
+	store_fd = -1;
+	if (!forceload)
+	    fatal("Invalid format in %s", MemoTextDBName);
+	log("Invalid format in %s, memo texts will be lost", MemoTextDBName);
+	return;
+    }
+    store_len = st.st_size;
+}
+
+/*************************************************************************/
+
+/* Return the text of the given memo, reading it from the store if it isn't
+ * in memory.  The returned string may only be used until the next memo is
+ * sent or read. */
+
+const char *memo_text(const Memo *m)
+{
+    const unsigned char *rec;
+
+    if (m->text)
+	return m->text;
+    if (!m->textpos || !(rec = store_record(m->textpos)))
+	return "";
+    return (const char *)rec + RECORD_HEADER + rec[8];
+}
+
+/*************************************************************************/
+
+/* Write the text of the given memo to the store under the given owner and
+ * the memo's current number, and free its in-memory copy.  If there is no
+ * store, or it can't be written, the text stays in memory. */
+
+void store_memo_text(const char *owner, Memo *m)
+{
+    const char *text;
+    unsigned char *rec;
+    uint32 len, ownerlen;
+    static time_t lastwarn = 0;
+
+    if (store_fd < 0 || readonly)
+	return;
+    text = memo_text(m);
+    len = strlen(text);
+    ownerlen = strlen(owner);
+    if (ownerlen > 255)
+	ownerlen = 255;
+    rec = smalloc(RECORD_HEADER + ownerlen + len + 1);
+    put32(rec, len);
+    put32(rec+4, m->number);
+    rec[8] = ownerlen;
+    memcpy(rec+RECORD_HEADER, owner, ownerlen);
+    memcpy(rec+RECORD_HEADER+ownerlen, text, len+1);
+    len += RECORD_HEADER + ownerlen + 1;
+    if (store_len + len < store_len
+     || write_at(store_fd, rec, len, store_len) < 0) {
+	log_perror("Write error on %s", MemoTextDBName);
+	if (time(NULL) - lastwarn > WarningTimeout) {
+	    wallops(NULL, "Write error on %s: %s", MemoTextDBName,
+		    strerror(errno));
+	    lastwarn = time(NULL);
+	}
+	/* Don't leave a partial record behind */
+	if (ftruncate(store_fd, store_len) < 0)
+	    log_perror("Unable to restore %s", MemoTextDBName);
+	if (!m->text)
+	    m->text = sstrdup((const char *)rec+RECORD_HEADER+ownerlen);
+	m->textpos = 0;
+	free(rec);
+	return;
+    }
+    free(rec);
+    if (m->text) {
+	free(m->text);
+	m->text = NULL;
+    }
+    m->textpos = store_len;
+    store_len += len;
+    store_unsynced = 1;
+}
+
+/*************************************************************************/
+
+/* Make sure every text written to the store is on disk.  Called before
+ * the nick and channel databases or their journals are written, since
+ * they record the texts' offsets. */
+
+void memo_store_sync(void)
+{
+    if (store_fd < 0 || !store_unsynced)
+	return;
+    if (DB_SYNC(store_fd) < 0) {
+	log_perror("Can't sync memo store %s", MemoTextDBName);
+	return;
+    }
+    store_unsynced = 0;
+}
+
+/*************************************************************************/
+
+/* Check the memos just loaded for the given owner: texts still stored in
+ * the database itself are moved to the store, and stored texts whose
+ * record doesn't match are flagged to be searched for by
+ * memo_store_loaded().  Called from memos_loaded(). */
+
+void memo_store_check(const char *owner, MemoInfo *mi)
+{
+    const unsigned char *rec;
+    Memo *m;
+    int i;
+
+    for (i = 0, m = mi->memos; i < mi->memocount; i++, m++) {
+	if (m->text) {
+	    m->textpos = 0;
+	    store_memo_text(owner, m);
+	    if (m->textpos)
+		store_moved++;
+	} else if (m->textpos) {
+	    if (store_fd < 0) {
+		/* Checked by memo_store_loaded() */
+		store_missing = 1;
+		continue;
+	    }
+	    rec = store_record(m->textpos);
+	    if (!rec || !record_is(rec, owner, m->number)) {
+		m->textpos = 0;
+		m->flags |= MF_NOTEXT;
+		store_lost++;
+	    }
+	}
+    }
+}
+
+/*************************************************************************/
+
+/* Look up the memo list a record's owner refers to. */
+
+static MemoInfo *record_owner(const unsigned char *rec)
+{
+    char owner[256];
+    NickInfo *ni;
+    ChannelInfo *ci;
+
+    memcpy(owner, rec+RECORD_HEADER, rec[8]);
+    owner[rec[8]] = 0;
+    if (*owner == '#') {
+	if ((ci = cs_findchan(owner)) != NULL)
+	    return &ci->memos;
+    } else {
+	if ((ni = findnick(owner)) != NULL && !ni->link)
+	    return &ni->memos;
+    }
+    return NULL;
+}
+
+/* Search the store for texts flagged by memo_store_check().  Later records
+ * take precedence over earlier ones for the same memo.  Returns the number
+ * of texts which could not be found. */
+
+static int find_lost_texts(void)
+{
+    const unsigned char *rec;
+    uint32 pos;
+    MemoInfo *mi;
+    NickInfo *ni;
+    ChannelInfo *ci;
+    int i, lost = 0;
+
+    for (pos = 4; (rec = store_record(pos)) != NULL; pos += RECORD_LEN(rec)) {
+	if ((mi = record_owner(rec)) != NULL
+	 && (i = find_memo(mi, get32(rec+4))) >= 0
+	 && (mi->memos[i].flags & MF_NOTEXT)
+	) {
+	    mi->memos[i].textpos = pos;
+	}
+    }
+    if (pos != store_len)
+	log("%s: %s is damaged after offset %lu", s_MemoServ,
+	    MemoTextDBName, (unsigned long)pos);
+
+#define CLEAR_LOST(mi) do {				\
+    for (i = 0; i < (mi)->memocount; i++) {		\
+	if ((mi)->memos[i].flags & MF_NOTEXT) {		\
+	    (mi)->memos[i].flags &= ~MF_NOTEXT;		\
+	    if (!(mi)->memos[i].textpos)		\
+		lost++;					\
+	}						\
+    }							\
+} while (0)
+    for (ni = firstnick(); ni; ni = nextnick())
+	CLEAR_LOST(&ni->memos);
+    for (ci = cs_firstchan(); ci; ci = cs_nextchan())
+	CLEAR_LOST(&ci->memos);
+#undef CLEAR_LOST
+    return lost;
+}
+
+/*************************************************************************/
+
+/* Copy the live records to a new store file, replace the old file with it
+ * and point all memos at their new offsets.  Return 0 on success, -1 on
+ * failure (in which case the old store remains in use). */
+
+static int compact_store(long count)
+{
+    char newname[PATH_MAX];
+    unsigned char buf[4];
+    const unsigned char *rec;
+    uint32 *newpos, pos, len;
+    int fd, i, n;
+    NickInfo *ni;
+    ChannelInfo *ci;
+
+    snprintf(newname, sizeof(newname), "%s.new", MemoTextDBName);
+    fd = open(newname, O_RDWR|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) {
+	log_perror("Can't create %s", newname);
+	return -1;
+    }
+    newpos = smalloc(sizeof(*newpos) * (count ? count : 1));
+    put32(buf, STORE_MAGIC);
+    if (write_at(fd, buf, 4, 0) < 0)
+	goto fail;
+    pos = 4;
+    n = 0;
+
+    /* The nick and channel lists are walked in the same order below, so
+     * newpos[] needs no key. */
+#define COPY_LIVE(mi) do {					\
+    for (i = 0; i < (mi)->memocount; i++) {			\
+	if (!(mi)->memos[i].textpos)				\
+	    continue;						\
+	if (!(rec = store_record((mi)->memos[i].textpos)))	\
+	    goto fail;						\
+	len = RECORD_LEN(rec);					\
+	if (write_at(fd, rec, len, pos) < 0)			\
+	    goto fail;						\
+	newpos[n++] = pos;					\
+	pos += len;						\
+    }								\
+} while (0)
+    for (ni = firstnick(); ni; ni = nextnick())
+	COPY_LIVE(&ni->memos);
+    for (ci = cs_firstchan(); ci; ci = cs_nextchan())
+	COPY_LIVE(&ci->memos);
+#undef COPY_LIVE
+
+    if (fsync(fd) < 0 || rename(newname, MemoTextDBName) < 0)
+	goto fail;
+    if (sync_dir(MemoTextDBName) < 0)
+	log_perror("Can't sync directory of %s", MemoTextDBName);
+
+#if HAVE_MMAP
+    if (store_map)
+	munmap(store_map, store_maplen);
+    store_map = NULL;
+    store_maplen = 0;
+#endif
+    close(store_fd);
+    store_fd = fd;
+    store_len = pos;
+    n = 0;
+#define SET_NEW(mi) do {				\
+    for (i = 0; i < (mi)->memocount; i++) {		\
+	if ((mi)->memos[i].textpos)			\
+	    (mi)->memos[i].textpos = newpos[n++];	\
+    }							\
+} while (0)
+    for (ni = firstnick(); ni; ni = nextnick())
+	SET_NEW(&ni->memos);
+    for (ci = cs_firstchan(); ci; ci = cs_nextchan())
+	SET_NEW(&ci->memos);
+#undef SET_NEW
+    free(newpos);
+    return 0;
+
+  fail:
+    log_perror("Can't compact memo store %s", MemoTextDBName);
+    free(newpos);
+    close(fd);
+    unlink(newname);
+    return -1;
+}
+
+/*************************************************************************/
+
+/* Finish setting up the store after the nick and channel databases have
+ * been loaded: find any texts that weren't where the databases said, and
+ * compact the store if it has accumulated enough garbage.  If anything
+ * moved, the databases are saved so that they point to the new offsets. */
+
+void memo_store_loaded(void)
+{
+    const unsigned char *rec;
+    uint32 live = 4;
+    long count = 0;
+    int i, lost, changed = 0;
+    NickInfo *ni;
+    ChannelInfo *ci;
+
+    if (store_fd < 0) {
+	/* Without the store these texts can't be read or kept up to date */
+	if (store_missing && !readonly && !forceload) {
+	    if (!MemoTextDBName)
+		fatal("Memo texts are kept in a memo store, but MemoTextDB"
+		      " is not set");
+	    fatal("Memo texts are kept in %s, which could not be opened",
+		  MemoTextDBName);
+	}
+	if (store_missing)
+	    log("%s: memo texts are unavailable without the memo store",
+		s_MemoServ);
+	return;
+    }
+    if (store_moved) {
+	log("%s: moved %d memo texts to %s", s_MemoServ, store_moved,
+	    MemoTextDBName);
+	store_moved = 0;
+	changed = 1;
+    }
+    if (store_lost) {
+	log("%s: %d memo texts not found at their recorded offsets,"
+	    " searching %s", s_MemoServ, store_lost, MemoTextDBName);
+	lost = find_lost_texts();
+	if (lost)
+	    log("%s: %d memo texts could not be found", s_MemoServ, lost);
+	store_lost = 0;
+	changed = 1;
+    }
+    if (readonly)
+	return;
+
+#define COUNT_LIVE(mi) do {					\
+    for (i = 0; i < (mi)->memocount; i++) {			\
+	if ((mi)->memos[i].textpos				\
+	 && (rec = store_record((mi)->memos[i].textpos))) {	\
+	    live += RECORD_LEN(rec);				\
+	    count++;						\
+	}							\
+    }								\
+} while (0)
+    for (ni = firstnick(); ni; ni = nextnick())
+	COUNT_LIVE(&ni->memos);
+    for (ci = cs_firstchan(); ci; ci = cs_nextchan())
+	COUNT_LIVE(&ci->memos);
+#undef COUNT_LIVE
+
+    if (store_len - live > live + STORE_SLACK) {
+	uint32 oldlen = store_len;
+	if (compact_store(count) == 0) {
+	    log("%s: compacted %s from %lu to %lu bytes", s_MemoServ,
+		MemoTextDBName, (unsigned long)oldlen, (unsigned long)live);
+	    changed = 1;
+	}
+    }
+    if (changed) {
+	save_ns_dbase();
+	save_cs_dbase();
+    }
+}
+
+/*************************************************************************/
@@ -477,7 +477,6 @@ int process_numlist(const char *numstr, int *count_ret,
     memset(numflag, 0, sizeof(numflag));
     min = 65536;
     max = 0;
-    va_start(args, u);
 
     /* This algorithm ignores invalid characters, ignores a dash
      * when it precedes a comma, and ignores everything from the
@@ -518,7 +517,10 @@ int process_numlist(const char *numstr, int *count_ret,
 	if (!numflag[i])
 	    continue;
 	numcount++;
+	/* The callback consumes the arguments, so start afresh each time. */
+	va_start(args, u);
 	res = callback(u, i, args);
+	va_end(args);
 	if (debug)
 	    log("debug: process_numlist: tried to do %d; result = %d", i, res);
 	if (res < 0)
@@ -526,7 +528,6 @@ int process_numlist(const char *numstr, int *count_ret,
 	retval += res;
     }
 
-    va_end(args);
     if (count_ret)
         *count_ret = numcount;
     return retval;
@@ -89,6 +89,7 @@ void load_nakill(void)
     nakills = scalloc(sizeof(*nakills), nakill_size);
 
     switch (ver) {
+      case 12:
       case 11:
 	for (i = 0; i < nnakill; i++) {
 	    SAFE(read_string(&nakills[i].nick, f));
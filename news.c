@@ -142,6 +142,7 @@ void load_news()
     if (!(f = open_db(s_OperServ, NewsDBName, "r")))
 	return;
     switch (i = get_file_version(f)) {
+      case 12:
       case 11:
       case 10:
       case 9:
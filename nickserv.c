@@ -29,43 +29,29 @@
 
 /*************************************************************************/
 
-#define HASH(nick)  (hashtable[(unsigned char)((nick)[0])]<<5 \
-		     | hashtable[(unsigned char)((nick)[1])])
-#define HASHSIZE    1024
+/* The nickname table is hashed on the whole (lowercased) nickname, so
+ * chains stay short and insertion is O(1); alphabetical order, where it is
+ * needed, comes from the separate index below. */
+#define HASH(nick)  (hash_nick(nick) & (HASHSIZE-1))
+#define HASHSIZE    0x10000
 static NickInfo *nicklists[HASHSIZE];
 
-static const char hashtable[256] = {
-     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-
-     0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15,
-    16,17,18,19,20,21,22,23,24,25,26,27,28,29, 0, 0,
-     0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15,
-    16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,30,
-
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-    31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,31,
-};
-
-/*************************************************************************/
-
-#define TO_COLLIDE   0			/* Collide the user with this nick */
-#define TO_RELEASE   1			/* Release a collided nick */
-#define TO_SEND_433  2			/* Send a 433 numeric */
+/* All nicknames sorted with irc_stricmp(), for firstnick_sorted().  Adding
+ * or removing a nick just marks it out of date, and it is rebuilt the next
+ * time it is needed, so that registrations, drops and expiries don't have
+ * to keep it in order. */
+static NickInfo **nick_order = NULL;
+static int nick_order_count = 0, nick_order_size = 0;
+static int nick_order_pos = 0;
+static int nick_order_dirty = 1;
 
 /*************************************************************************/
 
+static void compile_access(NickInfo *ni);
 static int is_on_access(User *u, NickInfo *ni);
-static void alpha_insert_nick(NickInfo *ni);
+static unsigned int hash_nick(const char *nick);
+static void insert_nick(NickInfo *ni);
+static void unlink_nick(NickInfo *ni);
 static NickInfo *makenick(const char *nick);
 static int delnick(NickInfo *ni);
 static void remove_links(NickInfo *ni);
@@ -78,8 +64,8 @@ static void nick_bad_password(User *u, NickInfo *ni);
 
 static void collide(NickInfo *ni, int from_timeout);
 static void release(NickInfo *ni, int from_timeout);
-static void add_ns_timeout(NickInfo *ni, int type, time_t delay);
-static void rem_ns_timeout(NickInfo *ni, int type, int del_to);
+static void schedule_enforce(NickInfo *ni, int type, time_t delay);
+static void cancel_enforce(NickInfo *ni, int type);
 
 static void do_help(User *u);
 static void do_register(User *u);
@@ -309,6 +295,49 @@ NickInfo *nextnick(void)
 
 /*************************************************************************/
 
+/* Iterate over all NickInfo structures in alphabetical order.  Nicknames
+ * must not be added or removed during the iteration.
+ */
+
+static int compare_nick_order(const void *a, const void *b)
+{
+    return irc_stricmp((*(NickInfo **)a)->nick, (*(NickInfo **)b)->nick);
+}
+
+NickInfo *firstnick_sorted(void)
+{
+    if (nick_order_dirty) {
+	NickInfo *ni;
+	if (!nick_order) {
+	    nick_order_size = 1024;
+	    nick_order = smalloc(sizeof(*nick_order) * nick_order_size);
+	}
+	nick_order_count = 0;
+	for (ni = firstnick(); ni; ni = nextnick()) {
+	    if (nick_order_count >= nick_order_size) {
+		nick_order_size *= 2;
+		nick_order = srealloc(nick_order,
+				sizeof(*nick_order) * nick_order_size);
+	    }
+	    nick_order[nick_order_count++] = ni;
+	}
+	qsort(nick_order, nick_order_count, sizeof(*nick_order),
+	      compare_nick_order);
+	nick_order_dirty = 0;
+    }
+    nick_order_pos = 0;
+    return nextnick_sorted();
+}
+
+NickInfo *nextnick_sorted(void)
+{
+    if (nick_order_pos < nick_order_count)
+	return nick_order[nick_order_pos++];
+    return NULL;
+}
+
+/*************************************************************************/
+
 /* Return information on memory use.  Assumes pointers are valid. */
 
 void get_nickserv_stats(long *nrec, long *memuse)
@@ -336,6 +365,14 @@ void get_nickserv_stats(long *nrec, long *memuse)
 	    if (*accptr)
 		mem += strlen(*accptr)+1;
 	}
+	if (ni->access_match) {
+	    /* Same strings again, plus the entry array */
+	    mem += sizeof(AccessMatch) * ni->accesscount;
+	    for (accptr=ni->access, i=0; i < ni->accesscount; accptr++, i++) {
+		if (*accptr)
+		    mem += strlen(*accptr)+1;
+	    }
+	}
     }
     *nrec = count;
     *memuse = mem;
@@ -368,6 +405,66 @@ int check_on_access(User *u)
 
 /*************************************************************************/
 
+/* Return whether a user is the same one who last identified for their
+ * nick, as seen after a netsplit: the Services stamp matches the one
+ * recorded at identification, as does the user@host.  This needs no
+ * access list matching, so it is checked before anything else when
+ * validating users.  Always returns 0 if NoSplitRecovery is set.
+ *
+ * This can be exploited to gain improper privilege if an attacker
+ * has the same Services stamp, username and hostname as the
+ * victim.
+ *
+ * Under ircd.dal 4.4.15+ and other servers supporting a Services
+ * stamp, Services guarantees that the first condition cannot occur
+ * unless the stamp counter rolls over (2^31-1 client connections).
+ * This is practically infeasible.  As an example, on a network of
+ * 30 servers, an attack introducing 10 new clients every second on
+ * every server would need to be sustained for 83 days (2.8 months)
+ * to cause the stamp to roll over.
+ *
+ * Under other servers, an attack is theoretically possible, but
+ * would require access to the computer the victim is using for IRC
+ * or the DNS servers for the victim's domain and IP address range
+ * in order to have the same hostname, and would require that the
+ * attacker connect so that he has the same server timestamp as the
+ * victim (this could be accomplished by finding a server with a
+ * clock slower than that of the victim's server and timing the
+ * connection attempt properly).
+ *
+ * When using Unreal, the username and hostname are not checked,
+ * since the real hostname is not saved, only the fake one.
+ * However, since Unreal supports Services stamps, this is still
+ * believed safe (see above).
+ *
+ * If someone gets a hacked server into your network, all bets are
+ * off.
+ */
+
+int split_recovered(User *u)
+{
+    NickInfo *ni = u->real_ni;
+#ifndef IRC_UNREAL
+    const char *mask;
+    int len;
+#endif
+
+    if (NoSplitRecovery || !ni || ni->id_stamp == 0
+     || u->services_stamp != ni->id_stamp)
+	return 0;
+#ifdef IRC_UNREAL
+    return 1;
+#else
+    /* Compare "user@host" in place rather than building it. */
+    mask = ni->last_usermask;
+    len = strlen(u->username);
+    return mask && strncmp(mask, u->username, len) == 0 && mask[len] == '@'
+	&& strcmp(mask+len+1, u->host) == 0;
+#endif
+}
+
+/*************************************************************************/
+
 /* Check whether a user is on the access list of the nick they're using, or
  * if they're the same user who last identified for the nick.  If not, send
  * warnings as appropriate.  If so (and not NI_SECURE), update last seen
@@ -399,55 +496,15 @@ int validate_user(User *u)
 #endif
 	    notice_lang(s_NickServ, u, DISCONNECT_IN_1_MINUTE);
 #ifndef DONT_SEND_433
-	add_ns_timeout(ni, TO_SEND_433, 40);
+	schedule_enforce(ni, TO_SEND_433, 40);
 #endif
-	add_ns_timeout(ni, TO_COLLIDE, 60);
+	schedule_enforce(ni, TO_COLLIDE, 60);
 	return 0;
     }
 
-    if (!NoSplitRecovery) {
-	/*
-	 * This can be exploited to gain improper privilege if an attacker
-	 * has the same Services stamp, username and hostname as the
-	 * victim.
-	 *
-	 * Under ircd.dal 4.4.15+ and other servers supporting a Services
-	 * stamp, Services guarantees that the first condition cannot occur
-	 * unless the stamp counter rolls over (2^31-1 client connections).
-	 * This is practically infeasible.  As an example, on a network of
-	 * 30 servers, an attack introducing 10 new clients every second on
-	 * every server would need to be sustained for 83 days (2.8 months)
-	 * to cause the stamp to roll over.
-	 *
-	 * Under other servers, an attack is theoretically possible, but
-	 * would require access to the computer the victim is using for IRC
-	 * or the DNS servers for the victim's domain and IP address range
-	 * in order to have the same hostname, and would require that the
-	 * attacker connect so that he has the same server timestamp as the
-	 * victim (this could be accomplished by finding a server with a
-	 * clock slower than that of the victim's server and timing the
-	 * connection attempt properly).
-	 *
-	 * When using Unreal, the username and hostname are not checked,
-	 * since the real hostname is not saved, only the fake one.
-	 * However, since Unreal supports Services stamps, this is still
-	 * believed safe (see above).
-	 *
-	 * If someone gets a hacked server into your network, all bets are
-	 * off.
-	 */
-	if (ni->id_stamp != 0 && u->services_stamp == ni->id_stamp) {
-#ifndef IRC_UNREAL
-	    char buf[BUFSIZE];
-	    snprintf(buf, sizeof(buf), "%s@%s", u->username, u->host);
-	    if (strcmp(buf, ni->last_usermask) == 0) {
-#endif
-		ni->status |= NS_IDENTIFIED;
-		return 1;
-#ifndef IRC_UNREAL
-	    }
-#endif
-	}
+    if (split_recovered(u)) {
+	ni->status |= NS_IDENTIFIED;
+	return 1;
     }
 
     on_access = check_on_access(u);
@@ -488,9 +545,9 @@ int validate_user(User *u)
 	    else
 #endif
 	    	notice_lang(s_NickServ, u, DISCONNECT_IN_20_SECONDS);
-	    add_ns_timeout(ni, TO_COLLIDE, 20);
+	    schedule_enforce(ni, TO_COLLIDE, 20);
 #ifndef DONT_SEND_433
-	    add_ns_timeout(ni, TO_SEND_433, 10);
+	    schedule_enforce(ni, TO_SEND_433, 10);
 #endif
 	} else {
 #ifdef HAVE_NICKCHANGE
@@ -499,9 +556,9 @@ int validate_user(User *u)
 	    else
 #endif
 	    	notice_lang(s_NickServ, u, DISCONNECT_IN_1_MINUTE);
-	    add_ns_timeout(ni, TO_COLLIDE, 60);
+	    schedule_enforce(ni, TO_COLLIDE, 60);
 #ifndef DONT_SEND_433
-	    add_ns_timeout(ni, TO_SEND_433, 40);
+	    schedule_enforce(ni, TO_SEND_433, 40);
 #endif
 	}
     }
@@ -549,7 +606,7 @@ void cancel_user(User *u)
 	    snprintf(realname, sizeof(realname), "%s Enforcement", s_NickServ);
 	    send_nick(u->nick, NSEnforcerUser, NSEnforcerHost, ServerName,
 		      realname, 0);
-	    add_ns_timeout(ni, TO_RELEASE, NSReleaseTimeout);
+	    schedule_enforce(ni, TO_RELEASE, NSReleaseTimeout);
 	    ni->status &= ~NS_TEMPORARY;
 	    ni->status |= NS_KILL_HELD;
 	} else {
@@ -558,7 +615,7 @@ void cancel_user(User *u)
 #ifdef HAVE_NICKCHANGE
 	}
 #endif
-	rem_ns_timeout(ni, TO_COLLIDE, 1);
+	cancel_enforce(ni, TO_COLLIDE);
     }
 }
 
@@ -627,51 +684,141 @@ void expire_nicks()
 /*********************** NickServ private routines ***********************/
 /*************************************************************************/
 
+/* (Re)build the compiled form of the given nick's access list.  Must be
+ * called whenever ni->access changes.  The AccessMatch array and the
+ * lowercased copies of the masks share a single allocation. */
+
+static void compile_access(NickInfo *ni)
+{
+    AccessMatch *am;
+    char *s, *at;
+    const char *t;
+    int i, size;
+
+    if (ni->access_match) {
+	free(ni->access_match);
+	ni->access_match = NULL;
+    }
+    if (!ni->accesscount)
+	return;
+    size = sizeof(AccessMatch) * ni->accesscount;
+    for (i = 0; i < ni->accesscount; i++) {
+	if (ni->access[i])
+	    size += strlen(ni->access[i]) + 1;
+    }
+    ni->access_match = am = smalloc(size);
+    s = (char *)(am + ni->accesscount);
+    for (i = 0; i < ni->accesscount; i++, am++) {
+	memset(am, 0, sizeof(*am));
+	if (!ni->access[i])
+	    continue;
+	strcpy(s, ni->access[i]);
+	strlower(s);
+	am->user = s;
+	s += strlen(s) + 1;
+	/* A "user@host" string has exactly one '@', so a mask with one
+	 * '@' can only match with the two '@'s lined up. */
+	at = strchr(am->user, '@');
+	if (!at || strchr(at+1, '@'))
+	    continue;
+	*at = 0;
+	am->host = am->hostlit = at+1;
+	for (t = am->host; *t; t++) {
+	    if (*t == '*' || *t == '?')
+		am->hostlit = t+1;
+	}
+	am->hostlitlen = strlen(am->hostlit);
+	am->hostwild = (am->hostlit != am->host);
+    }
+}
+
+/*************************************************************************/
+
 /* Is the given user's address on the given nick's access list?  Return 1
- * if so, 0 if not. */
+ * if so, 0 if not.  Uses the compiled list, so no memory is allocated;
+ * most non-matching entries are rejected by the literal host tail alone.
+ */
 
 static int is_on_access(User *u, NickInfo *ni)
 {
-    int i;
-    char *buf;
+    const AccessMatch *am;
+    const char *s, *t;
+    int i, hostlen;
+    char buf[BUFSIZE];
 
-    if (ni->accesscount == 0)
+    if (ni->accesscount == 0 || !ni->access_match)
 	return 0;
-    i = strlen(u->username);
-    buf = smalloc(i + strlen(u->host) + 2);
-    sprintf(buf, "%s@%s", u->username, u->host);
-    strlower(buf+i+1);
-    for (i = 0; i < ni->accesscount; i++) {
-	if (match_wild_nocase(ni->access[i], buf)) {
-	    free(buf);
-	    return 1;
+    hostlen = strlen(u->host);
+    for (i = 0, am = ni->access_match; i < ni->accesscount; i++, am++) {
+	if (!am->user)
+	    continue;
+	if (!am->host) {
+	    /* Odd mask (from an old database); match the whole thing */
+	    snprintf(buf, sizeof(buf), "%s@%s", u->username, u->host);
+	    if (match_wild_nocase(am->user, buf))
+		return 1;
+	    continue;
 	}
+	if (am->hostwild ? am->hostlitlen > hostlen
+			 : am->hostlitlen != hostlen)
+	    continue;
+	s = u->host + hostlen - am->hostlitlen;
+	for (t = am->hostlit; *t && tolower((unsigned char)*s) == *t;
+	     s++, t++)
+	    ;
+	if (*t)
+	    continue;
+	if ((!am->hostwild || match_wild_nocase(am->host, u->host))
+	 && match_wild_nocase(am->user, u->username))
+	    return 1;
     }
-    free(buf);
     return 0;
 }
 
 /*************************************************************************/
 
-/* Insert a nick alphabetically into the database. */
+/* Hash function for nicknames; case-insensitive in the same way as
+ * irc_stricmp(). */
 
-static void alpha_insert_nick(NickInfo *ni)
+static unsigned int hash_nick(const char *nick)
 {
-    NickInfo *ptr, *prev;
-    char *nick = ni->nick;
+    unsigned int hash = 0;
+
+    while (*nick)
+	hash = hash*31 + irc_tolower(*nick++);
+    return hash;
+}
 
-    for (prev = NULL, ptr = nicklists[HASH(nick)];
-			ptr && irc_stricmp(ptr->nick, nick) < 0;
-			prev = ptr, ptr = ptr->next)
-	;
-    ni->prev = prev;
-    ni->next = ptr;
-    if (!prev)
-	nicklists[HASH(nick)] = ni;
+/*************************************************************************/
+
+/* Insert a nick into the database. */
+
+static void insert_nick(NickInfo *ni)
+{
+    int hash = HASH(ni->nick);
+
+    ni->prev = NULL;
+    ni->next = nicklists[hash];
+    if (ni->next)
+	ni->next->prev = ni;
+    nicklists[hash] = ni;
+    nick_order_dirty = 1;
+}
+
+/*************************************************************************/
+
+/* Remove a nick from the hash table and alphabetical index.  Does not free
+ * anything. */
+
+static void unlink_nick(NickInfo *ni)
+{
+    if (ni->next)
+	ni->next->prev = ni->prev;
+    if (ni->prev)
+	ni->prev->next = ni->next;
     else
-	prev->next = ni;
-    if (ptr)
-	ptr->prev = ni;
+	nicklists[HASH(ni->nick)] = ni->next;
+    nick_order_dirty = 1;
 }
 
 /*************************************************************************/
@@ -687,7 +834,8 @@ static NickInfo *makenick(const char *nick)
 
     ni = scalloc(sizeof(NickInfo), 1);
     strscpy(ni->nick, nick, NICKMAX);
-    alpha_insert_nick(ni);
+    insert_nick(ni);
+    ns_journal_mark(ni);
     return ni;
 }
 
@@ -702,7 +850,8 @@ static int delnick(NickInfo *ni)
 {
     int i;
 
-    rem_ns_timeout(ni, -1, 1);
+    ns_journal_mark(ni);
+    cancel_enforce(ni, -1);
     cs_remove_nick(ni);
     os_remove_nick(ni);
     if (ni->linkcount)
@@ -724,6 +873,8 @@ static int delnick(NickInfo *ni)
 	}
 	free(ni->access);
     }
+    if (ni->access_match)
+	free(ni->access_match);
     if (ni->memos.memos) {
 	for (i = 0; i < ni->memos.memocount; i++) {
 	    if (ni->memos.memos[i].text)
@@ -731,12 +882,7 @@ static int delnick(NickInfo *ni)
 	}
 	free(ni->memos.memos);
     }
-    if (ni->next)
-	ni->next->prev = ni->prev;
-    if (ni->prev)
-	ni->prev->next = ni->next;
-    else
-	nicklists[HASH(ni->nick)] = ni->next;
+    unlink_nick(ni);
     free(ni);
     return 1;
 }
@@ -761,6 +907,7 @@ static void remove_links(NickInfo *ni)
 	    if (ni->link) {
 		ptr->link = ni->link;
 		ni->link->linkcount++;
+		ns_journal_mark(ptr);
 	    } else {
 		delink(ptr);
 		delinked = 1;
@@ -779,6 +926,7 @@ static void delink(NickInfo *ni)
 {
     NickInfo *link;
 
+    ns_journal_mark(ni);
     link = ni->link;
     ni->link = NULL;
     link->linkcount--;
@@ -807,6 +955,7 @@ static void delink(NickInfo *ni)
 	ni->access = access;
 	for (i = 0; i < ni->accesscount; i++, access++)
 	    *access = sstrdup(link->access[i]);
+	compile_access(ni);
     }
 }
 
@@ -823,6 +972,7 @@ static void link_fix_users(void)
 	if (u->real_ni)
 	    u->ni = getlink(u->real_ni);
     }
+    cs_links_changed();
 }
 
 /*************************************************************************/
@@ -840,6 +990,7 @@ static void suspend(NickInfo *ni, const char *reason,
     si->suspended = time(NULL);
     si->expires = expires;
     ni->suspendinfo = si;
+    ns_journal_mark(ni);
 }
 
 /*************************************************************************/
@@ -863,6 +1014,7 @@ static void unsuspend(NickInfo *ni, int set_time)
 	free(ni->suspendinfo->reason);
     free(ni->suspendinfo);
     ni->suspendinfo = NULL;
+    ns_journal_mark(ni);
     if (set_time && NSExpire && NSSuspendGrace
      && (now - ni->last_seen >= NSExpire - NSSuspendGrace)
     ) {
@@ -932,7 +1084,7 @@ static void collide(NickInfo *ni, int from_timeout)
     u = finduser(ni->nick);
 
     if (!from_timeout)
-	rem_ns_timeout(ni, TO_COLLIDE, 1);
+	cancel_enforce(ni, TO_COLLIDE);
 
 #ifdef HAVE_NICKCHANGE
     if (NSForceNickChange) {
@@ -956,7 +1108,7 @@ static void collide(NickInfo *ni, int from_timeout)
 		  realname, 0);
 
 	ni->status |= NS_KILL_HELD;
-	add_ns_timeout(ni, TO_RELEASE, NSReleaseTimeout);
+	schedule_enforce(ni, TO_RELEASE, NSReleaseTimeout);
 #ifdef HAVE_NICKCHANGE
     }
 #endif
@@ -969,7 +1121,7 @@ static void collide(NickInfo *ni, int from_timeout)
 static void release(NickInfo *ni, int from_timeout)
 {
     if (!from_timeout)
-	rem_ns_timeout(ni, TO_RELEASE, 1);
+	cancel_enforce(ni, TO_RELEASE);
     send_cmd(ni->nick, "QUIT");
     ni->status &= ~NS_KILL_HELD;
 }
@@ -977,132 +1129,205 @@ static void release(NickInfo *ni, int from_timeout)
 /*************************************************************************/
 /*************************************************************************/
 
-static struct my_timeout {
-    struct my_timeout *next, *prev;
-    NickInfo *ni;
-    Timeout *to;
-    int type;
-} *my_timeouts;
+/* Pending collides, releases and 433 numerics are kept in the NickInfo
+ * itself, in enforce_due[] and enforce_set[] (indexed by TO_*).  A nick
+ * with anything pending sits in one bucket of a wheel of one-second
+ * buckets, chosen by the time of its earliest action, and a single
+ * repeating timeout works through the buckets as they come due.  So
+ * scheduling or cancelling an action takes constant time, and each pass
+ * costs time in proportion to the nicks acted on (plus any in the same
+ * buckets but a whole turn of the wheel ahead).  Everything a pass sends
+ * to the network is written out in one go at the end.
+ */
+
+#define ENFORCE_SLOTS	64
+
+static NickInfo *enforce_wheel[ENFORCE_SLOTS];
+static int enforce_count = 0;		/* Number of nicks in the wheel */
+static time_t enforce_last = 0;		/* Last second processed */
+static Timeout *enforce_timeout = NULL;
+
+/* Nicks taken from the wheel to be acted on by the current pass.  A nick
+ * deleted during the pass has its entry here cleared. */
+static NickInfo **enforce_batch = NULL;
+static int enforce_batch_count = 0, enforce_batch_size = 0;
+
+static void timeout_enforce(Timeout *to);
 
 /*************************************************************************/
 
-/* Collide a nick on timeout. */
+/* Take a nick out of its wheel bucket. */
 
-static void timeout_collide(Timeout *t)
+static void enforce_unlink(NickInfo *ni)
 {
-    NickInfo *ni = t->data;
-    User *u;
-
-    rem_ns_timeout(ni, TO_COLLIDE, 0);
-    /* If they identified or don't exist anymore, don't kill them. */
-    if ((ni->status & NS_IDENTIFIED)
-		|| !(u = finduser(ni->nick))
-		|| u->my_signon > t->settime)
-	return;
-    /* The RELEASE timeout will always add to the beginning of the
-     * list, so we won't see it.  Which is fine because it can't be
-     * triggered yet anyway. */
-    collide(ni, 1);
+    if (ni->enforce_next)
+	ni->enforce_next->enforce_prev = ni->enforce_prev;
+    if (ni->enforce_prev)
+	ni->enforce_prev->enforce_next = ni->enforce_next;
+    else
+	enforce_wheel[ni->enforce_when % ENFORCE_SLOTS] = ni->enforce_next;
+    ni->enforce_next = ni->enforce_prev = NULL;
+    ni->enforce_when = 0;
+    enforce_count--;
 }
 
 /*************************************************************************/
 
-/* Release a nick on timeout. */
+/* Move a nick to the bucket for its earliest pending action, or out of
+ * the wheel if it has none. */
 
-static void timeout_release(Timeout *t)
+static void enforce_requeue(NickInfo *ni)
 {
-    NickInfo *ni = t->data;
+    time_t when = 0;
+    int i;
 
-    rem_ns_timeout(ni, TO_RELEASE, 0);
-    release(ni, 1);
+    for (i = 0; i < TO_MAX; i++) {
+	if (ni->enforce_due[i] && (!when || ni->enforce_due[i] < when))
+	    when = ni->enforce_due[i];
+    }
+    if (when && !enforce_timeout) {
+	enforce_last = time(NULL) - 1;
+	enforce_timeout = add_timeout(1, timeout_enforce, 1);
+    }
+    /* Anything already overdue goes in the next bucket to be processed. */
+    if (when && when <= enforce_last)
+	when = enforce_last + 1;
+    if (when == ni->enforce_when)
+	return;
+    if (ni->enforce_when)
+	enforce_unlink(ni);
+    if (!when)
+	return;
+    ni->enforce_when = when;
+    ni->enforce_prev = NULL;
+    ni->enforce_next = enforce_wheel[when % ENFORCE_SLOTS];
+    if (ni->enforce_next)
+	ni->enforce_next->enforce_prev = ni;
+    enforce_wheel[when % ENFORCE_SLOTS] = ni;
+    enforce_count++;
 }
 
 /*************************************************************************/
 
-/* Send a 433 (nick in use) numeric to the given user. */
+/* Carry out whatever is due for the given nick.  If the user has since
+ * identified or left, or the nick was taken again after the action was
+ * scheduled, a collide or 433 is dropped. */
 
-static void timeout_send_433(Timeout *t)
+static void enforce_nick(NickInfo *ni, time_t now)
 {
-    NickInfo *ni = t->data;
     User *u;
-
-    rem_ns_timeout(ni, TO_SEND_433, 0);
-    /* If they identified or don't exist anymore, don't send the 433. */
-    if ((ni->status & NS_IDENTIFIED)
-		|| !(u = finduser(ni->nick))
-		|| u->my_signon > t->settime)
-	return;
-    if (ni->status & NS_VERBOTEN)
-	send_cmd(ServerName, "433 %s %s :Nickname may not be used",
-		 ni->nick, ni->nick);
-    else
-	send_cmd(ServerName, "433 %s %s :Nickname is registered to someone"
-		 " else", ni->nick, ni->nick);
+    time_t set;
+
+    if (ni->enforce_due[TO_SEND_433] && ni->enforce_due[TO_SEND_433] <= now) {
+	set = ni->enforce_set[TO_SEND_433];
+	ni->enforce_due[TO_SEND_433] = 0;
+	if (!(ni->status & NS_IDENTIFIED)
+		&& (u = finduser(ni->nick)) && u->my_signon <= set) {
+	    if (ni->status & NS_VERBOTEN)
+		send_cmd(ServerName, "433 %s %s :Nickname may not be used",
+			 ni->nick, ni->nick);
+	    else
+		send_cmd(ServerName, "433 %s %s :Nickname is registered to"
+			 " someone else", ni->nick, ni->nick);
+	}
+    }
+    if (ni->enforce_due[TO_COLLIDE] && ni->enforce_due[TO_COLLIDE] <= now) {
+	set = ni->enforce_set[TO_COLLIDE];
+	ni->enforce_due[TO_COLLIDE] = 0;
+	if (!(ni->status & NS_IDENTIFIED)
+		&& (u = finduser(ni->nick)) && u->my_signon <= set)
+	    collide(ni, 1);
+    }
+    if (ni->enforce_due[TO_RELEASE] && ni->enforce_due[TO_RELEASE] <= now) {
+	ni->enforce_due[TO_RELEASE] = 0;
+	release(ni, 1);
+    }
+    enforce_requeue(ni);
 }
 
 /*************************************************************************/
 
-/* Add a collide/release/433 timeout. */
+/* Process every bucket which has come due since the last pass. */
 
-void add_ns_timeout(NickInfo *ni, int type, time_t delay)
+static void timeout_enforce(Timeout *to)
 {
-    Timeout *to;
-    struct my_timeout *t;
-    void (*timeout_routine)(Timeout *);
+    time_t now = time(NULL);
+    NickInfo *ni, *next;
+    int i;
+
+    if (now - enforce_last > ENFORCE_SLOTS)
+	enforce_last = now - ENFORCE_SLOTS;
+    while (enforce_last < now) {
+	enforce_last++;
+	ni = enforce_wheel[enforce_last % ENFORCE_SLOTS];
+	for (; ni; ni = next) {
+	    next = ni->enforce_next;
+	    if (ni->enforce_when > now)
+		continue;
+	    enforce_unlink(ni);
+	    if (enforce_batch_count >= enforce_batch_size) {
+		enforce_batch_size += 64;
+		enforce_batch = srealloc(enforce_batch,
+				sizeof(*enforce_batch) * enforce_batch_size);
+	    }
+	    enforce_batch[enforce_batch_count++] = ni;
+	}
+    }
+    if (enforce_batch_count) {
+	set_write_hold(1);
+	for (i = 0; i < enforce_batch_count; i++) {
+	    if (enforce_batch[i])
+		enforce_nick(enforce_batch[i], now);
+	}
+	set_write_hold(0);
+	if (debug)
+	    log("debug: %s: enforcement pass handled %d nicks", s_NickServ,
+		enforce_batch_count);
+	enforce_batch_count = 0;
+    }
+    if (!enforce_count) {
+	to->repeat = 0;
+	enforce_timeout = NULL;
+    }
+}
 
-    if (type == TO_COLLIDE)
-	timeout_routine = timeout_collide;
-    else if (type == TO_RELEASE)
-	timeout_routine = timeout_release;
-    else if (type == TO_SEND_433)
-	timeout_routine = timeout_send_433;
-    else {
+/*************************************************************************/
+
+/* Schedule a collide, release or 433 for the given nick `delay' seconds
+ * from now, replacing any of the same type already pending. */
+
+static void schedule_enforce(NickInfo *ni, int type, time_t delay)
+{
+    if (type < 0 || type >= TO_MAX) {
 	log("%s: unknown timeout type %d!  ni=%p (%s), delay=%ld",
 	    s_NickServ, type, ni, ni->nick, delay);
 	return;
     }
-    to = add_timeout(delay, timeout_routine, 0);
-    to->data = ni;
-    t = smalloc(sizeof(*t));
-    t->next = my_timeouts;
-    t->prev = NULL;
-    if (my_timeouts)
-	my_timeouts->prev = t;
-    my_timeouts = t;
-    t->ni = ni;
-    t->to = to;
-    t->type = type;
+    ni->enforce_set[type] = time(NULL);
+    ni->enforce_due[type] = ni->enforce_set[type] + delay;
+    enforce_requeue(ni);
 }
 
 /*************************************************************************/
 
-/* Remove a collide/release timeout from our private list.  If del_to is
- * nonzero, also delete the associated timeout.  If type == -1, delete
- * timeouts of all types.
- */
+/* Cancel a pending action of the given type for a nick, or all of them if
+ * type == -1 (which must be done before the nick is deleted). */
 
-static void rem_ns_timeout(NickInfo *ni, int type, int del_to)
+static void cancel_enforce(NickInfo *ni, int type)
 {
-    struct my_timeout *t, *t2;
+    int i;
 
-    t = my_timeouts;
-    while (t) {
-	if (t->ni == ni && (type < 0 || t->type == type)) {
-	    t2 = t->next;
-	    if (t->next)
-		t->next->prev = t->prev;
-	    if (t->prev)
-		t->prev->next = t->next;
-	    else
-		my_timeouts = t->next;
-	    if (del_to)
-		del_timeout(t->to);
-	    free(t);
-	    t = t2;
-	} else {
-	    t = t->next;
+    for (i = 0; i < TO_MAX; i++) {
+	if (type < 0 || i == type)
+	    ni->enforce_due[i] = 0;
+    }
+    if (type < 0) {
+	for (i = 0; i < enforce_batch_count; i++) {
+	    if (enforce_batch[i] == ni)
+		enforce_batch[i] = NULL;
 	}
     }
+    enforce_requeue(ni);
 }
 
 /*************************************************************************/
@@ -1136,11 +1361,105 @@ static void do_help(User *u)
 
 /*************************************************************************/
 
+/* Register the user's current nick with the given password (already
+ * encrypted if encryption is in use) and E-mail address (may be NULL).
+ */
+
+static void register_nick(User *u, const char *pass, const char *email)
+{
+    NickInfo *ni;
+
+    ni = makenick(u->nick);
+    if (!ni) {
+	log("%s: makenick(%s) failed", s_NickServ, u->nick);
+	notice_lang(s_NickServ, u, NICK_REGISTRATION_FAILED);
+	return;
+    }
+#ifdef USE_ENCRYPTION
+    memcpy(ni->pass, pass, PASSMAX);
+    ni->status = NS_ENCRYPTEDPW | NS_IDENTIFIED | NS_RECOGNIZED;
+#else
+    if (strlen(pass) > PASSMAX-1) /* -1 for null byte */
+	notice_lang(s_NickServ, u, PASSWORD_TRUNCATED, PASSMAX-1);
+    strscpy(ni->pass, pass, PASSMAX);
+    ni->status = NS_IDENTIFIED | NS_RECOGNIZED;
+#endif
+    ni->flags = NSDefFlags;
+    ni->memos.memomax = MSMaxMemos;
+    ni->channelcount = 0;
+    ni->channelmax = CSMaxReg;
+#ifdef IRC_UNREAL
+    ni->last_usermask = smalloc(strlen(u->username)+strlen(u->fakehost)+2);
+    sprintf(ni->last_usermask, "%s@%s", u->username, u->fakehost);
+#else
+    ni->last_usermask = smalloc(strlen(u->username)+strlen(u->host)+2);
+    sprintf(ni->last_usermask, "%s@%s", u->username, u->host);
+#endif
+    ni->last_realname = sstrdup(u->realname);
+    ni->time_registered = ni->last_seen = time(NULL);
+    ni->accesscount = 1;
+    ni->access = smalloc(sizeof(char *));
+    ni->access[0] = create_mask(u, 0);
+    compile_access(ni);
+    ni->language = DEF_LANGUAGE;
+    ni->link = NULL;
+    if (email)
+	ni->email = sstrdup(email);
+    u->ni = u->real_ni = ni;
+    if (email) {
+	log("%s: `%s' registered by %s@%s (%s)", s_NickServ,
+	    u->nick, u->username, u->host, email);
+    } else {
+	log("%s: `%s' registered by %s@%s", s_NickServ,
+	    u->nick, u->username, u->host);
+    }
+    notice_lang(s_NickServ, u, NICK_REGISTERED, u->nick, ni->access[0]);
+#ifndef USE_ENCRYPTION
+    notice_lang(s_NickServ, u, NICK_PASSWORD_IS, ni->pass);
+#endif
+    u->lastnickreg = time(NULL);
+    if (UMODE_REG)
+	send_cmd(s_NickServ, "SVSMODE %s :+%s", u->nick,
+		 mode_flags_to_string(UMODE_REG, MODE_USER));
+}
+
+/*************************************************************************/
+
+#ifdef USE_ENCRYPTION
+
+/* Finish a REGISTER once the password has been encrypted.  Things may
+ * have changed while we were waiting, so check again that the nick can
+ * still be registered. */
+
+static void register_result(int res, const char *buf, void *data)
+{
+    PassRequest *req = data;
+    User *u = req->user;
+
+    if (!u) {
+	/* User quit in the meantime; nothing to do */
+    } else if (res < 0) {
+	log("%s: Failed to encrypt password for %s (register)",
+	    s_NickServ, req->name);
+	notice_lang(s_NickServ, u, NICK_REGISTRATION_FAILED);
+    } else if (readonly) {
+	notice_lang(s_NickServ, u, NICK_REGISTRATION_DISABLED);
+    } else if (irc_stricmp(u->nick, req->name) != 0 || u->real_ni) {
+	notice_lang(s_NickServ, u, NICK_REGISTRATION_FAILED);
+    } else {
+	register_nick(u, buf, req->email);
+    }
+    free_pass_request(req);
+}
+
+#endif /* USE_ENCRYPTION */
+
+/*************************************************************************/
+
 /* Register a nick. */
 
 static void do_register(User *u)
 {
-    NickInfo *ni;
     char *pass = strtok(NULL, " ");
     char *email = strtok(NULL, " ");
 
@@ -1204,98 +1523,57 @@ static void do_register(User *u)
     } else if (email && !valid_email(email)) {
 	notice_lang(s_NickServ, u, BAD_EMAIL);
 
+    } else if (u->pass_request) {
+	notice_lang(s_NickServ, u, PASSWORD_IN_PROGRESS);
+
     } else {
 #ifdef USE_ENCRYPTION
+	PassRequest *req;
 	int len = strlen(pass);
-	char passbuf[PASSMAX];
 	if (len > PASSMAX) {
 	    len = PASSMAX;
 	    pass[len] = 0;
 	    notice_lang(s_NickServ, u, PASSWORD_TRUNCATED, PASSMAX);
 	}
-	if (encrypt(pass, len, passbuf, PASSMAX) < 0) {
-	    memset(pass, 0, strlen(pass));
-	    log("%s: Failed to encrypt password for %s (register)",
-		s_NickServ, u->nick);
-	    notice_lang(s_NickServ, u, NICK_REGISTRATION_FAILED);
-	    return;
-	}
+	req = new_pass_request(u, u->nick, NULL);
+	if (email)
+	    req->email = sstrdup(email);
+	encrypt_async(pass, len, PASSMAX, register_result, req);
 	memset(pass, 0, strlen(pass));
-#endif
-	ni = makenick(u->nick);
-	if (!ni) {
-	    log("%s: makenick(%s) failed", s_NickServ, u->nick);
-	    notice_lang(s_NickServ, u, NICK_REGISTRATION_FAILED);
-	    return;
-	}
-#ifdef USE_ENCRYPTION
-	memcpy(ni->pass, passbuf, PASSMAX);
-	ni->status = NS_ENCRYPTEDPW | NS_IDENTIFIED | NS_RECOGNIZED;
-#else
-	if (strlen(pass) > PASSMAX-1) /* -1 for null byte */
-	    notice_lang(s_NickServ, u, PASSWORD_TRUNCATED, PASSMAX-1);
-	strscpy(ni->pass, pass, PASSMAX);
-	ni->status = NS_IDENTIFIED | NS_RECOGNIZED;
-#endif
-	ni->flags = NSDefFlags;
-	ni->memos.memomax = MSMaxMemos;
-	ni->channelcount = 0;
-	ni->channelmax = CSMaxReg;
-#ifdef IRC_UNREAL
-	ni->last_usermask = smalloc(strlen(u->username)+strlen(u->fakehost)+2);
-	sprintf(ni->last_usermask, "%s@%s", u->username, u->fakehost);
 #else
-	ni->last_usermask = smalloc(strlen(u->username)+strlen(u->host)+2);
-	sprintf(ni->last_usermask, "%s@%s", u->username, u->host);
+	register_nick(u, pass, email);
 #endif
-	ni->last_realname = sstrdup(u->realname);
-	ni->time_registered = ni->last_seen = time(NULL);
-	ni->accesscount = 1;
-	ni->access = smalloc(sizeof(char *));
-	ni->access[0] = create_mask(u, 0);
-	ni->language = DEF_LANGUAGE;
-	ni->link = NULL;
-	if (email)
-	    ni->email = sstrdup(email);
-	u->ni = u->real_ni = ni;
-	if (email) {
-	    log("%s: `%s' registered by %s@%s (%s)", s_NickServ,
-		u->nick, u->username, u->host, email);
-	} else {
-	    log("%s: `%s' registered by %s@%s", s_NickServ,
-		u->nick, u->username, u->host);
-	}
-	notice_lang(s_NickServ, u, NICK_REGISTERED, u->nick, ni->access[0]);
-#ifndef USE_ENCRYPTION
-	notice_lang(s_NickServ, u, NICK_PASSWORD_IS, ni->pass);
-#endif
-	u->lastnickreg = time(NULL);
-	if (UMODE_REG)
-	    send_cmd(s_NickServ, "SVSMODE %s :+%s", u->nick,
-		     mode_flags_to_string(UMODE_REG, MODE_USER));
-	
     }
 
 }
 
 /*************************************************************************/
 
-static void do_identify(User *u)
+/* Finish an IDENTIFY once the password has been checked.  If the nick
+ * was changed, dropped, suspended or given a new password while we were
+ * waiting, the result no longer applies, so just report failure. */
+
+static void identify_result(int res, const char *buf, void *data)
 {
-    char *pass = strtok(NULL, " ");
+    PassRequest *req = data;
+    User *u = req->user;
     NickInfo *ni;
-    int res;
+    int changed;
 
-    if (!pass) {
-	syntax_error(s_NickServ, u, "IDENTIFY", NICK_IDENTIFY_SYNTAX);
-
-    } else if (!(ni = u->real_ni)) {
-	notice(s_NickServ, u->nick, "Your nick isn't registered.");
+    if (!u) {
+	free_pass_request(req);
+	return;
+    }
+    ni = u->real_ni;
+    changed = (!ni || irc_stricmp(ni->nick, req->name) != 0
+	       || memcmp(ni->pass, req->pass, PASSMAX) != 0
+	       || getlink(ni)->suspendinfo);
+    free_pass_request(req);
 
-    } else if (getlink(ni)->suspendinfo) {
-	notice_lang(s_NickServ, u, NICK_X_SUSPENDED, u->nick);
+    if (changed) {
+	notice_lang(s_NickServ, u, NICK_IDENTIFY_FAILED);
 
-    } else if (!(res = check_password(pass, ni->pass))) {
+    } else if (!res) {
 	log("%s: Failed IDENTIFY for %s!%s@%s",
 		s_NickServ, u->nick, u->username, u->host);
 	nick_bad_password(u, ni);
@@ -1304,6 +1582,14 @@ static void do_identify(User *u)
 	notice_lang(s_NickServ, u, NICK_IDENTIFY_FAILED);
 
     } else {
+	if (buf) {
+	    /* Password was in an old format; store the upgraded one. */
+	    memcpy(ni->pass, buf, PASSMAX);
+	    ns_journal_mark(ni);
+	    if (debug)
+		log("debug: %s: Upgraded password for %s",
+		    s_NickServ, ni->nick);
+	}
 	ni->bad_passwords = 0;
 	ni->status |= NS_IDENTIFIED;
 	ni->id_stamp = u->services_stamp;
@@ -1340,6 +1626,31 @@ static void do_identify(User *u)
     }
 }
 
+
+static void do_identify(User *u)
+{
+    char *pass = strtok(NULL, " ");
+    NickInfo *ni;
+    PassRequest *req;
+
+    if (!pass) {
+	syntax_error(s_NickServ, u, "IDENTIFY", NICK_IDENTIFY_SYNTAX);
+
+    } else if (!(ni = u->real_ni)) {
+	notice(s_NickServ, u->nick, "Your nick isn't registered.");
+
+    } else if (getlink(ni)->suspendinfo) {
+	notice_lang(s_NickServ, u, NICK_X_SUSPENDED, u->nick);
+
+    } else if (u->pass_request) {
+	notice_lang(s_NickServ, u, PASSWORD_IN_PROGRESS);
+
+    } else {
+	req = new_pass_request(u, ni->nick, ni->pass);
+	check_password_async(pass, ni->pass, identify_result, req);
+    }
+}
+
 /*************************************************************************/
 
 static void do_drop(User *u)
@@ -1459,7 +1770,12 @@ static void do_set(User *u)
 			strupper(cmd));
 	else
 	    notice_lang(s_NickServ, u, NICK_SET_UNKNOWN_OPTION, strupper(cmd));
+	return;
     }
+    /* Some options are set on the link target, some on the nick itself */
+    ns_journal_mark(ni);
+    if (!set_nick)
+	ns_journal_mark(u->real_ni);
 }
 
 /*************************************************************************/
@@ -1495,6 +1811,7 @@ static void do_unset(User *u)
 	notice_lang(s_NickServ, u, NICK_IDENTIFY_REQUIRED, s_NickServ);
     } else if (stricmp(cmd, "URL") == 0) {
 	do_set_url(u, set_nick ? ni : u->real_ni, NULL);
+	ns_journal_mark(set_nick ? ni : u->real_ni);
     } else if (stricmp(cmd, "EMAIL") == 0) {
 	if (NSRequireEmail) {
 	    if (set_nick)
@@ -1503,6 +1820,7 @@ static void do_unset(User *u)
 		notice_lang(s_NickServ, u, NICK_UNSET_EMAIL_BAD);
 	} else {
 	    do_set_email(u, set_nick ? ni : u->real_ni, NULL);
+	    ns_journal_mark(set_nick ? ni : u->real_ni);
 	}
     } else {
 	syntax_error(s_NickServ, u, "UNSET",
@@ -1573,6 +1891,7 @@ static void do_set_language(User *u, NickInfo *ni, char *param)
 	return;
     }
     ni->language = langlist[langnum];
+    lang_use(ni->language);
     notice_lang(s_NickServ, u, NICK_SET_LANGUAGE_CHANGED);
 }
 
@@ -1785,6 +2104,8 @@ static void do_access(User *u)
 	ni->accesscount++;
 	ni->access = srealloc(ni->access, sizeof(char *) * ni->accesscount);
 	ni->access[ni->accesscount-1] = sstrdup(mask);
+	compile_access(ni);
+	ns_journal_mark(ni);
 	notice_lang(s_NickServ, u, NICK_ACCESS_ADDED, mask);
 
     } else if (stricmp(cmd, "DEL") == 0) {
@@ -1815,6 +2136,8 @@ static void do_access(User *u)
 	    free(ni->access);
 	    ni->access = NULL;
 	}
+	compile_access(ni);
+	ns_journal_mark(ni);
 
     } else if (stricmp(cmd, "LIST") == 0) {
 	notice_lang(s_NickServ, u, NICK_ACCESS_LIST);
@@ -1908,6 +2231,8 @@ static void do_link(User *u)
 
 	ni->link = target;
 	target->linkcount++;
+	ns_journal_mark(ni);
+	ns_journal_mark(top);	/* Memos may be moved there */
 	do {
 	    target->channelcount += ni->channelcount;
 	    if (target->link)
@@ -1922,17 +2247,14 @@ static void do_link(User *u)
 	    free(ni->access);
 	    ni->access = NULL;
 	    ni->accesscount = 0;
+	    compile_access(ni);
 	}
 	if (ni->memos.memos) {
 	    int i, num;
 	    Memo *memo;
 	    if (top->memos.memos) {
-		num = 0;
-		for (i = 0; i < top->memos.memocount; i++) {
-		    if (top->memos.memos[i].number > num)
-			num = top->memos.memos[i].number;
-		}
-		num++;
+		/* Memos are sorted, so the last has the highest number */
+		num = top->memos.memos[top->memos.memocount-1].number + 1;
 		top->memos.memos = srealloc(top->memos.memos,
 			sizeof(Memo) * (ni->memos.memocount +
 			                top->memos.memocount));
@@ -1945,8 +2267,11 @@ static void do_link(User *u)
 	    for (i = 0; i < ni->memos.memocount; i++, memo++) {
 		*memo = ni->memos.memos[i];
 		memo->number = num++;
+		store_memo_text(top->nick, memo);
 	    }
 	    top->memos.memocount += ni->memos.memocount;
+	    top->memos.unread += ni->memos.unread;
+	    ni->memos.unread = 0;
 	    ni->memos.memocount = 0;
 	    free(ni->memos.memos);
 	    ni->memos.memos = NULL;
@@ -2042,7 +2367,7 @@ static void do_listlinks(User *u)
 
 	notice_lang(s_NickServ, u, NICK_LISTLINKS_HEADER, ni->nick);
 
-	for (ni2 = firstnick(); ni2; ni2 = nextnick()) {
+	for (ni2 = firstnick_sorted(); ni2; ni2 = nextnick_sorted()) {
 	    if (ni2 == ni)
 		continue;
 	    if (param ? getlink(ni2) == ni : ni2->link == ni) {
@@ -2267,7 +2592,7 @@ static void do_list(User *u)
 	}
 
 	notice_lang(s_NickServ, u, NICK_LIST_HEADER, pattern);
-	for (ni = firstnick(); ni; ni = nextnick()) {
+	for (ni = firstnick_sorted(); ni; ni = nextnick_sorted()) {
 	    link = getlink(ni);
 	    if (!is_servadmin && ((ni->flags & NI_PRIVATE)
 				  || (ni->status & NS_VERBOTEN)))
@@ -15,9 +15,32 @@
 #endif
 
 
-/* Nickname info structure.  Each nick structure is stored in one of 256
- * lists; the list is determined by the first character of the nick.  Nicks
- * are stored in alphabetical order within lists. */
+/* Compiled form of one nick access list entry (see compile_access() in
+ * nickserv.c).  The mask is lowercased and split at its '@', so that the
+ * user and host parts can be matched without building a "user@host"
+ * string; hostlit is the literal text following the last wildcard in the
+ * host part, which the end of any matching host must be equal to. */
+
+typedef struct {
+    const char *user;	/* User part (whole mask if host == NULL) */
+    const char *host;	/* Host part, or NULL if mask hasn't exactly 1 '@' */
+    const char *hostlit;/* Literal tail of host part */
+    int16 hostlitlen;	/* strlen(hostlit) */
+    int16 hostwild;	/* Does the host part contain any wildcards? */
+} AccessMatch;
+
+
+/* Types of pending enforcement action on a nick (indexes into
+ * NickInfo.enforce_due[]; see nickserv.c): */
+#define TO_COLLIDE   0			/* Collide the user with this nick */
+#define TO_RELEASE   1			/* Release a collided nick */
+#define TO_SEND_433  2			/* Send a 433 numeric */
+#define TO_MAX       3
+
+
+/* Nickname info structure.  Each nick structure is stored in one of the
+ * lists of the nickname hash table (see nickserv.c); lists are not kept in
+ * any particular order. */
 
 struct nickinfo_ {
     NickInfo *next, *prev;
@@ -59,6 +82,16 @@ struct nickinfo_ {
     ChannelInfo **founderchans;	/* Array of ... */
 
     int bad_passwords;	/* # of bad passwords for nick since last good one */
+
+    int journal_dirty;	/* Changed since last journal flush? */
+
+    AccessMatch *access_match;	/* Compiled access list (accesscount
+				 * entries, strings in the same block) */
+
+    time_t enforce_due[TO_MAX];	/* When each action is due (0 = none) */
+    time_t enforce_set[TO_MAX];	/* When each action was scheduled */
+    time_t enforce_when;	/* Enforcement bucket (0 = not queued) */
+    NickInfo *enforce_next, *enforce_prev;
 };
 
 
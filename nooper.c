@@ -92,6 +92,7 @@ void load_nooper(void)
     noopers = scalloc(sizeof(*noopers), nooper_size);
 
     switch (ver) {
+      case 12:
       case 11:
 	for (i = 0; i < nnooper; i++) {
 	    SAFE(read_string(&noopers[i].mask, f));
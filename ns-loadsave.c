@@ -10,6 +10,26 @@
 /*************************************************************************/
 /*************************************************************************/
 
+/* Change journal.  When DatabaseJournal is set, the nicknames changed
+ * since the last flush are remembered in journal_queue[], and
+ * ns_journal_flush() appends their current records to
+ * <NickDBName>.journal: a byte of JOURNAL_RECORD followed by the record
+ * as save_nick() writes it, or JOURNAL_DELETE followed by the name of a
+ * nick that no longer exists.  The full database is then only written
+ * every so often, to compact the journal; see ns_journal_rotate().  When
+ * loading, any journals are replayed over the database in order.
+ */
+
+#define JOURNAL_RECORD	1
+#define JOURNAL_DELETE	2
+
+static char (*journal_queue)[NICKMAX];	/* Nicks to write on next flush */
+static int journal_count = 0, journal_size = 0;
+static int replaying = 0;	/* Are we reading a journal? */
+static int journal_damaged = 0;	/* Was a journal only partly replayed? */
+
+/*************************************************************************/
+
 #define SAFE(x) do {					\
     if ((x) < 0) {					\
 	if (!forceload)					\
@@ -40,12 +60,10 @@ static void load_old_ns_dbase(dbFILE *f, int ver)
     } old_nickinfo;
 
     int i, j, c;
-    NickInfo *ni, **last, *prev;
+    NickInfo *ni;
     int failed = 0;
 
     for (i = 33; i < 256 && !failed; i++) {
-	last = &nicklists[i];
-	prev = NULL;
 	while ((c = getc_db(f)) != 0) {
 	    if (c != 1)
 		fatal("Invalid format in %s", NickDBName);
@@ -53,11 +71,8 @@ static void load_old_ns_dbase(dbFILE *f, int ver)
 	    if (debug >= 3)
 		log("debug: load_old_ns_dbase read nick %s", old_nickinfo.nick);
 	    ni = scalloc(1, sizeof(NickInfo));
-	    *last = ni;
-	    last = &ni->next;
-	    ni->prev = prev;
-	    prev = ni;
 	    strscpy(ni->nick, old_nickinfo.nick, NICKMAX);
+	    insert_nick(ni);
 	    strscpy(ni->pass, old_nickinfo.pass, PASSMAX);
 	    ni->time_registered = old_nickinfo.time_registered;
 	    ni->last_seen = old_nickinfo.last_seen;
@@ -80,17 +95,7 @@ static void load_old_ns_dbase(dbFILE *f, int ver)
 	    if (ni->flags & 8)
 		ni->status |= NS_ENCRYPTEDPW;
 	    ni->flags &= ~0xE000000C;
-#ifdef USE_ENCRYPTION
-	    if (!(ni->status & (NS_ENCRYPTEDPW | NS_VERBOTEN))) {
-		if (debug)
-		    log("debug: %s: encrypting password for `%s' on load",
-				s_NickServ, ni->nick);
-		if (encrypt_in_place(ni->pass, PASSMAX) < 0)
-		    fatal("%s: Can't encrypt `%s' nickname password!",
-				s_NickServ, ni->nick);
-		ni->status |= NS_ENCRYPTEDPW;
-	    }
-#else
+#ifndef USE_ENCRYPTION
 	    if (ni->status & NS_ENCRYPTEDPW) {
 		/* Bail: it makes no sense to continue with encrypted
 		 * passwords, since we won't be able to verify them */
@@ -123,6 +128,7 @@ static void load_old_ns_dbase(dbFILE *f, int ver)
 			free(s);
 		    j++;
 		}
+		compile_access(ni);
 	    }
 	    ni->id_stamp = 0;
 	    if (ver < 3) {
@@ -132,7 +138,6 @@ static void load_old_ns_dbase(dbFILE *f, int ver)
 		    ni->flags |= NI_MEMO_SIGNON | NI_MEMO_RECEIVE;
 	    }
 	} /* while (getc_db(f) != 0) */
-	*last = NULL;
     } /* for (i) */
     if (debug >= 2)
 	log("debug: load_old_ns_dbase(): loading memos");
@@ -145,7 +150,7 @@ static void load_old_ns_dbase(dbFILE *f, int ver)
 
 #define SAFE(x) do {					\
     if ((x) < 0) {					\
-	if (!forceload)					\
+	if (!forceload && !replaying)			\
 	    fatal("Read error on %s", NickDBName);	\
 	return NULL;					\
     }							\
@@ -175,17 +180,7 @@ NickInfo *load_nick(dbFILE *f, int ver)
     ni->last_seen = tmp32;
     SAFE(read_int16(&ni->status, f));
     ni->status &= ~NS_TEMPORARY;
-#ifdef USE_ENCRYPTION
-    if (!(ni->status & (NS_ENCRYPTEDPW | NS_VERBOTEN))) {
-	if (debug)
-	    log("debug: %s: encrypting password for `%s' on load",
-		s_NickServ, ni->nick);
-	if (encrypt_in_place(ni->pass, PASSMAX) < 0)
-	    fatal("%s: Can't encrypt `%s' nickname password!",
-		  s_NickServ, ni->nick);
-	ni->status |= NS_ENCRYPTEDPW;
-    }
-#else
+#ifndef USE_ENCRYPTION
     if (ni->status & NS_ENCRYPTEDPW) {
 	/* Bail: it makes no sense to continue with encrypted
 	 * passwords, since we won't be able to verify them */
@@ -234,6 +229,7 @@ NickInfo *load_nick(dbFILE *f, int ver)
 	    ni->access = access;
 	    for (i = 0; i < ni->accesscount; i++, access++)
 		SAFE(read_string(access, f));
+	    compile_access(ni);
 	}
 	SAFE(read_int16(&ni->memos.memocount, f));
 	SAFE(read_int16(&ni->memos.memomax, f));
@@ -247,8 +243,13 @@ NickInfo *load_nick(dbFILE *f, int ver)
 		SAFE(read_int32(&tmp32, f));
 		memos->time = tmp32;
 		SAFE(read_buffer(memos->sender, f));
+		if (ver >= 12)
+		    SAFE(read_int32(&memos->textpos, f));
+		else
+		    memos->textpos = 0;
 		SAFE(read_string(&memos->text, f));
 	    }
+	    memos_loaded(&ni->memos, ni->nick);
 	}
 	SAFE(read_int16(&ni->channelcount, f));
 	SAFE(read_int16(&ni->channelmax, f));
@@ -260,8 +261,9 @@ NickInfo *load_nick(dbFILE *f, int ver)
 		ni->channelmax = CSMaxReg;
 	}
 	SAFE(read_int16(&ni->language, f));
-	if (!langtexts[ni->language])
+	if (ni->language < 0 || ni->language >= NUM_LANGS)
 	    ni->language = DEF_LANGUAGE;
+	lang_use(ni->language);
     }
     /* Link and channel counts are recalculated later */
     ni->linkcount = 0;
@@ -273,6 +275,201 @@ NickInfo *load_nick(dbFILE *f, int ver)
 
 /*************************************************************************/
 
+/* Free a nick read in by load_nick(), whose link is still a name, and
+ * remove it from the nick list. */
+
+static void free_loaded_nick(NickInfo *ni)
+{
+    int i;
+
+    unlink_nick(ni);
+    if (ni->url)
+	free(ni->url);
+    if (ni->email)
+	free(ni->email);
+    if (ni->last_usermask)
+	free(ni->last_usermask);
+    if (ni->last_realname)
+	free(ni->last_realname);
+    if (ni->last_quit)
+	free(ni->last_quit);
+    if (ni->link)
+	free(ni->link);
+    if (ni->suspendinfo) {
+	if (ni->suspendinfo->reason)
+	    free(ni->suspendinfo->reason);
+	free(ni->suspendinfo);
+    }
+    if (ni->access) {
+	for (i = 0; i < ni->accesscount; i++) {
+	    if (ni->access[i])
+		free(ni->access[i]);
+	}
+	free(ni->access);
+    }
+    if (ni->access_match)
+	free(ni->access_match);
+    if (ni->memos.memos) {
+	for (i = 0; i < ni->memos.memocount; i++) {
+	    if (ni->memos.memos[i].text)
+		free(ni->memos.memos[i].text);
+	}
+	free(ni->memos.memos);
+    }
+    free(ni);
+}
+
+/*************************************************************************/
+
+/* Replay the given journal file over the nicks loaded so far.  A damaged
+ * record (for example, one cut short by a crash during a flush) ends the
+ * replay, since nothing after it can be trusted.  Returns the number of
+ * records applied.
+ */
+
+static int replay_journal(const char *filename)
+{
+    dbFILE *f;
+    int ver, c, count = 0;
+    NickInfo *ni, *old;
+    char nick[NICKMAX];
+
+    if (!(f = open_db(s_NickServ, filename, "r")))
+	return 0;
+    ver = get_file_version(f);
+    if (ver < 5 || ver > FILE_VERSION) {
+	log("%s: Unsupported version number (%d) on %s, not replaying",
+	    s_NickServ, ver, filename);
+	close_db(f);
+	return 0;
+    }
+    replaying = 1;
+    while ((c = getc_db(f)) != EOF) {
+	if (c == JOURNAL_RECORD) {
+	    if (!(ni = load_nick(f, ver)))
+		break;
+	    if ((old = findnick(ni->nick)) != NULL)
+		free_loaded_nick(old);
+	    insert_nick(ni);
+	} else if (c == JOURNAL_DELETE && read_buffer(nick, f)) {
+	    nick[NICKMAX-1] = 0;
+	    if ((old = findnick(nick)) != NULL)
+		free_loaded_nick(old);
+	} else {
+	    break;
+	}
+	count++;
+    }
+    replaying = 0;
+    if (c != EOF) {
+	log("%s: %s damaged after %d records, ignoring the rest",
+	    s_NickServ, filename, count);
+    }
+    if (c != EOF || f->badblocks)
+	journal_damaged = 1;
+    close_db(f);
+    if (debug)
+	log("debug: %s: replayed %d records from %s",
+	    s_NickServ, count, filename);
+    return count;
+}
+
+/* Replay both journals (the older one, if any, first), then resolve the
+ * nick links left as names by load_nick(). */
+
+static void replay_journals(void)
+{
+    char buf[PATH_MAX];
+    NickInfo *ni;
+
+    snprintf(buf, sizeof(buf), "%s.journal.old", NickDBName);
+    replay_journal(buf);
+    snprintf(buf, sizeof(buf), "%s.journal", NickDBName);
+    replay_journal(buf);
+
+    for (ni = firstnick(); ni; ni = nextnick()) {
+	if (ni->link) {
+	    char *s = (char *)ni->link;
+	    ni->link = findnick(s);
+	    free(s);
+	    if (ni->link)
+		ni->link->linkcount++;
+	}
+    }
+}
+
+/* A damaged journal can't be appended to: the length of a block cut
+ * short by a crash would run into the records written after it, and they
+ * would be lost along with it on the next replay.  So if one was found,
+ * save the whole database now, which leaves neither journal needed.
+ */
+
+static void replace_damaged_journals(void)
+{
+    char buf[PATH_MAX];
+    int errors = db_write_errors;
+
+    if (!journal_damaged || readonly)
+	return;
+    journal_damaged = 0;
+    log("%s: saving %s to replace its damaged journal", s_NickServ,
+	NickDBName);
+    save_ns_dbase();
+    if (db_write_errors != errors)
+	return;		/* The old journals are still needed */
+    snprintf(buf, sizeof(buf), "%s.journal", NickDBName);
+    unlink(buf);
+}
+
+/*************************************************************************/
+
+/* Encrypt the passwords of any nicks loaded without encryption (from a
+ * database saved before encryption was enabled).  This is done once all
+ * the nicks are loaded, so that the passwords can be hashed several at a
+ * time with encrypt_in_place_batch().
+ */
+
+#ifdef USE_ENCRYPTION
+static void encrypt_nick_list(NickInfo **list, int count)
+{
+    char *bufs[16];
+    int i;
+
+    for (i = 0; i < count; i++)
+	bufs[i] = list[i]->pass;
+    if (encrypt_in_place_batch(bufs, count, PASSMAX) < 0)
+	fatal("%s: Can't encrypt `%s' nickname password!",
+	      s_NickServ, list[0]->nick);
+    for (i = 0; i < count; i++)
+	list[i]->status |= NS_ENCRYPTEDPW;
+}
+#endif
+
+static void encrypt_loaded_nicks(void)
+{
+#ifdef USE_ENCRYPTION
+    NickInfo *ni, *list[16];
+    int count = 0;
+
+    for (ni = firstnick(); ni; ni = nextnick()) {
+	if (ni->status & (NS_ENCRYPTEDPW | NS_VERBOTEN))
+	    continue;
+	if (debug)
+	    log("debug: %s: encrypting password for `%s' on load",
+		s_NickServ, ni->nick);
+	list[count++] = ni;
+	if (count == lenof(list)) {
+	    encrypt_nick_list(list, count);
+	    count = 0;
+	}
+    }
+    if (count > 0)
+	encrypt_nick_list(list, count);
+#endif
+}
+
+/*************************************************************************/
+
 void load_ns_dbase(void)
 {
     dbFILE *f;
@@ -280,10 +477,16 @@ void load_ns_dbase(void)
     NickInfo *ni;
     int failed = 0;
 
-    if (!(f = open_db(s_NickServ, NickDBName, "r")))
+    if (!(f = open_db(s_NickServ, NickDBName, "r"))) {
+	/* The first full save may not have happened yet */
+	replay_journals();
+	encrypt_loaded_nicks();
+	replace_damaged_journals();
 	return;
+    }
 
     switch (ver = get_file_version(f)) {
+      case 12:
       case 11:
       case 10:
       case 9:
@@ -293,11 +496,17 @@ void load_ns_dbase(void)
       case 5:
 	for (i = 0; i < 256 && !failed; i++) {
 	    while ((c = getc_db(f)) != 0) {
-		if (c != 1)
+		if (c != 1) {
+		    /* Damaged blocks have already been reported */
+		    if (c == EOF && f->badblocks) {
+			failed = 1;
+			break;
+		    }
 		    fatal("Invalid format in %s", NickDBName);
+		}
 		ni = load_nick(f, ver);
 		if (ni) {
-		    alpha_insert_nick(ni);
+		    insert_nick(ni);
 		} else {
 		    failed = 1;
 		    break;
@@ -305,17 +514,8 @@ void load_ns_dbase(void)
 	    }
 	}
 
-	/* Now resolve links */
-	for (ni = firstnick(); ni; ni = nextnick()) {
-	    if (ni->link) {
-		char *s = (char *)ni->link;
-		ni->link = findnick(s);
-		free(s);
-		if (ni->link)
-		    ni->link->linkcount++;
-	    }
-	}
-
+	/* Bring the data up to date and resolve links */
+	replay_journals();
 	break;
 
       case 4:
@@ -334,6 +534,8 @@ void load_ns_dbase(void)
     } /* switch (version) */
 
     close_db(f);
+    encrypt_loaded_nicks();
+    replace_damaged_journals();
 }
 
 #undef SAFE
@@ -341,75 +543,101 @@ void load_ns_dbase(void)
 /*************************************************************************/
 /*************************************************************************/
 
+#define SAFE(x) do { if ((x) < 0) return -1; } while (0)
+
+/* Write a single nick's record.  Returns 0 on success, -1 on error. */
+
+static int save_nick(dbFILE *f, NickInfo *ni)
+{
+    int i;
+    char **access;
+    Memo *memos;
+
+    SAFE(write_buffer(ni->nick, f));
+    SAFE(write_buffer(ni->pass, f));
+    SAFE(write_string(ni->url, f));
+    SAFE(write_string(ni->email, f));
+    SAFE(write_string(ni->last_usermask, f));
+    SAFE(write_string(ni->last_realname, f));
+    SAFE(write_string(ni->last_quit, f));
+    SAFE(write_int32(ni->time_registered, f));
+    SAFE(write_int32(ni->last_seen, f));
+    SAFE(write_int16(ni->status, f));
+    if (ni->link) {
+	SAFE(write_string(ni->link->nick, f));
+	SAFE(write_int16(ni->linkcount, f));
+	SAFE(write_int16(ni->channelcount, f));
+    } else {
+	SAFE(write_string(NULL, f));
+	SAFE(write_int16(ni->linkcount, f));
+	SAFE(write_int32(ni->flags, f));
+	SAFE(write_ptr(ni->suspendinfo, f));
+	if (ni->suspendinfo) {
+	    SAFE(write_buffer(ni->suspendinfo->who, f));
+	    SAFE(write_string(ni->suspendinfo->reason, f));
+	    SAFE(write_int32(ni->suspendinfo->suspended, f));
+	    SAFE(write_int32(ni->suspendinfo->expires, f));
+	}
+	SAFE(write_int16(ni->accesscount, f));
+	for (i=0, access=ni->access; i<ni->accesscount; i++, access++)
+	    SAFE(write_string(*access, f));
+	SAFE(write_int16(ni->memos.memocount, f));
+	SAFE(write_int16(ni->memos.memomax, f));
+	memos = ni->memos.memos;
+	for (i = 0; i < ni->memos.memocount; i++, memos++) {
+	    SAFE(write_int32(memos->number, f));
+	    SAFE(write_int16(memos->flags, f));
+	    SAFE(write_int32(memos->time, f));
+	    SAFE(write_buffer(memos->sender, f));
+	    SAFE(write_int32(memos->textpos, f));
+	    SAFE(write_string(memos->text, f));
+	}
+	SAFE(write_int16(ni->channelcount, f));
+	SAFE(write_int16(ni->channelmax, f));
+	SAFE(write_int16(ni->language, f));
+    }
+    return 0;
+}
+
+#undef SAFE
+
+/*************************************************************************/
+
 #define SAFE(x) do { if ((x) < 0) goto fail; } while (0)
 
 void save_ns_dbase(void)
 {
     dbFILE *f;
-    int i;
     NickInfo *ni;
-    char **access;
-    Memo *memos;
+    char oldname[PATH_MAX];
     static time_t lastwarn = 0;
 
+    memo_store_sync();
     if (!(f = open_db(s_NickServ, NickDBName, "w")))
 	return;
     for (ni = firstnick(); ni; ni = nextnick()) {
 	SAFE(write_int8(1, f));
-	SAFE(write_buffer(ni->nick, f));
-	SAFE(write_buffer(ni->pass, f));
-	SAFE(write_string(ni->url, f));
-	SAFE(write_string(ni->email, f));
-	SAFE(write_string(ni->last_usermask, f));
-	SAFE(write_string(ni->last_realname, f));
-	SAFE(write_string(ni->last_quit, f));
-	SAFE(write_int32(ni->time_registered, f));
-	SAFE(write_int32(ni->last_seen, f));
-	SAFE(write_int16(ni->status, f));
-	if (ni->link) {
-	    SAFE(write_string(ni->link->nick, f));
-	    SAFE(write_int16(ni->linkcount, f));
-	    SAFE(write_int16(ni->channelcount, f));
-	} else {
-	    SAFE(write_string(NULL, f));
-	    SAFE(write_int16(ni->linkcount, f));
-	    SAFE(write_int32(ni->flags, f));
-	    SAFE(write_ptr(ni->suspendinfo, f));
-	    if (ni->suspendinfo) {
-		SAFE(write_buffer(ni->suspendinfo->who, f));
-		SAFE(write_string(ni->suspendinfo->reason, f));
-		SAFE(write_int32(ni->suspendinfo->suspended, f));
-		SAFE(write_int32(ni->suspendinfo->expires, f));
-	    }
-	    SAFE(write_int16(ni->accesscount, f));
-	    for (i=0, access=ni->access; i<ni->accesscount; i++, access++)
-		SAFE(write_string(*access, f));
-	    SAFE(write_int16(ni->memos.memocount, f));
-	    SAFE(write_int16(ni->memos.memomax, f));
-	    memos = ni->memos.memos;
-	    for (i = 0; i < ni->memos.memocount; i++, memos++) {
-		SAFE(write_int32(memos->number, f));
-		SAFE(write_int16(memos->flags, f));
-		SAFE(write_int32(memos->time, f));
-		SAFE(write_buffer(memos->sender, f));
-		SAFE(write_string(memos->text, f));
-	    }
-	    SAFE(write_int16(ni->channelcount, f));
-	    SAFE(write_int16(ni->channelmax, f));
-	    SAFE(write_int16(ni->language, f));
-	}
-    } /* for (ni) */
+	SAFE(save_nick(f, ni));
+	end_record_db(f);
+    }
     {
 	/* This is an UGLY HACK but it simplifies loading.  It will go away
 	 * in the next file version */
 	static char buf[256];
 	SAFE(write_buffer(buf, f));
     }
-    close_db(f);
+    if (close_db(f) < 0) {
+	f = NULL;	/* close_db() has already restored it */
+	goto fail;
+    }
+    /* Everything in the old journal is in the new database now */
+    snprintf(oldname, sizeof(oldname), "%s.journal.old", NickDBName);
+    unlink(oldname);
     return;
 
   fail:
-    restore_db(f);
+    if (f)
+	restore_db(f);
     log_perror("Write error on %s", NickDBName);
     if (time(NULL) - lastwarn > WarningTimeout) {
 	wallops(NULL, "Write error on %s: %s", NickDBName,
@@ -421,3 +649,112 @@ void save_ns_dbase(void)
 #undef SAFE
 
 /*************************************************************************/
+/*************************************************************************/
+
+/* Note that the given nick has changed (or is about to be dropped), so
+ * that it is written to the journal on the next flush. */
+
+void ns_journal_mark(NickInfo *ni)
+{
+    if (!JournalFlush || readonly || !ni || ni->journal_dirty)
+	return;
+    if (journal_count >= journal_size) {
+	journal_size += 64;
+	journal_queue = srealloc(journal_queue,
+				 sizeof(*journal_queue) * journal_size);
+    }
+    strscpy(journal_queue[journal_count++], ni->nick, NICKMAX);
+    ni->journal_dirty = 1;
+}
+
+/*************************************************************************/
+
+#define SAFE(x) do { if ((x) < 0) goto fail; } while (0)
+
+/* Append the records of all changed nicks to the journal.  If the write
+ * fails, the journal is cut back to where it was and the changes stay
+ * queued for the next attempt.
+ */
+
+void ns_journal_flush(void)
+{
+    dbFILE *f;
+    NickInfo *ni;
+    char buf[PATH_MAX];
+    int i;
+    static time_t lastwarn = 0;
+
+    if (!journal_count)
+	return;
+    memo_store_sync();
+    snprintf(buf, sizeof(buf), "%s.journal", NickDBName);
+    if (!(f = open_db(s_NickServ, buf, "a")))
+	return;
+    for (i = 0; i < journal_count; i++) {
+	ni = findnick(journal_queue[i]);
+	if (!ni) {
+	    SAFE(write_int8(JOURNAL_DELETE, f));
+	    if (!write_buffer(journal_queue[i], f))
+		goto fail;
+	} else if (ni->journal_dirty == 1) {
+	    SAFE(write_int8(JOURNAL_RECORD, f));
+	    SAFE(save_nick(f, ni));
+	    ni->journal_dirty = 2;	/* Don't write it twice */
+	}
+	end_record_db(f);
+    }
+    if (close_db(f) < 0) {
+	f = NULL;	/* close_db() has already restored it */
+	goto fail;
+    }
+    for (i = 0; i < journal_count; i++) {
+	if ((ni = findnick(journal_queue[i])) != NULL)
+	    ni->journal_dirty = 0;
+    }
+    if (debug >= 2)
+	log("debug: %s: journaled %d changes", s_NickServ, journal_count);
+    journal_count = 0;
+    return;
+
+  fail:
+    if (f)
+	restore_db(f);
+    for (i = 0; i < journal_count; i++) {
+	if ((ni = findnick(journal_queue[i])) != NULL)
+	    ni->journal_dirty = 1;
+    }
+    log_perror("Write error on %s", buf);
+    if (time(NULL) - lastwarn > WarningTimeout) {
+	wallops(NULL, "Write error on %s: %s", buf, strerror(errno));
+	lastwarn = time(NULL);
+    }
+}
+
+#undef SAFE
+
+/*************************************************************************/
+
+/* Prepare for a full save of the nickname database: flush the journal
+ * and set it aside as <NickDBName>.journal.old, so that changes made from
+ * now on go to a new journal.  save_ns_dbase() deletes the old journal
+ * once the database has been written.  If an old journal is still
+ * present (the last full save failed), keep appending to the current one
+ * instead; the next successful save covers both.  This must be done by
+ * the process which keeps the journal, not by a background saver.
+ */
+
+void ns_journal_rotate(void)
+{
+    char buf[PATH_MAX], oldbuf[PATH_MAX];
+
+    if (!JournalFlush)
+	return;
+    ns_journal_flush();
+    snprintf(buf, sizeof(buf), "%s.journal", NickDBName);
+    snprintf(oldbuf, sizeof(oldbuf), "%s.journal.old", NickDBName);
+    if (access(oldbuf, F_OK) < 0 && rename(buf, oldbuf) < 0
+     && errno != ENOENT)
+	log_perror("Can't rename %s to %s", buf, oldbuf);
+}
+
+/*************************************************************************/
@@ -10,6 +10,7 @@
 #include "services.h"
 #include "pseudo.h"
 #include "news.h"
+#include "datafiles.h"
 
 #include <unistd.h>
 
@@ -76,6 +77,9 @@ static void closenet_timeout(Timeout *to);
 #ifdef DEBUG_COMMANDS
 static void send_clone_lists(User *u);
 static void do_matchwild(User *u);
+static void do_matchbench(User *u);
+static void do_dbbench(User *u);
+static void do_passbench(User *u);
 #endif
 
 /*************************************************************************/
@@ -156,6 +160,9 @@ static Command cmds[] = {
     { "LISTUSER",   send_user_info,     is_services_root, -1,-1,-1,-1,-1 },
     { "LISTTIMERS", send_timeout_list,  is_services_root, -1,-1,-1,-1,-1 },
     { "MATCHWILD",  do_matchwild,       is_services_root, -1,-1,-1,-1,-1 },
+    { "MATCHBENCH", do_matchbench,      is_services_root, -1,-1,-1,-1,-1 },
+    { "DBBENCH",    do_dbbench,         is_services_root, -1,-1,-1,-1,-1 },
+    { "PASSBENCH",  do_passbench,       is_services_root, -1,-1,-1,-1,-1 },
     { "LISTCLONES", send_clone_lists,   is_services_root, -1,-1,-1,-1,-1 },
 #endif
 
@@ -253,6 +260,7 @@ void load_os_dbase(void)
     if (!(f = open_db(s_OperServ, OperDBName, "r")))
 	return;
     switch (ver = get_file_version(f)) {
+      case 12:
       case 11:
       case 10:
       case 9:
@@ -772,7 +780,7 @@ static void do_stats(User *u)
     }
 
     if (extra && stricmp(extra, "ALL") == 0 && is_services_admin(u)) {
-	long count, mem, count2, mem2;
+	long count, mem, count2, mem2, ms;
 	int i;
 
 	notice_lang(s_OperServ, u, OPER_STATS_BYTES_READ, total_read / 1024);
@@ -835,6 +843,11 @@ static void do_stats(User *u)
 	notice_lang(s_OperServ, u, OPER_STATS_SESSIONS_MEM,
 			count, (mem+512) / 1024);
 #endif
+
+	get_language_stats(&count, &mem, &mem2, &count2, &ms);
+	notice_lang(s_OperServ, u, OPER_STATS_LANGUAGE_MEM,
+			(int)count, (int)((mem+512) / 1024),
+			(int)((mem2+512) / 1024), (int)count2, (int)ms);
     }
 }
 
@@ -1327,6 +1340,278 @@ static void do_matchwild(User *u)
 	notice(s_OperServ, u->nick, "Syntax error.");
 }
 
+
+/* match_usermask() as it was before masks could be pre-split, for
+ * comparison by MATCHBENCH. */
+
+static int match_usermask_strtok(const char *mask, User *user)
+{
+    char *mask2 = sstrdup(mask);
+    char *nick, *username, *host;
+    int match_user, match_host, result;
+
+    if (strchr(mask2, '!')) {
+	nick = strtok(mask2, "!");
+	username = strtok(NULL, "@");
+    } else {
+	nick = NULL;
+	username = strtok(mask2, "@");
+    }
+    host = strtok(NULL, "");
+    if (!host) {
+	free(mask2);
+	return 0;
+    }
+    match_user = match_wild(username, user->username);
+    match_host = match_wild_nocase(host, user->host);
+#ifdef IRC_UNREAL
+    if (user->fakehost)
+	match_host |= match_wild_nocase(host, user->fakehost);
+#endif
+    if (nick) {
+	result = match_wild_nocase(nick, user->nick) &&
+		 match_user && match_host;
+    } else {
+	result = match_user && match_host;
+    }
+    free(mask2);
+    return result;
+}
+
+/* Time `count' passes of matching a mask against every online user, with
+ * the old copying matcher, match_usermask() and match_parsed_usermask().
+ * Syntax: MATCHBENCH mask [count] */
+
+static void do_matchbench(User *u)
+{
+    char *mask = strtok(NULL, " ");
+    char *s = strtok(NULL, " ");
+    int count = s ? atoi(s) : 100;
+    int i, pass, matches[3];
+    long usec[3];
+    struct timeval start, stop;
+    UserMask um;
+    User *user;
+
+    if (!mask || count <= 0) {
+	notice(s_OperServ, u->nick, "Syntax error.");
+	return;
+    }
+    parse_usermask(mask, &um);
+    for (i = 0; i < 3; i++) {
+	matches[i] = 0;
+	gettimeofday(&start, NULL);
+	for (pass = 0; pass < count; pass++) {
+	    for (user = firstuser(); user; user = nextuser()) {
+		if (i == 0)
+		    matches[i] += match_usermask_strtok(mask, user);
+		else if (i == 1)
+		    matches[i] += match_usermask(mask, user);
+		else
+		    matches[i] += match_parsed_usermask(&um, user);
+	    }
+	}
+	gettimeofday(&stop, NULL);
+	usec[i] = (stop.tv_sec - start.tv_sec) * 1000000
+		+ (stop.tv_usec - start.tv_usec);
+    }
+    free_usermask(&um);
+    notice(s_OperServ, u->nick, "old: %ld usec, %d matches", usec[0],
+	   matches[0]);
+    notice(s_OperServ, u->nick, "match_usermask: %ld usec, %d matches",
+	   usec[1], matches[1]);
+    notice(s_OperServ, u->nick, "match_parsed_usermask: %ld usec,"
+	   " %d matches", usec[2], matches[2]);
+}
+
+
+/* Time writing and reading back `count' synthetic nickname records laid
+ * out like those in nick.db, through the dbFILE routines.
+ * Syntax: DBBENCH [count] */
+
+static void do_dbbench(User *u)
+{
+    static const char filename[] = "dbbench.tmp";
+    char *s = strtok(NULL, " ");
+    int count = s ? atoi(s) : 1000000;
+    char nick[NICKMAX], pass[PASSMAX], buf[BUFSIZE];
+    char *str;
+    int i, j;
+    uint32 tmp32;
+    uint16 tmp16;
+    long usec[2];
+    off_t size;
+    struct timeval start, stop;
+    struct stat st;
+    dbFILE *f;
+
+    if (count <= 0) {
+	notice(s_OperServ, u->nick, "Syntax error.");
+	return;
+    }
+    memset(pass, 'x', sizeof(pass));
+    gettimeofday(&start, NULL);
+    if (!(f = open_db(s_OperServ, filename, "w"))) {
+	notice(s_OperServ, u->nick, "Can't create %s.", filename);
+	return;
+    }
+    for (i = 0; i < count; i++) {
+	snprintf(nick, sizeof(nick), "Nick%d", i);
+	snprintf(buf, sizeof(buf), "user%d@host-%d.example.net", i, i%1000);
+	write_int8(1, f);
+	write_db(f, nick, sizeof(nick));
+	write_db(f, pass, sizeof(pass));
+	write_string(NULL, f);
+	write_string("nick@example.net", f);
+	write_string(buf, f);
+	write_string("Synthetic User", f);
+	write_string("Quit: Leaving", f);
+	write_int32(time(NULL), f);
+	write_int32(time(NULL), f);
+	write_int16(0, f);
+	write_string(NULL, f);
+	write_int16(0, f);
+	write_int32(NI_SECURE, f);
+	write_ptr(NULL, f);
+	write_int16(1, f);
+	write_string("*@*.example.net", f);
+	write_int16(0, f);
+	write_int16(MSMaxMemos, f);
+	write_int16(0, f);
+	write_int16(CSMaxReg, f);
+	if (write_int16(DEF_LANGUAGE, f) < 0)
+	    break;
+    }
+    write_int8(0, f);
+    close_db(f);
+    gettimeofday(&stop, NULL);
+    usec[0] = (stop.tv_sec - start.tv_sec) * 1000000
+	    + (stop.tv_usec - start.tv_usec);
+    size = stat(filename, &st) == 0 ? st.st_size : -1;
+
+    gettimeofday(&start, NULL);
+    if (!(f = open_db(s_OperServ, filename, "r"))) {
+	notice(s_OperServ, u->nick, "Can't read %s.", filename);
+	return;
+    }
+    get_file_version(f);
+    for (i = 0; getc_db(f) == 1; i++) {
+	read_db(f, nick, sizeof(nick));
+	read_db(f, pass, sizeof(pass));
+	for (j = 0; j < 5; j++) {
+	    read_string(&str, f);
+	    if (str)
+		free(str);
+	}
+	read_int32(&tmp32, f);
+	read_int32(&tmp32, f);
+	read_int16(&tmp16, f);
+	read_string(&str, f);
+	read_int16(&tmp16, f);
+	read_int32(&tmp32, f);
+	read_ptr((void **)&str, f);
+	read_int16(&tmp16, f);
+	read_string(&str, f);
+	if (str)
+	    free(str);
+	read_int16(&tmp16, f);
+	read_int16(&tmp16, f);
+	read_int16(&tmp16, f);
+	read_int16(&tmp16, f);
+	if (read_int16(&tmp16, f) < 0)
+	    break;
+    }
+    close_db(f);
+    gettimeofday(&stop, NULL);
+    usec[1] = (stop.tv_sec - start.tv_sec) * 1000000
+	    + (stop.tv_usec - start.tv_usec);
+    unlink(filename);
+
+    notice(s_OperServ, u->nick, "write: %ld usec, %d records, %ld bytes",
+	   usec[0], count, (long)size);
+    notice(s_OperServ, u->nick, "read: %ld usec, %d records", usec[1], i);
+}
+
+/*************************************************************************/
+
+/* Time encrypting `count' passwords one at a time with encrypt() and all
+ * together with encrypt_batch(), then check the batch results with
+ * check_password_batch().  This runs in the main loop, so the count is
+ * limited to keep it from holding Services up for long.
+ * Syntax: PASSBENCH [count] */
+
+#define PASSBENCH_MAX	64
+
+static void do_passbench(User *u)
+{
+    char *s = strtok(NULL, " ");
+    int count = s ? atoi(s) : 16;
+    char (*pass)[16], (*crypted)[PASSMAX];
+    const char **src, **check;
+    char **dest;
+    int *len, *results;
+    int i, ok = 0;
+    long usec[2];
+    struct timeval start, stop;
+
+    if (count <= 0) {
+	notice(s_OperServ, u->nick, "Syntax error.");
+	return;
+    }
+    if (count > PASSBENCH_MAX) {
+	notice(s_OperServ, u->nick, "Count must be at most %d.",
+	       PASSBENCH_MAX);
+	return;
+    }
+    pass = smalloc(sizeof(*pass) * count);
+    crypted = smalloc(sizeof(*crypted) * count);
+    src = smalloc(sizeof(*src) * count);
+    check = smalloc(sizeof(*check) * count);
+    dest = smalloc(sizeof(*dest) * count);
+    len = smalloc(sizeof(*len) * count);
+    results = smalloc(sizeof(*results) * count);
+    for (i = 0; i < count; i++) {
+	snprintf(pass[i], sizeof(pass[i]), "password%d", i);
+	src[i] = pass[i];
+	len[i] = strlen(pass[i]);
+	dest[i] = crypted[i];
+	check[i] = crypted[i];
+    }
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < count; i++)
+	encrypt(src[i], len[i], dest[i], PASSMAX);
+    gettimeofday(&stop, NULL);
+    usec[0] = (stop.tv_sec - start.tv_sec) * 1000000
+	    + (stop.tv_usec - start.tv_usec);
+
+    gettimeofday(&start, NULL);
+    encrypt_batch(src, len, dest, PASSMAX, count);
+    gettimeofday(&stop, NULL);
+    usec[1] = (stop.tv_sec - start.tv_sec) * 1000000
+	    + (stop.tv_usec - start.tv_usec);
+
+    check_password_batch(src, check, results, count);
+    for (i = 0; i < count; i++) {
+	if (results[i] == 1)
+	    ok++;
+    }
+
+    notice(s_OperServ, u->nick, "encrypt: %ld usec, %ld passwords/sec",
+	   usec[0], usec[0] ? (long)(count * 1000000.0 / usec[0]) : 0);
+    notice(s_OperServ, u->nick,
+	   "encrypt_batch: %ld usec, %ld passwords/sec, %d/%d verified",
+	   usec[1], usec[1] ? (long)(count * 1000000.0 / usec[1]) : 0,
+	   ok, count);
+    free(pass);
+    free(crypted);
+    free(src);
+    free(check);
+    free(dest);
+    free(len);
+    free(results);
+}
+
 #endif	/* DEBUG_COMMANDS */
 
 /*************************************************************************/
@@ -1348,6 +1633,7 @@ static void do_killclones(User *u)
     int count=0;
     User *cloneuser, *user, *tempuser;
     char *clonemask, *akillmask;
+    UserMask um;
     char killreason[NICKMAX+32];
     char akillreason[] = "Temporary KILLCLONES akill.";
 
@@ -1360,13 +1646,14 @@ static void do_killclones(User *u)
     } else {
 	clonemask = smalloc(strlen(cloneuser->host) + 5);
 	sprintf(clonemask, "*!*@%s", cloneuser->host);
+	parse_usermask(clonemask, &um);
 
 	akillmask = smalloc(strlen(cloneuser->host) + 3);
 	sprintf(akillmask, "*@%s", strlower(cloneuser->host));
 
 	user = firstuser();
 	while (user) {
-	    if (match_usermask(clonemask, user) != 0) {
+	    if (match_parsed_usermask(&um, user) != 0) {
 		tempuser = nextuser();
 		count++;
 		snprintf(killreason, sizeof(killreason),
@@ -1388,6 +1675,7 @@ static void do_killclones(User *u)
 	log("%s: KILLCLONES: %d clone(s) matching %s killed.",
 			s_OperServ, count, clonemask);
 
+	free_usermask(&um);
 	free(akillmask);
 	free(clonemask);
     }
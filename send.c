@@ -123,30 +123,128 @@ void notice_list(const char *source, const char *dest, const char **text)
 }
 
 
+/* Language messages are written to the send buffer a line at a time
+ * without going through send_cmd(): each line is built by appending to
+ * the ":source NOTICE nick :" prefix and sent as is.  The message's
+ * render information (see lang/langcomp.c) says where its lines and %S's
+ * are, so messages without printf() conversions--most help texts--are
+ * sent straight from the language table.
+ */
+
+/* Set up a line buffer of BUFSIZE+2 bytes with the NOTICE prefix and
+ * return its length. */
+
+static int notice_prefix(char *line, const char *source, const char *dest)
+{
+    int len = snprintf(line, BUFSIZE, ":%s NOTICE %s :", source, dest);
+    return len < 0 || len >= BUFSIZE ? BUFSIZE-1 : len;
+}
+
+/* Append `n' bytes of text to a line buffer, truncating at BUFSIZE.
+ * Return the new length. */
+
+static int line_append(char *line, int len, const char *text, int n)
+{
+    if (n > BUFSIZE - len)
+	n = BUFSIZE - len;
+    memcpy(line+len, text, n);
+    return len+n;
+}
+
+/* Send a line built with the above. */
+
+static void send_line(char *line, int len, int prefixlen)
+{
+    /* Have to kludge around an ircII bug here (see notice_list()) */
+    if (len == prefixlen)
+	line[len++] = ' ';
+    if (debug)
+	log("debug: Sent: %.*s", len, line);
+    line[len] = '\r';
+    line[len+1] = '\n';
+    swrite(servsock, line, len+2);
+    last_send = time(NULL);
+}
+
+/* Send the pieces of a message without printf() conversions, replacing
+ * %S by `subst'. */
+
+static void notice_pieces(const char *source, const char *dest,
+			  const char *text, const unsigned char *render,
+			  const char *subst)
+{
+    char line[BUFSIZE+2];
+    int prefixlen, len, npieces, sublen = strlen(subst);
+    const unsigned char *piece;
+
+    prefixlen = len = notice_prefix(line, source, dest);
+    npieces = LANG_GET16(render+2);
+    for (piece = render+4; npieces > 0; npieces--, piece += 4) {
+	int info = LANG_GET16(piece+2);
+	len = line_append(line, len, text + LANG_GET16(piece),
+			  info & LANG_PIECE_LEN);
+	if (info & LANG_PIECE_SOURCE)
+	    len = line_append(line, len, subst, sublen);
+	if (info & LANG_PIECE_EOL) {
+	    send_line(line, len, prefixlen);
+	    len = prefixlen;
+	}
+    }
+}
+
+/* Send formatted text line by line, replacing each pair of \1 characters
+ * by `subst' if it is not NULL. */
+
+static void notice_text(const char *source, const char *dest,
+			const char *text, const char *subst)
+{
+    char line[BUFSIZE+2];
+    int prefixlen, len, n, i;
+
+    prefixlen = notice_prefix(line, source, dest);
+    while (*text) {
+	len = prefixlen;
+	n = strcspn(text, "\n");
+	for (i = 0; subst && i+1 < n; i++) {
+	    if (text[i] == 1 && text[i+1] == 1) {
+		len = line_append(line, len, text, i);
+		len = line_append(line, len, subst, strlen(subst));
+		text += i+2;
+		n -= i+2;
+		i = -1;
+	    }
+	}
+	len = line_append(line, len, text, n);
+	send_line(line, len, prefixlen);
+	text += n;
+	if (*text)
+	    text++;
+    }
+}
+
 /* Send a message in the user's selected language to the user using NOTICE. */
 
 void notice_lang(const char *source, User *dest, int message, ...)
 {
     va_list args;
     char buf[4096];	/* because messages can be really big */
-    char *s, *t;
+    const unsigned char *render;
     const char *fmt;
 
     if (!dest)
 	return;
-    va_start(args, message);
     fmt = getstring(dest->ni, message);
     if (!fmt)
 	return;
-    vsnprintf(buf, sizeof(buf), fmt, args);
-    s = buf;
-    while (*s) {
-	t = s;
-	s += strcspn(s, "\n");
-	if (*s)
-	    *s++ = 0;
-	send_cmd(source, "NOTICE %s :%s", dest->nick, *t ? t : " ");
+    render = getrender(dest->ni, message);
+    if (!(LANG_GET16(render) & (LANG_RF_FORMAT | LANG_RF_SOURCE))) {
+	notice_pieces(source, dest->nick, fmt, render, "");
+	return;
     }
+    va_start(args, message);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    notice_text(source, dest->nick, buf, NULL);
 }
 
 
@@ -157,32 +255,32 @@ void notice_lang(const char *source, User *dest, int message, ...)
 void notice_help(const char *source, User *dest, int message, ...)
 {
     va_list args;
-    char buf[4096], buf2[4096], outbuf[BUFSIZE];
-    char *s, *t;
+    char buf[4096];
+    const unsigned char *render;
     const char *fmt;
+    int flags;
 
     if (!dest)
 	return;
-    va_start(args, message);
     fmt = getstring(dest->ni, message);
     if (!fmt)
 	return;
-    /* Some sprintf()'s eat %S or turn it into just S, so change all %S's
-     * into \1\1... we assume this doesn't occur anywhere else in the
-     * string. */
-    strscpy(buf2, fmt, sizeof(buf2));
-    strnrepl(buf2, sizeof(buf2), "%S", "\1\1");
-    vsnprintf(buf, sizeof(buf), buf2, args);
-    s = buf;
-    while (*s) {
-	t = s;
-	s += strcspn(s, "\n");
-	if (*s)
-	    *s++ = 0;
-	strscpy(outbuf, t, sizeof(outbuf));
-	strnrepl(outbuf, sizeof(outbuf), "\1\1", source);
-	send_cmd(source, "NOTICE %s :%s", dest->nick, *outbuf ? outbuf : " ");
+    render = getrender(dest->ni, message);
+    flags = LANG_GET16(render);
+    if (!(flags & LANG_RF_FORMAT)) {
+	notice_pieces(source, dest->nick, fmt, render, source);
+	return;
     }
+    /* Some sprintf()'s eat %S or turn it into just S, so the language
+     * file has a copy of the message with each %S changed to \1\1... we
+     * assume this doesn't occur anywhere else in the string. */
+    if (flags & LANG_RF_SOURCE)
+	fmt = (const char *)render+2;
+    va_start(args, message);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    notice_text(source, dest->nick, buf,
+		(flags & LANG_RF_SOURCE) ? source : NULL);
 }
 
 /*************************************************************************/
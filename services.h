@@ -107,7 +107,7 @@ extern int shutdown(int, int);
 /* Version number for data files; if structures below change, increment
  * this.  (Otherwise -very- bad things will happen!) */
 
-#define FILE_VERSION	11
+#define FILE_VERSION	12
 
 /*************************************************************************/
 
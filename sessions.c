@@ -394,6 +394,7 @@ void load_exceptions()
     if (!(f = open_db(s_OperServ, ExceptionDBName, "r")))
 	return;
     switch (i = get_file_version(f)) {
+      case 12:
       case 11:
       case 10:
       case 9:
@@ -92,6 +92,7 @@ void load_snooper(void)
     snoopers = scalloc(sizeof(*snoopers), snooper_size);
 
     switch (ver) {
+      case 12:
       case 11:
 	for (i = 0; i < nsnooper; i++) {
 	    SAFE(read_string(&snoopers[i].mask, f));
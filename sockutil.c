@@ -193,6 +193,7 @@ static char *write_curpos = write_netbuf; /* Next byte to write to socket */
 static char *write_bufend = write_netbuf; /* Next position for data to socket */
 static char * const write_buftop = write_netbuf + NET_BUFSIZE;
 static int write_fd = -1;
+static int write_hold = 0;	/* Nesting count for set_write_hold() */
 int32 total_written;
 
 
@@ -282,11 +283,12 @@ static int buffered_write(int fd, char *buf, int len)
 	    }
 	}
 
-	/* Now write to the socket as much as we can. */
+	/* Now write to the socket as much as we can (unless writes are
+	 * being held and there's still room in the buffer). */
 	if (write_curpos == write_bufend+1 ||
 		(write_curpos == write_netbuf && write_bufend == write_buftop-1))
 	    flush_write_buffer(1);
-	else
+	else if (!write_hold)
 	    flush_write_buffer(0);
 	errno_save = errno;
 	if (write_curpos == write_bufend+1 ||
@@ -304,6 +306,25 @@ static int buffered_write(int fd, char *buf, int len)
     return len - left;
 }
 
+/* Hold (hold != 0) or release (hold == 0) data written to the socket in
+ * the buffer, so that a run of lines sent together goes out in as few
+ * write() calls as possible instead of one each.  Holds nest; when the
+ * last one is released, as much of the buffer as the socket will take is
+ * written.  Data is still written early if the buffer fills up.
+ */
+
+void set_write_hold(int hold)
+{
+    if (hold) {
+	write_hold++;
+	return;
+    }
+    if (write_hold > 0 && --write_hold == 0) {
+	while (flush_write_buffer(0) > 0)
+	    ;
+    }
+}
+
 /* Optimized version of the above for writing a single character; returns
  * the character in an int or EOF, like fputc().  Commented out because it
  * isn't currently used. */
@@ -370,6 +391,36 @@ int sungetc(int c, int s)
 
 /*************************************************************************/
 
+/* Descriptor which, when readable, cuts short the wait in sgets(); -1 if
+ * none.  See set_read_wakeup(). */
+static int wakeup_fd = -1;
+
+/* Have sgets() return as if the read had timed out whenever `fd' becomes
+ * readable while it is waiting, so that the caller can deal with whatever
+ * is waiting on `fd'.  Pass -1 to stop watching.
+ */
+
+void set_read_wakeup(int fd)
+{
+    wakeup_fd = fd;
+}
+
+/* Longest time in milliseconds sgets() may wait for data, or 0 to wait
+ * for ReadTimeout.  See set_read_limit(). */
+static int read_limit = 0;
+
+/* Have sgets() wait no longer than `ms' milliseconds (if less than
+ * ReadTimeout), for when the caller has work of its own to get back to.
+ * Pass 0 to wait for the full ReadTimeout again.
+ */
+
+void set_read_limit(int ms)
+{
+    read_limit = ms;
+}
+
+/*************************************************************************/
+
 /* If connection was broken, return NULL.  If the read timed out, return
  * (char *)-1.
  */
@@ -383,15 +434,22 @@ char *sgets(char *buf, int len, int s)
 
     if (len == 0)
 	return NULL;
-    FD_SET(s, &fds);
     tv.tv_sec = ReadTimeout;
     tv.tv_usec = 0;
-    while (read_buffer_len() == 0 &&
-		(i = select(s+1, &fds, NULL, NULL, &tv)) < 0) {
-	if (errno != EINTR)
+    if (read_limit > 0 && read_limit < ReadTimeout*1000) {
+	tv.tv_sec = read_limit / 1000;
+	tv.tv_usec = read_limit % 1000 * 1000;
+    }
+    while (read_buffer_len() == 0) {
+	FD_ZERO(&fds);
+	FD_SET(s, &fds);
+	if (wakeup_fd >= 0)
+	    FD_SET(wakeup_fd, &fds);
+	i = select((s > wakeup_fd ? s : wakeup_fd) + 1, &fds, NULL, NULL, &tv);
+	if (i >= 0 || errno != EINTR)
 	    break;
     }
-    if (i <= 0)
+    if (i <= 0 || (read_buffer_len() == 0 && !FD_ISSET(s, &fds)))
 	return (char *)-1;
     c = sgetc(s);
     if (c == EOF)
@@ -441,6 +499,11 @@ int sputs(char *str, int s)
     return buffered_write(s, str, strlen(str));
 }
 
+int swrite(int s, const char *buf, int len)
+{
+    return buffered_write(s, (char *)buf, len);
+}
+
 /*************************************************************************/
 
 int sockprintf(int s, char *fmt, ...)
@@ -391,6 +391,7 @@ void load_ss_dbase()
     if (!(f = open_db(s_StatServ, StatDBName, "r")))
         return;
     switch (i = get_file_version(f)) {
+      case 12:
       case 11:
       case 10:
       case 9:
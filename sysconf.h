@@ -34,3 +34,5 @@ typedef unsigned int uint32;
 #define HAVE_UMASK		1
 #define HAVE_FORK		1
 #define HAVE_GETHOSTBYNAME	1
+#define HAVE_MMAP		1
+#define HAVE_PTHREAD		1
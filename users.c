@@ -9,6 +9,7 @@
 
 #include "services.h"
 #include "news.h"
+#include "timeout.h"
 
 #define HASH(nick)  (((nick)[0]&31)<<5 | ((nick)[1]&31))
 #define HASHSIZE    1024
@@ -17,6 +18,14 @@ static User *userlist[HASHSIZE];
 int32 usercnt = 0, opcnt = 0, maxusercnt = 0;
 time_t maxusertime;
 
+/* Users from a server's burst waiting to be validated (see NSBurstDelay),
+ * oldest first, and the timeout which works through them. */
+static User *burst_first = NULL, *burst_last = NULL;
+static Timeout *burst_timeout = NULL;
+
+static void unqueue_burst_user(User *user);
+static int validate_burst_user(User *user);
+
 /*************************************************************************/
 /************************* User list management **************************/
 /*************************************************************************/
@@ -80,6 +89,7 @@ static void change_user_nick(User *user, const char *nick)
 	user->ni = getlink(user->real_ni);
     else
 	user->ni = NULL;
+    memset(user->access_cache, 0, sizeof(user->access_cache));
 }
 
 /*************************************************************************/
@@ -101,7 +111,11 @@ static void delete_user(User *user)
     stats_do_quit(user);
 #endif
 
+    if (user->burst_pending)
+	unqueue_burst_user(user);
     cancel_user(user);
+    if (user->pass_request)
+	user->pass_request->user = NULL;
     if (debug >= 2)
 	log("debug: delete_user(): free user data");
     free(user->username);
@@ -193,6 +207,38 @@ User *nextuser(void)
     return current;
 }
 
+/*************************************************************************/
+
+/* Record that a password operation concerning `name' (a nick or channel)
+ * has been started for the given user; `pass' is the password being
+ * checked against, or NULL if none.  The caller passes the result to
+ * check_password_async() or encrypt_async() and must call
+ * free_pass_request() when the operation completes.
+ */
+
+PassRequest *new_pass_request(User *user, const char *name, const char *pass)
+{
+    PassRequest *req = scalloc(sizeof(*req), 1);
+
+    req->user = user;
+    strscpy(req->name, name, sizeof(req->name));
+    if (pass)
+	memcpy(req->pass, pass, sizeof(req->pass));
+    user->pass_request = req;
+    return req;
+}
+
+/* Free a PassRequest, detaching it from its user if still present. */
+
+void free_pass_request(PassRequest *req)
+{
+    if (req->user)
+	req->user->pass_request = NULL;
+    free(req->email);
+    memset(req, 0, sizeof(*req));
+    free(req);
+}
+
 /*************************************************************************/
 /*************************************************************************/
 
@@ -319,6 +365,173 @@ static void quit_user(User *user, const char *quitmsg)
 /************************* Message handlers ******************************/
 /*************************************************************************/
 
+/* Check a user's nick with validate_user() (or, if `ni_changed' is zero
+ * because the user's nick group hasn't changed, just refresh NS_ON_ACCESS)
+ * and make their +r mode agree with the result.  Returns 0 if the user was
+ * killed in the process, 1 otherwise.
+ */
+
+static int validate_nick(User *user, int ni_changed)
+{
+    char nick[NICKMAX];
+
+    if (ni_changed) {
+	int valid;
+	strscpy(nick, user->nick, sizeof(nick));
+	valid = validate_user(user);
+	if (finduser(nick) != user)
+	    return 0;	/* Collided under NI_KILL_IMMED */
+	if (valid)
+	    check_memos(user);
+    } else {
+	/* Make sure NS_ON_ACCESS flag gets set for current nick */
+	check_on_access(user);
+    }
+    if (UMODE_REG) {
+	if (nick_identified(user)) {
+	    send_cmd(s_NickServ, "SVSMODE %s :+%s", user->nick,
+		     mode_flags_to_string(UMODE_REG, MODE_USER));
+	    user->mode |= UMODE_REG;
+	} else if (user->mode & UMODE_REG) {
+# ifndef IRC_BAHAMUT  /* Bahamut removes the "+r" usermode automatically */
+	    send_cmd(s_NickServ, "SVSMODE %s :-%s", user->nick,
+		     mode_flags_to_string(UMODE_REG, MODE_USER));
+# endif
+	    user->mode &= ~UMODE_REG;
+	}
+    }
+    return 1;
+}
+
+/*************************************************************************/
+
+/* When a netsplit heals (or Services first link), the server's whole user
+ * list arrives at once, and validating each nick as it comes (access list
+ * matching, notices, collide timeouts, memo and news notices) holds up
+ * everything else until the burst is over.  With NSBurstDelay set, users
+ * introduced in a burst who are not recognized at once by split recovery
+ * are instead queued here, and validated in batches of NSBurstBatch from a
+ * timeout.  Until then their nick is treated as not recognized, and the
+ * channel checks that depend on it (autokicks, access-based modes) are
+ * left until the user is validated; see check_burst_channels().
+ */
+
+/* Return whether a new user was introduced as part of their server's
+ * burst, i.e. had signed on before the server linked to us. */
+
+static int is_burst_user(User *user)
+{
+    return user->server && user->signon < user->server->t_join;
+}
+
+static void timeout_validate_burst(Timeout *to)
+{
+    int count;
+
+    set_write_hold(1);
+    for (count = 0; burst_first && count < NSBurstBatch; count++)
+	validate_burst_user(burst_first);
+    set_write_hold(0);
+    if (debug && count)
+	log("debug: validated %d burst users%s", count,
+	    burst_first ? "" : ", queue empty");
+    if (!burst_first) {
+	to->repeat = 0;
+	burst_timeout = NULL;
+    }
+}
+
+/* Queue a new user for validation.  Until then their nick is treated as
+ * not recognized, so clear any status left from its previous user, as
+ * validate_user() would. */
+
+static void queue_burst_user(User *user)
+{
+    if (user->real_ni)
+	user->real_ni->status &= ~NS_TEMPORARY;
+    user->burst_pending = 1;
+    user->burst_next = NULL;
+    user->burst_prev = burst_last;
+    if (burst_last)
+	burst_last->burst_next = user;
+    else
+	burst_first = user;
+    burst_last = user;
+    if (!burst_timeout)
+	burst_timeout = add_timeout_ms(NSBurstDelay, timeout_validate_burst, 1);
+}
+
+/* Run the channel checks skipped by do_join() and do_sjoin() while the
+ * given user was waiting to be validated. */
+
+static void check_burst_channels(User *user)
+{
+    struct u_chanlist *uc, *next;
+    struct c_userlist *cu;
+    Channel *c;
+    char *av[3];
+
+    for (uc = user->chans; uc; uc = next) {
+	next = uc->next;
+	c = uc->chan;
+	if (check_kick(user, c->name)) {
+	    /* check_kick() sends the kick, but leaves the user on our
+	     * channel lists */
+	    av[0] = c->name;
+	    av[1] = user->nick;
+	    av[2] = CSAutokickReason;
+	    do_kick(s_ChanServ, 3, av);
+	    continue;
+	}
+	for (cu = c->users; cu && cu->user != user; cu = cu->next)
+	    ;
+	if (cu)
+	    cu->mode = check_chan_user_modes(NULL, user, c->name, cu->mode);
+	if (c->ci && c->ci->entry_message)
+	    notice(s_ChanServ, user->nick, "%s", c->ci->entry_message);
+    }
+}
+
+static void unqueue_burst_user(User *user)
+{
+    if (user->burst_prev)
+	user->burst_prev->burst_next = user->burst_next;
+    else
+	burst_first = user->burst_next;
+    if (user->burst_next)
+	user->burst_next->burst_prev = user->burst_prev;
+    else
+	burst_last = user->burst_prev;
+    user->burst_next = user->burst_prev = NULL;
+    user->burst_pending = 0;
+}
+
+/* Return whether any users are waiting to be validated, in which case the
+ * main loop should not sit idle for long. */
+
+int burst_users_waiting(void)
+{
+    return burst_first != NULL;
+}
+
+/* Validate a user waiting after a burst, then check the channels they
+ * joined meanwhile.  Returns 0 if the user was killed in the process, 1
+ * otherwise.
+ */
+
+static int validate_burst_user(User *user)
+{
+    unqueue_burst_user(user);
+    display_news(user, NEWS_LOGON);
+    /* If they identified while waiting, their nick needs no checking. */
+    if (!nick_identified(user) && !validate_nick(user, 1))
+	return 0;
+    check_burst_channels(user);
+    return 1;
+}
+
+/*************************************************************************/
+
 /* Handle a server NICK command.  Note that we do some parameter swapping
  * in messages.c/m_nick() to simplify life here.
  *	av[0] = nick
@@ -342,6 +555,7 @@ int do_nick(const char *source, int ac, char **av)
 {
     User *user;
     NickInfo *new_ni;	/* New master nick */
+    int was_pending = 0;	/* Nonzero if leaving the burst queue */
     int ni_changed = 1;	/* Did master nick change? */
 
     if (!*source) {
@@ -416,6 +630,10 @@ int do_nick(const char *source, int ac, char **av)
 	if (user->server)
 	    user->server->stats->usercnt++;
 #endif
+	if (NSBurstDelay && is_burst_user(user) && !split_recovered(user)) {
+	    queue_burst_user(user);
+	    return 1;
+	}
 	display_news(user, NEWS_LOGON);
 
     } else {
@@ -429,6 +647,12 @@ int do_nick(const char *source, int ac, char **av)
 	}
 	if (debug)
 	    log("debug: %s changes nick to %s", source, av[0]);
+	if (user->burst_pending) {
+	    /* The new nick will be validated below instead. */
+	    unqueue_burst_user(user);
+	    display_news(user, NEWS_LOGON);
+	    was_pending = 1;
+	}
 
 	/* Be extra careful with Services root privileges; validate_user()
 	 * will clear all NS_TEMPORARY flags the next time someone uses
@@ -458,27 +682,8 @@ int do_nick(const char *source, int ac, char **av)
 	change_user_nick(user, av[0]);
     }
 
-    if (ni_changed) {
-	if (validate_user(user))
-	    check_memos(user);
-    } else {
-	/* Make sure NS_ON_ACCESS flag gets set for current nick */
-	check_on_access(user);
-    }
-    if (UMODE_REG) {
-	if (nick_identified(user)) {
-	    send_cmd(s_NickServ, "SVSMODE %s :+%s", av[0],
-		     mode_flags_to_string(UMODE_REG, MODE_USER));
-	    user->mode |= UMODE_REG;
-	} else if (user->mode & UMODE_REG) {
-# ifndef IRC_BAHAMUT  /* Bahamut removes the "+r" usermode automatically */
-	    send_cmd(s_NickServ, "SVSMODE %s :-%s", av[0],
-		     mode_flags_to_string(UMODE_REG, MODE_USER));
-# endif
-	    user->mode &= ~UMODE_REG;
-	}
-    }
-
+    if (validate_nick(user, ni_changed) && was_pending)
+	check_burst_channels(user);
     return 1;
 }
 
@@ -523,11 +728,13 @@ void do_join(const char *source, int ac, char **av)
 	}
 
 	/* Make sure check_kick comes before chan_adduser, so banned users
-	 * don't get to see things like channel keys. */
-	if (check_kick(user, s))
+	 * don't get to see things like channel keys.  Users waiting for
+	 * burst validation are checked when they're validated. */
+	if (!user->burst_pending && check_kick(user, s))
 	    continue;
 	c = chan_adduser(user, s, 0);
-	if ((ci = cs_findchan(s)) && ci->entry_message)
+	if (!user->burst_pending
+	 && (ci = cs_findchan(s)) && ci->entry_message)
 	    notice(s_ChanServ, user->nick, "%s", ci->entry_message);
 	uc = smalloc(sizeof(*c));
 	uc->next = user->chans;
@@ -617,11 +824,14 @@ void do_sjoin(const char *source, int ac, char **av)
 	}
 	if (debug)
 	    log("debug: %s SJOINs %s", nick, channel);
-	if (check_kick(user, channel))
+	/* Users waiting for burst validation are checked when they're
+	 * validated. */
+	if (!user->burst_pending && check_kick(user, channel))
 	    continue;
 	c = chan_adduser(user, channel, modes);
 	joins++;
-	if ((ci || (ci = cs_findchan(channel))) && ci->entry_message)
+	if (!user->burst_pending
+	 && (ci || (ci = cs_findchan(channel))) && ci->entry_message)
 	    notice(s_ChanServ, user->nick, "%s", ci->entry_message);
 	uc = smalloc(sizeof(*uc));
 	uc->next = user->chans;
@@ -955,42 +1165,91 @@ int is_voiced(const char *nick, const char *chan)
 /*************************************************************************/
 /*************************************************************************/
 
+/* Split the mask in um->buf (in place) into its parts. */
+
+static void do_parse_usermask(UserMask *um)
+{
+    char *s;
+
+    if ((s = strchr(um->buf, '!')) != NULL) {
+	*s++ = 0;
+	um->nick = *um->buf ? um->buf : NULL;
+	um->user = s;
+    } else {
+	um->nick = NULL;
+	um->user = um->buf;
+    }
+    if ((s = strchr(um->user, '@')) != NULL && s != um->user && s[1]) {
+	*s++ = 0;
+	um->host = s;
+    } else {
+	um->host = NULL;
+    }
+}
+
+/*************************************************************************/
+
 /* Does the user's usermask match the given mask (either nick!user@host or
  * just user@host)?  Also checks fakehost where supported.
  */
 
 int match_usermask(const char *mask, User *user)
 {
-    char *mask2 = sstrdup(mask);
-    char *nick, *username, *host;
-    int match_user, match_host, result;
-
-    if (strchr(mask2, '!')) {
-	nick = strtok(mask2, "!");
-	username = strtok(NULL, "@");
-    } else {
-	nick = NULL;
-	username = strtok(mask2, "@");
+    char buf[BUFSIZE];
+    UserMask um;
+    int result;
+
+    if (strlen(mask) >= sizeof(buf)) {
+	parse_usermask(mask, &um);
+	result = match_parsed_usermask(&um, user);
+	free_usermask(&um);
+	return result;
     }
-    host = strtok(NULL, "");
-    if (!host) {
-	free(mask2);
+    strcpy(buf, mask);
+    um.buf = buf;
+    do_parse_usermask(&um);
+    return match_parsed_usermask(&um, user);
+}
+
+/*************************************************************************/
+
+/* Split a usermask up for use with match_parsed_usermask().  The
+ * UserMask must be freed with free_usermask() when no longer needed. */
+
+void parse_usermask(const char *mask, UserMask *um)
+{
+    um->buf = sstrdup(mask);
+    do_parse_usermask(um);
+}
+
+
+void free_usermask(UserMask *um)
+{
+    if (um->buf)
+	free(um->buf);
+    um->buf = um->nick = um->user = um->host = NULL;
+}
+
+
+/* Like match_usermask(), but for a mask already split by
+ * parse_usermask().  Does not allocate any memory. */
+
+int match_parsed_usermask(const UserMask *um, User *user)
+{
+    int match_host;
+
+    if (!um->host)
 	return 0;
-    }
-    match_user = match_wild(username, user->username);
-    match_host = match_wild_nocase(host, user->host);
+    if (!match_wild(um->user, user->username))
+	return 0;
+    match_host = match_wild_nocase(um->host, user->host);
 #ifdef IRC_UNREAL
-    if (user->fakehost)
-	match_host |= match_wild_nocase(host, user->fakehost);
+    if (!match_host && user->fakehost)
+	match_host = match_wild_nocase(um->host, user->fakehost);
 #endif
-    if (nick) {
-	result = match_wild_nocase(nick, user->nick) &&
-		 match_user && match_host;
-    } else {
-	result = match_user && match_host;
-    }
-    free(mask2);
-    return result;
+    if (!match_host)
+	return 0;
+    return !um->nick || match_wild_nocase(um->nick, user->nick);
 }
 
 /*************************************************************************/
@@ -12,6 +12,21 @@
 
 /*************************************************************************/
 
+/* Number of get_access() results remembered for each user. */
+#define USER_ACCESS_CACHE	4
+
+/* A password check or encryption started on behalf of a user by NickServ
+ * or ChanServ (see check_password_async() and encrypt_async()) which has
+ * not yet completed.  `user' is cleared if the user quits in the meantime,
+ * in which case the result is discarded. */
+typedef struct passrequest_ PassRequest;
+struct passrequest_ {
+    User *user;
+    char name[CHANMAX];			/* Nick or channel concerned */
+    char pass[PASSMAX];			/* Password checked against */
+    char *email;			/* For NickServ REGISTER */
+};
+
 struct user_ {
     User *next, *prev;
     char nick[NICKMAX];
@@ -43,8 +58,34 @@ struct user_ {
     time_t invalid_pw_time;		/* Time of last invalid password */
     time_t lastmemosend;		/* Last time MS SEND command used */
     time_t lastnickreg;			/* Last time NS REGISTER cmd used */
+    struct u_accesscache {
+	ChannelInfo *ci;
+	NickInfo *ni;			/* User's effective nick then */
+	int16 status;			/* NS_IDENTIFIED|NS_RECOGNIZED then */
+	int16 level;
+	uint32 gen;			/* cs_access_gen then; 0 = unused */
+    } access_cache[USER_ACCESS_CACHE];	/* Recent channel access levels */
+    int access_cache_next;		/* Next access_cache[] slot to use */
+    PassRequest *pass_request;		/* Password operation in progress */
+    User *burst_next, *burst_prev;	/* Queue of users awaiting validation
+					 *    after a burst (NSBurstDelay) */
+    int burst_pending;			/* Nonzero if on that queue */
 };
 
 /*************************************************************************/
 
+/* A nick!user@host (or user@host) mask split into its parts, so that it
+ * can be matched against users repeatedly without copying it each time;
+ * see parse_usermask() and match_parsed_usermask().  The parts all point
+ * into buf. */
+
+typedef struct {
+    char *buf;
+    char *nick;				/* NULL if mask has no nick part */
+    char *user;
+    char *host;				/* NULL if mask is invalid */
+} UserMask;
+
+/*************************************************************************/
+
 #endif /* USERS_H */